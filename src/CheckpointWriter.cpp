@@ -0,0 +1,139 @@
+#include "CheckpointWriter.hpp"
+
+#include <iostream>
+#include <stdexcept>  // std::runtime_error
+
+#include "LayerData.hpp"
+#include "opencl\Context.hpp"
+
+namespace cnn_sr {
+
+CheckpointWriter::CheckpointWriter(ConfigBasedDataPipeline* pipeline,
+                                   const char* const file_path)
+    : _pipeline(pipeline),
+      _context(pipeline->context()),
+      _file_path(file_path),
+      _busy(false) {
+  _params.layers.resize(pipeline->layer_count());
+  _staging.resize(pipeline->layer_count());
+  _params.has_training_state = true;
+}
+
+CheckpointWriter::~CheckpointWriter() { wait(); }
+
+void CheckpointWriter::wait() {
+  if (_thread.joinable()) _thread.join();
+}
+
+bool CheckpointWriter::schedule(GpuAllocationPool& gpu_alloc,
+                                const TrainingState& training_state) {
+  if (_busy) return false;
+  wait();  // thread has finished, but still needs join
+
+  _params.epochs = _pipeline->epoch_count();
+  _params.training_state = training_state;
+  _params.training_state.optimizer_step = gpu_alloc.parameter_arena.step;
+  cl_event ev;
+  for (size_t i = 0; i < _pipeline->layer_count(); i++) {
+    ev = stage(*_pipeline->layer(i), gpu_alloc.layers[i], _staging[i],
+               _params.layers[i]);
+  }
+  auto loss_scaling = _pipeline->loss_scaling_state();
+  if (loss_scaling != gpu_nullptr) {
+    ev = stage_buffer(loss_scaling, _loss_scaling_staging,
+                      _params.training_state.loss_scaling,
+                      DataPipeline::LOSS_SCALING_STATE_SIZE);
+  } else {
+    _params.training_state.loss_scaling.clear();
+  }
+
+  // queue is in-order, so last read finished means all reads finished.
+  // Context releases its events on block(), thread needs own reference
+  _context->check_error(clRetainEvent(ev), "Could not retain checkpoint event");
+  _busy = true;
+  _thread = std::thread(&CheckpointWriter::write, this, ev);
+  return true;
+}
+
+cl_event CheckpointWriter::stage(const LayerData& layer_data,
+                                 LayerAllocationPool& gpu_alloc,
+                                 StagingBuffers& staging,
+                                 LayerParameters& target) {
+  target.n_prev_filter_cnt = layer_data.n_prev_filter_cnt;
+  target.current_filter_count = layer_data.current_filter_count;
+  target.f_spatial_size = layer_data.f_spatial_size;
+  size_t weights_size = layer_data.weight_size(),
+         bias_size = layer_data.bias_size();
+
+  stage_buffer(gpu_alloc.weights, staging.weights, target.weights,
+               weights_size);
+  auto ev = stage_buffer(gpu_alloc.bias, staging.bias, target.bias, bias_size);
+
+  // momentum, only if we have done at least one update
+  if (gpu_alloc.previous_batch_delta_w == gpu_nullptr) {
+    target.previous_delta_w.clear();
+    target.previous_delta_b.clear();
+  } else {
+    stage_buffer(gpu_alloc.previous_batch_delta_w, staging.previous_delta_w,
+                 target.previous_delta_w, weights_size);
+    ev = stage_buffer(gpu_alloc.previous_batch_delta_b,
+                      staging.previous_delta_b, target.previous_delta_b,
+                      bias_size);
+  }
+
+  // Adam moments, only for packed parameters
+  if (gpu_alloc.first_moment_w == gpu_nullptr) {
+    target.first_moment_w.clear();
+    target.first_moment_b.clear();
+    target.second_moment_w.clear();
+    target.second_moment_b.clear();
+    return ev;
+  }
+  stage_buffer(gpu_alloc.first_moment_w, staging.first_moment_w,
+               target.first_moment_w, weights_size);
+  stage_buffer(gpu_alloc.first_moment_b, staging.first_moment_b,
+               target.first_moment_b, bias_size);
+  stage_buffer(gpu_alloc.second_moment_w, staging.second_moment_w,
+               target.second_moment_w, weights_size);
+  return stage_buffer(gpu_alloc.second_moment_b, staging.second_moment_b,
+                      target.second_moment_b, bias_size);
+}
+
+cl_event CheckpointWriter::stage_buffer(opencl::MemoryHandle src,
+                                        opencl::MemoryHandle& staging,
+                                        std::vector<float>& target,
+                                        size_t count) {
+  if (src == gpu_nullptr)
+    throw std::runtime_error(
+        "Tried to write checkpoint, but parameters are not on gpu");
+  if (staging == gpu_nullptr)
+    staging = _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * count);
+  target.resize(count);
+
+  auto copy_ev = _context->copy_buffer(src, staging);
+  return _context->read_buffer(staging, (void*)&target[0], false, &copy_ev, 1);
+}
+
+void CheckpointWriter::write(cl_event read_finished) {
+  // NOTE: do not touch the Context here, it is not thread safe
+  cl_int ciErr1 = clWaitForEvents(1, &read_finished);
+  clReleaseEvent(read_finished);
+
+  try {
+    if (ciErr1 != CL_SUCCESS)
+      throw std::runtime_error("Reading checkpoint data failed");
+    // with loss scaling Adam step is counted on gpu
+    auto& state = _params.training_state;
+    if (!state.loss_scaling.empty())
+      state.optimizer_step = (size_t)state.loss_scaling[4];
+    ParametersFile::write(_file_path.c_str(), _params,
+                          ParametersStorage::Float32);
+    std::cout << "Checkpoint written to: '" << _file_path
+              << "' (epochs: " << _params.epochs << ")" << std::endl;
+  } catch (std::exception& e) {
+    std::cout << "[Warning] Could not write checkpoint: " << e.what()
+              << std::endl;
+  }
+  _busy = false;
+}
+}
@@ -0,0 +1,77 @@
+#ifndef CHECKPOINT_WRITER_H
+#define CHECKPOINT_WRITER_H
+
+#include <atomic>
+#include <thread>
+
+#include "ConfigBasedDataPipeline.hpp"
+#include "ParametersFile.hpp"
+
+namespace cnn_sr {
+
+/**
+ * Writes checkpoints without stopping the training. Parameters and optimizer
+ * state (momentum or Adam moments) are copied on device into staging buffers, read back with non blocking
+ * read_buffer and then serialized & written to disk on background thread.
+ * The copy is ordered with training kernels (in-order queue), so next update
+ * can start as soon as the copy finishes.
+ *
+ * Only one checkpoint can be in flight. Requests made while previous one is
+ * still being written are skipped.
+ */
+class CheckpointWriter {
+ public:
+  CheckpointWriter(ConfigBasedDataPipeline*, const char* const file_path);
+  ~CheckpointWriter();
+
+  /**
+   * Snapshot current parameters and start the write.
+   * @return false if previous checkpoint is still being written
+   */
+  bool schedule(GpuAllocationPool&, const TrainingState&);
+
+  /** Wait till checkpoint that is in flight is written */
+  void wait();
+
+  inline bool busy() const { return _busy; }
+
+ private:
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+  /** device side copies of LayerAllocationPool */
+  struct StagingBuffers {
+    opencl::MemoryHandle weights = gpu_nullptr;
+    opencl::MemoryHandle bias = gpu_nullptr;
+    opencl::MemoryHandle previous_delta_w = gpu_nullptr;
+    opencl::MemoryHandle previous_delta_b = gpu_nullptr;
+    opencl::MemoryHandle first_moment_w = gpu_nullptr;
+    opencl::MemoryHandle first_moment_b = gpu_nullptr;
+    opencl::MemoryHandle second_moment_w = gpu_nullptr;
+    opencl::MemoryHandle second_moment_b = gpu_nullptr;
+  };
+
+  cl_event stage(const LayerData&, LayerAllocationPool&, StagingBuffers&,
+                 LayerParameters&);
+
+  cl_event stage_buffer(opencl::MemoryHandle src, opencl::MemoryHandle& staging,
+                        std::vector<float>& target, size_t count);
+
+  /** runs on background thread */
+  void write(cl_event read_finished);
+
+ private:
+  ConfigBasedDataPipeline* const _pipeline;
+  opencl::Context* const _context;
+  const std::string _file_path;
+  /** one per layer */
+  std::vector<StagingBuffers> _staging;
+  opencl::MemoryHandle _loss_scaling_staging = gpu_nullptr;
+  /** host side destination of all reads, owned by the thread during write */
+  ParametersFile _params;
+  std::thread _thread;
+  std::atomic<bool> _busy;
+};
+}
+
+#endif /* CHECKPOINT_WRITER_H   */
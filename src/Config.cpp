@@ -15,6 +15,15 @@ ParametersDistribution::ParametersDistribution(float mean_w, float mean_b,
                                                float sd_w, float sd_b)
     : mean_w(mean_w), sd_w(sd_w), mean_b(mean_b), sd_b(sd_b) {}
 
+LayerConfig::LayerConfig(size_t filter_count, size_t f_spatial_size,
+                         float learning_rate, ParametersDistribution pd,
+                         bool relu)
+    : filter_count(filter_count),
+      f_spatial_size(f_spatial_size),
+      relu(relu),
+      learning_rate(learning_rate),
+      params_distr(pd) {}
+
 ///
 /// Config
 ///
@@ -25,52 +34,55 @@ Config::Config(size_t n1, size_t n2,                                       //
                ParametersDistribution pd2,                                 //
                ParametersDistribution pd3,                                 //
                const char* const parameters_file)
-    : n1(n1),
-      n2(n2),
-      f1(f1),
-      f2(f2),
-      f3(f3),
+    : Config({LayerConfig(n1, f1, learning_rates[0], pd1),
+              LayerConfig(n2, f2, learning_rates[1], pd2),
+              LayerConfig(1, f3, learning_rates[2], pd3, false)},
+             momentum, weight_decay, parameters_file) {}
+
+Config::Config(const std::vector<LayerConfig>& layers, float momentum,
+               float weight_decay, const char* const parameters_file)
+    : layers(layers),
       momentum(momentum),
       weight_decay_parameter(weight_decay),
-      parameters_file(parameters_file),
-      params_distr_1(pd1),
-      params_distr_2(pd2),
-      params_distr_3(pd3) {
-  for (size_t i = 0; i < 3; i++) {
-    this->learning_rate[i] = learning_rates[i];
-  }
-}
+      parameters_file(parameters_file ? parameters_file : "") {}
 
-size_t Config::total_padding() const { return f1 + f2 + f3 - 3; }
+size_t Config::total_padding() const {
+  size_t padding = 0;
+  for (auto& layer : layers) padding += layer.f_spatial_size - 1;
+  return padding;
+}
 
 void Config::validate(Config& config) {
-  // spatial size works best if is odd number
-  utils::require(is_odd(config.f1), "f1 should be odd");
-  utils::require(is_odd(config.f2), "f2 should be odd");
-  utils::require(is_odd(config.f3), "f3 should be odd");
-  // both filter count and spatial size cannot be 0
-  utils::require(config.n1 > 0, "n1 should be >0");
-  utils::require(config.n2 > 0, "n2 should be >0");
-  utils::require(config.f1 > 0, "f1 should be >0");
-  utils::require(config.f2 > 0, "f2 should be >0");
-  utils::require(config.f3 > 0, "f3 should be >0");
-
-  utils::require(config.f3 > 0, "f3 should be >0");
+  utils::require(config.layers.size() >= 2, "Expected at least 2 layers");
+  for (auto& layer : config.layers) {
+    // spatial size works best if is odd number
+    utils::require(is_odd(layer.f_spatial_size),
+                   "Spatial size of each layer should be odd");
+    // both filter count and spatial size cannot be 0
+    utils::require(layer.filter_count > 0,
+                   "Filter count of each layer should be >0");
+    utils::require(layer.f_spatial_size > 0,
+                   "Spatial size of each layer should be >0");
+    utils::require(layer.learning_rate > 0, "All learning rates should be >0");
+    utils::require(layer.params_distr.sd_w > 0,
+                   "std dev. for weights should be > 0");
+    utils::require(layer.params_distr.sd_b >= 0,
+                   "std dev. for bias should be >= 0");
+  }
+  utils::require(config.layers.back().filter_count == config.output_channels(),
+                 "Last layer should have upscale_factor^2 filters");
+  utils::require(!config.layers.back().relu, "Last layer should be linear");
+
   utils::require(config.weight_decay_parameter >= 0,
                  "weight_decay should be >0");
-  utils::require(config.learning_rate[0] > 0 && config.learning_rate[1] > 0 &&
-                     config.learning_rate[2] > 0,
-                 "All learning rates should be >0");
-
-  // ParametersDistribution
-  ParametersDistribution* pd_arr[3] = {&config.params_distr_1,  //
-                                       &config.params_distr_2,  //
-                                       &config.params_distr_3};
-  for (auto i = 0; i < 3; i++) {
-    auto pd = pd_arr[i];
-    utils::require(pd->sd_w > 0, "std dev. for weights should be > 0");
-    utils::require(pd->sd_b >= 0, "std dev. for bias should be >= 0");
-  }
+  utils::require(config.adam_beta1 >= 0 && config.adam_beta1 < 1 &&
+                     config.adam_beta2 >= 0 && config.adam_beta2 < 1,
+                 "Adam betas should be in [0, 1)");
+  utils::require(config.adam_epsilon > 0, "Adam epsilon should be >0");
+  utils::require(config.upscale_factor > 0, "upscale_factor should be >0");
+  utils::require(config.loss_scale >= 1, "loss_scale should be >=1");
+  utils::require(config.loss_scale_growth_interval > 0,
+                 "loss_scale_growth_interval should be >0");
 }
 
 ///
@@ -78,10 +90,21 @@ void Config::validate(Config& config) {
 ///
 
 struct ConfigHelper {
-  size_t n1, n2, f1, f2, f3;
+  size_t n1 = 0, n2 = 0, f1 = 0, f2 = 0, f3 = 0;
   float momentum, weight_decay, lr1, lr2, lr3;
   std::string parameters_file = "";
+  std::string parameters_storage = "float32";
+  std::string activation_storage = "float32";
+  unsigned int upscale_factor = 1;
+  std::string training_precision = "float32";
+  std::string recompute_activations = "none";
+  float loss_scale = 65536.0f;
+  unsigned int loss_scale_growth_interval = 1000;
+  std::string optimizer = "momentum";
+  float adam_beta1 = 0.9f, adam_beta2 = 0.999f, adam_epsilon = 1e-8f;
   std::vector<float> learning_rates;
+  /** generic network definition, replaces n1..f3 and learning_rates */
+  std::vector<LayerConfig> layers;
 };
 
 void fix_params_distribution(ParametersDistribution& d) {
@@ -100,6 +123,38 @@ void load_parameters_distr(JsonNode* node, ParametersDistribution& data) {
   }
 }
 
+/**
+ * Filter count of last layer may be omitted, it follows upscale_factor.
+ * Activation defaults to relu, except for the last layer that is linear.
+ */
+void load_layers(JsonNode* node, std::vector<LayerConfig>& layers) {
+  std::string activation;
+  for (auto layer_node : node->value) {
+    utils::require(layer_node->value.getTag() == JSON_OBJECT,
+                   "Each entry of 'layers' should be an object");
+    unsigned int filter_count = 0, f_spatial_size = 0;
+    LayerConfig layer;
+    activation = "";
+    for (auto subnode : layer_node->value) {
+      utils::try_read_uint(*subnode, filter_count, "filters");
+      utils::try_read_uint(*subnode, f_spatial_size, "f");
+      utils::try_read_string(*subnode, activation, "activation");
+      utils::try_read_float(*subnode, layer.learning_rate, "learning_rate");
+      if (strcmp(subnode->key, "parameters_distribution") == 0)
+        load_parameters_distr(subnode, layer.params_distr);
+    }
+    utils::require(activation.empty() || activation == "relu" ||
+                       activation == "linear",
+                   "Layer activation should be either relu or linear");
+    layer.filter_count = filter_count;
+    layer.f_spatial_size = f_spatial_size;
+    layer.relu = activation != "linear";
+    fix_params_distribution(layer.params_distr);
+    layers.push_back(layer);
+  }
+  if (!layers.empty() && activation.empty()) layers.back().relu = false;
+}
+
 Config ConfigReader::read(const char* const file) {
   JsonValue value;
   JsonAllocator allocator;
@@ -118,9 +173,27 @@ Config ConfigReader::read(const char* const file) {
     utils::try_read_float(*node, cfg_h.momentum, "momentum");
     utils::try_read_float(*node, cfg_h.weight_decay, "weight_decay_parameter");
     utils::try_read_string(*node, cfg_h.parameters_file, "parameters_file");
+    utils::try_read_uint(*node, cfg_h.upscale_factor, "upscale_factor");
+    utils::try_read_string(*node, cfg_h.parameters_storage,
+                           "parameters_storage");
+    utils::try_read_string(*node, cfg_h.activation_storage,
+                           "activation_storage");
+    utils::try_read_string(*node, cfg_h.training_precision,
+                           "training_precision");
+    utils::try_read_string(*node, cfg_h.recompute_activations,
+                           "recompute_activations");
+    utils::try_read_float(*node, cfg_h.loss_scale, "loss_scale");
+    utils::try_read_uint(*node, cfg_h.loss_scale_growth_interval,
+                         "loss_scale_growth_interval");
     utils::try_read_vector(*node, cfg_h.learning_rates, "learning_rates");
+    utils::try_read_string(*node, cfg_h.optimizer, "optimizer");
+    utils::try_read_float(*node, cfg_h.adam_beta1, "adam_beta1");
+    utils::try_read_float(*node, cfg_h.adam_beta2, "adam_beta2");
+    utils::try_read_float(*node, cfg_h.adam_epsilon, "adam_epsilon");
 
-    if (strcmp(key, parameters_keys[0]) == 0) {
+    if (strcmp(key, "layers") == 0 && node->value.getTag() == JSON_ARRAY) {
+      load_layers(node, cfg_h.layers);
+    } else if (strcmp(key, parameters_keys[0]) == 0) {
       load_parameters_distr(node, pd1);
     } else if (strcmp(key, parameters_keys[1]) == 0) {
       load_parameters_distr(node, pd2);
@@ -132,15 +205,52 @@ Config ConfigReader::read(const char* const file) {
   fix_params_distribution(pd1);
   fix_params_distribution(pd2);
   fix_params_distribution(pd3);
-  utils::require(cfg_h.learning_rates.size() == 3,
+  bool generic = !cfg_h.layers.empty();
+  utils::require(generic || cfg_h.learning_rates.size() == 3,
                  "Expected 3 learning rates (one per layer) to be provided");
+  utils::require(cfg_h.parameters_storage == "float32" ||
+                     cfg_h.parameters_storage == "float16",
+                 "parameters_storage should be either float32 or float16");
+  utils::require(cfg_h.activation_storage == "float32" ||
+                     cfg_h.activation_storage == "float16",
+                 "activation_storage should be either float32 or float16");
+  utils::require(cfg_h.training_precision == "float32" ||
+                     cfg_h.training_precision == "mixed",
+                 "training_precision should be either float32 or mixed");
+  utils::require(cfg_h.recompute_activations == "none" ||
+                     cfg_h.recompute_activations == "first_layer",
+                 "recompute_activations should be either none or first_layer");
+  utils::require(cfg_h.optimizer == "momentum" || cfg_h.optimizer == "adam" ||
+                     cfg_h.optimizer == "adamw",
+                 "optimizer should be one of: momentum, adam, adamw");
 
-  Config cfg(cfg_h.n1, cfg_h.n2,            //
-             cfg_h.f1, cfg_h.f2, cfg_h.f3,  //
-             cfg_h.momentum, cfg_h.weight_decay,
-             &cfg_h.learning_rates[0],  //
-             pd1, pd2, pd3,             //
-             cfg_h.parameters_file.c_str());
+  Config cfg = generic ? Config(cfg_h.layers,  //
+                                cfg_h.momentum, cfg_h.weight_decay,
+                                cfg_h.parameters_file.c_str())
+                       : Config(cfg_h.n1, cfg_h.n2,            //
+                                cfg_h.f1, cfg_h.f2, cfg_h.f3,  //
+                                cfg_h.momentum, cfg_h.weight_decay,
+                                &cfg_h.learning_rates[0],  //
+                                pd1, pd2, pd3,             //
+                                cfg_h.parameters_file.c_str());
+  if (cfg_h.parameters_storage == "float16")
+    cfg.parameters_storage = ParametersStorage::Float16;
+  cfg.upscale_factor = cfg_h.upscale_factor;
+  // filter count of last layer follows upscale_factor
+  auto& last_layer = cfg.layers.back();
+  if (!generic || last_layer.filter_count == 0)
+    last_layer.filter_count = cfg.output_channels();
+  cfg.mixed_precision = cfg_h.training_precision == "mixed";
+  cfg.half_activations =
+      cfg_h.activation_storage == "float16" || cfg.mixed_precision;
+  cfg.recompute_first_layer = cfg_h.recompute_activations == "first_layer";
+  cfg.loss_scale = cfg_h.loss_scale;
+  cfg.loss_scale_growth_interval = cfg_h.loss_scale_growth_interval;
+  if (cfg_h.optimizer == "adam") cfg.optimizer = Optimizer::Adam;
+  if (cfg_h.optimizer == "adamw") cfg.optimizer = Optimizer::AdamW;
+  cfg.adam_beta1 = cfg_h.adam_beta1;
+  cfg.adam_beta2 = cfg_h.adam_beta2;
+  cfg.adam_epsilon = cfg_h.adam_epsilon;
   Config::validate(cfg);
 
   return cfg;
@@ -157,19 +267,33 @@ std::ostream& operator<<(std::ostream& os,
 }
 
 std::ostream& operator<<(std::ostream& os, const cnn_sr::Config& cfg) {
+  using cnn_sr::Optimizer;
+  const char* const optimizer_names[3] = {"momentum", "adam", "adamw"};
   /* clang-format off */
   os << "Config {" << std::endl
      << "  parameters file: '" << cfg.parameters_file << "'" << std::endl
-     << "  momentum: " << cfg.momentum << std::endl
-     << "  learning rates: { " << cfg.learning_rate[0] << ", "
-                               << cfg.learning_rate[1] << ", "
-                               << cfg.learning_rate[2] << "}" << std::endl
-     << "  layer 1: " << cfg.n1 << " filters, " << cfg.f1 << " spatial size" << std::endl
-     << "  layer 2: " << cfg.n2 << " filters, " << cfg.f2 << " spatial size" << std::endl
-     << "  layer 3: " << cfg.f3 << " spatial size" << std::endl
-     << "  parameters dist. 1 " << cfg.params_distr_1 << std::endl
-     << "  parameters dist. 2 " << cfg.params_distr_2 << std::endl
-     << "  parameters dist. 3 " << cfg.params_distr_3 << "}" << std::endl;
+     << "  parameters storage: " << (cfg.parameters_storage == cnn_sr::ParametersStorage::Float16 ? "float16" : "float32") << std::endl
+     << "  activation storage: " << (cfg.half_activations ? "float16" : "float32") << std::endl
+     << "  training precision: " << (cfg.mixed_precision ? "mixed" : "float32") << std::endl
+     << "  recompute activations: " << (cfg.recompute_first_layer ? "first_layer" : "none") << std::endl;
+  if (cfg.mixed_precision)
+    os << "  loss scale: " << cfg.loss_scale << ", growth interval: "
+       << cfg.loss_scale_growth_interval << std::endl;
+  os << "  optimizer: " << optimizer_names[(unsigned int)cfg.optimizer] << std::endl;
+  if (cfg.optimizer == Optimizer::Momentum)
+    os << "  momentum: " << cfg.momentum << std::endl;
+  else
+    os << "  adam betas: " << cfg.adam_beta1 << ", " << cfg.adam_beta2
+       << ", epsilon: " << cfg.adam_epsilon << std::endl;
+  os << "  weight decay: " << cfg.weight_decay_parameter << std::endl;
+  for (size_t i = 0; i < cfg.layers.size(); i++) {
+    auto& layer = cfg.layers[i];
+    os << "  layer " << (i + 1) << ": " << layer.filter_count << " filters, "
+       << layer.f_spatial_size << " spatial size, "
+       << (layer.relu ? "relu" : "linear") << ", learning rate " << layer.learning_rate << std::endl
+       << "    parameters dist. " << layer.params_distr << std::endl;
+  }
+  os << "  upscale factor: " << cfg.upscale_factor << "}" << std::endl;
   /* clang-format on */
   return os;
 }
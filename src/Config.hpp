@@ -2,6 +2,7 @@
 #define CONFIG_H
 
 #include "pch.hpp"
+#include "ParametersFile.hpp"
 #include <ostream>  // for std::ostream& operator<<(..)
 
 namespace cnn_sr {
@@ -14,28 +15,79 @@ struct ParametersDistribution {
   float mean_b = 0.0f, sd_b = 0.0f;
 };
 
+/** Single convolution layer of the network */
+struct LayerConfig {
+  LayerConfig() {}
+  LayerConfig(size_t filter_count, size_t f_spatial_size, float learning_rate,
+              ParametersDistribution, bool relu = true);
+
+  /** last layer: one filter per output sub-pixel (upscale_factor^2) */
+  size_t filter_count = 0, f_spatial_size = 0;
+  /** relu or linear (identity). Last layer is always linear */
+  bool relu = true;
+  float learning_rate = 0.0f;
+  ParametersDistribution params_distr;
+};
+
+/** Weight update rule used during training */
+enum class Optimizer : unsigned int { Momentum = 0, Adam = 1, AdamW = 2 };
+
 struct Config {
+  /** Classic 3 layer SRCNN: n1, n2, f1, f2, f3 */
   Config(size_t, size_t,          //
          size_t, size_t, size_t,  //
          float, float, float*,    //
          ParametersDistribution, ParametersDistribution, ParametersDistribution,
          const char* const = nullptr);
 
+  Config(const std::vector<LayerConfig>&, float momentum, float weight_decay,
+         const char* const = nullptr);
+
   static void validate(Config&);
 
   size_t total_padding() const;
 
+  /** filter count of last layer, one output channel per sub-pixel */
+  inline size_t output_channels() const {
+    return upscale_factor * upscale_factor;
+  }
+
   // core parameters
-  const size_t n1, n2;
-  const size_t f1, f2, f3;
+  /** at least 2 layers, executed in order */
+  std::vector<LayerConfig> layers;
   const float momentum, weight_decay_parameter;
-  float learning_rate[3];
   std::string parameters_file = "";
-
-  // random parameters(weights/biases)
-  ParametersDistribution params_distr_1;
-  ParametersDistribution params_distr_2;
-  ParametersDistribution params_distr_3;
+  /**
+   * 1 - input is already upscaled, every layer runs at output resolution.
+   * r > 1 - last layer has r*r filters that are rearranged into r*r block of
+   * output pixels (sub-pixel convolution), all layers run at input resolution
+   */
+  size_t upscale_factor = 1;
+  /** used when writing binary parameters file */
+  ParametersStorage parameters_storage = ParametersStorage::Float32;
+  /**
+   * store outputs and deltas of hidden layers as half. Parameters, gradients,
+   * network input and last layer stay float32
+   */
+  bool half_activations = false;
+  /**
+   * mixed precision training: deltas and gradients are computed in half with
+   * dynamic loss scaling. Implies half_activations
+   */
+  bool mixed_precision = false;
+  /**
+   * training: output of first layer is dropped after second layer used it
+   * and computed again during backpropagation. Trades one extra layer
+   * execution per mini-batch for memory
+   */
+  bool recompute_first_layer = false;
+  /** initial loss scale, doubled after each loss_scale_growth_interval
+   * updates without overflow */
+  float loss_scale = 65536.0f;
+  size_t loss_scale_growth_interval = 1000;
+  /** momentum is only used by Optimizer::Momentum, betas only by Adam(W) */
+  Optimizer optimizer = Optimizer::Momentum;
+  float adam_beta1 = 0.9f, adam_beta2 = 0.999f, adam_epsilon = 1e-8f;
 };
 
 class ConfigReader {
@@ -1,6 +1,9 @@
 
 #include "ConfigBasedDataPipeline.hpp"
 
+#include <algorithm>  // for std::min, std::max
+#include <cmath>      // for std::abs, std::log10
+#include <limits>     // for std::numeric_limits
 #include <random>     // for std::mt19937
 #include <chrono>     // for random seed
 #include <fstream>    // for parameters dump
@@ -9,25 +12,173 @@
 #include "json/gason.h"
 
 #include "Config.hpp"
+#include "ParametersFile.hpp"
+#include "SampleCache.hpp"
 #include "pch.hpp"
 #include "opencl\Context.hpp"
 #include "opencl\UtilsOpenCL.hpp"
 
 auto print_steps = false;
 
-const char *const layer_parameters_key[3] = {"layer1", "layer2", "layer3"};
-
 using namespace cnn_sr;
 
 namespace cnn_sr {
 
+///
+/// SampleArena
+///
+void SampleArena::allocate(opencl::Context *context, size_t w_, size_t h_,
+                           size_t capacity_, DatasetStorage storage_,
+                           size_t expected_scale_) {
+  utils::require(capacity_ > 0, "Sample arena cannot be empty");
+  storage = storage_;
+  w = w_;
+  h = h_;
+  capacity = capacity_;
+  expected_scale = expected_scale_;
+  size_t alloc_size = storage_element_size(storage) * w * h * capacity;
+  input_luma = context->allocate(CL_MEM_READ_ONLY, alloc_size);
+  expected_luma = context->allocate(
+      CL_MEM_READ_ONLY, alloc_size * expected_scale * expected_scale);
+  input_means =
+      context->allocate(CL_MEM_READ_ONLY, sizeof(cl_float) * capacity);
+  context->zeros_float(input_means, true);
+}
+
+void SampleArena::write(opencl::Context *context, size_t slot,
+                        const void *input, const void *expected) {
+  utils::require(slot < capacity, "Sample arena slot out of bounds");
+  size_t sample_size = storage_element_size(storage) * w * h,
+         expected_size = sample_size * expected_scale * expected_scale;
+  context->write_buffer(input_luma, slot * sample_size, sample_size,
+                        (void *)input, false);
+  context->write_buffer(expected_luma, slot * expected_size, expected_size,
+                        (void *)expected, false);
+}
+
+void SampleArena::write_means(opencl::Context *context, const float *means,
+                              size_t count) {
+  utils::require(count <= capacity, "Too many sample means for the arena");
+  context->write_buffer(input_means, 0, sizeof(cl_float) * count,
+                        (void *)means, false);
+}
+
+///
+/// ParameterArena
+///
+void ParameterArena::pack(opencl::Context *context,
+                          const std::vector<const LayerData *> &layers,
+                          const std::vector<LayerAllocationPool *> &allocs,
+                          bool adam_moments) {
+  utils::require(layers.size() == allocs.size(), "Layer count mismatch");
+  size_t align = context->sub_buffer_alignment() / sizeof(cl_float);
+  if (align == 0) align = 1;
+
+  // layout: weights_1, bias_1, weights_2, bias_2, ...
+  segment_ranges.clear();
+  size_t offset = 0;
+  for (auto layer : layers) {
+    LayerData::validate(*layer);
+    size_t counts[2] = {layer->weight_size(), layer->bias_size()};
+    for (size_t count : counts) {
+      offset = (offset + align - 1) / align * align;
+      segment_ranges.push_back(offset);
+      segment_ranges.push_back(offset + count);
+      offset += count;
+    }
+  }
+  size = offset;
+
+  std::vector<float> values(size, 0.0f);
+  for (size_t i = 0; i < layers.size(); i++) {
+    const LayerData *layer = layers[i];
+    std::copy(layer->weights_ptr(), layer->weights_ptr() + layer->weight_size(),
+              values.begin() + segment_ranges[4 * i]);
+    std::copy(layer->bias_ptr(), layer->bias_ptr() + layer->bias_size(),
+              values.begin() + segment_ranges[4 * i + 2]);
+  }
+
+  size_t alloc_size = sizeof(cl_float) * size;
+  parameters = context->allocate(CL_MEM_READ_WRITE, alloc_size);
+  gradients = context->allocate(CL_MEM_READ_WRITE, alloc_size);
+  context->write_buffer(parameters, (void *)&values[0], true);
+  context->zeros_float(gradients, true);
+  if (!adam_moments) {
+    previous_deltas = context->allocate(CL_MEM_READ_WRITE, alloc_size);
+    context->zeros_float(previous_deltas, true);
+  } else {
+    first_moments = context->allocate(CL_MEM_READ_WRITE, alloc_size);
+    second_moments = context->allocate(CL_MEM_READ_WRITE, alloc_size);
+    context->zeros_float(first_moments, true);
+    context->zeros_float(second_moments, true);
+  }
+  step = 0;
+
+  segment_ranges_gpu = context->allocate(
+      CL_MEM_READ_ONLY, sizeof(cl_uint) * segment_ranges.size());
+  context->write_buffer(segment_ranges_gpu, (void *)&segment_ranges[0], true);
+  segment_rates.resize(segment_ranges.size());
+  segment_rates_gpu = context->allocate(
+      CL_MEM_READ_ONLY, sizeof(cl_float) * segment_rates.size());
+
+  // layer buffers are views into the arena
+  auto view = [&](opencl::MemoryHandle parent, size_t segment) {
+    size_t begin = segment_ranges[2 * segment],
+           end = segment_ranges[2 * segment + 1];
+    return context->create_sub_buffer(parent, CL_MEM_READ_WRITE,
+                                      sizeof(cl_float) * begin,
+                                      sizeof(cl_float) * (end - begin));
+  };
+  for (size_t i = 0; i < allocs.size(); i++) {
+    LayerAllocationPool &alloc = *allocs[i];
+    utils::require(alloc.weights == gpu_nullptr && alloc.bias == gpu_nullptr,
+                   "Layer parameters were already uploaded, cannot pack them");
+    alloc.weights = view(parameters, 2 * i);
+    alloc.bias = view(parameters, 2 * i + 1);
+    alloc.accumulating_grad_w = view(gradients, 2 * i);
+    alloc.accumulating_grad_b = view(gradients, 2 * i + 1);
+    if (!adam_moments) {
+      alloc.previous_batch_delta_w = view(previous_deltas, 2 * i);
+      alloc.previous_batch_delta_b = view(previous_deltas, 2 * i + 1);
+      continue;
+    }
+    alloc.first_moment_w = view(first_moments, 2 * i);
+    alloc.first_moment_b = view(first_moments, 2 * i + 1);
+    alloc.second_moment_w = view(second_moments, 2 * i);
+    alloc.second_moment_b = view(second_moments, 2 * i + 1);
+  }
+}
+
+void ParameterArena::write_rates(opencl::Context *context,
+                                 const float *learning_rates,
+                                 float weight_decay) {
+  for (size_t i = 0; i < segment_count() / 2; i++) {
+    segment_rates[4 * i] = learning_rates[i];
+    segment_rates[4 * i + 1] = weight_decay;
+    segment_rates[4 * i + 2] = learning_rates[i];
+    segment_rates[4 * i + 3] = 0.0f;
+  }
+  context->write_buffer(segment_rates_gpu, (void *)&segment_rates[0], true);
+}
+
+///
+/// ConfigBasedDataPipeline
+///
 ConfigBasedDataPipeline::ConfigBasedDataPipeline(Config &cfg,
                                                  opencl::Context *context)
-    : DataPipeline(context),
-      _config(&cfg),
-      layer_data_1(1, cfg.n1, cfg.f1),
-      layer_data_2(cfg.n1, cfg.n2, cfg.f2),
-      layer_data_3(cfg.n2, 1, cfg.f3) {}
+    : DataPipeline(context), _config(&cfg) {
+  // network input is single channel luma
+  size_t n_prev_filter_cnt = 1;
+  _layers.reserve(cfg.layers.size());
+  for (auto &layer : cfg.layers) {
+    _layers.emplace_back(n_prev_filter_cnt, layer.filter_count,
+                         layer.f_spatial_size);
+    _learning_rates.push_back(layer.learning_rate);
+    n_prev_filter_cnt = layer.filter_count;
+  }
+  _int8_layers.resize(_layers.size());
+  _activation_max.resize(_layers.size(), 0.0f);
+}
 
 void ConfigBasedDataPipeline::init(int load_flags) {
   DataPipeline::init(load_flags);
@@ -42,13 +193,10 @@ void ConfigBasedDataPipeline::init(int load_flags) {
     std::cout
         << "No parameters file provided, initializing random weights and biases"
         << std::endl;
-    fill_random_parameters(layer_data_1, _config->params_distr_1);
-    fill_random_parameters(layer_data_2, _config->params_distr_2);
-    fill_random_parameters(layer_data_3, _config->params_distr_3);
+    for (size_t i = 0; i < _layers.size(); i++)
+      fill_random_parameters(_layers[i], _config->layers[i].params_distr);
   }
-  LayerData::validate(layer_data_1);
-  LayerData::validate(layer_data_2);
-  LayerData::validate(layer_data_3);
+  for (auto &layer : _layers) LayerData::validate(layer);
 }
 
 void ConfigBasedDataPipeline::load_kernels(int load_flags) {
@@ -56,22 +204,29 @@ void ConfigBasedDataPipeline::load_kernels(int load_flags) {
 
   bool load_layers = (load_flags & DataPipeline::LOAD_KERNEL_LAYERS) != 0,
        load_backp = (load_flags & DataPipeline::LOAD_KERNEL_BACKPROPAGATE) != 0;
+  // network input, last layer output and its deltas are always float
+  bool half = _config->half_activations, mixed = _config->mixed_precision;
+
+  size_t layer_cnt = _layers.size(), last = layer_cnt - 1;
 
-  if (load_layers) {
-    if (!_layer_1_kernel)
-      _layer_1_kernel = create_layer_kernel(layer_data_1, false);
-    if (!_layer_2_kernel)
-      _layer_2_kernel = create_layer_kernel(layer_data_2, false);
-    if (!_layer_3_kernel)
-      _layer_3_kernel = create_layer_kernel(layer_data_3, true);
+  /* clang-format off */
+  if (load_layers && _layer_kernels.empty()) {
+    for (size_t i = 0; i < layer_cnt; i++) {
+      bool skip_relu = !_config->layers[i].relu;
+      _layer_kernels.push_back(create_layer_kernel(_layers[i], skip_relu, half && i > 0, half && i < last));
+    }
   }
 
-  if (load_backp) {
-    if (!_layer_1_deltas_kernel)
-      _layer_1_deltas_kernel = create_deltas_kernel(layer_data_1);
-    if (!_layer_2_deltas_kernel)
-      _layer_2_deltas_kernel = create_deltas_kernel(layer_data_2);
+  if (load_backp && _backpropagate_kernels.empty()) {
+    // there is no deltas kernel for last layer, its deltas come from the loss
+    for (size_t i = 0; i < last; i++) {
+      bool skip_relu = !_config->layers[i].relu;
+      _deltas_kernels.push_back(create_deltas_kernel(_layers[i], half, half && i + 1 < last, mixed, skip_relu));
+    }
+    for (size_t i = 0; i < layer_cnt; i++)
+      _backpropagate_kernels.push_back(create_backpropagate_kernel(half && i < last, half && i > 0, mixed));
   }
+  /* clang-format on */
 }
 
 void ConfigBasedDataPipeline::set_mini_batch_size(size_t mini_batch_size) {
@@ -79,50 +234,344 @@ void ConfigBasedDataPipeline::set_mini_batch_size(size_t mini_batch_size) {
   std::cout << "mini-batch size: " << _mini_batch_size << std::endl;
 }
 
-void ConfigBasedDataPipeline::allocate_buffers(size_t img_w, size_t img_h) {
-  size_t l1_output_dim[2], l2_output_dim[2], l3_output_dim[2];
-  layer_data_1.get_output_dimensions(l1_output_dim, img_w, img_h);
-  layer_data_2.get_output_dimensions(l2_output_dim,  //
-                                     l1_output_dim[0], l1_output_dim[1]);
-  layer_data_3.get_output_dimensions(l3_output_dim,  //
-                                     l2_output_dim[0], l2_output_dim[1]);
+size_t ConfigBasedDataPipeline::activation_el_size() const {
+  return _config->half_activations ? sizeof(cl_half) : sizeof(cl_float);
+}
+
+void ConfigBasedDataPipeline::layer_dimensions(
+    size_t input_w, size_t input_h, std::vector<size_t> &dims) const {
+  dims.resize(2 * _layers.size());
+  for (size_t i = 0; i < _layers.size(); i++) {
+    _layers[i].get_output_dimensions(&dims[2 * i], input_w, input_h);
+    input_w = dims[2 * i];
+    input_h = dims[2 * i + 1];
+  }
+}
+
+std::vector<LayerAllocationPool> &ConfigBasedDataPipeline::layer_allocs(
+    GpuAllocationPool &gpu_alloc) const {
+  utils::require(gpu_alloc.layers.size() == _layers.size(),
+                 "Gpu allocation pool should have one entry per layer");
+  return gpu_alloc.layers;
+}
+
+std::vector<size_t> ConfigBasedDataPipeline::plan_buffers(
+    MemoryPlanner &planner, size_t img_w, size_t img_h, bool keep_activations,
+    bool recompute_first_layer) const {
+  std::vector<size_t> dims;
+  layer_dimensions(img_w, img_h, dims);
+  size_t layer_cnt = _layers.size(), last = layer_cnt - 1,
+         act = activation_el_size(), r = _config->upscale_factor,
+         per_batch0 = _mini_batch_size * sizeof(cl_float) * img_w * img_h;
+  const size_t unused = (size_t)-1;
+
+  // schedule, same order as in execute_batch, forward and backpropagate:
+  //   0                    gather samples / copy input
+  //   1 + i                forward layer i
+  //   L + 1                pixel shuffle
+  //   L + 2                loss (result read)
+  //   L + 3                pixel unshuffle
+  //   grad(i)              gradients of layer i, from last to first
+  //   grad(i) + 1          deltas of layer i - 1
+  // Recomputed first layer output is written right before grad(1), that
+  // step is shared with deltas of layer 1 (or unshuffle if L = 2). Deltas
+  // of first layer then overwrite it in place (see layer_deltas.cl)
+  auto fwd = [](size_t i) { return 1 + i; };
+  size_t shuffle = layer_cnt + 1, loss = layer_cnt + 2,
+         unshuffle = layer_cnt + 3;
+  auto grad = [=](size_t i) { return layer_cnt + 4 + 2 * (last - i); };
+  auto deltas = [=](size_t i) { return grad(i + 1) + 1; };
+
+  bool recompute = keep_activations && recompute_first_layer;
+  std::vector<size_t> ids(5 + 2 * layer_cnt, unused);
+  ids[0] = planner.add(per_batch0, 0, keep_activations ? grad(0) : fwd(0));
+  if (keep_activations) ids[1] = planner.add(per_batch0 * r * r, 0, loss);
+
+  for (size_t i = 0; i < layer_cnt; i++) {
+    size_t el_size = i < last ? act : sizeof(cl_float),
+           size = _mini_batch_size * el_size * dims[2 * i] * dims[2 * i + 1] *
+                  _layers[i].current_filter_count;
+    // output
+    size_t out_end = keep_activations ? (i < last ? deltas(i) : loss)
+                                      : (i < last ? fwd(i + 1) : loss);
+    if (i == last && r > 1) out_end = shuffle;
+    if (i == 0 && recompute) {
+      out_end = fwd(1);
+      ids.back() = planner.add(size, grad(1) - 1, grad(0));
+    }
+    ids[4 + 2 * i] = planner.add(size, fwd(i), out_end);
+    if (i == last && r > 1) {
+      ids[2] = planner.add(size, shuffle, loss);
+      if (keep_activations) ids[3] = planner.add(size, loss, unshuffle);
+    }
+    if (!keep_activations) continue;
+    // deltas
+    if (i == 0 && recompute) continue;
+    size_t delta_begin =
+        i < last ? deltas(i) : (r > 1 ? unshuffle : loss),
+           delta_end = i > 0 ? deltas(i - 1) : grad(0);
+    ids[5 + 2 * i] = planner.add(size, delta_begin, delta_end);
+  }
+  return ids;
+}
+
+void ConfigBasedDataPipeline::allocate_buffers(size_t img_w, size_t img_h,
+                                               bool keep_activations,
+                                               bool recompute_first_layer) {
+  // views first, then the arena they point into. Release is idempotent, so
+  // aliased handles (e.g. recomputed output as first delta) are fine
+  auto release = [this](opencl::MemoryHandle h) {
+    if (h != gpu_nullptr) _context->raw_memory(h)->release();
+  };
+  release(_forward_gpu_buf);
+  release(_ground_truth_gpu_buf);
+  for (auto h : _out_gpu_bufs) release(h);
+  for (auto h : _delta_gpu_bufs) release(h);
+  release(_recomputed_out_gpu_buf);
+  release(_result_gpu_buf);
+  release(_delta_result_gpu_buf);
+  release(_activations_arena_gpu_buf);
+  release(_batch_slots_gpu_buf);
+  release(_batch_losses_gpu_buf);
+  release(_int8_input_gpu_buf);
+  for (auto h : _int8_out_gpu_bufs) release(h);
+
+  MemoryPlanner planner;
+  auto ids = plan_buffers(planner, img_w, img_h, keep_activations,
+                          recompute_first_layer);
+  size_t arena_size = planner.plan(_context->sub_buffer_alignment()),
+         last = _layers.size() - 1;
+  _activations_arena_gpu_buf =
+      _context->allocate(CL_MEM_READ_WRITE, arena_size);
+  std::cout << "Layer buffers: " << (arena_size >> 10) << "KB ("
+            << (planner.unplanned_size() >> 10) << "KB without reuse)"
+            << std::endl;
 
-  size_t per_img0 = img_w * img_h,  //
-      per_img1 = l1_output_dim[0] * l1_output_dim[1] *
-                 layer_data_1.current_filter_count,
-         per_img2 = l2_output_dim[0] * l2_output_dim[1] *
-                    layer_data_2.current_filter_count,
-         per_img3 = l3_output_dim[0] * l3_output_dim[1] *
-                    layer_data_3.current_filter_count;
+  auto view = [&](size_t id) {
+    if (id == (size_t)-1) return gpu_nullptr;
+    return _context->create_sub_buffer(_activations_arena_gpu_buf,
+                                       CL_MEM_READ_WRITE, planner.offset(id),
+                                       planner.size(id));
+  };
+  _forward_gpu_buf = view(ids[0]);
+  _ground_truth_gpu_buf = view(ids[1]);
+  _out_gpu_bufs.clear();
+  _delta_gpu_bufs.clear();
+  for (size_t i = 0; i < _layers.size(); i++) {
+    _out_gpu_bufs.push_back(view(ids[4 + 2 * i]));
+    _delta_gpu_bufs.push_back(view(ids[5 + 2 * i]));
+  }
+  _recomputed_out_gpu_buf = view(ids.back());
+  if (_recomputed_out_gpu_buf != gpu_nullptr)
+    _delta_gpu_bufs[0] = _recomputed_out_gpu_buf;
+  // sub-pixel layer: same values, but rearranged into bigger image
+  size_t r = _config->upscale_factor;
+  _result_gpu_buf = r == 1 ? _out_gpu_bufs[last] : view(ids[2]);
+  _delta_result_gpu_buf = r == 1 ? _delta_gpu_bufs[last] : view(ids[3]);
 
   /* clang-format off */
-  _ground_truth_gpu_buf = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * 4 * per_img0);
-  _forward_gpu_buf = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * 4 * per_img0);
-  _out_1_gpu_buf   = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * 4 * per_img1);
-  _out_2_gpu_buf   = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * 4 * per_img2);
-  _out_3_gpu_buf   = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * 4 * per_img3);
-  _delta_1_gpu_buf = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * 4 * per_img1);
-  _delta_2_gpu_buf = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * 4 * per_img2);
-  _delta_3_gpu_buf = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * 4 * per_img3);
+  _batch_slots_gpu_buf = _context->allocate(CL_MEM_READ_ONLY, _mini_batch_size * sizeof(cl_uint));
+  _batch_losses_gpu_buf = _context->allocate(CL_MEM_READ_WRITE, _mini_batch_size * sizeof(cl_float));
   /* clang-format on */
+  _batch_slots.resize(_mini_batch_size);
+  _buffers_w = img_w;
+  _buffers_h = img_h;
+  _activations_kept = keep_activations;
+  _first_layer_recomputed = _recomputed_out_gpu_buf != gpu_nullptr;
+  // int8 buffers are allocated on first int8 forward
+  _int8_input_gpu_buf = gpu_nullptr;
+  _int8_out_gpu_bufs.assign(last, gpu_nullptr);
 }
 
 ///
 /// Pipeline: forward/backward propagation wrappers
 ///
 
-cl_event ConfigBasedDataPipeline::forward(LayerAllocationPool &layer_1_alloc,
-                                          LayerAllocationPool &layer_2_alloc,
-                                          LayerAllocationPool &layer_3_alloc,
+cl_event ConfigBasedDataPipeline::forward(GpuAllocationPool &gpu_alloc,
                                           SampleAllocationPool &sample) {
-  set_mini_batch_size(1);
-  allocate_buffers(sample.input_w, sample.input_h);
+  if (_mini_batch_size != 1 || _buffers_w != sample.input_w ||
+      _buffers_h != sample.input_h) {
+    set_mini_batch_size(1);
+    allocate_buffers(sample.input_w, sample.input_h, false);
+  }
   _context->copy_buffer(sample.input_luma, _forward_gpu_buf);
-  // we use 0, since there is no offset
-  return forward(layer_1_alloc,  //
-                 layer_2_alloc,  //
-                 layer_3_alloc,  //
-                 sample.input_w, sample.input_h, 1);
+  _batch_input_gpu_buf = _forward_gpu_buf;
+  return forward(layer_allocs(gpu_alloc), sample.input_w, sample.input_h, 1);
+}
+
+void ConfigBasedDataPipeline::result_size(size_t input_w, size_t input_h,
+                                          size_t *result_dim) const {
+  size_t padding = _config->total_padding(), r = _config->upscale_factor;
+  result_dim[0] = (input_w - padding) * r;
+  result_dim[1] = (input_h - padding) * r;
+}
+
+cl_event ConfigBasedDataPipeline::shuffle_result(size_t sample_w,
+                                                 size_t sample_h,
+                                                 size_t sample_count,
+                                                 cl_event *ev_to_wait_for) {
+  size_t r = _config->upscale_factor, padding = _config->total_padding();
+  if (r == 1) return *ev_to_wait_for;
+  if (print_steps) std::cout << "### Pixel shuffle" << std::endl;
+  return pixel_shuffle(_out_gpu_bufs.back(), sample_w - padding,
+                       sample_h - padding, sample_count, r, _result_gpu_buf,
+                       ev_to_wait_for);
+}
+
+///
+/// Int8 inference
+///
+/** Largest absolute value of float or half buffer, blocks */
+float max_abs_value(opencl::Context *context, opencl::MemoryHandle buffer,
+                    size_t count, size_t el_size) {
+  std::vector<float> values(count);
+  if (el_size == sizeof(cl_half)) {
+    std::vector<unsigned short> half_values(count);
+    context->read_buffer(buffer, 0, el_size * count,
+                         (void *)&half_values[0], true);
+    for (size_t i = 0; i < count; i++)
+      values[i] = utils::half_to_float(half_values[i]);
+  } else {
+    context->read_buffer(buffer, 0, el_size * count, (void *)&values[0], true);
+  }
+
+  float result = 0.0f;
+  for (float v : values) result = std::max(result, std::abs(v));
+  return result;
+}
+
+void ConfigBasedDataPipeline::observe_activation_ranges(
+    GpuAllocationPool &gpu_alloc, SampleAllocationPool &sample) {
+  // inputs of all layers are read after forward
+  if (_mini_batch_size != 1 || _buffers_w != sample.input_w ||
+      _buffers_h != sample.input_h || !_activations_kept ||
+      _first_layer_recomputed) {
+    set_mini_batch_size(1);
+    allocate_buffers(sample.input_w, sample.input_h, true);
+  }
+  forward(gpu_alloc, sample);
+  _context->block();
+
+  // input of each layer: network input or output of previous layer
+  std::vector<size_t> dims;
+  layer_dimensions(sample.input_w, sample.input_h, dims);
+  for (size_t i = 0; i < _layers.size(); i++) {
+    float v =
+        i == 0 ? max_abs_value(_context, _forward_gpu_buf,
+                               sample.input_w * sample.input_h,
+                               sizeof(cl_float))
+               : max_abs_value(_context, _out_gpu_bufs[i - 1],
+                               _layers[i].input_size(dims[2 * i - 2],
+                                                     dims[2 * i - 1]),
+                               activation_el_size());
+    _activation_max[i] = std::max(_activation_max[i], v);
+  }
+}
+
+void ConfigBasedDataPipeline::calibrate_int8() {
+  utils::require(_activation_max[0] > 0.0f,
+                 "Int8 calibration requires at least one observed sample");
+  std::cout << "Int8 input scales:";
+  for (size_t i = 0; i < _layers.size(); i++) {
+    auto &quantized = _int8_layers[i];
+    // dead layer (f.e. all relu outputs were 0) still needs valid scale
+    float range = _activation_max[i] > 0.0f ? _activation_max[i] : 1.0f;
+    quantized.input_scale = range / 127;
+    quantized.compute_weight_scales(_layers[i]);
+    quantized.quantize_weights(_layers[i]);
+    std::cout << " " << quantized.input_scale;
+  }
+  std::cout << std::endl;
+}
+
+bool ConfigBasedDataPipeline::int8_calibrated() const {
+  for (auto &quantized : _int8_layers)
+    if (!quantized.calibrated()) return false;
+  return true;
+}
+
+cl_event ConfigBasedDataPipeline::forward_int8(GpuAllocationPool &gpu_alloc,
+                                               SampleAllocationPool &sample) {
+  utils::require(int8_calibrated(),
+                 "Int8 inference requires calibrated parameters file");
+  check_initialized(DataPipeline::LOAD_KERNEL_LAYERS);
+  auto &allocs = layer_allocs(gpu_alloc);
+  size_t last = _layers.size() - 1;
+  // compiled only if used
+  if (_int8_kernels.empty()) {
+    for (size_t i = 0; i < _layers.size(); i++)
+      _int8_kernels.push_back(create_int8_layer_kernel(
+          _layers[i], i == last, !_config->layers[i].relu));
+  }
+
+  size_t w = sample.input_w, h = sample.input_h;
+  if (_mini_batch_size != 1 || _buffers_w != w || _buffers_h != h) {
+    set_mini_batch_size(1);
+    allocate_buffers(w, h, false);
+  }
+  std::vector<size_t> dims;
+  layer_dimensions(w, h, dims);
+
+  // output of each layer is quantized with input scale of the next one,
+  // last layer writes float
+  auto finish_token = quantize(sample.input_luma, w * h,
+                               _int8_layers[0].input_scale,
+                               _int8_input_gpu_buf);
+  for (size_t i = 0; i < _layers.size(); i++) {
+    auto &input = i == 0 ? _int8_input_gpu_buf : _int8_out_gpu_bufs[i - 1];
+    auto &output = i == last ? _out_gpu_bufs[last] : _int8_out_gpu_bufs[i];
+    size_t input_w = i == 0 ? w : dims[2 * i - 2],
+           input_h = i == 0 ? h : dims[2 * i - 1];
+    float output_scale = i == last ? 0.0f : _int8_layers[i + 1].input_scale;
+    finish_token = execute_layer_int8(*_int8_kernels[i], _layers[i],
+                                      _int8_layers[i], allocs[i], input,
+                                      input_w, input_h, 1, output_scale,
+                                      output, &finish_token);
+  }
+  return shuffle_result(w, h, 1, &finish_token);
+}
+
+float ConfigBasedDataPipeline::result_psnr(opencl::MemoryHandle reference,
+                                           size_t reference_w,
+                                           size_t reference_h) {
+  size_t result_dim[2];
+  result_size(_buffers_w, _buffers_h, result_dim);
+  size_t result_w = result_dim[0], result_h = result_dim[1];
+  utils::require(reference_w >= result_w && reference_h >= result_h,
+                 "PSNR reference is smaller than the result");
+
+  float squared_error_sum;
+  squared_error(reference, reference_w, reference_h, 1, _result_gpu_buf,
+                _batch_losses_gpu_buf, squared_error_sum,
+                reference_w - result_w);
+  float mse = squared_error_sum / (result_w * result_h);
+  if (mse <= 0.0f) return std::numeric_limits<float>::infinity();
+  return 10.0f * std::log10(1.0f / mse);
+}
+
+bool ConfigBasedDataPipeline::use_arena_views(const SampleArena &arena,
+                                              size_t first_slot, size_t count) {
+  size_t sample_size = sizeof(cl_float) * arena.w * arena.h,
+         offset = first_slot * sample_size,
+         expected_scale = arena.expected_scale * arena.expected_scale;
+  if (arena.storage != DatasetStorage::Float32 ||
+      offset % _context->sub_buffer_alignment() != 0)
+    return false;
+
+  // views are created once and reused in following epochs
+  auto key = std::make_tuple(&arena, first_slot, count);
+  auto it = _arena_views.find(key);
+  if (it == _arena_views.end()) {
+    auto input = _context->create_sub_buffer(
+        arena.input_luma, CL_MEM_READ_ONLY, offset, sample_size * count);
+    auto expected = _context->create_sub_buffer(
+        arena.expected_luma, CL_MEM_READ_ONLY, offset * expected_scale,
+        sample_size * count * expected_scale);
+    it = _arena_views.insert({key, std::make_pair(input, expected)}).first;
+  }
+  _batch_input_gpu_buf = it->second.first;
+  _batch_ground_truth_gpu_buf = it->second.second;
+  return true;
 }
 
 float ConfigBasedDataPipeline::execute_batch(
@@ -133,11 +582,15 @@ float ConfigBasedDataPipeline::execute_batch(
   if (sample_set.empty() || _mini_batch_size == 0) {
     throw std::runtime_error("Batch cannot be empty");
   }
-  size_t w = sample_set[0]->input_w, h = sample_set[0]->input_h;
+  size_t w = sample_set[0]->input_w, h = sample_set[0]->input_h,
+         r = _config->upscale_factor;
 
   // allocate memory
-  if (_out_1_gpu_buf == gpu_nullptr) {
-    allocate_buffers(w, h);
+  bool recompute = _config->recompute_first_layer;
+  if (_out_gpu_bufs.empty() || !_activations_kept ||
+      _first_layer_recomputed != recompute || w != _buffers_w ||
+      h != _buffers_h || _batch_slots.size() < _mini_batch_size) {
+    allocate_buffers(w, h, true, recompute);
   }
 
   float validation_error = 0.0f;  // only if executing validation set
@@ -146,42 +599,84 @@ float ConfigBasedDataPipeline::execute_batch(
     // << (backpropagate__ ? "Backpropagate" : "Validation")
     // << "), start idx " << i << std::endl;
 
-    // copy mini batch so that data is nicely aligned in memory
-    size_t img_offset = 0, samples_in_batch = 0, j = i;
-    while (samples_in_batch < _mini_batch_size && j < sample_set.size()) {
-      SampleAllocationPool &sample = *sample_set[j];
-      _context->copy_buffer(sample.input_luma, _forward_gpu_buf, img_offset,
-                            nullptr, 0);
-      _context->copy_buffer(sample.expected_luma, _ground_truth_gpu_buf,
-                            img_offset, nullptr, 0);
-      img_offset += sample.input_w * sample.input_h * 4;
-      // img_offset += _context->raw_memory(sample.input_luma)->size;
-      ++samples_in_batch;
-      ++j;
+    if (_sample_cache) {
+      // refills of next mini-batch are queued before compute of this one
+      size_t count = std::min(_mini_batch_size, sample_set.size() - i),
+             next = i + count,
+             next_count = std::min(_mini_batch_size, sample_set.size() - next);
+      _sample_cache->make_resident(&sample_set[i], count);
+      if (next_count > 0)
+        _sample_cache->prefetch(&sample_set[next], next_count);
     }
-    _context->block();
 
-    // forward propagation
-    auto forward_ev = forward(gpu_alloc.layer_1,  //
-                              gpu_alloc.layer_2,  //
-                              gpu_alloc.layer_3,  //
-                              w, h, samples_in_batch);
+    // gather mini batch so that data is nicely aligned in memory. Only slot
+    // list is written, queue is in-order so no need to block. If samples
+    // already are in consecutive slots we just use views into the arena
+    size_t samples_in_batch = std::min(_mini_batch_size, sample_set.size() - i);
+    SampleArena *arena = sample_set[i]->arena;
+    utils::require(arena && arena->w == w && arena->h == h,
+                   "Training samples should be in arena of mini-batch size");
+    utils::require(arena->expected_scale == r,
+                   "Expected samples should be upscale_factor times bigger "
+                   "then input samples");
+    size_t first_slot = sample_set[i]->arena_slot;
+    bool consecutive = true;
+    for (size_t j = 0; j < samples_in_batch; j++) {
+      utils::require(sample_set[i + j]->arena == arena,
+                     "All samples of mini-batch should be in the same arena");
+      _batch_slots[j] = sample_set[i + j]->arena_slot;
+      consecutive &= _batch_slots[j] == first_slot + j;
+    }
+    // slots are also needed to store per sample losses
+    bool track_losses = backpropagate__ && _loss_arena;
+    utils::require(!track_losses || arena == _loss_arena,
+                   "Sample losses are tracked for different arena");
+    bool use_views =
+        consecutive && use_arena_views(*arena, first_slot, samples_in_batch);
+    if (!use_views || track_losses) {
+      _context->write_buffer(_batch_slots_gpu_buf, 0,
+                             sizeof(cl_uint) * samples_in_batch,
+                             (void *)&_batch_slots[0], false);
+    }
+    if (!use_views) {
+      _batch_input_gpu_buf = _forward_gpu_buf;
+      _batch_ground_truth_gpu_buf = _ground_truth_gpu_buf;
+      gather_samples(arena->input_luma, arena->expected_luma,
+                     arena->input_means, arena->storage, _batch_slots_gpu_buf,
+                     samples_in_batch, w * h, _forward_gpu_buf,
+                     _ground_truth_gpu_buf, nullptr, r);
+    }
 
-    // execute mini batch:
+    // forward propagation
+    auto forward_ev =
+        forward(layer_allocs(gpu_alloc), w, h, samples_in_batch);
+
+    // execute mini batch, result and ground truth are r times bigger then
+    // the input
+    size_t padding = _config->total_padding() * r;
+    if (track_losses) {
+      // does not block, losses stay on gpu until next draw
+      squared_error_per_sample(_batch_ground_truth_gpu_buf, w * r, h * r,
+                               samples_in_batch, _result_gpu_buf,
+                               _batch_losses_gpu_buf, padding, &forward_ev);
+      scatter_losses(_batch_losses_gpu_buf, _batch_slots_gpu_buf,
+                     samples_in_batch, _sample_losses_gpu_buf);
+    }
     if (backpropagate__) {
-      backpropagate(gpu_alloc.layer_1,       //
-                    gpu_alloc.layer_2,       //
-                    gpu_alloc.layer_3,       //
-                    w, h, samples_in_batch,  //
+      backpropagate(layer_allocs(gpu_alloc),  //
+                    w, h, samples_in_batch,   //
                     &forward_ev);
+      _samples_since_update += samples_in_batch;
+      ++_batches_since_update;
+      if (_update_interval > 0 && _batches_since_update >= _update_interval)
+        apply_accumulated_gradients(gpu_alloc);
     } else {
       // we are executing validation set - schedule all squared_error calcs
-      size_t padding = _config->total_padding();
       float validation_error__ = 0.0f;
-      auto e = squared_error(_ground_truth_gpu_buf,   //
-                             w, h, samples_in_batch,  //
-                             _out_3_gpu_buf, _tmp_gpu_float, validation_error__,
-                             padding, &forward_ev);
+      auto e = squared_error(_batch_ground_truth_gpu_buf,  //
+                             w * r, h * r, samples_in_batch,
+                             _result_gpu_buf, _batch_losses_gpu_buf,
+                             validation_error__, padding, &forward_ev);
       clWaitForEvents(1, &e);
       validation_error += validation_error__;
     }
@@ -194,169 +689,273 @@ float ConfigBasedDataPipeline::execute_batch(
   return validation_error;
 }
 
+void ConfigBasedDataPipeline::track_sample_losses(const SampleArena &arena) {
+  utils::require(arena.capacity > 0, "Sample arena is empty");
+  size_t count = arena.capacity;
+  _loss_arena = &arena;
+  _sample_losses_gpu_buf =
+      _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * count);
+  _train_slots_gpu_buf =
+      _context->allocate(CL_MEM_READ_ONLY, sizeof(cl_uint) * count);
+  _train_losses_gpu_buf =
+      _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * count);
+  _loss_cdf_gpu_buf =
+      _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * count);
+  _context->zeros_float(_sample_losses_gpu_buf, true);
+}
+
+void ConfigBasedDataPipeline::draw_samples_by_loss(
+    float loss_fraction, std::mt19937 &generator,
+    std::vector<SampleAllocationPool *> &train_set) {
+  utils::require(_loss_arena, "Sample losses are not tracked");
+  size_t draw_count = train_set.size();
+  if (draw_count == 0) return;
+  utils::require(draw_count <= _loss_arena->capacity,
+                 "More training samples then arena slots");
+
+  // only training samples can be drawn, validation slots never get a loss
+  _train_slots.resize(draw_count);
+  for (size_t i = 0; i < draw_count; i++) {
+    utils::require(train_set[i]->arena == _loss_arena,
+                   "Sample losses are tracked for different arena");
+    _train_slots[i] = train_set[i]->arena_slot;
+  }
+  if (_drawn_slots.size() < draw_count) {
+    _loss_uniforms_gpu_buf =
+        _context->allocate(CL_MEM_READ_ONLY, sizeof(cl_float) * draw_count);
+    _drawn_slots_gpu_buf =
+        _context->allocate(CL_MEM_WRITE_ONLY, sizeof(cl_uint) * draw_count);
+    _loss_uniforms.resize(draw_count);
+    _drawn_slots.resize(draw_count);
+  }
+
+  // random numbers come from host generator, so that draws are reproducible
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  for (size_t i = 0; i < draw_count; i++)
+    _loss_uniforms[i] = uniform(generator);
+
+  // queue is in-order, only the result read blocks. Draws are indices into
+  // train_set
+  _context->write_buffer(_train_slots_gpu_buf, 0,
+                         sizeof(cl_uint) * draw_count,
+                         (void *)&_train_slots[0], false);
+  _context->write_buffer(_loss_uniforms_gpu_buf, 0,
+                         sizeof(cl_float) * draw_count,
+                         (void *)&_loss_uniforms[0], false);
+  gather_losses(_sample_losses_gpu_buf, _train_slots_gpu_buf, draw_count,
+                _train_losses_gpu_buf);
+  loss_prefix_sum(_train_losses_gpu_buf, draw_count, _loss_cdf_gpu_buf);
+  draw_by_loss(_loss_cdf_gpu_buf, draw_count, _loss_uniforms_gpu_buf,
+               draw_count, loss_fraction, _drawn_slots_gpu_buf);
+  _context->read_buffer(_drawn_slots_gpu_buf, 0, sizeof(cl_uint) * draw_count,
+                        (void *)&_drawn_slots[0], true);
+  _train_samples.assign(train_set.begin(), train_set.end());
+  for (size_t i = 0; i < draw_count; i++)
+    train_set[i] = _train_samples[_drawn_slots[i]];
+}
+
 ///
 /// Pipeline: forward/backward propagation implementation
 ///
 cl_event ConfigBasedDataPipeline::forward(
-    LayerAllocationPool &layer_1_alloc,  //
-    LayerAllocationPool &layer_2_alloc,  //
-    LayerAllocationPool &layer_3_alloc,  //
+    std::vector<LayerAllocationPool> &allocs,  //
     size_t sample_w, size_t sample_h, size_t sample_count) {
   //
   check_initialized(DataPipeline::LOAD_KERNEL_LAYERS);
-  size_t l1_output_dim[2], l2_output_dim[2];
-  layer_data_1.get_output_dimensions(l1_output_dim,  //
-                                     sample_w, sample_h);
-  layer_data_2.get_output_dimensions(l2_output_dim,  //
-                                     l1_output_dim[0], l1_output_dim[1]);
+  std::vector<size_t> dims;
+  layer_dimensions(sample_w, sample_h, dims);
 
   if (sample_count > _mini_batch_size)
     throw std::runtime_error("Allocation pool out of bounds exception");
+  size_t act = activation_el_size(), last = _layers.size() - 1;
+
+  // each layer reads output of the previous one
+  cl_event finish_token;
+  for (size_t i = 0; i < _layers.size(); i++) {
+    if (print_steps)
+      std::cout << "### Executing layer " << (i + 1) << std::endl;
+    auto &input = i == 0 ? _batch_input_gpu_buf : _out_gpu_bufs[i - 1];
+    size_t input_w = i == 0 ? sample_w : dims[2 * i - 2],
+           input_h = i == 0 ? sample_h : dims[2 * i - 1];
+    cl_event *ev = i == 0 ? nullptr : &finish_token;
+    finish_token = execute_layer(*_layer_kernels[i], _layers[i],
+                                 allocs[i], input,                // layer cfg
+                                 input_w, input_h, sample_count,  // input
+                                 _out_gpu_bufs[i], ev,
+                                 i < last ? act : sizeof(cl_float));
+  }
 
-  // layer 1
-  if (print_steps) std::cout << "### Executing layer 1" << std::endl;
-  cl_event finish_token1 =
-      execute_layer(*_layer_1_kernel, layer_data_1, layer_1_alloc,  // layer cfg
-                    _forward_gpu_buf,                               //
-                    sample_w, sample_h, sample_count,               // input
-                    _out_1_gpu_buf);
-
-  // layer 2
-  if (print_steps) std::cout << "### Executing layer 2" << std::endl;
-  cl_event finish_token2 =
-      execute_layer(*_layer_2_kernel, layer_data_2, layer_2_alloc,  // layer cfg
-                    _out_1_gpu_buf,                                 //
-                    l1_output_dim[0], l1_output_dim[1], sample_count,  // input
-                    _out_2_gpu_buf, &finish_token1);
-
-  // layer 3
-  if (print_steps) std::cout << "### Executing layer 3" << std::endl;
-  cl_event finish_token3 =
-      execute_layer(*_layer_3_kernel, layer_data_3, layer_3_alloc,  // layer cfg
-                    _out_2_gpu_buf,                                 //
-                    l2_output_dim[0], l2_output_dim[1], sample_count,  // input
-                    _out_3_gpu_buf, &finish_token2);
-
-  return finish_token3;
+  return shuffle_result(sample_w, sample_h, sample_count, &finish_token);
 }
 
 cl_event ConfigBasedDataPipeline::backpropagate(
-    cnn_sr::LayerAllocationPool &layer_1_alloc,
-    cnn_sr::LayerAllocationPool &layer_2_alloc,
-    cnn_sr::LayerAllocationPool &layer_3_alloc,             //
+    std::vector<LayerAllocationPool> &allocs,               //
     size_t sample_w, size_t sample_h, size_t sample_count,  //
     cl_event *ev_to_wait_for) {
   // dimensions
-  size_t layer_1_out_dim[2], layer_2_out_dim[2], layer_3_out_dim[2];
-  layer_data_1.get_output_dimensions(layer_1_out_dim,  //
-                                     sample_w, sample_h);
-  layer_data_2.get_output_dimensions(layer_2_out_dim,  //
-                                     layer_1_out_dim[0], layer_1_out_dim[1]);
-  layer_data_3.get_output_dimensions(layer_3_out_dim,  //
-                                     layer_2_out_dim[0], layer_2_out_dim[1]);
+  std::vector<size_t> dims;
+  layer_dimensions(sample_w, sample_h, dims);
+  size_t act = activation_el_size(), last = _layers.size() - 1;
+  // deltas_evs[i] - deltas of layer i are ready
+  std::vector<cl_event> deltas_evs(_layers.size());
 
   // propagate deltas
   if (print_steps)
     std::cout << "### Calculating deltas for last layer" << std::endl;
-  size_t padding = _config->total_padding();
-  auto event2_1 = last_layer_delta(_ground_truth_gpu_buf,             //
-                                   sample_w, sample_h, sample_count,  //
-                                   _out_3_gpu_buf, _delta_3_gpu_buf,  //
-                                   padding, ev_to_wait_for);
+  size_t r = _config->upscale_factor,
+         padding = _config->total_padding() * r;
+  deltas_evs[last] = last_layer_delta(_batch_ground_truth_gpu_buf,  //
+                                      sample_w * r, sample_h * r,   //
+                                      sample_count,                 //
+                                      _result_gpu_buf, _delta_result_gpu_buf,
+                                      padding, ev_to_wait_for,
+                                      _loss_scaling_gpu_buf);
+  if (r > 1) {
+    // deltas of sub-pixels back to r*r channels of last layer
+    deltas_evs[last] = pixel_unshuffle(
+        _delta_result_gpu_buf, dims[2 * last], dims[2 * last + 1],
+        sample_count, r, _delta_gpu_bufs[last], &deltas_evs[last]);
+  }
 
-  if (print_steps)
-    std::cout << "### Calculating deltas for 2nd layer" << std::endl;
-  auto event2_2 = calculate_deltas(*_layer_2_deltas_kernel,     //
-                                   layer_data_2, layer_data_3,  //
-                                   layer_3_alloc,               //
-                                   _delta_2_gpu_buf, _delta_3_gpu_buf,
-                                   layer_3_out_dim[0], layer_3_out_dim[1],  //
-                                   sample_count,                            //
-                                   _out_2_gpu_buf, &event2_1);
+  // gradients of each layer are computed as soon as its deltas are ready,
+  // so that deltas and outputs die early (see plan_buffers). Deltas of layer
+  // i - 1 use weights of layer i, those are updated only after whole batch
+  std::vector<cl_event> evs;
+  std::vector<opencl::MemoryHandle> outs(_out_gpu_bufs);
+  for (size_t i = last; i > 0; i--) {
+    if (i == 1 && _first_layer_recomputed) {
+      // weights did not change since forward, so result is the same
+      if (print_steps)
+        std::cout << "### Recomputing layer 1" << std::endl;
+      outs[0] = _recomputed_out_gpu_buf;
+      deltas_evs[1] = execute_layer(*_layer_kernels[0], _layers[0], allocs[0],
+                                    _batch_input_gpu_buf,              //
+                                    sample_w, sample_h, sample_count,  //
+                                    outs[0], &deltas_evs[1], act);
+    }
+    if (print_steps)
+      std::cout << "### Backpropagate(weights&bias gradients) - layer "
+                << (i + 1) << std::endl;
+    evs.push_back(DataPipeline::backpropagate(
+        *_backpropagate_kernels[i], _layers[i],  //
+        outs[i - 1], _delta_gpu_bufs[i],         //
+        allocs[i],                               //
+        dims[2 * i], dims[2 * i + 1],            //
+        sample_count,                            //
+        &deltas_evs[i], 1, act));
+
+    if (print_steps)
+      std::cout << "### Calculating deltas for layer " << i << std::endl;
+    deltas_evs[i - 1] = calculate_deltas(
+        *_deltas_kernels[i - 1],                     //
+        _layers[i - 1], _layers[i], allocs[i],       //
+        _delta_gpu_bufs[i - 1], _delta_gpu_bufs[i],  //
+        dims[2 * i], dims[2 * i + 1],                //
+        sample_count,                                //
+        outs[i - 1], &deltas_evs[i], act);
+  }
 
   if (print_steps)
-    std::cout << "### Calculating deltas for 1nd layer" << std::endl;
-  auto event2_3 = calculate_deltas(*_layer_1_deltas_kernel,     //
-                                   layer_data_1, layer_data_2,  //
-                                   layer_2_alloc,               //
-                                   _delta_1_gpu_buf, _delta_2_gpu_buf,
-                                   layer_2_out_dim[0], layer_2_out_dim[1],  //
-                                   sample_count,                            //
-                                   _out_1_gpu_buf, &event2_2);
-
-  // gradient w, gradient b for all layers
-  if (print_steps)
-    std::cout << "### Backpropagate(weights&bias gradients) - 3rd layer"
+    std::cout << "### Backpropagate(weights&bias gradients) - layer 1"
               << std::endl;
-  auto event3_1 =
-      DataPipeline::backpropagate(layer_data_3,  //
-                                  _out_2_gpu_buf, _delta_3_gpu_buf,
-                                  layer_3_alloc,                           //
-                                  layer_3_out_dim[0], layer_3_out_dim[1],  //
-                                  sample_count,                            //
-                                  &event2_1);
+  evs.push_back(deltas_evs[0]);
+  return DataPipeline::backpropagate(*_backpropagate_kernels[0], _layers[0],
+                                     _batch_input_gpu_buf, _delta_gpu_bufs[0],
+                                     allocs[0],             //
+                                     dims[0], dims[1],      //
+                                     sample_count,          //
+                                     &evs[0], evs.size());
+}
 
-  if (print_steps)
-    std::cout << "### Backpropagate(weights&bias gradients) - 2nd layer"
-              << std::endl;
-  auto event3_2 =
-      DataPipeline::backpropagate(layer_data_2,  //
-                                  _out_1_gpu_buf, _delta_2_gpu_buf,
-                                  layer_2_alloc,                           //
-                                  layer_2_out_dim[0], layer_2_out_dim[1],  //
-                                  sample_count,                            //
-                                  &event2_2);
+void ConfigBasedDataPipeline::pack_parameters(GpuAllocationPool &gpu_alloc) {
+  auto &allocs = layer_allocs(gpu_alloc);
+  std::vector<const LayerData *> layers;
+  std::vector<LayerAllocationPool *> alloc_ptrs;
+  for (size_t i = 0; i < _layers.size(); i++) {
+    layers.push_back(&_layers[i]);
+    alloc_ptrs.push_back(&allocs[i]);
+  }
+  gpu_alloc.parameter_arena.pack(_context, layers, alloc_ptrs,
+                                 _config->optimizer != Optimizer::Momentum);
+  // rates do not change during training, no per-update transfer
+  gpu_alloc.parameter_arena.write_rates(_context, &_learning_rates[0],
+                                        _config->weight_decay_parameter);
+
+  if (_config->mixed_precision) {
+    std::vector<float> state(LOSS_SCALING_STATE_SIZE, 0.0f);
+    state[0] = _config->loss_scale;
+    _loss_scaling_gpu_buf = _context->allocate(
+        CL_MEM_READ_WRITE, sizeof(cl_float) * state.size());
+    _context->write_buffer(_loss_scaling_gpu_buf, (void *)&state[0], true);
+  }
+}
 
-  if (print_steps)
-    std::cout << "### Backpropagate(weights&bias gradients) - 1st layer"
-              << std::endl;
-  cl_event evs[3] = {event2_3, event3_1, event3_2};
-  auto event3_3 =
-      DataPipeline::backpropagate(layer_data_1,                            //
-                                  _forward_gpu_buf, _delta_1_gpu_buf,      //
-                                  layer_1_alloc,                           //
-                                  layer_1_out_dim[0], layer_1_out_dim[1],  //
-                                  sample_count,                            //
-                                  evs, 3);
-
-  return event3_3;
-}
-
-void ConfigBasedDataPipeline::update_parameters(
-    cnn_sr::LayerAllocationPool &layer_1_alloc,
-    cnn_sr::LayerAllocationPool &layer_2_alloc,
-    cnn_sr::LayerAllocationPool &layer_3_alloc, size_t batch_size,
+cl_event ConfigBasedDataPipeline::update_parameters(
+    GpuAllocationPool &gpu_alloc, size_t batch_size,
     cl_event *ev_to_wait_for) {
+  auto &arena = gpu_alloc.parameter_arena;
+  utils::require(arena.size > 0, "Parameters were not packed");
   if (print_steps)
-    std::cout << "### Updating weights and biases - 3rd layer" << std::endl;
-  DataPipeline::update_parameters(layer_data_3, layer_3_alloc, batch_size,
-                                  _config->momentum,
-                                  _config->weight_decay_parameter,
-                                  _config->learning_rate[2], ev_to_wait_for);
+    std::cout << "### Updating weights and biases - all layers" << std::endl;
+
+  // mixed precision: overflow is detected and handled on gpu, update is
+  // skipped by the kernel itself, so there is no need to wait for the flag
+  auto loss_scaling = _loss_scaling_gpu_buf;
+  if (loss_scaling != gpu_nullptr)
+    check_overflow(arena.gradients, arena.size, loss_scaling, ev_to_wait_for);
+
+  cl_event ev;
+  if (_config->optimizer != Optimizer::Momentum) {
+    // with loss scaling the step is counted on gpu, only for applied updates
+    size_t step = loss_scaling == gpu_nullptr ? ++arena.step : 0;
+    ev = update_packed_parameters_adam(
+        arena.parameters, arena.gradients, arena.first_moments,
+        arena.second_moments, arena.segment_ranges_gpu,
+        arena.segment_rates_gpu, arena.segment_count(), arena.size,
+        batch_size, _config->adam_beta1, _config->adam_beta2,
+        _config->adam_epsilon, step, _config->optimizer == Optimizer::AdamW,
+        ev_to_wait_for, loss_scaling);
+  } else {
+    ev = update_packed_parameters(
+        arena.parameters, arena.gradients, arena.previous_deltas,
+        arena.segment_ranges_gpu, arena.segment_rates_gpu,
+        arena.segment_count(), arena.size, batch_size, _config->momentum,
+        ev_to_wait_for, loss_scaling);
+  }
+  if (loss_scaling == gpu_nullptr) return ev;
+  return update_loss_scale(loss_scaling, _config->loss_scale_growth_interval,
+                           &ev);
+}
 
-  if (print_steps)
-    std::cout << "### Updating weights and biases - 2nd layer" << std::endl;
-  DataPipeline::update_parameters(layer_data_2, layer_2_alloc, batch_size,
-                                  _config->momentum,
-                                  _config->weight_decay_parameter,
-                                  _config->learning_rate[1], ev_to_wait_for);
+bool ConfigBasedDataPipeline::read_loss_scaling(float &loss_scale,
+                                                size_t &skipped_updates) {
+  if (_loss_scaling_gpu_buf == gpu_nullptr) return false;
+  std::vector<float> state(LOSS_SCALING_STATE_SIZE);
+  _context->read_buffer(_loss_scaling_gpu_buf, (void *)&state[0], true);
+  loss_scale = state[0];
+  skipped_updates = (size_t)state[3];
+  return true;
+}
 
-  if (print_steps)
-    std::cout << "### Updating weights and biases - 1st layer" << std::endl;
-  DataPipeline::update_parameters(layer_data_1, layer_1_alloc, batch_size,
-                                  _config->momentum,
-                                  _config->weight_decay_parameter,
-                                  _config->learning_rate[0], ev_to_wait_for);
+void ConfigBasedDataPipeline::read_loss_scaling_state(TrainingState &state) {
+  state.loss_scaling.clear();
+  if (_loss_scaling_gpu_buf == gpu_nullptr) return;
+  state.loss_scaling.resize(LOSS_SCALING_STATE_SIZE);
+  _context->read_buffer(_loss_scaling_gpu_buf, (void *)&state.loss_scaling[0],
+                        true);
+  state.optimizer_step = (size_t)state.loss_scaling[4];
+}
 
-  // TODO optimize ?
-  _context->block();
-  _context->zeros_float(layer_1_alloc.accumulating_grad_w, true);
-  _context->zeros_float(layer_2_alloc.accumulating_grad_w, true);
-  _context->zeros_float(layer_3_alloc.accumulating_grad_w, true);
-  _context->zeros_float(layer_1_alloc.accumulating_grad_b, true);
-  _context->zeros_float(layer_2_alloc.accumulating_grad_b, true);
-  _context->zeros_float(layer_3_alloc.accumulating_grad_b, true);
+void ConfigBasedDataPipeline::apply_accumulated_gradients(
+    GpuAllocationPool &gpu_alloc) {
+  if (_samples_since_update == 0) return;
+  update_parameters(gpu_alloc, _samples_since_update);
+  _samples_since_update = 0;
+  _batches_since_update = 0;
+}
 
+void ConfigBasedDataPipeline::finish_epoch(GpuAllocationPool &gpu_alloc) {
+  apply_accumulated_gradients(gpu_alloc);
   ++epochs;
 }
 
@@ -378,6 +977,10 @@ void ConfigBasedDataPipeline::fill_random_parameters(
   }
 }
 
+std::string layer_parameters_key(size_t layer_id) {
+  return "layer" + std::to_string(layer_id + 1);
+}
+
 void load_layer_parameters(JsonNode *node, LayerData &data) {
   for (auto subnode : node->value) {
     utils::try_read_vector(*subnode, data.weights, "weights");
@@ -385,8 +988,36 @@ void load_layer_parameters(JsonNode *node, LayerData &data) {
   }
 }
 
+void load_layer_parameters(LayerParameters &params, LayerData &data) {
+  if (params.n_prev_filter_cnt != data.n_prev_filter_cnt ||
+      params.current_filter_count != data.current_filter_count ||
+      params.f_spatial_size != data.f_spatial_size) {
+    throw std::runtime_error(
+        "Layer dimensions in parameters file do not match the config");
+  }
+  // no copy, data is already in the right format
+  data.weights.swap(params.weights);
+  data.bias.swap(params.bias);
+}
+
 size_t ConfigBasedDataPipeline::load_parameters_file(
     const char *const file_path) {
+  if (ParametersFile::is_binary(file_path)) {
+    ParametersFile &params = _checkpoint;
+    ParametersFile::read(file_path, params);
+    utils::require(params.layers.size() == _layers.size(),
+                   "Layer count in parameters file does not match the config");
+    for (size_t i = 0; i < _layers.size(); i++) {
+      auto &layer = params.layers[i];
+      load_layer_parameters(layer, _layers[i]);
+      if (layer.input_scale <= 0.0f) continue;
+      _int8_layers[i].input_scale = layer.input_scale;
+      _int8_layers[i].weight_scales = layer.weight_scales;
+      _int8_layers[i].quantize_weights(_layers[i]);
+    }
+    return params.epochs;
+  }
+
   size_t epochs = 0;
   JsonValue value;
   JsonAllocator allocator;
@@ -397,15 +1028,15 @@ size_t ConfigBasedDataPipeline::load_parameters_file(
     auto key = node->key;
     // std::cout << key << std::endl;
 
-    if (utils::try_read_uint(*node, epochs, "epochs")) {
-      continue;
-    } else if (strcmp(key, layer_parameters_key[0]) == 0) {
-      load_layer_parameters(node, layer_data_1);
-    } else if (strcmp(key, layer_parameters_key[1]) == 0) {
-      load_layer_parameters(node, layer_data_2);
-    } else if (strcmp(key, layer_parameters_key[2]) == 0) {
-      load_layer_parameters(node, layer_data_3);
-    } else {
+    if (utils::try_read_uint(*node, epochs, "epochs")) continue;
+    // layers are stored under "layer1", "layer2", ...
+    bool layer_found = false;
+    for (size_t i = 0; i < _layers.size() && !layer_found; i++) {
+      if (strcmp(key, layer_parameters_key(i).c_str()) != 0) continue;
+      load_layer_parameters(node, _layers[i]);
+      layer_found = true;
+    }
+    if (!layer_found) {
       std::cout << "[Warning] Unknown key '" << key << "' in parameters file"
                 << std::endl;
     }
@@ -413,10 +1044,73 @@ size_t ConfigBasedDataPipeline::load_parameters_file(
   return epochs;
 }
 
+void upload_momentum(opencl::Context *context, LayerParameters &params,
+                     LayerAllocationPool &gpu_alloc) {
+  if (params.previous_delta_w.empty()) return;
+  size_t w_size = sizeof(cl_float) * params.previous_delta_w.size(),
+         b_size = sizeof(cl_float) * params.previous_delta_b.size();
+  // packed parameters already have the buffers
+  /* clang-format off */
+  if (gpu_alloc.previous_batch_delta_w == gpu_nullptr)
+    gpu_alloc.previous_batch_delta_w = context->allocate(CL_MEM_READ_WRITE, w_size);
+  if (gpu_alloc.previous_batch_delta_b == gpu_nullptr)
+    gpu_alloc.previous_batch_delta_b = context->allocate(CL_MEM_READ_WRITE, b_size);
+  /* clang-format on */
+  context->write_buffer(gpu_alloc.previous_batch_delta_w,
+                        (void *)&params.previous_delta_w[0], true);
+  context->write_buffer(gpu_alloc.previous_batch_delta_b,
+                        (void *)&params.previous_delta_b[0], true);
+}
+
+void upload_adam_moments(opencl::Context *context, LayerParameters &params,
+                         LayerAllocationPool &gpu_alloc) {
+  // only packed parameters have the moments
+  if (params.first_moment_w.empty() || gpu_alloc.first_moment_w == gpu_nullptr)
+    return;
+  context->write_buffer(gpu_alloc.first_moment_w,
+                        (void *)&params.first_moment_w[0], true);
+  context->write_buffer(gpu_alloc.first_moment_b,
+                        (void *)&params.first_moment_b[0], true);
+  context->write_buffer(gpu_alloc.second_moment_w,
+                        (void *)&params.second_moment_w[0], true);
+  context->write_buffer(gpu_alloc.second_moment_b,
+                        (void *)&params.second_moment_b[0], true);
+}
+
+bool ConfigBasedDataPipeline::restore_training_state(
+    GpuAllocationPool &gpu_alloc, TrainingState &state) {
+  if (_checkpoint.layers.size() != _layers.size()) return false;
+  auto &allocs = layer_allocs(gpu_alloc);
+  bool momentum = _config->optimizer == Optimizer::Momentum;
+  for (size_t i = 0; i < _layers.size(); i++) {
+    if (momentum)
+      upload_momentum(_context, _checkpoint.layers[i], allocs[i]);
+    else
+      upload_adam_moments(_context, _checkpoint.layers[i], allocs[i]);
+  }
+  if (_checkpoint.has_training_state) {
+    state = _checkpoint.training_state;
+    if (!momentum) gpu_alloc.parameter_arena.step = state.optimizer_step;
+    if (_loss_scaling_gpu_buf != gpu_nullptr) {
+      // checkpoint may come from run without mixed precision
+      auto scaling = state.loss_scaling;
+      if (scaling.size() != LOSS_SCALING_STATE_SIZE) {
+        scaling.assign(LOSS_SCALING_STATE_SIZE, 0.0f);
+        scaling[0] = _config->loss_scale;
+        scaling[4] = (float)state.optimizer_step;
+      }
+      _context->write_buffer(_loss_scaling_gpu_buf, (void *)&scaling[0], true);
+    }
+  }
+  bool restored = _checkpoint.has_training_state;
+  _checkpoint = ParametersFile();  // free the memory
+  return restored;
+}
+
 ///
 /// Parameters write
 ///
-void dump_layer_parameters(std::ostream &os, const char *const key,
+void dump_layer_parameters(std::ostream &os, const std::string &key,
                            std::vector<float> &weights,
                            std::vector<float> &bias) {
   os << "  \"" << key << "\":{" << std::endl
@@ -431,19 +1125,80 @@ void dump_layer_parameters(std::ostream &os, const char *const key,
 
 void ConfigBasedDataPipeline::write_params_to_file(
     const char *const file_path,  //
-    cnn_sr::LayerAllocationPool layer_1_alloc,
-    cnn_sr::LayerAllocationPool layer_2_alloc,
-    cnn_sr::LayerAllocationPool layer_3_alloc) {
+    GpuAllocationPool &gpu_alloc, const TrainingState *training_state) {
   std::cout << "Saving parameters to: '" << file_path << "'" << std::endl;
+  auto &allocs = layer_allocs(gpu_alloc);
   // read weights
-  /* clang-format off */
-  _context->read_buffer(layer_1_alloc.weights, (void *)&layer_data_1.weights[0], true);
-  _context->read_buffer(layer_2_alloc.weights, (void *)&layer_data_2.weights[0], true);
-  _context->read_buffer(layer_3_alloc.weights, (void *)&layer_data_3.weights[0], true);
-  _context->read_buffer(layer_1_alloc.bias, (void *)&layer_data_1.bias[0], true);
-  _context->read_buffer(layer_2_alloc.bias, (void *)&layer_data_2.bias[0], true);
-  _context->read_buffer(layer_3_alloc.bias, (void *)&layer_data_3.bias[0], true);
-  /* clang-format on */
+  for (size_t i = 0; i < _layers.size(); i++) {
+    auto &layer = _layers[i];
+    _context->read_buffer(allocs[i].weights, (void *)&layer.weights[0], true);
+    _context->read_buffer(allocs[i].bias, (void *)&layer.bias[0], true);
+  }
+
+  // binary version, unless we were explicitly asked for JSON
+  if (!ParametersFile::is_json_path(file_path)) {
+    ParametersFile params;
+    params.epochs = this->epochs;
+    for (size_t i = 0; i < _layers.size(); i++) {
+      auto layer = &_layers[i];
+      params.layers.push_back(LayerParameters());
+      LayerParameters &p = params.layers.back();
+      p.n_prev_filter_cnt = layer->n_prev_filter_cnt;
+      p.current_filter_count = layer->current_filter_count;
+      p.f_spatial_size = layer->f_spatial_size;
+      p.weights = layer->weights;
+      p.bias = layer->bias;
+      p.input_scale = _int8_layers[i].input_scale;
+      p.weight_scales = _int8_layers[i].weight_scales;
+
+      // momentum, only if we have done at least one update
+      auto &alloc = allocs[i];
+      if (training_state && alloc.previous_batch_delta_w != gpu_nullptr) {
+        p.previous_delta_w.resize(layer->weight_size());
+        p.previous_delta_b.resize(layer->bias_size());
+        _context->read_buffer(alloc.previous_batch_delta_w,
+                              (void *)&p.previous_delta_w[0], true);
+        _context->read_buffer(alloc.previous_batch_delta_b,
+                              (void *)&p.previous_delta_b[0], true);
+      }
+      if (training_state && alloc.first_moment_w != gpu_nullptr) {
+        p.first_moment_w.resize(layer->weight_size());
+        p.first_moment_b.resize(layer->bias_size());
+        p.second_moment_w.resize(layer->weight_size());
+        p.second_moment_b.resize(layer->bias_size());
+        _context->read_buffer(alloc.first_moment_w,
+                              (void *)&p.first_moment_w[0], true);
+        _context->read_buffer(alloc.first_moment_b,
+                              (void *)&p.first_moment_b[0], true);
+        _context->read_buffer(alloc.second_moment_w,
+                              (void *)&p.second_moment_w[0], true);
+        _context->read_buffer(alloc.second_moment_b,
+                              (void *)&p.second_moment_b[0], true);
+      }
+    }
+
+    auto storage = _config->parameters_storage;
+    if (training_state) {
+      params.has_training_state = true;
+      params.training_state = *training_state;
+      params.training_state.optimizer_step = gpu_alloc.parameter_arena.step;
+      read_loss_scaling_state(params.training_state);
+      storage = ParametersStorage::Float32;
+    }
+    ParametersFile::write(file_path, params, storage);
+    return;
+  }
+
+  if (training_state) {
+    std::cout << "[Warning] JSON parameters file does not store optimizer "
+                 "and training state, resumed training will not be exact"
+              << std::endl;
+  }
+  if (int8_calibrated()) {
+    std::cout << "[Warning] JSON parameters file does not store int8 "
+                 "calibration"
+              << std::endl;
+  }
 
   // write to file
   std::ofstream params_file;
@@ -452,13 +1207,11 @@ void ConfigBasedDataPipeline::write_params_to_file(
               << "  \"epochs\": " << this->epochs << "," << std::endl
               << std::endl;
 
-  /* clang-format off */
-  dump_layer_parameters(params_file, layer_parameters_key[0], layer_data_1.weights, layer_data_1.bias);
-  params_file << "," << std::endl;
-  dump_layer_parameters(params_file, layer_parameters_key[1], layer_data_2.weights, layer_data_2.bias);
-  params_file << "," << std::endl;
-  dump_layer_parameters(params_file, layer_parameters_key[2], layer_data_3.weights, layer_data_3.bias);
-  /* clang-format on */
+  for (size_t i = 0; i < _layers.size(); i++) {
+    if (i > 0) params_file << "," << std::endl;
+    dump_layer_parameters(params_file, layer_parameters_key(i),
+                          _layers[i].weights, _layers[i].bias);
+  }
 
   params_file << std::endl
               << "}";
@@ -500,20 +1253,23 @@ void ConfigBasedDataPipeline::write_result_image(
     const char *const out_path,  //
     opencl::utils::ImageData &input_img, SampleAllocationPool &sample) {
   std::cout << "Saving result image to: '" << out_path << "'" << std::endl;
-  size_t luma_w = input_img.w - _config->total_padding(),
-         luma_h = input_img.h - _config->total_padding();
+  // sample luma may have been upscaled on gpu (see extract_luma), chroma is
+  // upscaled by both that and the upscale_factor
+  size_t r = (sample.input_w / input_img.w) * _config->upscale_factor,
+         luma_dim[2];
+  result_size(sample.input_w, sample.input_h, luma_dim);
   // create result image
   opencl::MemoryHandle gpu_buf_target = gpu_nullptr;
-  swap_luma(input_img, sample.input_data, _out_3_gpu_buf, gpu_buf_target,
-            luma_w, luma_h);
+  swap_luma(input_img, sample.input_data, _result_gpu_buf, gpu_buf_target,
+            luma_dim[0], luma_dim[1], nullptr, r);
 
   // read result
-  size_t result_size = input_img.w * input_img.h * 3;  // 3 channels
-  std::vector<unsigned char> result(result_size);
+  size_t res_w = input_img.w * r, res_h = input_img.h * r;
+  std::vector<unsigned char> result(res_w * res_h * 3);  // 3 channels
   _context->read_buffer(gpu_buf_target, (void *)&result[0], true);
 
   // write result
-  opencl::utils::ImageData res_img(input_img.w, input_img.h, 3, &result[0]);
+  opencl::utils::ImageData res_img(res_w, res_h, 3, &result[0]);
   opencl::utils::write_image(out_path, res_img);
 
   // debug images
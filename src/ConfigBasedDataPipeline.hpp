@@ -1,11 +1,48 @@
 #ifndef CONFIG_BASED_DATA_PIPELINE_H
 #define CONFIG_BASED_DATA_PIPELINE_H
 
+#include <map>
+#include <random>  // for std::mt19937
+#include <tuple>
+
 #include "DataPipeline.hpp"
 #include "LayerData.hpp"
+#include "MemoryPlanner.hpp"
+#include "ParametersFile.hpp"
 
 namespace cnn_sr {
 
+/**
+ * Luma of training samples of the same size, kept in 2 contiguous buffers.
+ * Sample in slot s occupies elements [s*w*h, (s+1)*w*h) of both, so that
+ * whole mini-batch can be gathered with single kernel launch. If the network
+ * upscales on its own, expected samples are expected_scale times bigger in
+ * each dimension.
+ */
+struct SampleArena {
+  /** Element type of both luma buffers, expanded to float on gather */
+  DatasetStorage storage = DatasetStorage::Float32;
+  /** dimensions of input sample */
+  size_t w = 0, h = 0, capacity = 0;
+  size_t expected_scale = 1;
+  opencl::MemoryHandle input_luma = gpu_nullptr;
+  opencl::MemoryHandle expected_luma = gpu_nullptr;
+  /** Float per slot, mean subtracted from input luma (only used for uint8) */
+  opencl::MemoryHandle input_means = gpu_nullptr;
+
+  /** Allocate buffers for capacity samples, means are zeroed */
+  void allocate(opencl::Context*, size_t w, size_t h, size_t capacity,
+                DatasetStorage storage = DatasetStorage::Float32,
+                size_t expected_scale = 1);
+
+  /** Non blocking write of single sample, data has to live till block */
+  void write(opencl::Context*, size_t slot, const void* input,
+             const void* expected);
+
+  /** Non blocking write of means for first count slots */
+  void write_means(opencl::Context*, const float* means, size_t count);
+};
+
 /**
  * All gpu buffer handles related to single image
  */
@@ -16,6 +53,14 @@ struct SampleAllocationPool {
   opencl::MemoryHandle input_luma = gpu_nullptr;
   /** Dimensions of original image*/
   size_t input_w, input_h;
+  /** Index of the sample in sorted list of sample files */
+  size_t id = 0;
+  /**
+   * Training: arena that holds luma of the sample. Training samples do not
+   * use input_luma/expected_luma
+   */
+  SampleArena* arena = nullptr;
+  size_t arena_slot = 0;
 
   /** Training: Raw 3 channel image loaded from hard drive */
   opencl::MemoryHandle expected_data = gpu_nullptr;
@@ -29,15 +74,66 @@ struct SampleAllocationPool {
   // SampleAllocationPool& operator=(const SampleAllocationPool&) = delete;
 };
 
+/**
+ * Weights and biases of all layers packed into buffers with the same layout:
+ * parameters and gradients, plus optimizer state - previous deltas for
+ * momentum, first and second moments for Adam(W). Buffers in
+ * LayerAllocationPool become sub-buffers of these, so that the optimizer can
+ * update all layers with single launch. Each segment (weights or bias of a
+ * layer) starts at sub-buffer alignment.
+ */
+struct ParameterArena {
+  /** floats in each buffer, including padding between segments */
+  size_t size = 0;
+  opencl::MemoryHandle parameters = gpu_nullptr;
+  opencl::MemoryHandle gradients = gpu_nullptr;
+  /** Momentum only */
+  opencl::MemoryHandle previous_deltas = gpu_nullptr;
+  /** Adam only, same layout */
+  opencl::MemoryHandle first_moments = gpu_nullptr;
+  opencl::MemoryHandle second_moments = gpu_nullptr;
+  /** Adam: updates done so far */
+  size_t step = 0;
+  /** 2 per segment: [begin, end) */
+  std::vector<unsigned int> segment_ranges;
+  opencl::MemoryHandle segment_ranges_gpu = gpu_nullptr;
+  /** 2 per segment: learning rate, weight decay */
+  std::vector<float> segment_rates;
+  opencl::MemoryHandle segment_rates_gpu = gpu_nullptr;
+
+  inline size_t segment_count() const { return segment_ranges.size() / 2; }
+
+  /**
+   * Allocate the buffers, upload current weights and biases and point layer
+   * allocations to sub-buffers. Gradients and optimizer state (momentum
+   * deltas or Adam moments) are zeroed. Layer allocations must not have any
+   * buffers yet.
+   */
+  void pack(opencl::Context*, const std::vector<const LayerData*>&,
+            const std::vector<LayerAllocationPool*>&, bool adam_moments);
+
+  /**
+   * Blocking, rates stay on gpu for all following updates. One learning rate
+   * per layer, bias has no weight decay
+   */
+  void write_rates(opencl::Context*, const float* learning_rates,
+                   float weight_decay);
+};
+
 /** Represents all general allocations that we will make */
 struct GpuAllocationPool {
-  LayerAllocationPool layer_1;
-  LayerAllocationPool layer_2;
-  LayerAllocationPool layer_3;
+  /** One per layer of the network, see ConfigBasedDataPipeline::layer_count */
+  std::vector<LayerAllocationPool> layers;
+  /** Training: backing buffers of the layers above */
+  ParameterArena parameter_arena;
 
+  /** Training: luma of all resident samples */
+  SampleArena sample_arena;
   std::vector<SampleAllocationPool> samples;
 };
 
+class SampleCache;
+
 /**
  * Class that wraps all low level functions from DataPipeline into something
  * more usable
@@ -50,20 +146,125 @@ class ConfigBasedDataPipeline : public DataPipeline {
 
   void set_mini_batch_size(size_t);
 
+  /** If set, samples of each mini-batch are made resident before use */
+  inline void set_sample_cache(SampleCache* cache) { _sample_cache = cache; }
+
+  /**
+   * Update parameters after every n trained mini-batches (gradient
+   * accumulation steps). 0 (default) updates only in finish_epoch, which
+   * is full-batch gradient descent.
+   */
+  inline void set_update_interval(size_t n) { _update_interval = n; }
+
   float execute_batch(bool backpropagate, GpuAllocationPool&,
                       std::vector<SampleAllocationPool*>&);
 
-  cl_event forward(LayerAllocationPool& layer_1_alloc,  //
-                   LayerAllocationPool& layer_2_alloc,  //
-                   LayerAllocationPool& layer_3_alloc,  //
-                   SampleAllocationPool& sample);
+  /**
+   * Keep loss of every trained sample of the arena on gpu (initially 0), so
+   * that draw_samples_by_loss can prefer samples with high error.
+   */
+  void track_sample_losses(const SampleArena&);
+
+  /**
+   * Replace training samples with as many samples drawn from them (with
+   * replacement). Fraction loss_fraction of them is drawn in proportion to
+   * last loss of the sample, rest uniformly. This function blocks.
+   */
+  void draw_samples_by_loss(float loss_fraction, std::mt19937&,
+                            std::vector<SampleAllocationPool*>& train_set);
+
+  cl_event forward(GpuAllocationPool&, SampleAllocationPool& sample);
+
+  ///
+  /// Int8 inference
+  ///
+  /**
+   * Calibration step: float forward of the sample that remembers largest
+   * absolute input value of each layer. This function blocks.
+   */
+  void observe_activation_ranges(GpuAllocationPool&, SampleAllocationPool&);
+
+  /**
+   * Compute int8 scales from ranges observed so far and quantize weights.
+   * Has to be called before first forward_int8.
+   */
+  void calibrate_int8();
+
+  bool int8_calibrated() const;
+
+  /** Same as forward, but all layers use int8 (see layer_int8.cl) */
+  cl_event forward_int8(GpuAllocationPool&, SampleAllocationPool& sample);
+
+  /**
+   * PSNR of last forward result (luma in 0..1) against reference that is
+   * either ground truth of the sample or another result. This function blocks.
+   */
+  float result_psnr(opencl::MemoryHandle reference, size_t reference_w,
+                    size_t reference_h);
+
+  /** Luma of last forward, after pixel shuffle if upscale_factor > 1 */
+  inline opencl::MemoryHandle result_buffer() const { return _result_gpu_buf; }
+
+  /** Dimensions of the result for input of given size */
+  void result_size(size_t input_w, size_t input_h, size_t* result_dim) const;
 
  private:
-  void allocate_buffers(size_t, size_t);
+  /**
+   * Ground truth, layer input, layer outputs and deltas are sub-buffers of
+   * single arena, buffers that are never live at the same time share memory
+   * (see MemoryPlanner and plan_buffers).
+   * @param keep_activations all layer outputs stay valid after forward and
+   *                         deltas are allocated. Needed for backpropagation
+   *                         and int8 calibration. Otherwise outputs of hidden
+   *                         layers are overwritten during forward
+   * @param recompute_first_layer  backpropagation only: first layer output
+   *                         dies after forward and backpropagate computes it
+   *                         again into _recomputed_out_gpu_buf, its deltas
+   *                         are then written over it
+   */
+  void allocate_buffers(size_t, size_t, bool keep_activations,
+                        bool recompute_first_layer = false);
+
+  /**
+   * Lifetimes of buffers from allocate_buffers, steps follow the order in
+   * which forward and backpropagate enqueue the kernels.
+   * @return ids: input, ground truth, result, delta result, then
+   *         (out, delta) for each layer and recomputed first layer output.
+   *         Unused buffers get (size_t)-1
+   */
+  std::vector<size_t> plan_buffers(MemoryPlanner&, size_t img_w, size_t img_h,
+                                   bool keep_activations,
+                                   bool recompute_first_layer) const;
+
+  /** Layer allocations of the pool, one per layer */
+  std::vector<LayerAllocationPool>& layer_allocs(GpuAllocationPool&) const;
+
+  /**
+   * Output width and height of every layer for input of given size, 2 values
+   * per layer
+   */
+  void layer_dimensions(size_t input_w, size_t input_h,
+                        std::vector<size_t>& dims) const;
+
+  /**
+   * Rearrange last layer output into _result_gpu_buf. Nothing to do if
+   * upscale_factor is 1, then both are the same buffer.
+   */
+  cl_event shuffle_result(size_t w, size_t h, size_t id, cl_event* ev);
+
+  /** Bytes per value of hidden layers outputs and deltas */
+  size_t activation_el_size() const;
 
-  cl_event forward(LayerAllocationPool& layer_1_alloc,  //
-                   LayerAllocationPool& layer_2_alloc,  //
-                   LayerAllocationPool& layer_3_alloc,  //
+  /** Update parameters with all gradients accumulated so far */
+  void apply_accumulated_gradients(GpuAllocationPool&);
+
+  /**
+   * Point mini-batch input and ground truth directly to sub-buffers of the
+   * arena. Only possible for float32 arenas with aligned offset.
+   */
+  bool use_arena_views(const SampleArena&, size_t first_slot, size_t count);
+
+  cl_event forward(std::vector<LayerAllocationPool>&,  //
                    size_t w, size_t h, size_t id);
 
   /* clang-format off */
@@ -75,43 +276,81 @@ class ConfigBasedDataPipeline : public DataPipeline {
    *   - backpropagate: calculate gradient w, gradient b for all layers
    *   - update weights and biases (NOTE: requires explicit call to ConfigBasedDataPipeline::update_parameters(...))
    *
-   * @param  layer_1_alloc        [description]
-   * @param  layer_2_alloc        [description]
-   * @param  layer_3_alloc        [description]
-   * @param  cnn_input            input that was provided during forward step
-   * @param  gpu_buf_ground_truth expected result
-   * @param  ground_truth_w       width of both cnn_input and gpu_buf_ground_truth
-   * @param  ground_truth_h       height of both cnn_input and gpu_buf_ground_truth
-   * @param  weight_decay
+   * @param  layer_allocs         one per layer
+   * @param  sample_w             width of input provided during forward step
+   * @param  sample_h             height of input provided during forward step
+   * @param  sample_count         samples in mini-batch
    * @param  ev_to_wait_for       [description]
    * @return                      [description]
    */
-  cl_event backpropagate(cnn_sr::LayerAllocationPool&,
-                         cnn_sr::LayerAllocationPool&,
-                         cnn_sr::LayerAllocationPool&,
+  cl_event backpropagate(std::vector<LayerAllocationPool>&,
                          size_t, size_t, size_t,
                          cl_event* ev_to_wait_for = nullptr);
   /* clang-format on */
 
  public:
-  /** update weights and biases*/
-  void update_parameters(cnn_sr::LayerAllocationPool&,
-                         cnn_sr::LayerAllocationPool&,
-                         cnn_sr::LayerAllocationPool&, size_t batch_size,
-                         cl_event* ev_to_wait_for = nullptr);
+  /**
+   * Move parameters of all layers into gpu_alloc.parameter_arena and upload
+   * learning rates. Has to be called before training, before any layer
+   * buffer was allocated.
+   */
+  void pack_parameters(GpuAllocationPool&);
+
+  /**
+   * Update weights and biases of all layers with single launch and clear
+   * the gradients. Does not block. Requires pack_parameters.
+   */
+  cl_event update_parameters(GpuAllocationPool&, size_t batch_size,
+                             cl_event* ev_to_wait_for = nullptr);
+
+  /**
+   * Mixed precision: current loss scale and number of updates skipped due to
+   * gradient overflow. Returns false if loss scaling is not used. This
+   * function blocks.
+   */
+  bool read_loss_scaling(float& loss_scale, size_t& skipped_updates);
+
+  /**
+   * Mixed precision: copy whole loss scaling state (including Adam step) into
+   * training state, so that it can be checkpointed. This function blocks.
+   */
+  void read_loss_scaling_state(TrainingState&);
+
+  /** Mixed precision only, gpu_nullptr otherwise. See loss_scaling.cl */
+  inline opencl::MemoryHandle loss_scaling_state() const {
+    return _loss_scaling_gpu_buf;
+  }
+
+  /**
+   * Call after all training samples of the epoch were executed. Applies
+   * gradients accumulated since last update.
+   */
+  void finish_epoch(GpuAllocationPool&);
 
+  /**
+   * Write weights and biases. Uses binary format (see ParametersFile), unless
+   * the file has '.json' extension. If training state is provided the binary
+   * file becomes full checkpoint: momentum buffers are also read from gpu and
+   * everything is stored as float32, so that the training can be resumed
+   * bit-exactly.
+   */
   void write_params_to_file(const char* const file_path,  //
-                            cnn_sr::LayerAllocationPool,
-                            cnn_sr::LayerAllocationPool,
-                            cnn_sr::LayerAllocationPool);
+                            GpuAllocationPool&,
+                            const TrainingState* training_state = nullptr);
+
+  /**
+   * If parameters file was a checkpoint: upload stored momentum buffers and
+   * fill the training state. Returns false if there was nothing to restore.
+   */
+  bool restore_training_state(GpuAllocationPool&, TrainingState&);
 
   void write_result_image(const char* const, opencl::utils::ImageData&,
                           SampleAllocationPool& sample);
 
   inline const Config* config() { return _config; }
-  inline const LayerData* layer_1() { return &layer_data_1; }
-  inline const LayerData* layer_2() { return &layer_data_2; }
-  inline const LayerData* layer_3() { return &layer_data_3; }
+  inline size_t epoch_count() const { return epochs; }
+  inline size_t layer_count() const { return _layers.size(); }
+  inline const LayerData* layer(size_t i) const { return &_layers[i]; }
 
  protected:
   void load_kernels(int load_flags);
@@ -119,6 +358,7 @@ class ConfigBasedDataPipeline : public DataPipeline {
  private:
   void fill_random_parameters(LayerData&, ParametersDistribution&);
 
+  /** Read either JSON or binary parameters file, returns epochs */
   size_t load_parameters_file(const char* const);
 
   void create_luma_image(const char* const, opencl::MemoryHandle, size_t,
@@ -129,30 +369,86 @@ class ConfigBasedDataPipeline : public DataPipeline {
 
  private:
   Config* const _config;
-  LayerData layer_data_1;
-  LayerData layer_data_2;
-  LayerData layer_data_3;
+  /** one per layer in config, in order of execution */
+  std::vector<LayerData> _layers;
+  std::vector<float> _learning_rates;
   size_t epochs = 0;
   size_t _mini_batch_size = 0;
+  SampleCache* _sample_cache = nullptr;
+  /** in mini-batches, 0 means once per epoch */
+  size_t _update_interval = 0;
+  /** gradients accumulated since last update */
+  size_t _batches_since_update = 0, _samples_since_update = 0;
+  /** momentum and training state read from checkpoint, no weights/biases */
+  ParametersFile _checkpoint;
+  /** dimensions of samples that buffers were allocated for */
+  size_t _buffers_w = 0, _buffers_h = 0;
+  /** see allocate_buffers */
+  bool _activations_kept = false, _first_layer_recomputed = false;
+  opencl::MemoryHandle _activations_arena_gpu_buf = gpu_nullptr;
+
+  /** int8 inference: quantized layers, largest input of each layer seen */
+  std::vector<QuantizedLayer> _int8_layers;
+  std::vector<float> _activation_max;
+  /** int8 network input and outputs of all layers but the last */
+  opencl::MemoryHandle _int8_input_gpu_buf = gpu_nullptr;
+  std::vector<opencl::MemoryHandle> _int8_out_gpu_bufs;
 
   /* ground truth for batch */
   opencl::MemoryHandle _ground_truth_gpu_buf = gpu_nullptr;
   /** input for layer 1 */
   opencl::MemoryHandle _forward_gpu_buf = gpu_nullptr;
-  /** outputs for layers */
-  opencl::MemoryHandle _out_1_gpu_buf = gpu_nullptr,  //
-      _out_2_gpu_buf = gpu_nullptr,                   //
-      _out_3_gpu_buf = gpu_nullptr;
-  /** deltas for layers */
-  opencl::MemoryHandle _delta_1_gpu_buf = gpu_nullptr,  //
-      _delta_2_gpu_buf = gpu_nullptr,                   //
-      _delta_3_gpu_buf = gpu_nullptr;
-
-  opencl::Kernel* _layer_1_kernel = nullptr;
-  opencl::Kernel* _layer_2_kernel = nullptr;
-  opencl::Kernel* _layer_3_kernel = nullptr;
-  opencl::Kernel* _layer_1_deltas_kernel = nullptr;
-  opencl::Kernel* _layer_2_deltas_kernel = nullptr;
+  /**
+   * outputs and deltas for layers. Hidden layers may store them as half,
+   * last layer always uses float
+   */
+  std::vector<opencl::MemoryHandle> _out_gpu_bufs, _delta_gpu_bufs;
+  /** first layer output computed again for backpropagation, see Config */
+  opencl::MemoryHandle _recomputed_out_gpu_buf = gpu_nullptr;
+  /**
+   * last layer output and its deltas rearranged into the result image. Same
+   * as last of _out_gpu_bufs/_delta_gpu_bufs if upscale_factor is 1
+   */
+  opencl::MemoryHandle _result_gpu_buf = gpu_nullptr,  //
+      _delta_result_gpu_buf = gpu_nullptr;
+  /**
+   * Layer 1 input and ground truth of current mini-batch. Either the 2
+   * buffers above or sub-buffers of sample arena (no copy needed)
+   */
+  opencl::MemoryHandle _batch_input_gpu_buf = gpu_nullptr;
+  opencl::MemoryHandle _batch_ground_truth_gpu_buf = gpu_nullptr;
+  typedef std::tuple<const SampleArena*, size_t, size_t> ArenaViewKey;
+  std::map<ArenaViewKey, std::pair<opencl::MemoryHandle, opencl::MemoryHandle>>
+      _arena_views;
+  /** arena slots of samples in current mini-batch */
+  std::vector<unsigned int> _batch_slots;
+  opencl::MemoryHandle _batch_slots_gpu_buf = gpu_nullptr;
+  /** error of each sample in current mini-batch */
+  opencl::MemoryHandle _batch_losses_gpu_buf = gpu_nullptr;
+  /**
+   * mixed precision: loss scaling state, allocated in pack_parameters (see
+   * DataPipeline::check_overflow)
+   */
+  opencl::MemoryHandle _loss_scaling_gpu_buf = gpu_nullptr;
+
+  /** loss based sampling, only if track_sample_losses was called */
+  const SampleArena* _loss_arena = nullptr;
+  opencl::MemoryHandle _sample_losses_gpu_buf = gpu_nullptr;
+  opencl::MemoryHandle _train_slots_gpu_buf = gpu_nullptr;
+  opencl::MemoryHandle _train_losses_gpu_buf = gpu_nullptr;
+  opencl::MemoryHandle _loss_cdf_gpu_buf = gpu_nullptr;
+  opencl::MemoryHandle _loss_uniforms_gpu_buf = gpu_nullptr;
+  opencl::MemoryHandle _drawn_slots_gpu_buf = gpu_nullptr;
+  std::vector<float> _loss_uniforms;
+  std::vector<unsigned int> _train_slots;
+  std::vector<unsigned int> _drawn_slots;
+  std::vector<SampleAllocationPool*> _train_samples;
+
+  /** one per layer, there are no deltas kernel for last layer */
+  std::vector<opencl::Kernel*> _layer_kernels;
+  std::vector<opencl::Kernel*> _deltas_kernels;
+  std::vector<opencl::Kernel*> _backpropagate_kernels;
+  std::vector<opencl::Kernel*> _int8_kernels;
 };
 }
 
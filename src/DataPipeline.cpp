@@ -2,6 +2,8 @@
 
 #include <stdexcept>  // std::runtime_error
 #include <cstdio>     // snprintf
+#include <numeric>    // std::accumulate
+#include <cmath>      // std::pow
 
 #include "LayerData.hpp"
 #include "opencl/Context.hpp"
@@ -17,12 +19,19 @@ const char *const squared_error_kernel_file = "squared_error.cl";
 const char *const sum_kernel_file = "sum.cl";
 // forward:
 const char *const layer_kernel_file = "layer_uber_kernel.cl";
+const char *const layer_int8_kernel_file = "layer_int8.cl";
+const char *const quantize_kernel_file = "quantize.cl";
 // backpropagation:
 const char *const deltas_kernel_file = "layer_deltas.cl";
 const char *const last_layer_delta_kernel_file = "last_layer_delta.cl";
 const char *const backpropagate_kernel_file = "backpropagate.cl";
 const char *const subtract_from_all_kernel_file = "subtract_from_all.cl";
+const char *const gather_samples_kernel_file = "gather_samples.cl";
+const char *const augment_kernel_file = "augment.cl";
+const char *const loss_sampling_kernel_file = "loss_sampling.cl";
 const char *const update_parameters_kernel_file = "update_parameters.cl";
+const char *const loss_scaling_kernel_file = "loss_scaling.cl";
+const char *const pixel_shuffle_kernel_file = "pixel_shuffle.cl";
 
 using namespace cnn_sr;
 
@@ -38,6 +47,8 @@ int DataPipeline::LOAD_KERNEL_ALL = DataPipeline::LOAD_KERNEL_LUMA |  //
                                     DataPipeline::LOAD_KERNEL_BACKPROPAGATE |
                                     DataPipeline::LOAD_KERNEL_MISC;
 
+const size_t DataPipeline::LOSS_SCALING_STATE_SIZE = 5;
+
 ///
 /// Construction/init/misc
 ///
@@ -139,18 +150,66 @@ void DataPipeline::load_kernels(int load_flags) {
   if (load_misc) {
     if (!_squared_error_kernel)
       _squared_error_kernel       = ck(squared_error_kernel_file, nullptr, "squared_err");
+    if (!_clear_squared_error_kernel)
+      _clear_squared_error_kernel = ck(squared_error_kernel_file, nullptr, "clear_squared_err");
     if (!_sum_kernel) _sum_kernel = ck(sum_kernel_file,           nullptr, "sum");
     if (!_sum_squared_kernel)
       _sum_squared_kernel         = ck(sum_kernel_file, "-D SUM_SQUARED", "sum");
     if (!_subtract_from_all_kernel)
       _subtract_from_all_kernel   = ck(subtract_from_all_kernel_file, nullptr, "sub_from_all");
+    if (!_gather_samples_kernel)
+      _gather_samples_kernel      = ck(gather_samples_kernel_file, nullptr, "gather_samples");
+    if (!_gather_samples_u8_kernel)
+      _gather_samples_u8_kernel   = ck(gather_samples_kernel_file, "-D STORAGE_UINT8", "gather_samples");
+    if (!_gather_samples_f16_kernel)
+      _gather_samples_f16_kernel  = ck(gather_samples_kernel_file, "-D STORAGE_HALF", "gather_samples");
+    if (!_crop_kernel)
+      _crop_kernel                = ck(augment_kernel_file, nullptr, "crop");
+    if (!_downscale_kernel)
+      _downscale_kernel           = ck(augment_kernel_file, nullptr, "downscale");
+    if (!_upscale_bicubic_kernel)
+      _upscale_bicubic_kernel     = ck(augment_kernel_file, nullptr, "upscale_bicubic");
+    if (!_subtract_sample_mean_kernel)
+      _subtract_sample_mean_kernel = ck(augment_kernel_file, nullptr, "subtract_sample_mean");
+    if (!_scatter_losses_kernel)
+      _scatter_losses_kernel      = ck(loss_sampling_kernel_file, nullptr, "scatter_losses");
+    if (!_gather_losses_kernel)
+      _gather_losses_kernel       = ck(loss_sampling_kernel_file, nullptr, "gather_losses");
+    if (!_loss_prefix_sum_kernel)
+      _loss_prefix_sum_kernel     = ck(loss_sampling_kernel_file, nullptr, "loss_prefix_sum");
+    if (!_draw_by_loss_kernel)
+      _draw_by_loss_kernel        = ck(loss_sampling_kernel_file, nullptr, "draw_by_loss");
+    if (!_quantize_kernel)
+      _quantize_kernel            = ck(quantize_kernel_file, nullptr, "quantize");
+    if (!_pixel_shuffle_kernel)
+      _pixel_shuffle_kernel       = ck(pixel_shuffle_kernel_file, nullptr, "pixel_shuffle");
   }
 
   if (load_back) {
     if (!_last_layer_delta_kernel)
       _last_layer_delta_kernel  = ck(last_layer_delta_kernel_file, nullptr, "last_layer_delta");
+    if (!_last_layer_delta_scaled_kernel)
+      _last_layer_delta_scaled_kernel = ck(last_layer_delta_kernel_file, "-D LOSS_SCALING", "last_layer_delta");
     if (!_update_parameters_kernel)
       _update_parameters_kernel = ck(update_parameters_kernel_file, nullptr, "update_params");
+    if (!_update_packed_parameters_kernel)
+      _update_packed_parameters_kernel = ck(update_parameters_kernel_file, nullptr, "update_params_packed");
+    if (!_adam_kernel)
+      _adam_kernel              = ck(update_parameters_kernel_file, nullptr, "adam_packed");
+    if (!_adamw_kernel)
+      _adamw_kernel             = ck(update_parameters_kernel_file, "-D ADAMW", "adam_packed");
+    if (!_update_packed_scaled_kernel)
+      _update_packed_scaled_kernel = ck(update_parameters_kernel_file, "-D LOSS_SCALING", "update_params_packed");
+    if (!_adam_scaled_kernel)
+      _adam_scaled_kernel       = ck(update_parameters_kernel_file, "-D LOSS_SCALING", "adam_packed");
+    if (!_adamw_scaled_kernel)
+      _adamw_scaled_kernel      = ck(update_parameters_kernel_file, "-D ADAMW -D LOSS_SCALING", "adam_packed");
+    if (!_check_overflow_kernel)
+      _check_overflow_kernel    = ck(loss_scaling_kernel_file, nullptr, "check_overflow");
+    if (!_update_loss_scale_kernel)
+      _update_loss_scale_kernel = ck(loss_scaling_kernel_file, nullptr, "update_loss_scale");
+    if (!_pixel_unshuffle_kernel)
+      _pixel_unshuffle_kernel   = ck(pixel_shuffle_kernel_file, nullptr, "pixel_unshuffle");
     if (!_backpropagate_kernel)
       _backpropagate_kernel     = ck(backpropagate_kernel_file,     nullptr, "backpropagate");
     /* clang-format on */
@@ -159,12 +218,16 @@ void DataPipeline::load_kernels(int load_flags) {
 }
 
 opencl::Kernel *DataPipeline::create_layer_kernel(const LayerData &d,
-                                                  bool skip_relu) {
+                                                  bool skip_relu,
+                                                  bool half_input,
+                                                  bool half_output) {
   char buf[255];
   std::string defs =
       "-D CURRENT_FILTER_COUNT=%d -D PREVIOUS_FILTER_COUNT=%d -D "
       "F_SPATIAL_SIZE=%d";
   if (skip_relu) defs += " -D SKIP_RELU";
+  if (half_input) defs += " -D INPUT_HALF";
+  if (half_output) defs += " -D OUTPUT_HALF";
 
   snprintf(buf, 255, defs.c_str(), d.current_filter_count, d.n_prev_filter_cnt,
            d.f_spatial_size);
@@ -172,12 +235,48 @@ opencl::Kernel *DataPipeline::create_layer_kernel(const LayerData &d,
                                  buf, "forward");
 }
 
-opencl::Kernel *DataPipeline::create_deltas_kernel(const LayerData &d) {
+opencl::Kernel *DataPipeline::create_deltas_kernel(const LayerData &d,
+                                                   bool half_activations,
+                                                   bool half_next_deltas,
+                                                   bool half_math,
+                                                   bool skip_relu) {
   char buf[255];
-  snprintf(buf, 255, "-D CURRENT_FILTER_COUNT=%d", d.current_filter_count);
+  std::string defs = "-D CURRENT_FILTER_COUNT=%d";
+  if (half_activations) defs += " -D ACTIVATIONS_HALF";
+  if (half_next_deltas) defs += " -D NEXT_DELTAS_HALF";
+  if (half_math) defs += " -D HALF_MATH";
+  if (skip_relu) defs += " -D SKIP_RELU";
+
+  snprintf(buf, 255, defs.c_str(), d.current_filter_count);
   return _context->create_kernel((kernel_folder + deltas_kernel_file).c_str(),
                                  buf, "deltas");
 }
+opencl::Kernel *DataPipeline::create_int8_layer_kernel(const LayerData &d,
+                                                       bool last_layer,
+                                                       bool skip_relu) {
+  char buf[255];
+  std::string defs =
+      "-D CURRENT_FILTER_COUNT=%d -D PREVIOUS_FILTER_COUNT=%d -D "
+      "F_SPATIAL_SIZE=%d";
+  if (last_layer || skip_relu) defs += " -D SKIP_RELU";
+  if (last_layer) defs += " -D OUTPUT_FLOAT";
+
+  snprintf(buf, 255, defs.c_str(), d.current_filter_count, d.n_prev_filter_cnt,
+           d.f_spatial_size);
+  return _context->create_kernel(
+      (kernel_folder + layer_int8_kernel_file).c_str(), buf, "forward_int8");
+}
+opencl::Kernel *DataPipeline::create_backpropagate_kernel(bool half_deltas,
+                                                          bool half_input,
+                                                          bool half_math) {
+  std::string defs = "";
+  if (half_deltas) defs += " -D DELTAS_HALF";
+  if (half_input) defs += " -D INPUT_HALF";
+  if (half_math) defs += " -D HALF_MATH";
+  return _context->create_kernel(
+      (kernel_folder + backpropagate_kernel_file).c_str(), defs.c_str(),
+      "backpropagate");
+}
 
 ///
 /// execute: misc
@@ -186,14 +285,18 @@ opencl::Kernel *DataPipeline::create_deltas_kernel(const LayerData &d) {
 cl_event DataPipeline::extract_luma(opencl::utils::ImageData &img_data,
                                     opencl::MemoryHandle &gpu_buf_raw_img,
                                     opencl::MemoryHandle &gpu_buf_luma,
-                                    bool normalize, cl_event *ev_to_wait_for) {
+                                    bool normalize, cl_event *ev_to_wait_for,
+                                    size_t scale) {
   check_initialized(DataPipeline::LOAD_KERNEL_LUMA);
+  utils::require(scale > 0, "Luma scale should be > 0");
 
-  size_t out_pixel_count = img_data.w * img_data.h /* sizeof(cl_char)*/;
+  size_t img_pixel_count = img_data.w * img_data.h /* sizeof(cl_char)*/,
+         out_w = img_data.w * scale, out_h = img_data.h * scale,
+         out_pixel_count = out_w * out_h;
   auto kernel = normalize ? _luma_kernel_norm : _luma_kernel_raw;
 
   // memory allocation
-  if (!ALLOCATION_HAS_RIGHT_SIZE(gpu_buf_raw_img, out_pixel_count)) {
+  if (!ALLOCATION_HAS_RIGHT_SIZE(gpu_buf_raw_img, img_pixel_count)) {
     gpu_buf_raw_img = _context->create_image(
         CL_MEM_READ_WRITE, CL_RGBA, CL_UNSIGNED_INT8, img_data.w, img_data.h);
   }
@@ -206,12 +309,13 @@ cl_event DataPipeline::extract_luma(opencl::utils::ImageData &img_data,
   // kernel args
   kernel->push_arg(gpu_buf_raw_img);
   kernel->push_arg(gpu_buf_luma);
-  kernel->push_arg(sizeof(cl_uint), (void *)&img_data.w);
-  kernel->push_arg(sizeof(cl_uint), (void *)&img_data.h);
+  kernel->push_arg(sizeof(cl_uint), (void *)&out_w);
+  kernel->push_arg(sizeof(cl_uint), (void *)&out_h);
+  kernel->push_arg(sizeof(cl_uint), (void *)&scale);
 
   // Launch kernel
   size_t global_work_size[2], local_work_size[2],
-      work_dims[2] = {(size_t)img_data.w, (size_t)img_data.h};
+      work_dims[2] = {out_w, out_h};
   opencl::utils::work_sizes(*kernel, 2, global_work_size, local_work_size,
                             work_dims, print_work_dimensions);
   auto finish_token = kernel->execute(2, global_work_size, local_work_size,
@@ -224,11 +328,11 @@ cl_event DataPipeline::swap_luma(opencl::utils::ImageData &img_data,
                                  opencl::MemoryHandle gpu_buf_new_luma,
                                  opencl::MemoryHandle &target,
                                  size_t new_luma_w, size_t new_luma_h,
-                                 cl_event *ev_to_wait_for) {
+                                 cl_event *ev_to_wait_for, size_t scale) {
   check_initialized(DataPipeline::LOAD_KERNEL_LUMA);
 
   size_t img_size = img_data.w * img_data.h /* sizeof(cl_char)*/,
-         img_size_3ch = img_size * 3,
+         img_size_3ch = img_size * 3 * scale * scale,
          new_luma_size = new_luma_w * new_luma_h * sizeof(cl_float);
 
   // memory allocation
@@ -253,10 +357,11 @@ cl_event DataPipeline::swap_luma(opencl::utils::ImageData &img_data,
   _swap_luma_kernel->push_arg(sizeof(cl_uint), (void *)&img_data.h);
   _swap_luma_kernel->push_arg(sizeof(cl_uint), (void *)&new_luma_w);
   _swap_luma_kernel->push_arg(sizeof(cl_uint), (void *)&new_luma_h);
+  _swap_luma_kernel->push_arg(sizeof(cl_uint), (void *)&scale);
 
   // Launch kernel
   size_t global_work_size[2], local_work_size[2],
-      work_dims[2] = {(size_t)img_data.w, (size_t)img_data.h};
+      work_dims[2] = {img_data.w * scale, img_data.h * scale};
   opencl::utils::work_sizes(*_swap_luma_kernel, 2, global_work_size,
                             local_work_size, work_dims, print_work_dimensions);
   auto finish_token =
@@ -332,6 +437,325 @@ cl_event DataPipeline::subtract_from_all(opencl::MemoryHandle data, float val,
   return finish_token;
 }
 
+cl_event DataPipeline::gather_samples(
+    opencl::MemoryHandle input_arena, opencl::MemoryHandle expected_arena,
+    opencl::MemoryHandle input_means, DatasetStorage storage,
+    opencl::MemoryHandle slots, size_t sample_count, size_t px_count,
+    opencl::MemoryHandle input_target, opencl::MemoryHandle expected_target,
+    cl_event *ev_to_wait_for, size_t expected_scale) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  size_t expected_px_count = px_count * expected_scale * expected_scale,
+         len = sample_count * expected_px_count;
+  utils::require(element_count(slots, sizeof(cl_uint)) >= sample_count,
+                 "Slots buffer is too small");
+  utils::require(
+      element_count(input_target, sizeof(cl_float)) >=
+              sample_count * px_count &&
+          element_count(expected_target, sizeof(cl_float)) >= len,
+      "Gathered samples would not fit into target buffers");
+  auto kernel = storage == DatasetStorage::UInt8
+                    ? _gather_samples_u8_kernel
+                    : storage == DatasetStorage::Float16
+                          ? _gather_samples_f16_kernel
+                          : _gather_samples_kernel;
+
+  // kernel args
+  kernel->push_arg(input_arena);
+  kernel->push_arg(expected_arena);
+  kernel->push_arg(input_means);
+  kernel->push_arg(slots);
+  kernel->push_arg(input_target);
+  kernel->push_arg(expected_target);
+  kernel->push_arg(sizeof(cl_uint), (void *)&px_count);
+  kernel->push_arg(sizeof(cl_uint), (void *)&expected_px_count);
+  kernel->push_arg(sizeof(cl_uint), (void *)&sample_count);
+
+  // run
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*kernel, 1, &global_work_size, &local_work_size,
+                            &len, print_work_dimensions);
+  return kernel->execute(1, &global_work_size, &local_work_size,
+                         ev_to_wait_for);
+}
+
+cl_event DataPipeline::pixel_shuffle(opencl::MemoryHandle src, size_t w,
+                                     size_t h, size_t sample_count, size_t r,
+                                     opencl::MemoryHandle target,
+                                     cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  size_t len = sample_count * w * h * r * r;
+  utils::require(element_count(src, sizeof(cl_float)) >= len,
+                 "Source buffer is too small");
+  utils::require(element_count(target, sizeof(cl_float)) >= len,
+                 "Shuffled image would not fit into target buffer");
+
+  // kernel args
+  _pixel_shuffle_kernel->push_arg(src);
+  _pixel_shuffle_kernel->push_arg(target);
+  _pixel_shuffle_kernel->push_arg(sizeof(cl_uint), (void *)&w);
+  _pixel_shuffle_kernel->push_arg(sizeof(cl_uint), (void *)&h);
+  _pixel_shuffle_kernel->push_arg(sizeof(cl_uint), (void *)&r);
+  _pixel_shuffle_kernel->push_arg(sizeof(cl_uint), (void *)&sample_count);
+
+  // run
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_pixel_shuffle_kernel, 1, &global_work_size,
+                            &local_work_size, &len, print_work_dimensions);
+  return _pixel_shuffle_kernel->execute(1, &global_work_size,
+                                        &local_work_size, ev_to_wait_for);
+}
+
+cl_event DataPipeline::pixel_unshuffle(opencl::MemoryHandle src, size_t w,
+                                       size_t h, size_t sample_count,
+                                       size_t r, opencl::MemoryHandle target,
+                                       cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_BACKPROPAGATE);
+  size_t len = sample_count * w * h * r * r;
+  utils::require(element_count(src, sizeof(cl_float)) >= len,
+                 "Source buffer is too small");
+  utils::require(element_count(target, sizeof(cl_float)) >= len,
+                 "Unshuffled values would not fit into target buffer");
+
+  // kernel args
+  _pixel_unshuffle_kernel->push_arg(src);
+  _pixel_unshuffle_kernel->push_arg(target);
+  _pixel_unshuffle_kernel->push_arg(sizeof(cl_uint), (void *)&w);
+  _pixel_unshuffle_kernel->push_arg(sizeof(cl_uint), (void *)&h);
+  _pixel_unshuffle_kernel->push_arg(sizeof(cl_uint), (void *)&r);
+  _pixel_unshuffle_kernel->push_arg(sizeof(cl_uint), (void *)&sample_count);
+
+  // run
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_pixel_unshuffle_kernel, 1, &global_work_size,
+                            &local_work_size, &len, print_work_dimensions);
+  return _pixel_unshuffle_kernel->execute(1, &global_work_size,
+                                          &local_work_size, ev_to_wait_for);
+}
+
+cl_event DataPipeline::crop_samples(opencl::MemoryHandle source,
+                                    opencl::MemoryHandle crops,
+                                    size_t sample_count, size_t size,
+                                    opencl::MemoryHandle target,
+                                    cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  size_t len = sample_count * size * size;
+  utils::require(element_count(crops, 4 * sizeof(cl_uint)) >= sample_count,
+                 "Crops buffer is too small");
+  utils::require(element_count(target, sizeof(cl_float)) >= len,
+                 "Crops would not fit into target buffer");
+
+  // kernel args
+  _crop_kernel->push_arg(source);
+  _crop_kernel->push_arg(crops);
+  _crop_kernel->push_arg(target);
+  _crop_kernel->push_arg(sizeof(cl_uint), (void *)&size);
+  _crop_kernel->push_arg(sizeof(cl_uint), (void *)&sample_count);
+
+  // run
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_crop_kernel, 1, &global_work_size,
+                            &local_work_size, &len, print_work_dimensions);
+  return _crop_kernel->execute(1, &global_work_size, &local_work_size,
+                               ev_to_wait_for);
+}
+
+cl_event DataPipeline::downscale(opencl::MemoryHandle src, size_t sample_count,
+                                 size_t size, size_t small_size,
+                                 opencl::MemoryHandle target,
+                                 cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  size_t len = sample_count * small_size * small_size;
+  utils::require(small_size > 0 && small_size <= size,
+                 "Downscaled size should be in range (0, size]");
+  utils::require(
+      element_count(src, sizeof(cl_float)) >= sample_count * size * size,
+      "Source buffer is too small");
+  utils::require(element_count(target, sizeof(cl_float)) >= len,
+                 "Downscaled images would not fit into target buffer");
+
+  // kernel args
+  _downscale_kernel->push_arg(src);
+  _downscale_kernel->push_arg(target);
+  _downscale_kernel->push_arg(sizeof(cl_uint), (void *)&size);
+  _downscale_kernel->push_arg(sizeof(cl_uint), (void *)&small_size);
+  _downscale_kernel->push_arg(sizeof(cl_uint), (void *)&sample_count);
+
+  // run
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_downscale_kernel, 1, &global_work_size,
+                            &local_work_size, &len, print_work_dimensions);
+  return _downscale_kernel->execute(1, &global_work_size, &local_work_size,
+                                    ev_to_wait_for);
+}
+
+cl_event DataPipeline::upscale_bicubic(opencl::MemoryHandle src,
+                                       size_t sample_count, size_t small_size,
+                                       size_t size, opencl::MemoryHandle target,
+                                       cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  size_t len = sample_count * size * size;
+  utils::require(element_count(src, sizeof(cl_float)) >=
+                     sample_count * small_size * small_size,
+                 "Source buffer is too small");
+  utils::require(element_count(target, sizeof(cl_float)) >= len,
+                 "Upscaled images would not fit into target buffer");
+
+  // kernel args
+  _upscale_bicubic_kernel->push_arg(src);
+  _upscale_bicubic_kernel->push_arg(target);
+  _upscale_bicubic_kernel->push_arg(sizeof(cl_uint), (void *)&small_size);
+  _upscale_bicubic_kernel->push_arg(sizeof(cl_uint), (void *)&size);
+  _upscale_bicubic_kernel->push_arg(sizeof(cl_uint), (void *)&sample_count);
+
+  // run
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_upscale_bicubic_kernel, 1, &global_work_size,
+                            &local_work_size, &len, print_work_dimensions);
+  return _upscale_bicubic_kernel->execute(1, &global_work_size,
+                                          &local_work_size, ev_to_wait_for);
+}
+
+cl_event DataPipeline::subtract_sample_means(opencl::MemoryHandle data,
+                                             size_t sample_count,
+                                             size_t px_count,
+                                             opencl::MemoryHandle means,
+                                             cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  utils::require(
+      element_count(data, sizeof(cl_float)) >= sample_count * px_count,
+      "Data buffer is too small");
+  utils::require(element_count(means, sizeof(cl_float)) >= sample_count,
+                 "Means buffer is too small");
+
+  // one work group per sample, reduction needs power of 2
+  size_t local_work_size = 64,
+         global_work_size = sample_count * local_work_size;
+
+  // kernel args
+  _subtract_sample_mean_kernel->push_arg(data);
+  _subtract_sample_mean_kernel->push_arg(means);
+  _subtract_sample_mean_kernel->push_arg(sizeof(cl_float) * local_work_size,
+                                         nullptr);
+  _subtract_sample_mean_kernel->push_arg(sizeof(cl_uint), (void *)&px_count);
+
+  // run
+  return _subtract_sample_mean_kernel->execute(
+      1, &global_work_size, &local_work_size, ev_to_wait_for);
+}
+
+///
+/// loss based sampling
+///
+
+cl_event DataPipeline::scatter_losses(opencl::MemoryHandle batch_losses,
+                                      opencl::MemoryHandle slots,
+                                      size_t sample_count,
+                                      opencl::MemoryHandle sample_losses,
+                                      cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  utils::require(
+      element_count(batch_losses, sizeof(cl_float)) >= sample_count &&
+          element_count(slots, sizeof(cl_uint)) >= sample_count,
+      "Batch losses or slots buffer is too small");
+
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_scatter_losses_kernel, 1, &global_work_size,
+                            &local_work_size, &sample_count,
+                            print_work_dimensions);
+
+  // kernel args
+  _scatter_losses_kernel->push_arg(batch_losses);
+  _scatter_losses_kernel->push_arg(slots);
+  _scatter_losses_kernel->push_arg(sample_losses);
+  _scatter_losses_kernel->push_arg(sizeof(cl_uint), (void *)&sample_count);
+
+  // run
+  return _scatter_losses_kernel->execute(1, &global_work_size,
+                                         &local_work_size, ev_to_wait_for);
+}
+
+cl_event DataPipeline::gather_losses(opencl::MemoryHandle sample_losses,
+                                     opencl::MemoryHandle slots, size_t count,
+                                     opencl::MemoryHandle target,
+                                     cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  utils::require(element_count(slots, sizeof(cl_uint)) >= count &&
+                     element_count(target, sizeof(cl_float)) >= count,
+                 "Slots or target buffer is too small");
+
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_gather_losses_kernel, 1, &global_work_size,
+                            &local_work_size, &count, print_work_dimensions);
+
+  // kernel args
+  _gather_losses_kernel->push_arg(sample_losses);
+  _gather_losses_kernel->push_arg(slots);
+  _gather_losses_kernel->push_arg(target);
+  _gather_losses_kernel->push_arg(sizeof(cl_uint), (void *)&count);
+
+  // run
+  return _gather_losses_kernel->execute(1, &global_work_size,
+                                        &local_work_size, ev_to_wait_for);
+}
+
+cl_event DataPipeline::loss_prefix_sum(opencl::MemoryHandle losses,
+                                       size_t count, opencl::MemoryHandle cdf,
+                                       cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  utils::require(count > 0, "Nothing to sum");
+  utils::require(element_count(losses, sizeof(cl_float)) >= count &&
+                     element_count(cdf, sizeof(cl_float)) >= count,
+                 "Losses or cdf buffer is too small");
+
+  // single work group, scan of chunk totals needs power of 2
+  size_t local_work_size = 64, global_work_size = local_work_size;
+
+  // kernel args
+  _loss_prefix_sum_kernel->push_arg(losses);
+  _loss_prefix_sum_kernel->push_arg(cdf);
+  _loss_prefix_sum_kernel->push_arg(sizeof(cl_float) * local_work_size,
+                                    nullptr);
+  _loss_prefix_sum_kernel->push_arg(sizeof(cl_uint), (void *)&count);
+
+  // run
+  return _loss_prefix_sum_kernel->execute(1, &global_work_size,
+                                          &local_work_size, ev_to_wait_for);
+}
+
+cl_event DataPipeline::draw_by_loss(opencl::MemoryHandle cdf, size_t count,
+                                    opencl::MemoryHandle uniforms,
+                                    size_t draw_count, float loss_fraction,
+                                    opencl::MemoryHandle target,
+                                    cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  utils::require(count > 0, "Nothing to draw from");
+  utils::require(loss_fraction >= 0.0f && loss_fraction <= 1.0f,
+                 "Loss fraction should be in [0, 1]");
+  utils::require(element_count(cdf, sizeof(cl_float)) >= count,
+                 "Cdf buffer is too small");
+  utils::require(
+      element_count(uniforms, sizeof(cl_float)) >= draw_count &&
+          element_count(target, sizeof(cl_uint)) >= draw_count,
+      "Uniforms or target buffer is too small");
+
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_draw_by_loss_kernel, 1, &global_work_size,
+                            &local_work_size, &draw_count,
+                            print_work_dimensions);
+
+  // kernel args
+  _draw_by_loss_kernel->push_arg(cdf);
+  _draw_by_loss_kernel->push_arg(uniforms);
+  _draw_by_loss_kernel->push_arg(target);
+  _draw_by_loss_kernel->push_arg(sizeof(cl_uint), (void *)&count);
+  _draw_by_loss_kernel->push_arg(sizeof(cl_uint), (void *)&draw_count);
+  _draw_by_loss_kernel->push_arg(sizeof(cl_float), (void *)&loss_fraction);
+
+  // run
+  return _draw_by_loss_kernel->execute(1, &global_work_size, &local_work_size,
+                                       ev_to_wait_for);
+}
+
 ///
 /// execute: cnn forward propagation
 ///
@@ -362,7 +786,8 @@ cl_event DataPipeline::execute_layer(opencl::Kernel &kernel,
                                      size_t input_w, size_t input_h,
                                      size_t sample_count,  //
                                      opencl::MemoryHandle &gpu_buf_out,
-                                     cl_event *ev_to_wait_for) {
+                                     cl_event *ev_to_wait_for,
+                                     size_t out_el_size) {
   pre_execute_layer_validation(data, gpu_buf_in, input_w, input_h);
 
   size_t out_size[2];
@@ -374,7 +799,7 @@ cl_event DataPipeline::execute_layer(opencl::Kernel &kernel,
   // buffers: W, B, out_target
   size_t weights_alloc_size = sizeof(cl_float) * data.weight_size(),
          bias_alloc_size = sizeof(cl_float) * data.bias_size(),
-         out_alloc_size = sizeof(cl_float) * out_count;
+         out_alloc_size = out_el_size * out_count;
 
   if (!ALLOCATION_HAS_RIGHT_SIZE(gpu_alloc.weights, weights_alloc_size)) {
     gpu_alloc.weights =
@@ -409,6 +834,97 @@ cl_event DataPipeline::execute_layer(opencl::Kernel &kernel,
                         events_to_wait_for_count);
 }
 
+cl_event DataPipeline::execute_layer_int8(
+    opencl::Kernel &kernel, const LayerData &data,
+    const QuantizedLayer &quantized, LayerAllocationPool &gpu_alloc,
+    opencl::MemoryHandle input, size_t input_w, size_t input_h,
+    size_t sample_count, float output_scale, opencl::MemoryHandle &output,
+    cl_event *ev_to_wait_for) {
+  LayerData::validate(data);
+  utils::require(quantized.calibrated() &&
+                     quantized.weights.size() == data.weight_size(),
+                 "Layer was not quantized");
+  utils::require(element_count(input, sizeof(cl_char)) >=
+                     sample_count * data.input_size(input_w, input_h),
+                 "Int8 layer input buffer is too small");
+
+  size_t out_size[2];
+  data.get_output_dimensions(out_size, input_w, input_h);
+  size_t out_count = out_size[0] * out_size[1] * data.current_filter_count;
+  size_t out_el_size = output_scale > 0.0f ? sizeof(cl_char) : sizeof(cl_float);
+
+  // upload quantized parameters on first use
+  if (gpu_alloc.int8_weights == gpu_nullptr) {
+    std::vector<float> scales(data.current_filter_count);
+    for (size_t n = 0; n < scales.size(); n++)
+      scales[n] = quantized.input_scale * quantized.weight_scales[n];
+    /* clang-format off */
+    gpu_alloc.int8_weights = _context->allocate(CL_MEM_READ_ONLY, sizeof(cl_char) * data.weight_size());
+    gpu_alloc.int8_scales = _context->allocate(CL_MEM_READ_ONLY, sizeof(cl_float) * scales.size());
+    _context->write_buffer(gpu_alloc.int8_weights, (void *)&quantized.weights[0], true);
+    _context->write_buffer(gpu_alloc.int8_scales, (void *)&scales[0], true);
+    /* clang-format on */
+  }
+  if (!ALLOCATION_HAS_RIGHT_SIZE(gpu_alloc.bias,
+                                 sizeof(cl_float) * data.bias_size())) {
+    gpu_alloc.bias = _context->allocate(CL_MEM_READ_WRITE,
+                                        sizeof(cl_float) * data.bias_size());
+    _context->write_buffer(gpu_alloc.bias, (void *)data.bias_ptr(), true);
+  }
+  if (!ALLOCATION_HAS_RIGHT_SIZE(output,
+                                 out_el_size * out_count * sample_count)) {
+    output = _context->allocate(CL_MEM_READ_WRITE,
+                                out_el_size * out_count * sample_count);
+  }
+
+  // args
+  float output_inv_scale = output_scale > 0.0f ? 1.0f / output_scale : 0.0f;
+  kernel.push_arg(input);
+  kernel.push_arg(output);
+  kernel.push_arg(gpu_alloc.int8_weights);
+  kernel.push_arg(gpu_alloc.int8_scales);
+  kernel.push_arg(gpu_alloc.bias);
+  kernel.push_arg(sizeof(cl_float), (void *)&output_inv_scale);
+  kernel.push_arg(sizeof(cl_uint), (void *)&input_w);
+  kernel.push_arg(sizeof(cl_uint), (void *)&input_h);
+
+  // run
+  int events_to_wait_for_count = ev_to_wait_for ? 1 : 0;
+  size_t global_work_size[3], local_work_size[3],
+      work_dims[2] = {out_size[0], out_size[1]};
+  opencl::utils::work_sizes(kernel, 2, global_work_size, local_work_size,
+                            work_dims, print_work_dimensions);
+  global_work_size[2] = sample_count;
+  local_work_size[2] = 1;
+  return kernel.execute(3, global_work_size, local_work_size, ev_to_wait_for,
+                        events_to_wait_for_count);
+}
+
+cl_event DataPipeline::quantize(opencl::MemoryHandle src, size_t count,
+                                float scale, opencl::MemoryHandle &target,
+                                cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_MISC);
+  utils::require(scale > 0.0f, "Quantization scale has to be positive");
+  utils::require(element_count(src, sizeof(cl_float)) >= count,
+                 "Quantized buffer is too small");
+  if (!ALLOCATION_HAS_RIGHT_SIZE(target, sizeof(cl_char) * count)) {
+    target = _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_char) * count);
+  }
+
+  float inv_scale = 1.0f / scale;
+  _quantize_kernel->push_arg(src);
+  _quantize_kernel->push_arg(target);
+  _quantize_kernel->push_arg(sizeof(cl_float), (void *)&inv_scale);
+  _quantize_kernel->push_arg(sizeof(cl_uint), (void *)&count);
+
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*_quantize_kernel, 1, &global_work_size,
+                            &local_work_size, &count, print_work_dimensions);
+  int events_to_wait_for_count = ev_to_wait_for ? 1 : 0;
+  return _quantize_kernel->execute(1, &global_work_size, &local_work_size,
+                                   ev_to_wait_for, events_to_wait_for_count);
+}
+
 ///
 /// backpropagation
 ///
@@ -421,28 +937,50 @@ cl_event DataPipeline::squared_error(opencl::MemoryHandle gpu_buf_ground_truth,
                                      opencl::MemoryHandle tmp_buffer,
                                      float &target, size_t total_padding,
                                      cl_event *ev_to_wait_for) {
+  auto finish_token = squared_error_per_sample(
+      gpu_buf_ground_truth, ground_truth_w, ground_truth_h, sample_count,
+      gpu_buf_algo_res, tmp_buffer, total_padding, ev_to_wait_for);
+
+  std::vector<float> per_sample(sample_count);
+  auto ev = _context->read_buffer(tmp_buffer, 0,
+                                  sizeof(cl_float) * sample_count,
+                                  (void *)&per_sample[0], true, &finish_token,
+                                  1);
+  target = std::accumulate(per_sample.begin(), per_sample.end(), 0.0f);
+  return ev;
+}
+
+cl_event DataPipeline::squared_error_per_sample(
+    opencl::MemoryHandle gpu_buf_ground_truth,  //
+    size_t ground_truth_w, size_t ground_truth_h, size_t sample_count,
+    opencl::MemoryHandle gpu_buf_algo_res,
+    opencl::MemoryHandle gpu_buf_target,  //
+    size_t total_padding, cl_event *ev_to_wait_for) {
   check_initialized(DataPipeline::LOAD_KERNEL_MISC);
   size_t algo_w = ground_truth_w - total_padding,
          algo_h = ground_truth_h - total_padding,  //
       algo_size = algo_w * algo_h;
 
   // check allocations
-  /* clang-format off */
-  /*
-  if (!ALLOCATION_HAS_RIGHT_SIZE(gpu_buf_ground_truth, sizeof(cl_float) * ground_truth_w * ground_truth_h)) {
-    throw std::runtime_error(
-        "Provided ground_truth_w, ground_truth_h dimensions did not match "
-        "allocated gpu_buf_ground_truth buffer size");
-  }*/
-  if (!ALLOCATION_HAS_RIGHT_SIZE(gpu_buf_algo_res, sizeof(cl_float) * algo_size)) {
-    throw std::runtime_error( "Allocated gpu_buf_algo_res buffer size did not match calculated size");
-  }
-  /* clang-format on */
-  float zero = 0.0f;
-  auto event_count = ev_to_wait_for == nullptr ? 0 : 1;
-  auto ev_write = _context->write_buffer(tmp_buffer, (void *)&zero, false,
-                                         ev_to_wait_for, event_count);
-  ev_to_wait_for = &ev_write;
+  utils::require(element_count(gpu_buf_algo_res, sizeof(cl_float)) >=
+                     sample_count * algo_size,
+                 "Allocated gpu_buf_algo_res buffer size did not match "
+                 "calculated size");
+  utils::require(
+      element_count(gpu_buf_target, sizeof(cl_float)) >= sample_count,
+      "Target buffer is too small");
+
+  // kernel adds to the per sample values, clear them on the device
+  size_t clear_global_work_size, clear_local_work_size;
+  opencl::utils::work_sizes(*_clear_squared_error_kernel, 1,
+                            &clear_global_work_size, &clear_local_work_size,
+                            &sample_count, print_work_dimensions);
+  _clear_squared_error_kernel->push_arg(gpu_buf_target);
+  _clear_squared_error_kernel->push_arg(sizeof(cl_uint),
+                                        (void *)&sample_count);
+  auto ev_clear = _clear_squared_error_kernel->execute(
+      1, &clear_global_work_size, &clear_local_work_size, ev_to_wait_for);
+  ev_to_wait_for = &ev_clear;
 
   size_t global_work_size[3], local_work_size[3],
       work_dims[2] = {algo_w, algo_h};
@@ -450,12 +988,12 @@ cl_event DataPipeline::squared_error(opencl::MemoryHandle gpu_buf_ground_truth,
                             local_work_size, work_dims, print_work_dimensions);
   global_work_size[2] = sample_count;
   local_work_size[2] = 1;
-  
+
   // kernel args
   size_t local_mem_size = local_work_size[0] * local_work_size[1];
   _squared_error_kernel->push_arg(gpu_buf_ground_truth);
   _squared_error_kernel->push_arg(gpu_buf_algo_res);
-  _squared_error_kernel->push_arg(tmp_buffer);
+  _squared_error_kernel->push_arg(gpu_buf_target);
   _squared_error_kernel->push_arg(sizeof(cl_float) * local_mem_size,
                                   nullptr);  // scratch
   _squared_error_kernel->push_arg(sizeof(cl_uint), (void *)&ground_truth_w);
@@ -464,11 +1002,8 @@ cl_event DataPipeline::squared_error(opencl::MemoryHandle gpu_buf_ground_truth,
   _squared_error_kernel->push_arg(sizeof(cl_uint), (void *)&algo_h);
 
   // run
-  cl_event finish_token = _squared_error_kernel->execute(
-      3, global_work_size, local_work_size, ev_to_wait_for);
-
-  return _context->read_buffer(tmp_buffer, (void *)&target, false,
-                               &finish_token, 1);
+  return _squared_error_kernel->execute(3, global_work_size, local_work_size,
+                                        ev_to_wait_for);
 }
 
 cl_event DataPipeline::last_layer_delta(
@@ -476,9 +1011,13 @@ cl_event DataPipeline::last_layer_delta(
     size_t ground_truth_w, size_t ground_truth_h, size_t sample_count,
     opencl::MemoryHandle gpu_buf_algo_res,
     opencl::MemoryHandle &gpu_buf_target,  //
-    size_t total_padding, cl_event *ev_to_wait_for) {
+    size_t total_padding, cl_event *ev_to_wait_for,
+    opencl::MemoryHandle loss_scaling) {
   //
   check_initialized(DataPipeline::LOAD_KERNEL_BACKPROPAGATE);
+  bool scaled = loss_scaling != gpu_nullptr;
+  auto kernel = scaled ? _last_layer_delta_scaled_kernel  //
+                       : _last_layer_delta_kernel;
   size_t algo_w = ground_truth_w - total_padding,
          algo_h = ground_truth_h - total_padding,  //
       algo_size = algo_w * algo_h;
@@ -500,23 +1039,23 @@ cl_event DataPipeline::last_layer_delta(
   /* clang-format on */
 
   // kernel args
-  _last_layer_delta_kernel->push_arg(gpu_buf_ground_truth);
-  _last_layer_delta_kernel->push_arg(gpu_buf_algo_res);
-  _last_layer_delta_kernel->push_arg(gpu_buf_target);
-  _last_layer_delta_kernel->push_arg(sizeof(cl_uint), (void *)&ground_truth_w);
-  _last_layer_delta_kernel->push_arg(sizeof(cl_uint), (void *)&ground_truth_h);
-  _last_layer_delta_kernel->push_arg(sizeof(cl_uint), (void *)&algo_w);
-  _last_layer_delta_kernel->push_arg(sizeof(cl_uint), (void *)&algo_h);
+  kernel->push_arg(gpu_buf_ground_truth);
+  kernel->push_arg(gpu_buf_algo_res);
+  kernel->push_arg(gpu_buf_target);
+  kernel->push_arg(sizeof(cl_uint), (void *)&ground_truth_w);
+  kernel->push_arg(sizeof(cl_uint), (void *)&ground_truth_h);
+  kernel->push_arg(sizeof(cl_uint), (void *)&algo_w);
+  kernel->push_arg(sizeof(cl_uint), (void *)&algo_h);
+  if (scaled) kernel->push_arg(loss_scaling);
 
   // run
   size_t global_work_size[3], local_work_size[3],
       work_dims[2] = {algo_w, algo_h};
-  opencl::utils::work_sizes(*_last_layer_delta_kernel, 2, global_work_size,
-                            local_work_size, work_dims, print_work_dimensions);
+  opencl::utils::work_sizes(*kernel, 2, global_work_size, local_work_size,
+                            work_dims, print_work_dimensions);
   global_work_size[2] = sample_count;
   local_work_size[2] = 1;
-  return _last_layer_delta_kernel->execute(3, global_work_size, local_work_size,
-                                           ev_to_wait_for);
+  return kernel->execute(3, global_work_size, local_work_size, ev_to_wait_for);
 }
 
 cl_event DataPipeline::calculate_deltas(
@@ -525,7 +1064,8 @@ cl_event DataPipeline::calculate_deltas(
     LayerAllocationPool &next_gpu_alloc,  //
     opencl::MemoryHandle curr_deltas, opencl::MemoryHandle next_deltas,
     size_t next_layer_out_w, size_t next_layer_out_h, size_t sample_count,
-    opencl::MemoryHandle curr_output, cl_event *ev_to_wait_for) {
+    opencl::MemoryHandle curr_output, cl_event *ev_to_wait_for,
+    size_t activation_el_size) {
   //
   // @pre validation
   LayerData::validate(next_layer);
@@ -542,7 +1082,7 @@ cl_event DataPipeline::calculate_deltas(
          out_size = out_w * out_h * next_layer.n_prev_filter_cnt;
   // gpu memory alloc sizes
   size_t weights_alloc_size = sizeof(cl_float) * next_layer.weight_size(),
-         out_alloc_size = sizeof(cl_float) * out_size,
+         out_alloc_size = activation_el_size * out_size,
          next_out_alloc_size = sizeof(cl_float) * next_out_size;
 
   /* clang-format off */
@@ -600,8 +1140,23 @@ cl_event DataPipeline::backpropagate(LayerData &layer_data,  //
                                      size_t layer_out_w, size_t layer_out_h,
                                      size_t sample_count,  //
                                      cl_event *ev_to_wait_for, size_t ev_cnt) {
-  LayerData::validate(layer_data);
   check_initialized(DataPipeline::LOAD_KERNEL_BACKPROPAGATE);
+  return backpropagate(*_backpropagate_kernel, layer_data,  //
+                       layer_input, layer_deltas, gpu_alloc,
+                       layer_out_w, layer_out_h, sample_count,  //
+                       ev_to_wait_for, ev_cnt);
+}
+
+cl_event DataPipeline::backpropagate(opencl::Kernel &kernel,
+                                     LayerData &layer_data,  //
+                                     opencl::MemoryHandle layer_input,
+                                     opencl::MemoryHandle layer_deltas,
+                                     LayerAllocationPool &gpu_alloc,
+                                     size_t layer_out_w, size_t layer_out_h,
+                                     size_t sample_count,  //
+                                     cl_event *ev_to_wait_for, size_t ev_cnt,
+                                     size_t input_el_size) {
+  LayerData::validate(layer_data);
 
   size_t input_w = layer_out_w + layer_data.f_spatial_size - 1,
          input_h = layer_out_h + layer_data.f_spatial_size - 1;
@@ -615,7 +1170,7 @@ cl_event DataPipeline::backpropagate(LayerData &layer_data,  //
   // std::cout << "weights_size: " << weights_size << std::endl;
 
   // allocations
-  size_t in_alloc_size = sizeof(cl_float) * in_count,
+  size_t in_alloc_size = input_el_size * in_count,
          out_alloc_size = sizeof(cl_float) * out_count,
          grad_w_size = sizeof(cl_float) * layer_data.weight_size(),
          grad_b_size = sizeof(cl_float) * layer_data.bias_size();
@@ -640,7 +1195,6 @@ cl_event DataPipeline::backpropagate(LayerData &layer_data,  //
   /* clang-format on */
 
   // args
-  opencl::Kernel &kernel = *_backpropagate_kernel;
   kernel.push_arg(layer_deltas);
   kernel.push_arg(layer_input);
   kernel.push_arg(gpu_alloc.accumulating_grad_w);
@@ -728,5 +1282,147 @@ cl_event DataPipeline::update_parameters(LayerData &layer_data,  //
                                             events_to_wait_for_count);
 }
 
+cl_event DataPipeline::update_packed_parameters(
+    opencl::MemoryHandle parameters, opencl::MemoryHandle gradients,
+    opencl::MemoryHandle previous_deltas, opencl::MemoryHandle segment_ranges,
+    opencl::MemoryHandle segment_rates, size_t segment_count, size_t size,
+    size_t batch_size, float momentum, cl_event *ev_to_wait_for,
+    opencl::MemoryHandle loss_scaling) {
+  check_initialized(DataPipeline::LOAD_KERNEL_BACKPROPAGATE);
+  utils::require(batch_size > 0, "Batch cannot be empty");
+  utils::require(element_count(parameters, sizeof(cl_float)) >= size &&
+                     element_count(gradients, sizeof(cl_float)) >= size &&
+                     element_count(previous_deltas, sizeof(cl_float)) >= size,
+                 "Packed parameter buffers are too small");
+  utils::require(
+      element_count(segment_ranges, sizeof(cl_uint)) >= 2 * segment_count &&
+          element_count(segment_rates, sizeof(cl_float)) >= 2 * segment_count,
+      "Segment buffers are too small");
+
+  // args
+  bool scaled = loss_scaling != gpu_nullptr;
+  auto kernel = scaled ? _update_packed_scaled_kernel  //
+                       : _update_packed_parameters_kernel;
+  kernel->push_arg(parameters);
+  kernel->push_arg(gradients);
+  kernel->push_arg(previous_deltas);
+  kernel->push_arg(segment_ranges);
+  kernel->push_arg(segment_rates);
+  kernel->push_arg(sizeof(cl_uint), (void *)&segment_count);
+  kernel->push_arg(sizeof(cl_float), (void *)&momentum);
+  kernel->push_arg(sizeof(cl_uint), (void *)&batch_size);
+  kernel->push_arg(sizeof(cl_uint), (void *)&size);
+  if (scaled) kernel->push_arg(loss_scaling);
+
+  // run
+  int events_to_wait_for_count = ev_to_wait_for ? 1 : 0;
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*kernel, 1, &global_work_size, &local_work_size,
+                            &size, print_work_dimensions);
+  return kernel->execute(1, &global_work_size, &local_work_size,
+                         ev_to_wait_for, events_to_wait_for_count);
+}
+
+cl_event DataPipeline::update_packed_parameters_adam(
+    opencl::MemoryHandle parameters, opencl::MemoryHandle gradients,
+    opencl::MemoryHandle first_moments, opencl::MemoryHandle second_moments,
+    opencl::MemoryHandle segment_ranges, opencl::MemoryHandle segment_rates,
+    size_t segment_count, size_t size, size_t batch_size, float beta1,
+    float beta2, float epsilon, size_t step, bool decoupled_decay,
+    cl_event *ev_to_wait_for, opencl::MemoryHandle loss_scaling) {
+  check_initialized(DataPipeline::LOAD_KERNEL_BACKPROPAGATE);
+  utils::require(batch_size > 0, "Batch cannot be empty");
+  utils::require(step > 0 || loss_scaling != gpu_nullptr,
+                 "Adam steps are counted from 1");
+  utils::require(element_count(parameters, sizeof(cl_float)) >= size &&
+                     element_count(gradients, sizeof(cl_float)) >= size &&
+                     element_count(first_moments, sizeof(cl_float)) >= size &&
+                     element_count(second_moments, sizeof(cl_float)) >= size,
+                 "Packed parameter buffers are too small");
+  utils::require(
+      element_count(segment_ranges, sizeof(cl_uint)) >= 2 * segment_count &&
+          element_count(segment_rates, sizeof(cl_float)) >= 2 * segment_count,
+      "Segment buffers are too small");
+
+  // computed in double, beta^step underflows slowly
+  float bias_correction_1 = (float)(1.0 - std::pow((double)beta1, step)),
+        bias_correction_2 = (float)(1.0 - std::pow((double)beta2, step));
+
+  // args
+  bool scaled = loss_scaling != gpu_nullptr;
+  auto kernel = scaled ? _adam_scaled_kernel : _adam_kernel;
+  if (decoupled_decay) kernel = scaled ? _adamw_scaled_kernel : _adamw_kernel;
+  kernel->push_arg(parameters);
+  kernel->push_arg(gradients);
+  kernel->push_arg(first_moments);
+  kernel->push_arg(second_moments);
+  kernel->push_arg(segment_ranges);
+  kernel->push_arg(segment_rates);
+  kernel->push_arg(sizeof(cl_uint), (void *)&segment_count);
+  kernel->push_arg(sizeof(cl_float), (void *)&beta1);
+  kernel->push_arg(sizeof(cl_float), (void *)&beta2);
+  kernel->push_arg(sizeof(cl_float), (void *)&epsilon);
+  kernel->push_arg(sizeof(cl_float), (void *)&bias_correction_1);
+  kernel->push_arg(sizeof(cl_float), (void *)&bias_correction_2);
+  kernel->push_arg(sizeof(cl_uint), (void *)&batch_size);
+  kernel->push_arg(sizeof(cl_uint), (void *)&size);
+  if (scaled) kernel->push_arg(loss_scaling);
+
+  // run
+  int events_to_wait_for_count = ev_to_wait_for ? 1 : 0;
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*kernel, 1, &global_work_size, &local_work_size,
+                            &size, print_work_dimensions);
+  return kernel->execute(1, &global_work_size, &local_work_size,
+                         ev_to_wait_for, events_to_wait_for_count);
+}
+
+cl_event DataPipeline::check_overflow(opencl::MemoryHandle gradients,
+                                      size_t size,
+                                      opencl::MemoryHandle loss_scaling,
+                                      cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_BACKPROPAGATE);
+  utils::require(element_count(gradients, sizeof(cl_float)) >= size,
+                 "Gradients buffer is too small");
+  utils::require(element_count(loss_scaling, sizeof(cl_float)) >=
+                     LOSS_SCALING_STATE_SIZE,
+                 "Loss scaling state is too small");
+
+  // args
+  auto kernel = _check_overflow_kernel;
+  kernel->push_arg(gradients);
+  kernel->push_arg(loss_scaling);
+  kernel->push_arg(sizeof(cl_uint), (void *)&size);
+
+  // run
+  int events_to_wait_for_count = ev_to_wait_for ? 1 : 0;
+  size_t global_work_size, local_work_size;
+  opencl::utils::work_sizes(*kernel, 1, &global_work_size, &local_work_size,
+                            &size, print_work_dimensions);
+  return kernel->execute(1, &global_work_size, &local_work_size,
+                         ev_to_wait_for, events_to_wait_for_count);
+}
+
+cl_event DataPipeline::update_loss_scale(opencl::MemoryHandle loss_scaling,
+                                         size_t growth_interval,
+                                         cl_event *ev_to_wait_for) {
+  check_initialized(DataPipeline::LOAD_KERNEL_BACKPROPAGATE);
+  utils::require(element_count(loss_scaling, sizeof(cl_float)) >=
+                     LOSS_SCALING_STATE_SIZE,
+                 "Loss scaling state is too small");
+  utils::require(growth_interval > 0, "Loss scale growth interval is 0");
+
+  // args
+  auto kernel = _update_loss_scale_kernel;
+  kernel->push_arg(loss_scaling);
+  kernel->push_arg(sizeof(cl_uint), (void *)&growth_interval);
+
+  // run
+  int events_to_wait_for_count = ev_to_wait_for ? 1 : 0;
+  size_t global_work_size = 1, local_work_size = 1;
+  return kernel->execute(1, &global_work_size, &local_work_size,
+                         ev_to_wait_for, events_to_wait_for_count);
+}
+
 // end: namespace cnn_sr
 }
@@ -2,6 +2,7 @@
 #define DATA_PIPELINE_H
 
 #include "pch.hpp"
+#include "DatasetFile.hpp"  // for DatasetStorage
 
 // TODO move this to opencl::Context
 const opencl::MemoryHandle gpu_nullptr = 1 << 30;
@@ -26,6 +27,16 @@ struct LayerAllocationPool {
   /** Backpropagation-momentum: Deltas that we had after previous batch,
       size: f*f*n*k */
   opencl::MemoryHandle previous_batch_delta_b = gpu_nullptr;
+  /** Adam: moving averages of gradient and squared gradient, only allocated
+      if Adam is used. size: same as weights/bias */
+  opencl::MemoryHandle first_moment_w = gpu_nullptr;
+  opencl::MemoryHandle first_moment_b = gpu_nullptr;
+  opencl::MemoryHandle second_moment_w = gpu_nullptr;
+  opencl::MemoryHandle second_moment_b = gpu_nullptr;
+  /** Int8 inference: quantized weights (see QuantizedLayer), size: f*f*n*k */
+  opencl::MemoryHandle int8_weights = gpu_nullptr;
+  /** Int8 inference: input_scale * weight_scale of each filter, size: n */
+  opencl::MemoryHandle int8_scales = gpu_nullptr;
 };
 
 /**
@@ -45,6 +56,9 @@ class DataPipeline {
   static int LOAD_KERNEL_NONE;
   static int LOAD_KERNEL_ALL;
 
+  /** floats in dynamic loss scaling state, see loss_scaling.cl */
+  static const size_t LOSS_SCALING_STATE_SIZE;
+
   DataPipeline(opencl::Context*);
   virtual ~DataPipeline() {}
   virtual void init(int load_flags = DataPipeline::LOAD_KERNEL_ALL);
@@ -52,7 +66,8 @@ class DataPipeline {
 
   /**
    * Take image, write it to GPU (gpu_buf_raw_img), and write luma channel
-   * separately to gpu_buf_luma
+   * separately to gpu_buf_luma. With scale > 1 luma is bicubically upscaled,
+   * so that low resolution image does not have to be pre-scaled on host
    *
    * used buffers:
    * 	in  - NONE
@@ -60,15 +75,20 @@ class DataPipeline {
    * 	      param->gpu_buf_luma(with luma channel of provided image)
    */
   cl_event extract_luma(opencl::utils::ImageData&, opencl::MemoryHandle&,
-                        opencl::MemoryHandle&, bool, cl_event* ev = nullptr);
+                        opencl::MemoryHandle&, bool, cl_event* ev = nullptr,
+                        size_t scale = 1);
 
-  /** Swap luma in image to specified set of values */
+  /**
+   * Swap luma in image to specified set of values. With scale > 1 target is
+   * scale times bigger then the image, chroma is interpolated bicubically
+   * (same as luma in extract_luma)
+   */
   cl_event swap_luma(opencl::utils::ImageData&,
                      opencl::MemoryHandle& gpu_buf_org_img,
                      opencl::MemoryHandle gpu_buf_new_luma,
                      opencl::MemoryHandle& target,  //
                      size_t new_luma_w, size_t new_luma_h,
-                     cl_event* ev = nullptr);
+                     cl_event* ev = nullptr, size_t scale = 1);
 
   /**
    * Forward propagation for single layer.
@@ -77,40 +97,85 @@ class DataPipeline {
    * 	in  - layer.weights, layer.bias, this layer's input(that means previous
    *                                                             layer output)
    * 	out - layer.output
+   *
+   * @param  out_el_size          2 if kernel stores output as half
    */
   cl_event execute_layer(opencl::Kernel&, const LayerData&,
                          cnn_sr::LayerAllocationPool&, opencl::MemoryHandle&,
                          size_t, size_t, size_t id, opencl::MemoryHandle&,
-                         cl_event* ev = nullptr);
+                         cl_event* ev = nullptr,
+                         size_t out_el_size = sizeof(float));
+
+  /**
+   * Int8 version of execute_layer, kernel from create_int8_layer_kernel.
+   * Quantized weights and scales are uploaded on first use.
+   *
+   * used buffers:
+   * 	in  - layer.int8_weights, layer.int8_scales, layer.bias, int8 input
+   * 	out - layer.output (int8, float for last layer)
+   *
+   * @param  output_scale         input_scale of next layer, 0 for last layer
+   */
+  cl_event execute_layer_int8(opencl::Kernel&, const LayerData&,
+                              const QuantizedLayer&, LayerAllocationPool&,
+                              opencl::MemoryHandle input, size_t input_w,
+                              size_t input_h, size_t sample_count,
+                              float output_scale, opencl::MemoryHandle& output,
+                              cl_event* ev = nullptr);
+
+  /**
+   * Symmetric int8 quantization: round(value / scale), saturated to 127.
+   * Target is allocated if needed.
+   */
+  cl_event quantize(opencl::MemoryHandle src, size_t count, float scale,
+                    opencl::MemoryHandle& target, cl_event* ev = nullptr);
 
   /**
    * This function blocks.
    *
    * used buffers:
    * 	in  - orginal image luma, layer_3.output
-   * 	out - this->_tmp_gpu_float
+   * 	out - tmp_buffer (error of each sample, at least sample_count floats)
    *
+   * @param  target               sum of errors of all samples
    * @param  total_padding        difference in size between ground_truth image
    *                              and result. Should be equal to f1+f2+f3-3
    */
   cl_event squared_error(opencl::MemoryHandle gpu_buf_ground_truth,
                          size_t ground_truth_w, size_t ground_truth_h,
-                         size_t id, opencl::MemoryHandle gpu_buf_algo_res,
+                         size_t sample_count,
+                         opencl::MemoryHandle gpu_buf_algo_res,
                          opencl::MemoryHandle tmp_buffer, float& target,
                          size_t total_padding, cl_event* ev = nullptr);
 
+  /**
+   * Same as squared_error, but does not block - error of each sample is only
+   * written to gpu_buf_target.
+   */
+  cl_event squared_error_per_sample(opencl::MemoryHandle gpu_buf_ground_truth,
+                                    size_t ground_truth_w,
+                                    size_t ground_truth_h, size_t sample_count,
+                                    opencl::MemoryHandle gpu_buf_algo_res,
+                                    opencl::MemoryHandle gpu_buf_target,
+                                    size_t total_padding,
+                                    cl_event* ev = nullptr);
+
   /**
    * Deltas last layer
    *
    * used buffers:
    * 	in  - orginal image luma, layer_3.output
    * 	out - param->gpu_buf_target
+   *
+   * @param  loss_scaling         if provided deltas are multiplied by the
+   *                              loss scale (see check_overflow)
    */
   cl_event last_layer_delta(opencl::MemoryHandle gpu_buf_ground_truth,
                             size_t ground_truth_w, size_t ground_truth_h,
                             size_t id, opencl::MemoryHandle gpu_buf_algo_res,
                             opencl::MemoryHandle& gpu_buf_target,
-                            size_t total_padding, cl_event* ev = nullptr);
+                            size_t total_padding, cl_event* ev = nullptr,
+                            opencl::MemoryHandle loss_scaling = gpu_nullptr);
 
   /**
    * Deltas for current layer based on next layer
@@ -118,6 +183,9 @@ class DataPipeline {
    * used buffers:
    * 	in  - next_layer.deltas, curr_layer.output, next_layer.weights
    * 	out - curr_layer.deltas
+   *
+   * @param  activation_el_size   2 if kernel stores curr_layer.output and
+   *                              curr_layer.deltas as half
    */
   cl_event calculate_deltas(opencl::Kernel&,  //
                             const LayerData&, const LayerData&,
@@ -125,7 +193,8 @@ class DataPipeline {
                             opencl::MemoryHandle, opencl::MemoryHandle,  //
                             size_t, size_t, size_t id,                   //
                             opencl::MemoryHandle,                        //
-                            cl_event* ev = nullptr);
+                            cl_event* ev = nullptr,
+                            size_t activation_el_size = sizeof(float));
 
   /**
    * Calculate gradients of weights and bias
@@ -140,6 +209,18 @@ class DataPipeline {
                          size_t layer_out_w, size_t layer_out_h, size_t id,
                          cl_event* ev = nullptr, size_t ev_cnt = 0);
 
+  /**
+   * Same as above, but with kernel created by create_backpropagate_kernel.
+   * @param  input_el_size        2 if kernel reads layer_input as half
+   */
+  cl_event backpropagate(opencl::Kernel&, LayerData&,
+                         opencl::MemoryHandle layer_input,
+                         opencl::MemoryHandle layer_deltas,
+                         LayerAllocationPool&,  //
+                         size_t layer_out_w, size_t layer_out_h, size_t id,
+                         cl_event* ev, size_t ev_cnt,
+                         size_t input_el_size = sizeof(float));
+
   /**
    * Update weights and biases based on gradients and various factors like batch
    * size, momentum, learning rate. Note that we are both using
@@ -155,6 +236,59 @@ class DataPipeline {
                              size_t batch_size, float momentum, float w_decay,
                              float learning_rate, cl_event* ev = nullptr);
 
+  /**
+   * Same as update_parameters, but for parameters of all layers packed into
+   * one buffer with gradients and previous deltas in the same layout. Zeroes
+   * the gradients.
+   *
+   * @param  segment_ranges cl_uint[2] per segment: [begin, end) in floats
+   * @param  segment_rates  cl_float[2] per segment: learning rate, w_decay
+   * @param  size           floats in each of the 3 buffers
+   * @param  loss_scaling   if provided gradients are divided by the loss
+   *                        scale and the update is skipped on overflow
+   */
+  cl_event update_packed_parameters(
+      opencl::MemoryHandle parameters, opencl::MemoryHandle gradients,
+      opencl::MemoryHandle previous_deltas, opencl::MemoryHandle segment_ranges,
+      opencl::MemoryHandle segment_rates, size_t segment_count, size_t size,
+      size_t batch_size, float momentum, cl_event* ev = nullptr,
+      opencl::MemoryHandle loss_scaling = gpu_nullptr);
+
+  /**
+   * Adam step over packed parameters, same layout as in
+   * update_packed_parameters. Zeroes the gradients.
+   *
+   * @param  step             1 for the first update. Ignored with
+   *                          loss_scaling, that counts only applied updates
+   * @param  decoupled_decay  AdamW: apply weight decay to parameters directly
+   *                          instead of adding it to the gradient
+   */
+  cl_event update_packed_parameters_adam(
+      opencl::MemoryHandle parameters, opencl::MemoryHandle gradients,
+      opencl::MemoryHandle first_moments, opencl::MemoryHandle second_moments,
+      opencl::MemoryHandle segment_ranges, opencl::MemoryHandle segment_rates,
+      size_t segment_count, size_t size, size_t batch_size, float beta1,
+      float beta2, float epsilon, size_t step, bool decoupled_decay,
+      cl_event* ev = nullptr, opencl::MemoryHandle loss_scaling = gpu_nullptr);
+
+  ///
+  /// dynamic loss scaling. State is cl_float[5]: loss scale, updates since
+  /// last overflow, overflow flag, skipped updates, applied updates (see
+  /// loss_scaling.cl)
+  ///
+
+  /** Raise overflow flag if any of first size gradients is inf or nan */
+  cl_event check_overflow(opencl::MemoryHandle gradients, size_t size,
+                          opencl::MemoryHandle loss_scaling,
+                          cl_event* ev = nullptr);
+
+  /**
+   * Call after the optimizer. Halve the scale on overflow, double it after
+   * growth_interval updates without one. Clears overflow flag.
+   */
+  cl_event update_loss_scale(opencl::MemoryHandle loss_scaling,
+                             size_t growth_interval, cl_event* ev = nullptr);
+
   ///
   /// misc. kernels
   ///
@@ -174,12 +308,126 @@ class DataPipeline {
   cl_event subtract_from_all(opencl::MemoryHandle, float,
                              cl_event* ev = nullptr);
 
+  /**
+   * Gather samples from arenas into contiguous mini-batch buffers. Sample in
+   * slot s occupies elements [s*px_count, (s+1)*px_count) of both arenas.
+   * Compact storages (uint8, float16) are expanded to float, for uint8 the
+   * per slot input mean is subtracted.
+   *
+   * @param slots           cl_uint arena slot for each sample of the
+   *                        mini-batch
+   * @param expected_scale  expected sample is expected_scale times bigger in
+   *                        each dimension then input sample
+   */
+  cl_event gather_samples(opencl::MemoryHandle input_arena,
+                          opencl::MemoryHandle expected_arena,
+                          opencl::MemoryHandle input_means, DatasetStorage,
+                          opencl::MemoryHandle slots, size_t sample_count,
+                          size_t px_count, opencl::MemoryHandle input_target,
+                          opencl::MemoryHandle expected_target,
+                          cl_event* ev = nullptr, size_t expected_scale = 1);
+
+  /**
+   * Sub-pixel convolution: layer output of size w*h with r*r channels becomes
+   * single channel image of size (w*r)*(h*r), see pixel_shuffle.cl
+   */
+  cl_event pixel_shuffle(opencl::MemoryHandle src, size_t w, size_t h,
+                         size_t sample_count, size_t r,
+                         opencl::MemoryHandle target, cl_event* ev = nullptr);
+
+  /** Inverse of pixel_shuffle, brings deltas back to layer layout */
+  cl_event pixel_unshuffle(opencl::MemoryHandle src, size_t w, size_t h,
+                           size_t sample_count, size_t r,
+                           opencl::MemoryHandle target,
+                           cl_event* ev = nullptr);
+
+  ///
+  /// augmentation kernels. All images are square, stored one after another
+  ///
+
+  /**
+   * Cut crops out of source images (uint8 luma) and normalize them.
+   * @param crops  cl_uint[4] per sample: source offset, source width, x, y
+   */
+  cl_event crop_samples(opencl::MemoryHandle source, opencl::MemoryHandle crops,
+                        size_t sample_count, size_t size,
+                        opencl::MemoryHandle target, cl_event* ev = nullptr);
+
+  /** Box filter downscale from size*size to small_size*small_size */
+  cl_event downscale(opencl::MemoryHandle src, size_t sample_count,
+                     size_t size, size_t small_size,
+                     opencl::MemoryHandle target, cl_event* ev = nullptr);
+
+  /** Bicubic upscale from small_size*small_size to size*size */
+  cl_event upscale_bicubic(opencl::MemoryHandle src, size_t sample_count,
+                           size_t small_size, size_t size,
+                           opencl::MemoryHandle target, cl_event* ev = nullptr);
+
+  /** Subtract mean of each sample from its values, means are written out */
+  cl_event subtract_sample_means(opencl::MemoryHandle data, size_t sample_count,
+                                 size_t px_count, opencl::MemoryHandle means,
+                                 cl_event* ev = nullptr);
+
+  ///
+  /// loss based sampling. Losses are indexed by arena slot
+  ///
+
+  /** sample_losses[slots[i]] = batch_losses[i] */
+  cl_event scatter_losses(opencl::MemoryHandle batch_losses,
+                          opencl::MemoryHandle slots, size_t sample_count,
+                          opencl::MemoryHandle sample_losses,
+                          cl_event* ev = nullptr);
+
+  /** target[i] = sample_losses[slots[i]] */
+  cl_event gather_losses(opencl::MemoryHandle sample_losses,
+                         opencl::MemoryHandle slots, size_t count,
+                         opencl::MemoryHandle target, cl_event* ev = nullptr);
+
+  /** Inclusive prefix sum of first count losses */
+  cl_event loss_prefix_sum(opencl::MemoryHandle losses, size_t count,
+                           opencl::MemoryHandle cdf, cl_event* ev = nullptr);
+
+  /**
+   * Draw draw_count slots from [0, count). Fraction loss_fraction of draws
+   * is proportional to loss, rest is uniform.
+   * @param uniforms  draw_count random floats in [0, 1)
+   */
+  cl_event draw_by_loss(opencl::MemoryHandle cdf, size_t count,
+                        opencl::MemoryHandle uniforms, size_t draw_count,
+                        float loss_fraction, opencl::MemoryHandle target,
+                        cl_event* ev = nullptr);
+
   ///
   /// kernel creation - ones that are not created during standard init
   ///
-  /** @param  skip_relu:bool skip relu step, writing raw result */
-  opencl::Kernel* create_layer_kernel(const LayerData&, bool);
-  opencl::Kernel* create_deltas_kernel(const LayerData&);
+  /**
+   * @param  skip_relu:bool skip relu step, writing raw result
+   * @param  half_input     input is stored as half
+   * @param  half_output    output is stored as half
+   */
+  opencl::Kernel* create_layer_kernel(const LayerData&, bool,
+                                      bool half_input = false,
+                                      bool half_output = false);
+  /**
+   * @param  half_activations  layer output and created deltas are half
+   * @param  half_next_deltas  deltas of next layer are half
+   * @param  half_math         compute in half (needs cl_khr_fp16)
+   * @param  skip_relu         layer is linear, activation derivative is 1
+   */
+  opencl::Kernel* create_deltas_kernel(const LayerData&,
+                                       bool half_activations = false,
+                                       bool half_next_deltas = false,
+                                       bool half_math = false,
+                                       bool skip_relu = false);
+  opencl::Kernel* create_backpropagate_kernel(bool half_deltas,
+                                              bool half_input,
+                                              bool half_math = false);
+  /**
+   * @param  last_layer:bool skip relu and write float result
+   * @param  skip_relu:bool  skip relu, but still write int8 (linear layer)
+   */
+  opencl::Kernel* create_int8_layer_kernel(const LayerData&, bool last_layer,
+                                           bool skip_relu = false);
 
   ///
   /// misc
@@ -213,12 +461,36 @@ class DataPipeline {
   opencl::Kernel* _luma_kernel_raw = nullptr;
   opencl::Kernel* _swap_luma_kernel = nullptr;
   opencl::Kernel* _squared_error_kernel = nullptr;
+  opencl::Kernel* _clear_squared_error_kernel = nullptr;
   opencl::Kernel* _sum_kernel = nullptr;
   opencl::Kernel* _sum_squared_kernel = nullptr;
   opencl::Kernel* _subtract_from_all_kernel = nullptr;
+  opencl::Kernel* _gather_samples_kernel = nullptr;
+  opencl::Kernel* _gather_samples_u8_kernel = nullptr;
+  opencl::Kernel* _gather_samples_f16_kernel = nullptr;
+  opencl::Kernel* _crop_kernel = nullptr;
+  opencl::Kernel* _downscale_kernel = nullptr;
+  opencl::Kernel* _upscale_bicubic_kernel = nullptr;
+  opencl::Kernel* _subtract_sample_mean_kernel = nullptr;
+  opencl::Kernel* _scatter_losses_kernel = nullptr;
+  opencl::Kernel* _gather_losses_kernel = nullptr;
+  opencl::Kernel* _loss_prefix_sum_kernel = nullptr;
+  opencl::Kernel* _draw_by_loss_kernel = nullptr;
   opencl::Kernel* _last_layer_delta_kernel = nullptr;
+  opencl::Kernel* _last_layer_delta_scaled_kernel = nullptr;
   opencl::Kernel* _update_parameters_kernel = nullptr;
+  opencl::Kernel* _update_packed_parameters_kernel = nullptr;
+  opencl::Kernel* _adam_kernel = nullptr;
+  opencl::Kernel* _adamw_kernel = nullptr;
+  opencl::Kernel* _update_packed_scaled_kernel = nullptr;
+  opencl::Kernel* _adam_scaled_kernel = nullptr;
+  opencl::Kernel* _adamw_scaled_kernel = nullptr;
+  opencl::Kernel* _check_overflow_kernel = nullptr;
+  opencl::Kernel* _update_loss_scale_kernel = nullptr;
   opencl::Kernel* _backpropagate_kernel = nullptr;
+  opencl::Kernel* _quantize_kernel = nullptr;
+  opencl::Kernel* _pixel_shuffle_kernel = nullptr;
+  opencl::Kernel* _pixel_unshuffle_kernel = nullptr;
 };
 }
 
@@ -0,0 +1,219 @@
+#include "DatasetFile.hpp"
+
+#include <cmath>    // std::round
+#include <cstring>  // memcpy, memcmp
+#include <fstream>
+#include <ios>  // std::ios_base::failure
+
+#include "opencl\UtilsOpenCL.hpp"
+
+namespace cnn_sr {
+
+const unsigned int DatasetFile::VERSION = 1;
+
+const char* const dataset_magic = "CNNSRDAT";
+const size_t dataset_magic_size = 8;
+const size_t dataset_header_size = dataset_magic_size + 4 * 4;
+const size_t index_entry_size = 4 * 4 + 8 + 8;
+
+///
+/// Helpers. NOTE: we assume the host is little endian
+///
+template <typename T>
+void put_value(std::vector<char>& buf, T value) {
+  const char* ptr = (const char*)&value;
+  buf.insert(buf.end(), ptr, ptr + sizeof(T));
+}
+
+template <typename T>
+T get_value(const char* ptr) {
+  T value;
+  memcpy(&value, ptr, sizeof(T));
+  return value;
+}
+
+size_t blob_size(size_t count, DatasetStorage storage) {
+  size_t el_size = storage_element_size(storage);
+  return (count * el_size + 3) & ~(size_t)3;  // 4 byte aligned
+}
+
+void put_luma(std::vector<char>& buf, const std::vector<float>& values,
+              float mean, DatasetStorage storage) {
+  size_t start = buf.size();
+  encode_luma(buf, &values[0], values.size(), mean, storage);
+  buf.resize(start + blob_size(values.size(), storage), 0);
+}
+
+///
+/// Storage
+///
+size_t storage_element_size(DatasetStorage storage) {
+  return storage == DatasetStorage::Float32
+             ? 4
+             : storage == DatasetStorage::Float16 ? 2 : 1;
+}
+
+DatasetStorage parse_storage(const std::string& name) {
+  if (name == "float16") return DatasetStorage::Float16;
+  if (name == "uint8") return DatasetStorage::UInt8;
+  utils::require(name == "float32",
+                 "Storage should be one of: float32, float16, uint8");
+  return DatasetStorage::Float32;
+}
+
+void encode_luma(std::vector<char>& buf, const float* values, size_t count,
+                 float mean, DatasetStorage storage) {
+  for (size_t i = 0; i < count; i++) {
+    float v = values[i];
+    if (storage == DatasetStorage::Float32) {
+      put_value<float>(buf, v);
+    } else if (storage == DatasetStorage::Float16) {
+      put_value<unsigned short>(buf, utils::float_to_half(v));
+    } else {
+      float raw = std::round((v + mean) * 255.0f);
+      raw = raw < 0.0f ? 0.0f : raw > 255.0f ? 255.0f : raw;
+      put_value<unsigned char>(buf, (unsigned char)raw);
+    }
+  }
+}
+
+///
+/// Host side preparation
+///
+void extract_luma(const unsigned char* rgba, size_t px_count, float* target,
+                  bool normalize) {
+  // same coefficients as in extract_luma.cl
+  for (size_t i = 0; i < px_count; i++) {
+    const unsigned char* px = rgba + i * 4;
+    float luma = px[0] * 0.299f + px[1] * 0.587f + px[2] * 0.114f;
+    target[i] = normalize ? luma / 255.0f : luma;
+  }
+}
+
+void load_luma(const char* const path, size_t& w, size_t& h,
+               std::vector<float>& target) {
+  opencl::utils::ImageData img;
+  opencl::utils::load_image(path, img);
+  if (!img.data) throw IOException("Could not read image: " + std::string(path));
+  w = (size_t)img.w;
+  h = (size_t)img.h;
+  target.resize(w * h);
+  extract_luma(img.data, w * h, &target[0]);
+}
+
+void prepare_host_sample(const TrainSampleFiles& files, HostSample& sample) {
+  size_t w, h;
+  load_luma(files.first.c_str(), w, h, sample.expected_luma);
+  load_luma(files.second.c_str(), sample.w, sample.h, sample.input_luma);
+  if (w != sample.w || h != sample.h)
+    throw IOException("Images of the sample have different sizes: " +
+                      files.second);
+
+  double sum = 0.0;
+  for (float v : sample.input_luma) sum += v;
+  sample.input_mean = (float)(sum / sample.input_luma.size());
+  for (float& v : sample.input_luma) v -= sample.input_mean;
+}
+
+///
+/// DatasetFile
+///
+bool DatasetFile::is_dataset(const char* const path) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[dataset_magic_size];
+  if (!file.read(magic, dataset_magic_size)) return false;
+  return memcmp(magic, dataset_magic, dataset_magic_size) == 0;
+}
+
+void DatasetFile::write(const char* const path,
+                        const std::vector<HostSample>& samples,
+                        DatasetStorage storage) {
+  // header
+  std::vector<char> data;
+  data.insert(data.end(), dataset_magic, dataset_magic + dataset_magic_size);
+  put_value<unsigned int>(data, VERSION);
+  put_value<unsigned int>(data, (unsigned int)storage);
+  put_value<unsigned int>(data, samples.size());
+  put_value<unsigned int>(data, 0);
+
+  // index
+  unsigned long long offset =
+      dataset_header_size + index_entry_size * samples.size();
+  for (auto& sample : samples) {
+    size_t blob = blob_size(sample.w * sample.h, storage);
+    put_value<unsigned int>(data, sample.w);
+    put_value<unsigned int>(data, sample.h);
+    put_value<float>(data, sample.input_mean);
+    put_value<unsigned int>(data, 0);
+    put_value<unsigned long long>(data, offset);
+    put_value<unsigned long long>(data, offset + blob);
+    offset += 2 * blob;
+  }
+
+  // blobs
+  for (auto& sample : samples) {
+    put_luma(data, sample.input_luma, sample.input_mean, storage);
+    put_luma(data, sample.expected_luma, 0.0f, storage);
+  }
+
+  utils::write_file_atomic(path, data.data(), data.size());
+}
+
+DatasetFile::DatasetFile(const char* const path) : _file(path) {
+  const char* data = _file.data();
+  if (_file.size() < dataset_header_size ||
+      memcmp(data, dataset_magic, dataset_magic_size) != 0)
+    throw IOException("Not a packed dataset file");
+  auto version = get_value<unsigned int>(data + 8);
+  if (version > VERSION)
+    throw IOException("Dataset file was written by newer version");
+  _storage = (DatasetStorage)get_value<unsigned int>(data + 12);
+  size_t sample_count = get_value<unsigned int>(data + 16);
+  if (_file.size() < dataset_header_size + index_entry_size * sample_count)
+    throw IOException("Dataset file is truncated");
+
+  _index.resize(sample_count);
+  for (size_t i = 0; i < sample_count; i++) {
+    const char* ptr = data + dataset_header_size + i * index_entry_size;
+    IndexEntry& e = _index[i];
+    e.w = get_value<unsigned int>(ptr);
+    e.h = get_value<unsigned int>(ptr + 4);
+    e.input_mean = get_value<float>(ptr + 8);
+    e.input_offset = (size_t)get_value<unsigned long long>(ptr + 16);
+    e.expected_offset = (size_t)get_value<unsigned long long>(ptr + 24);
+    size_t blob = blob_size(e.w * e.h, _storage);
+    if (e.input_offset + blob > _file.size() ||
+        e.expected_offset + blob > _file.size())
+      throw IOException("Dataset file is truncated");
+  }
+}
+
+const float* DatasetFile::input_luma(size_t i, float* decode_buffer) const {
+  auto& e = _index[i];
+  return decode(e.input_offset, e.w * e.h, e.input_mean, decode_buffer);
+}
+
+const float* DatasetFile::expected_luma(size_t i, float* decode_buffer) const {
+  auto& e = _index[i];
+  return decode(e.expected_offset, e.w * e.h, 0.0f, decode_buffer);
+}
+
+const float* DatasetFile::decode(size_t offset, size_t count, float mean,
+                                 float* decode_buffer) const {
+  const char* src = _file.data() + offset;
+  switch (_storage) {
+    case DatasetStorage::Float32:
+      return (const float*)src;  // blobs are 4 byte aligned
+    case DatasetStorage::Float16:
+      for (size_t i = 0; i < count; i++)
+        decode_buffer[i] =
+            utils::half_to_float(get_value<unsigned short>(src + i * 2));
+      return decode_buffer;
+    case DatasetStorage::UInt8:
+      for (size_t i = 0; i < count; i++)
+        decode_buffer[i] = ((unsigned char)src[i]) / 255.0f - mean;
+      return decode_buffer;
+  }
+  throw IOException("Unknown dataset storage");
+}
+}
@@ -0,0 +1,116 @@
+#ifndef DATASET_FILE_H
+#define DATASET_FILE_H
+
+#include "pch.hpp"
+
+namespace cnn_sr {
+
+/* clang-format off */
+/**
+ * Packed training samples. Images are decoded, converted to luma and (for
+ * input) mean subtracted once, during 'cnn pack'. Training can then map the
+ * file and upload samples as they are. All values are little endian.
+ *
+ *  file    := header, index_entry[sample_count], blob*
+ *  header  := magic:char[8]="CNNSRDAT", version:u32, storage:u32 (see DatasetStorage),
+ *             sample_count:u32, reserved:u32
+ *  index_entry := w:u32, h:u32, input_mean:f32, reserved:u32,
+ *                 input_offset:u64, expected_offset:u64 (offsets from file start)
+ *
+ * Each blob holds w*h luma values, is 4 byte aligned. Depending on storage:
+ *  Float32 - final float values
+ *  Float16 - final values as IEEE 754 half
+ *  UInt8   - round(luma * 255) before normalization/mean subtraction, to get
+ *            input: v / 255 - input_mean, expected: v / 255
+ */
+/* clang-format on */
+enum class DatasetStorage : unsigned int { Float32 = 0, Float16 = 1, UInt8 = 2 };
+
+/** Pair of images: first is ground truth ('_large'), second is input */
+typedef std::pair<std::string, std::string> TrainSampleFiles;
+
+/** Luma of single training sample prepared on host */
+struct HostSample {
+  size_t w = 0, h = 0;
+  float input_mean = 0.0f;
+  /** normalized (0..1), mean subtracted */
+  std::vector<float> input_luma;
+  /** normalized (0..1) */
+  std::vector<float> expected_luma;
+};
+
+/**
+ * Same as DataPipeline::extract_luma, but on host
+ * @param rgba      4 bytes per pixel
+ * @param normalize divide by 255
+ */
+void extract_luma(const unsigned char* rgba, size_t px_count, float* target,
+                  bool normalize = true);
+
+/**
+ * Append luma values to the buffer in provided storage (no padding). For
+ * uint8 the mean is added back before quantization.
+ */
+void encode_luma(std::vector<char>&, const float* values, size_t count,
+                 float mean, DatasetStorage);
+
+/** 'float32', 'float16' or 'uint8', throws on other values */
+DatasetStorage parse_storage(const std::string&);
+
+/** Bytes per luma value */
+size_t storage_element_size(DatasetStorage);
+
+/** Decode image and extract normalized luma */
+void load_luma(const char* const path, size_t& w, size_t& h,
+               std::vector<float>& target);
+
+/**
+ * Decode both images, extract luma and subtract mean from input luma
+ * @throws IOException if images could not be read or have different sizes
+ */
+void prepare_host_sample(const TrainSampleFiles&, HostSample&);
+
+class DatasetFile {
+ public:
+  static const unsigned int VERSION;
+
+  /** Check if the file starts with dataset magic */
+  static bool is_dataset(const char* const);
+
+  static void write(const char* const, const std::vector<HostSample>&,
+                    DatasetStorage);
+
+  /** Memory map the dataset. @throws IOException on invalid file */
+  DatasetFile(const char* const);
+
+  inline size_t size() const { return _index.size(); }
+  inline DatasetStorage storage() const { return _storage; }
+  inline size_t width(size_t i) const { return _index[i].w; }
+  inline size_t height(size_t i) const { return _index[i].h; }
+  inline float input_mean(size_t i) const { return _index[i].input_mean; }
+
+  /**
+   * Get luma values of the sample. For float32 storage returns pointer
+   * directly into mapped file (valid as long as this object lives), otherwise
+   * decodes into provided buffer of size w*h and returns it.
+   */
+  const float* input_luma(size_t, float* decode_buffer) const;
+  const float* expected_luma(size_t, float* decode_buffer) const;
+
+ private:
+  struct IndexEntry {
+    size_t w, h;
+    float input_mean;
+    size_t input_offset, expected_offset;
+  };
+
+  const float* decode(size_t offset, size_t count, float mean,
+                      float* decode_buffer) const;
+
+  utils::MappedFile _file;
+  DatasetStorage _storage;
+  std::vector<IndexEntry> _index;
+};
+}
+
+#endif /* DATASET_FILE_H   */
@@ -1,6 +1,7 @@
 #include "LayerData.hpp"
 
-// #include <algorithm>  // for std::copy
+#include <algorithm>  // for std::copy, std::max
+#include <cmath>      // for std::abs, std::round
 #include <cstdio>     // snprintf
 #include <stdexcept>  // std::runtime_error
 
@@ -70,6 +71,45 @@ size_t LayerData::input_size(size_t input_w, size_t input_h) const {
   return input_w * input_h * n_prev_filter_cnt;
 }
 
+///
+/// QuantizedLayer
+///
+
+void QuantizedLayer::compute_weight_scales(const LayerData& data) {
+  LayerData::validate(data);
+  size_t n_cnt = data.current_filter_count;
+  weight_scales.assign(n_cnt, 0.0f);
+  // float layout: [dy][dx][k][n]
+  for (size_t i = 0; i < data.weight_size(); i++) {
+    float& scale = weight_scales[i % n_cnt];
+    scale = std::max(scale, std::abs(data.weights[i]));
+  }
+  for (auto& scale : weight_scales) {
+    scale = scale > 0.0f ? scale / 127 : 1.0f;
+  }
+}
+
+void QuantizedLayer::quantize_weights(const LayerData& data) {
+  LayerData::validate(data);
+  if (weight_scales.size() != data.current_filter_count) {
+    throw std::runtime_error(
+        "Int8 weight scales do not match layer's filter count");
+  }
+
+  size_t f = data.f_spatial_size, k_cnt = data.n_prev_filter_cnt,
+         n_cnt = data.current_filter_count;
+  weights.resize(data.weight_size());
+  for (size_t dy = 0; dy < f; dy++)
+    for (size_t dx = 0; dx < f; dx++)
+      for (size_t k = 0; k < k_cnt; k++)
+        for (size_t n = 0; n < n_cnt; n++) {
+          float w = data.weights[((dy * f + dx) * k_cnt + k) * n_cnt + n];
+          float q = std::round(w / weight_scales[n]);
+          q = std::min(127.0f, std::max(-127.0f, q));
+          weights[((n * f + dy) * f + dx) * k_cnt + k] = (signed char)q;
+        }
+}
+
 // namespace cnn_sr
 }
 
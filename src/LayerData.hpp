@@ -57,6 +57,31 @@ struct LayerData {
   /** stale */
   std::vector<float> bias;
 };
+
+/**
+ * Int8 version of the layer used for inference. Weights are quantized
+ * symmetrically with one scale per filter, layer input with single scale
+ * that comes from calibration (largest absolute value seen / 127).
+ */
+struct QuantizedLayer {
+  /** real input value = input_scale * int8 value, 0 if not calibrated */
+  float input_scale = 0.0f;
+  /** real weight of filter n = weight_scales[n] * int8 value */
+  std::vector<float> weight_scales;
+  /**
+   * Each filter is contiguous, index:
+   *   ((n * f_spatial_size + dy) * f_spatial_size + dx) * n_prev_filter_cnt + k
+   */
+  std::vector<signed char> weights;
+
+  inline bool calibrated() const { return input_scale > 0.0f; }
+
+  /** Scales from largest absolute weight of each filter */
+  void compute_weight_scales(const LayerData&);
+
+  /** Quantize float weights of the layer with current weight_scales */
+  void quantize_weights(const LayerData&);
+};
 }
 
 std::ostream& operator<<(std::ostream&, const cnn_sr::LayerData&);
@@ -1,14 +1,26 @@
 #include <iostream>
-#include <algorithm>  // for random_shuffle
+#include <algorithm>  // for std::shuffle, std::sort
+#include <random>     // for std::mt19937
+#include <sstream>    // for serializing random engine
 #include <stdexcept>  // for runtime_exception
 #include <ctime>      // random seed
 #include <utility>    // for std::pair
 #include <cmath>      // for std::isnan
+#include <chrono>     // for checkpoint interval
+#include <memory>     // for std::unique_ptr
+#include <limits>     // for std::numeric_limits
+#include <numeric>    // for std::iota
+#include <cstring>    // for memcpy
 #include <unordered_map>
 
 #include "Config.hpp"
 #include "LayerData.hpp"
 #include "ConfigBasedDataPipeline.hpp"
+#include "CheckpointWriter.hpp"
+#include "DatasetFile.hpp"
+#include "SampleStream.hpp"
+#include "SampleCache.hpp"
+#include "SampleAugmenter.hpp"
 #include "pch.hpp"
 #include "opencl\Context.hpp"
 #include "opencl\UtilsOpenCL.hpp"
@@ -21,18 +33,55 @@ using namespace cnn_sr;
 ///
 cl_event prepare_image(DataPipeline* const pipeline, const char* const,
                        ImageData&, opencl::MemoryHandle&, opencl::MemoryHandle&,
-                       bool print = false);
+                       bool print = false, size_t scale = 1);
 
-void divide_samples(size_t validation_set_size, GpuAllocationPool&,
+void divide_samples(size_t validation_set_size, size_t shuffle_block,
+                    GpuAllocationPool&, std::vector<size_t>& sample_order,
+                    std::mt19937& generator,
                     std::vector<SampleAllocationPool*>& train_set,
                     std::vector<SampleAllocationPool*>& validation_set);
 
-typedef std::pair<std::string, std::string> TrainSampleFiles;
+void shuffle_blocks(std::vector<size_t>& sample_order, size_t block_size,
+                    std::mt19937& generator);
+
+void restore_training_state(TrainingState&, GpuAllocationPool&,
+                            std::vector<size_t>& sample_order,
+                            std::mt19937& generator, SampleStream*);
+
+void store_training_state(TrainingState&, GpuAllocationPool&,
+                          std::vector<size_t>& sample_order,
+                          std::mt19937& generator, SampleStream*);
 
 void get_training_samples(std::string, std::vector<TrainSampleFiles>&);
 
+void prepare_host_samples(const char* const samples_dir,
+                          std::vector<HostSample>&);
+
+void upload_sample(opencl::Context&, SampleArena&, size_t slot,
+                   const float* input, const float* expected, float input_mean,
+                   std::vector<char>& encoded);
+
+void load_samples(opencl::Context&, const char* const samples_dir,
+                  GpuAllocationPool&, DatasetStorage);
+
+void load_packed_samples(opencl::Context&, const char* const dataset_path,
+                         GpuAllocationPool&, DatasetStorage,
+                         size_t max_count = 0);
+
+SampleCache* load_cached_samples(opencl::Context&, const char* const in_path,
+                                 GpuAllocationPool&, size_t budget_bytes);
+
+void pack_samples(const char* const samples_dir, const char* const out_path,
+                  const char* const storage);
+
+size_t parse_duration(const char* const);
+
 void execute_forward(ConfigBasedDataPipeline&, GpuAllocationPool&,
-                     const char* const in_path, const char* const out_path);
+                     const char* const in_path, const char* const out_path,
+                     bool int8, size_t pre_scale);
+
+void calibrate_int8(ConfigBasedDataPipeline&, GpuAllocationPool&,
+                    const char* const samples_dir, const char* const out_path);
 
 ///
 /// main
@@ -45,11 +94,28 @@ int main(int argc, char** argv) {
   argparse.add_argument("train").help("Train mode");
   argparse.add_argument("dry").help("Do not store result");
   argparse.add_argument("profile").help("Print kernel execution times");
-  argparse.add_argument("-c", "--config").required().help("CNN configuration");
+  argparse.add_argument("pack").help("Pack samples directory into single dataset file");
+  argparse.add_argument("calibrate").help("Calibrate int8 inference on samples directory, write parameters with int8 scales");
+  argparse.add_argument("-c", "--config").help("CNN configuration, required unless packing");
   // argparse.add_argument("-p", "--parameters-file").help("Override parameters file provided in config");
-  argparse.add_argument("-i", "--in").required().help("Image during forward, samples directory during training");
+  argparse.add_argument("-i", "--in").required().help("Image during forward, samples directory or packed dataset during training");
   argparse.add_argument("-o", "--out").help("Output file path (either result image or new parameters)");
   argparse.add_argument("-e", "--epochs").help("Number of epochs during training");
+  argparse.add_argument("-d", "--duration").help("Training time budget: X[s|m|h|d|w], can be combined with --epochs");
+  argparse.add_argument("--checkpoint-epochs").help("Write checkpoint every N epochs during training");
+  argparse.add_argument("--checkpoint-minutes").help("Write checkpoint every M minutes during training");
+  argparse.add_argument("--crop-size").help("Train on random N*N crops of source images from -i directory, new crops every epoch");
+  argparse.add_argument("--degrade-factor").help("With --crop-size: input is crop downscaled by this factor and upscaled back (default: 2, ignored if upscale_factor > 1)");
+  argparse.add_argument("--mini-batch").help("Update parameters after every mini-batch of N samples instead of once per epoch");
+  argparse.add_argument("--accumulate-steps").help("With --mini-batch: accumulate gradients of K mini-batches per update (default: 1)");
+  argparse.add_argument("--loss-sampling").help("Draw this fraction of training samples in proportion to their last error, rest uniformly");
+  argparse.add_argument("--shuffle-block").help("Shuffle blocks of N consecutive samples instead of single samples. Mini-batches then need no copy");
+  argparse.add_argument("--shard-size").help("Stream packed dataset in shards of N samples instead of keeping all on gpu");
+  argparse.add_argument("--cache-mb").help("Keep only M megabytes of samples on gpu, rest in pinned host memory");
+  argparse.add_argument("--pack-storage").help("Pack: float32 (default), float16 or uint8");
+  argparse.add_argument("--sample-storage").help("Keep samples on gpu as float32 (default), float16 or uint8");
+  argparse.add_argument("--scale").help("Forward: bicubically upscale input image on gpu by this factor before layer 1 (default: 1)");
+  argparse.add_argument("--int8").help("Forward: use int8 layers (requires calibrated parameters) and report PSNR against float result");
   /* clang-format on */
 
   if (!argparse.parse(argc, argv)) {
@@ -59,18 +125,59 @@ int main(int argc, char** argv) {
   bool train = argparse.has_arg("train");
   bool dry = argparse.has_arg("dry");
   bool profile = argparse.has_arg("profile");
+  bool calibrate = argparse.has_arg("calibrate");
+  bool int8 = argparse.has_arg("int8");
   auto config_path = argparse.value("config");
   // auto pars_file_path = argparse.value("parameters-file");
   auto in_path = argparse.value("in");
   auto out_path = dry ? nullptr : argparse.value("out");
-  size_t epochs;
+  size_t epochs = 0, checkpoint_epochs = 0, checkpoint_minutes = 0,
+         shard_size = 0, cache_mb = 0, shuffle_block = 0, crop_size = 0,
+         sgd_mini_batch = 0, accumulate_steps = 1, pre_scale = 1;
+  argparse.value("mini-batch", sgd_mini_batch);
+  argparse.value("accumulate-steps", accumulate_steps);
+  argparse.value("crop-size", crop_size);
+  argparse.value("scale", pre_scale);
+  auto degrade_factor_arg = argparse.value("degrade-factor");
+  float degrade_factor =
+      degrade_factor_arg ? std::stof(degrade_factor_arg) : 2.0f;
+  auto loss_sampling_arg = argparse.value("loss-sampling");
+  float loss_sampling = loss_sampling_arg ? std::stof(loss_sampling_arg) : 0.0f;
+  argparse.value("shard-size", shard_size);
+  argparse.value("shuffle-block", shuffle_block);
+  argparse.value("cache-mb", cache_mb);
   argparse.value("epochs", epochs);
+  auto duration_arg = argparse.value("duration");
+  size_t duration_s = duration_arg ? parse_duration(duration_arg) : 0;
+  argparse.value("checkpoint-epochs", checkpoint_epochs);
+  argparse.value("checkpoint-minutes", checkpoint_minutes);
+  auto sample_storage_arg = argparse.value("sample-storage");
+  DatasetStorage sample_storage =
+      parse_storage(sample_storage_arg ? sample_storage_arg : "float32");
 
   if (!dry && !out_path) {
     std::cout << "Either provide out path or do the dry run" << std::endl;
     exit(EXIT_FAILURE);
   }
 
+  if (argparse.has_arg("pack")) {
+    if (out_path)
+      pack_samples(in_path, out_path, argparse.value("pack-storage"));
+    exit(EXIT_SUCCESS);
+  }
+
+  if (!config_path) {
+    std::cout << "Config file is required" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (train && epochs == 0 && duration_s == 0) {
+    std::cout << "Provide number of epochs and/or duration of the training"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (epochs == 0) epochs = std::numeric_limits<size_t>::max();
+
   if (profile) {
     std::cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!" << std::endl
               << "!!! RUNNING IN PROFILING MODE !!!" << std::endl
@@ -79,11 +186,16 @@ int main(int argc, char** argv) {
 
   // print base info
   if (train) {
-    std::cout << "Training mode, epochs: " << epochs << std::endl
-              << "Training samples directory: " << in_path << std::endl
+    std::cout << "Training mode, epochs: " << epochs
+              << ", duration: " << duration_s << "s" << std::endl
+              << "Training samples: " << in_path << std::endl
+              << "Output: " << (out_path ? out_path : "-") << std::endl;
+  } else if (calibrate) {
+    std::cout << "Int8 calibration mode" << std::endl
+              << "Calibration samples: " << in_path << std::endl
               << "Output: " << (out_path ? out_path : "-") << std::endl;
   } else {
-    std::cout << "Forward mode" << std::endl
+    std::cout << "Forward mode" << (int8 ? " (int8)" : "") << std::endl
               << "Input image: " << in_path << std::endl
               << "Output: " << (out_path ? out_path : "-") << std::endl;
   }
@@ -103,82 +215,230 @@ int main(int argc, char** argv) {
   ConfigBasedDataPipeline data_pipeline(cfg, &context);
   data_pipeline.init(DataPipeline::LOAD_KERNEL_ALL);
   GpuAllocationPool gpu_alloc;
+  gpu_alloc.layers.resize(data_pipeline.layer_count());
+
+  if (calibrate) {
+    utils::require(cfg.upscale_factor == 1,
+                   "Int8 calibration requires upscale_factor 1");
+    calibrate_int8(data_pipeline, gpu_alloc, in_path, out_path);
+    exit(EXIT_SUCCESS);
+  }
 
   if (!train) {
-    execute_forward(data_pipeline, gpu_alloc, in_path, out_path);
+    utils::require(pre_scale > 0, "Scale should be > 0");
+    execute_forward(data_pipeline, gpu_alloc, in_path, out_path, int8,
+                    pre_scale);
     exit(EXIT_SUCCESS);
   }
 
   // training mode:
-  // read training samples
-  std::vector<TrainSampleFiles> train_sample_files;
-  get_training_samples(in_path, train_sample_files);
-  const size_t validation_set_size = (size_t)(train_sample_files.size() *
-                                              validation_set_percent / 100.0f),
-               train_set_size = train_sample_files.size() - validation_set_size;
+  // read training samples. When streaming only the validation samples (first
+  // samples of the dataset, at most 1 shard) stay on gpu
+  std::unique_ptr<SampleStream> sample_stream;
+  std::unique_ptr<SampleCache> sample_cache;
+  std::unique_ptr<SampleAugmenter> sample_augmenter;
+  bool packed = DatasetFile::is_dataset(in_path);
+  // samples on disk have input and ground truth of the same size
+  const char* const upscale_requires_crops =
+      "Training with upscale_factor > 1 requires --crop-size";
+  utils::require(sample_storage == DatasetStorage::Float32 ||
+                     (cache_mb == 0 && shard_size == 0),
+                 "Compact sample storage is not supported with sample cache "
+                 "or streaming");
+  if (crop_size > 0) {
+    utils::require(cache_mb == 0 && shard_size == 0 && !packed &&
+                       sample_storage == DatasetStorage::Float32,
+                   "Augmented samples are generated on gpu, they cannot be "
+                   "packed, cached, streamed or stored compact");
+    sample_augmenter.reset(new SampleAugmenter(&data_pipeline, in_path,
+                                               crop_size, degrade_factor,
+                                               cfg.upscale_factor));
+    sample_augmenter->init_samples(gpu_alloc);
+  } else if (cache_mb > 0) {
+    utils::require(cfg.upscale_factor == 1, upscale_requires_crops);
+    utils::require(shard_size == 0, "Use either sample cache or streaming");
+    sample_cache.reset(load_cached_samples(context, in_path, gpu_alloc,
+                                           cache_mb * 1024 * 1024));
+    data_pipeline.set_sample_cache(sample_cache.get());
+  } else if (packed && shard_size > 0) {
+    utils::require(cfg.upscale_factor == 1, upscale_requires_crops);
+    size_t dataset_size = DatasetFile(in_path).size();
+    size_t validation_count =
+        std::min(shard_size, dataset_size * validation_set_percent / 100);
+    validation_count = std::max(validation_count, (size_t)1);
+    load_packed_samples(context, in_path, gpu_alloc, sample_storage,
+                        validation_count);
+    sample_stream.reset(new SampleStream(&context, in_path, shard_size,
+                                         validation_count));
+  } else if (packed) {
+    utils::require(cfg.upscale_factor == 1, upscale_requires_crops);
+    load_packed_samples(context, in_path, gpu_alloc, sample_storage);
+  } else {
+    utils::require(cfg.upscale_factor == 1, upscale_requires_crops);
+    utils::require(shard_size == 0, "Only packed dataset can be streamed");
+    load_samples(context, in_path, gpu_alloc, sample_storage);
+  }
+  utils::require(!gpu_alloc.samples.empty(), "No training samples found");
+
+  const size_t all_samples_count =
+      gpu_alloc.samples.size() +
+      (sample_stream ? sample_stream->sample_count() : 0);
+  size_t validation_set_size =
+      sample_stream ? gpu_alloc.samples.size()
+                    : (size_t)(gpu_alloc.samples.size() *
+                               validation_set_percent / 100.0f);
+  // only whole blocks go to validation, so that mini-batches stay contiguous
+  if (shuffle_block > 0) {
+    utils::require(!sample_stream, "Streamed shards are shuffled on their own");
+    validation_set_size -= validation_set_size % shuffle_block;
+  }
+  const size_t train_set_size = all_samples_count - validation_set_size;
   if (validation_set_size == 0) {
     std::cout << "[WARNING] Validation set is empty" << std::endl;
   } else {
     std::cout << "validation_set_size: " << validation_set_size << "/"
-              << train_sample_files.size() << " = "
-              << (validation_set_size * 100.0f / train_sample_files.size())
-              << "%" << std::endl;
-  }
-
-  data_pipeline.set_mini_batch_size((train_set_size / mini_batch_count) +
-                                    mini_batch_count);
-
-  // read & prepare images
-  for (auto& path_pair : train_sample_files) {
-    ImageData expected_output_img, input_img;
-    SampleAllocationPool sample_alloc_pool;
-    prepare_image(&data_pipeline, path_pair.first.c_str(), expected_output_img,
-                  sample_alloc_pool.expected_data,
-                  sample_alloc_pool.expected_luma);
-    auto ev1 = prepare_image(&data_pipeline, path_pair.second.c_str(),
-                             input_img, sample_alloc_pool.input_data,
-                             sample_alloc_pool.input_luma);
-    data_pipeline.subtract_mean(sample_alloc_pool.input_luma, nullptr, &ev1);
-    sample_alloc_pool.input_w = (size_t)input_img.w;
-    sample_alloc_pool.input_h = (size_t)input_img.h;
-    context.block();
-    // free 3-channel images
-    context.raw_memory(sample_alloc_pool.input_data)->release();
-    context.raw_memory(sample_alloc_pool.expected_data)->release();
-    gpu_alloc.samples.push_back(sample_alloc_pool);
+              << all_samples_count << " = "
+              << (validation_set_size * 100.0f / all_samples_count) << "%"
+              << std::endl;
+  }
+
+  // mini-batch buffers are allocated for the biggest set we execute at once
+  size_t max_batch_set =
+      sample_stream ? std::max(shard_size, validation_set_size)
+                    : train_set_size;
+  size_t mini_batch_size =
+      (max_batch_set / mini_batch_count) + mini_batch_count;
+  // one block per mini-batch, so that it can use the samples in place
+  if (shuffle_block > 0) mini_batch_size = shuffle_block;
+  // gradients are accumulated over whole epoch, so smaller mini-batches that
+  // fit into the cache do not change the result
+  if (sample_cache)
+    mini_batch_size = std::min(mini_batch_size, sample_cache->capacity());
+  // mini-batch SGD: here the size changes the result, so it is never adjusted
+  if (sgd_mini_batch > 0) {
+    utils::require(accumulate_steps > 0, "Accumulate steps should be > 0");
+    utils::require(shuffle_block == 0 || shuffle_block == sgd_mini_batch,
+                   "Shuffle block has to be equal to mini-batch size");
+    utils::require(!sample_cache || sgd_mini_batch <= sample_cache->capacity(),
+                   "Mini-batch does not fit into the sample cache");
+    mini_batch_size = sgd_mini_batch;
+    data_pipeline.set_update_interval(accumulate_steps);
+    std::cout << "mini-batch SGD: " << sgd_mini_batch << " samples, "
+              << accumulate_steps << " mini-batch(es) per update" << std::endl;
+  }
+  data_pipeline.set_mini_batch_size(mini_batch_size);
+
+  // losses are kept per slot of the sample arena, so all samples have to
+  // live there
+  if (loss_sampling > 0.0f) {
+    utils::require(loss_sampling <= 1.0f, "Loss sampling should be in (0, 1]");
+    utils::require(!sample_stream && !sample_cache && shuffle_block == 0,
+                   "Loss sampling cannot be combined with streaming, sample "
+                   "cache or block shuffle");
+    data_pipeline.track_sample_losses(gpu_alloc.sample_arena);
   }
 
   size_t samples_count = gpu_alloc.samples.size(),
          per_sample_px_count =
              gpu_alloc.samples[0].input_w * gpu_alloc.samples[0].input_h;
 
+  // resume optimizer state, shuffle order and random engine if we got
+  // checkpoint. Default seed keeps runs deterministic. Samples stay in id
+  // order, only the indices are shuffled
+  std::mt19937 shuffle_generator;
+  std::vector<size_t> sample_order(samples_count);
+  std::iota(sample_order.begin(), sample_order.end(), 0);
+  TrainingState training_state;
+  // one buffer for parameters of all layers, one optimizer launch per update
+  data_pipeline.pack_parameters(gpu_alloc);
+  if (data_pipeline.restore_training_state(gpu_alloc, training_state)) {
+    restore_training_state(training_state, gpu_alloc, sample_order,
+                           shuffle_generator, sample_stream.get());
+  }
+
+  // periodic checkpoints. JSON is too slow, use binary file next to it
+  std::unique_ptr<CheckpointWriter> checkpoint_writer;
+  if (out_path && (checkpoint_epochs > 0 || checkpoint_minutes > 0)) {
+    std::string checkpoint_path(out_path);
+    if (ParametersFile::is_json_path(out_path)) checkpoint_path += ".bin";
+    std::cout << "Checkpoints: '" << checkpoint_path << "'" << std::endl;
+    checkpoint_writer.reset(
+        new CheckpointWriter(&data_pipeline, checkpoint_path.c_str()));
+  }
+  auto train_start_time = std::chrono::steady_clock::now();
+  auto last_checkpoint_time = train_start_time;
+
   context.block();
 
   ///
   /// train
   ///
-  bool error = false;
-  for (size_t epoch_id = 0; epoch_id < epochs; epoch_id++) {
+  bool error = false, last_epoch = false;
+  size_t epoch_id = 0;
+  for (; epoch_id < epochs && !last_epoch; epoch_id++) {
     // std::cout << "-------- " << epoch_id << "-------- " << std::endl;
     std::vector<SampleAllocationPool*> train_set(samples_count);
     std::vector<SampleAllocationPool*> validation_set(samples_count);
-    divide_samples(validation_set_size, gpu_alloc, train_set, validation_set);
-
-    data_pipeline.execute_batch(true, gpu_alloc, train_set);
+    if (sample_stream) {
+      // without --mini-batch gradients accumulate over all shards, one
+      // update per epoch
+      validation_set.clear();
+      for (auto& sample : gpu_alloc.samples) validation_set.push_back(&sample);
+      sample_stream->begin_epoch(shuffle_generator);
+      while (sample_stream->next_shard(train_set, shuffle_generator)) {
+        data_pipeline.execute_batch(true, gpu_alloc, train_set);
+      }
+    } else {
+      if (sample_augmenter)
+        sample_augmenter->generate(gpu_alloc, shuffle_generator);
+      divide_samples(validation_set_size, shuffle_block, gpu_alloc,
+                     sample_order, shuffle_generator, train_set,
+                     validation_set);
+      // first epoch visits every training sample once to get its loss
+      if (loss_sampling > 0.0f && epoch_id > 0)
+        data_pipeline.draw_samples_by_loss(loss_sampling, shuffle_generator,
+                                           train_set);
+      data_pipeline.execute_batch(true, gpu_alloc, train_set);
+    }
 
-    data_pipeline.update_parameters(gpu_alloc.layer_1, gpu_alloc.layer_2,
-                                    gpu_alloc.layer_3, train_set.size());
+    data_pipeline.finish_epoch(gpu_alloc);
+
+    // time budget is checked once per epoch. Last epoch is always validated
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed_s = std::chrono::duration_cast<std::chrono::seconds>(
+                         now - train_start_time).count();
+    last_epoch = epoch_id == epochs - 1 ||
+                 (duration_s > 0 && (size_t)elapsed_s >= duration_s);
+
+    if (checkpoint_writer) {
+      auto minutes = std::chrono::duration_cast<std::chrono::minutes>(
+                         now - last_checkpoint_time).count();
+      bool epochs_due = checkpoint_epochs > 0 &&
+                        ((epoch_id + 1) % checkpoint_epochs) == 0,
+           time_due = checkpoint_minutes > 0 &&
+                      (size_t)minutes >= checkpoint_minutes;
+      if (epochs_due || time_due) {
+        store_training_state(training_state, gpu_alloc, sample_order,
+                             shuffle_generator, sample_stream.get());
+        if (checkpoint_writer->schedule(gpu_alloc, training_state)) {
+          last_checkpoint_time = now;
+        } else {
+          std::cout << "[Warning] Previous checkpoint is still being written, "
+                       "skipping" << std::endl;
+        }
+      }
+    }
 
     // doing validation every time after training just to print some number
     // is wasteful
-    if ((epoch_id % 25) == 0 || epoch_id == epochs - 1) {
+    if ((epoch_id % 25) == 0 || last_epoch) {
       float validation_squared_error =
           data_pipeline.execute_batch(false, gpu_alloc, validation_set);
 
       // if error happened we stop the training.
       if (std::isnan(validation_squared_error)) {
-        std::cout << "Error: squared error is NAN, after " << epoch_id << "/"
-                  << epochs << " epochs" << std::endl;
+        std::cout << "Error: squared error is NAN, after " << epoch_id
+                  << " epochs" << std::endl;
         error = true;
         break;
       }
@@ -189,22 +449,38 @@ int main(int argc, char** argv) {
                 << "mean validation error: " << mean_valid_err << " ("
                 << (mean_valid_err / per_sample_px_count) << " per px)"
                 << std::endl;
+      float loss_scale;
+      size_t skipped_updates;
+      if (data_pipeline.read_loss_scaling(loss_scale, skipped_updates))
+        std::cout << "    loss scale: " << loss_scale
+                  << ", skipped updates: " << skipped_updates << std::endl;
+      if (profile) context.print_app_memory_usage();
+      if (profile && sample_cache) sample_cache->print_stats();
     }
 
     context.block();
   }
 
+  auto train_time_s = std::chrono::duration_cast<std::chrono::seconds>(
+                          std::chrono::steady_clock::now() - train_start_time)
+                          .count();
+  std::cout << "Trained " << epoch_id << " epochs in " << train_time_s << "s"
+            << std::endl;
+
   ///
   /// write parameters to file
   ///
+  if (checkpoint_writer) checkpoint_writer->wait();
   if (out_path) {
-    data_pipeline.write_params_to_file(out_path, gpu_alloc.layer_1,
-                                       gpu_alloc.layer_2, gpu_alloc.layer_3);
+    store_training_state(training_state, gpu_alloc, sample_order,
+                         shuffle_generator, sample_stream.get());
+    data_pipeline.write_params_to_file(out_path, gpu_alloc, &training_state);
   }
   context.block();
 
   std::cout << "DONE" << std::endl;
   // calling exit does not call Context's destructor - do this by hand
+  sample_cache.reset();  // unmaps pinned memory
   context.~Context();
   exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -216,54 +492,399 @@ int main(int argc, char** argv) {
 ///
 void execute_forward(ConfigBasedDataPipeline& data_pipeline,
                      GpuAllocationPool& gpu_alloc, const char* const in_path,
-                     const char* const out_path) {
+                     const char* const out_path, bool int8,
+                     size_t pre_scale) {
   auto context = data_pipeline.context();
 
-  // read input image
+  // read input image, luma is upscaled on gpu
   ImageData input_img;
   SampleAllocationPool sample;
   auto ev1 = prepare_image(&data_pipeline, in_path, input_img,
-                           sample.input_data, sample.input_luma);
+                           sample.input_data, sample.input_luma, false,
+                           pre_scale);
   data_pipeline.subtract_mean(sample.input_luma, nullptr, &ev1);
-  sample.input_w = (size_t)input_img.w;
-  sample.input_h = (size_t)input_img.h;
+  sample.input_w = (size_t)input_img.w * pre_scale;
+  sample.input_h = (size_t)input_img.h * pre_scale;
   context->block();
 
   // process with layers
-  data_pipeline.forward(gpu_alloc.layer_1, gpu_alloc.layer_2, gpu_alloc.layer_3,
-                        sample);
+  data_pipeline.forward(gpu_alloc, sample);
+
+  if (int8) {
+    // float result is the reference
+    size_t result_dim[2];
+    data_pipeline.result_size(sample.input_w, sample.input_h, result_dim);
+    size_t result_w = result_dim[0], result_h = result_dim[1];
+    auto reference = context->allocate(CL_MEM_READ_WRITE,
+                                       sizeof(cl_float) * result_w * result_h);
+    context->copy_buffer(data_pipeline.result_buffer(), reference);
+    data_pipeline.forward_int8(gpu_alloc, sample);
+    float psnr = data_pipeline.result_psnr(reference, result_w, result_h);
+    std::cout << "Int8 result PSNR against float result: " << psnr << "dB"
+              << std::endl;
+  }
 
   if (out_path) {
     data_pipeline.write_result_image(out_path, input_img, sample);
   }
 }
 
+///
+/// Int8 calibration
+///
+void calibrate_int8(ConfigBasedDataPipeline& data_pipeline,
+                    GpuAllocationPool& gpu_alloc,
+                    const char* const samples_dir,
+                    const char* const out_path) {
+  auto context = data_pipeline.context();
+  std::vector<HostSample> host_samples;
+  prepare_host_samples(samples_dir, host_samples);
+  utils::require(!host_samples.empty(), "No calibration samples found");
+
+  // samples may differ in size, each gets own buffers
+  std::vector<SampleAllocationPool> samples(host_samples.size());
+  for (size_t i = 0; i < samples.size(); i++) {
+    auto& host_sample = host_samples[i];
+    auto& sample = samples[i];
+    size_t size = sizeof(cl_float) * host_sample.w * host_sample.h;
+    sample.input_w = host_sample.w;
+    sample.input_h = host_sample.h;
+    sample.input_luma = context->allocate(CL_MEM_READ_ONLY, size);
+    sample.expected_luma = context->allocate(CL_MEM_READ_ONLY, size);
+    context->write_buffer(sample.input_luma,
+                          (void*)&host_sample.input_luma[0], false);
+    context->write_buffer(sample.expected_luma,
+                          (void*)&host_sample.expected_luma[0], false);
+  }
+  context->block();
+
+  for (auto& sample : samples) {
+    data_pipeline.observe_activation_ranges(gpu_alloc, sample);
+  }
+  data_pipeline.calibrate_int8();
+
+  // compare both models against ground truth
+  double psnr_float = 0.0, psnr_int8 = 0.0;
+  for (auto& sample : samples) {
+    data_pipeline.forward(gpu_alloc, sample);
+    psnr_float += data_pipeline.result_psnr(sample.expected_luma,
+                                            sample.input_w, sample.input_h);
+    data_pipeline.forward_int8(gpu_alloc, sample);
+    psnr_int8 += data_pipeline.result_psnr(sample.expected_luma,
+                                           sample.input_w, sample.input_h);
+  }
+  psnr_float /= samples.size();
+  psnr_int8 /= samples.size();
+  std::cout << "Mean PSNR of " << samples.size()
+            << " calibration samples: float " << psnr_float << "dB, int8 "
+            << psnr_int8 << "dB, change: " << (psnr_int8 - psnr_float)
+            << "dB" << std::endl;
+
+  if (out_path) {
+    data_pipeline.write_params_to_file(out_path, gpu_alloc);
+  }
+}
+
 ///
 /// Training
 ///
-void divide_samples(size_t validation_set_size, GpuAllocationPool& pool,
+void divide_samples(size_t validation_set_size, size_t shuffle_block,
+                    GpuAllocationPool& pool, std::vector<size_t>& sample_order,
+                    std::mt19937& generator,
                     std::vector<SampleAllocationPool*>& train_set,
                     std::vector<SampleAllocationPool*>& validation_set) {
   std::vector<SampleAllocationPool>& samples = pool.samples;
   train_set.clear();
   validation_set.clear();
-  std::random_shuffle(samples.begin(), samples.end());
-  // auto st = samples.cbegin(), ne = std::next(st, validation_set_size);
-  // std::copy(st, ne, back_inserter(validation_set));
-  // std::copy(ne, samples.cend(), back_inserter(train_set));
-  for (size_t i = 0; i < samples.size(); i++) {
+  if (shuffle_block == 0) {
+    // same permutation as shuffling the samples themselves, so checkpoints
+    // written before stay valid
+    std::shuffle(sample_order.begin(), sample_order.end(), generator);
+  } else {
+    shuffle_blocks(sample_order, shuffle_block, generator);
+  }
+  for (size_t i = 0; i < sample_order.size(); i++) {
     if (i < validation_set_size) {
-      validation_set.push_back(&samples[i]);
+      validation_set.push_back(&samples[sample_order[i]]);
+    } else {
+      train_set.push_back(&samples[sample_order[i]]);
+    }
+  }
+}
+
+void shuffle_blocks(std::vector<size_t>& sample_order, size_t block_size,
+                    std::mt19937& generator) {
+  // current block order (as they appear in sample_order, which does not have
+  // to be block ordered f.e. if restored from checkpoint). Partial last block
+  // always stays at the end, so that other blocks start at block boundary
+  size_t count = sample_order.size(), full_blocks = count / block_size;
+  std::vector<size_t> blocks;
+  std::vector<bool> seen(full_blocks, false);
+  for (auto idx : sample_order) {
+    size_t block = idx / block_size;
+    if (block >= full_blocks || seen[block]) continue;
+    seen[block] = true;
+    blocks.push_back(block);
+  }
+  std::shuffle(blocks.begin(), blocks.end(), generator);
+
+  sample_order.clear();
+  for (auto block : blocks) {
+    for (size_t i = 0; i < block_size; i++)
+      sample_order.push_back(block * block_size + i);
+  }
+  for (size_t i = full_blocks * block_size; i < count; i++)
+    sample_order.push_back(i);
+}
+
+void restore_training_state(TrainingState& state, GpuAllocationPool& pool,
+                            std::vector<size_t>& sample_order,
+                            std::mt19937& generator, SampleStream* stream) {
+  // next epoch shuffles shard order of the previous one
+  if (stream && !stream->restore_shard_order(state.shard_order)) {
+    std::cout << "[Warning] Streamed shards changed since checkpoint was "
+                 "written, shard order will not be restored" << std::endl;
+  }
+
+  auto& samples = pool.samples;
+  if (state.sample_order.size() != samples.size()) {
+    std::cout << "[Warning] Samples changed since checkpoint was written ("
+              << state.sample_order.size() << " vs " << samples.size()
+              << "), shuffle order will not be restored" << std::endl;
+    return;
+  }
+
+  // samples are in id order, so ids are also their indices
+  for (auto id : state.sample_order) {
+    utils::require(id < samples.size(), "Invalid sample id in checkpoint");
+  }
+  sample_order = state.sample_order;
+
+  std::istringstream is(state.rng_state);
+  is >> generator;
+  utils::require(!is.fail(), "Could not restore random engine from checkpoint");
+  std::cout << "Restored training state from checkpoint" << std::endl;
+}
+
+void store_training_state(TrainingState& state, GpuAllocationPool& pool,
+                          std::vector<size_t>& sample_order,
+                          std::mt19937& generator, SampleStream* stream) {
+  state.shard_order.clear();
+  if (stream) state.shard_order = stream->shard_order();
+
+  std::ostringstream os;
+  os << generator;
+  state.rng_state = os.str();
+  state.sample_order.clear();
+  for (auto idx : sample_order)
+    state.sample_order.push_back(pool.samples[idx].id);
+}
+
+///
+/// Samples
+///
+void prepare_host_samples(const char* const samples_dir,
+                          std::vector<HostSample>& samples) {
+  std::vector<TrainSampleFiles> train_sample_files;
+  get_training_samples(samples_dir, train_sample_files);
+
+  // decoding jpgs dominates, spread it over all cores
+  auto start = std::chrono::steady_clock::now();
+  samples.resize(train_sample_files.size());
+  utils::parallel_for(samples.size(), [&](size_t i) {
+    prepare_host_sample(train_sample_files[i], samples[i]);
+  });
+  auto dt = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+  std::cout << "Decoded " << samples.size() << " samples in " << dt << "ms"
+            << std::endl;
+}
+
+/**
+ * Start non blocking upload of the sample into arena slot. Compact storages
+ * are encoded into the provided buffer, that has to live till the context is
+ * blocked.
+ */
+void upload_sample(opencl::Context& context, SampleArena& arena, size_t slot,
+                   const float* input, const float* expected, float input_mean,
+                   std::vector<char>& encoded) {
+  if (arena.storage == DatasetStorage::Float32) {
+    arena.write(&context, slot, input, expected);
+    return;
+  }
+  // expected luma is not mean subtracted
+  size_t px_count = arena.w * arena.h,
+         size = storage_element_size(arena.storage) * px_count;
+  encoded.clear();
+  encoded.reserve(2 * size);
+  encode_luma(encoded, input, px_count, input_mean, arena.storage);
+  encode_luma(encoded, expected, px_count, 0.0f, arena.storage);
+  arena.write(&context, slot, &encoded[0], &encoded[size]);
+}
+
+void load_samples(opencl::Context& context, const char* const samples_dir,
+                  GpuAllocationPool& gpu_alloc, DatasetStorage storage) {
+  std::vector<HostSample> host_samples;
+  prepare_host_samples(samples_dir, host_samples);
+  if (host_samples.empty()) return;
+
+  // mini-batches are gathered from single arena, samples must match in size
+  size_t count = host_samples.size(), w = host_samples[0].w,
+         h = host_samples[0].h;
+  auto& arena = gpu_alloc.sample_arena;
+  arena.allocate(&context, w, h, count, storage);
+
+  // all uploads are non blocking, host data lives till the block below
+  std::vector<std::vector<char>> encoded(count);
+  std::vector<float> means(count);
+  for (size_t i = 0; i < count; i++) {
+    auto& host_sample = host_samples[i];
+    utils::require(host_sample.w == w && host_sample.h == h,
+                   "Training samples should all have the same size");
+    SampleAllocationPool sample;
+    sample.input_w = w;
+    sample.input_h = h;
+    sample.id = i;
+    sample.arena = &arena;
+    sample.arena_slot = i;
+    means[i] = host_sample.input_mean;
+    upload_sample(context, arena, i, &host_sample.input_luma[0],
+                  &host_sample.expected_luma[0], host_sample.input_mean,
+                  encoded[i]);
+    gpu_alloc.samples.push_back(sample);
+  }
+  arena.write_means(&context, &means[0], count);
+  context.block();
+}
+
+void load_packed_samples(opencl::Context& context,
+                         const char* const dataset_path,
+                         GpuAllocationPool& gpu_alloc, DatasetStorage storage,
+                         size_t max_count) {
+  DatasetFile dataset(dataset_path);
+  bool needs_decode = dataset.storage() != DatasetStorage::Float32;
+  size_t count = max_count > 0 ? std::min(max_count, dataset.size())
+                               : dataset.size();
+  if (count == 0) return;
+
+  // mini-batches are gathered from single arena, samples must match in size
+  size_t w = dataset.width(0), h = dataset.height(0), px_count = w * h;
+  auto& arena = gpu_alloc.sample_arena;
+  arena.allocate(&context, w, h, count, storage);
+
+  // decoded values have to live till the uploads finish
+  std::vector<float> decoded(needs_decode ? 2 * px_count * count : 0);
+  std::vector<std::vector<char>> encoded(count);
+  std::vector<float> means(count);
+
+  // non blocking uploads straight from the mapped file (or decoded buffer)
+  for (size_t i = 0; i < count; i++) {
+    utils::require(dataset.width(i) == w && dataset.height(i) == h,
+                   "Training samples should all have the same size");
+    SampleAllocationPool sample;
+    sample.input_w = w;
+    sample.input_h = h;
+    sample.id = i;
+    sample.arena = &arena;
+    sample.arena_slot = i;
+    float* input_buf = needs_decode ? &decoded[2 * i * px_count] : nullptr;
+    float* expected_buf =
+        needs_decode ? &decoded[(2 * i + 1) * px_count] : nullptr;
+    means[i] = dataset.input_mean(i);
+    upload_sample(context, arena, i, dataset.input_luma(i, input_buf),
+                  dataset.expected_luma(i, expected_buf), means[i],
+                  encoded[i]);
+    gpu_alloc.samples.push_back(sample);
+  }
+  arena.write_means(&context, &means[0], count);
+  context.block();
+
+  std::cout << "Loaded " << count << "/" << dataset.size()
+            << " samples from packed dataset" << std::endl;
+}
+
+SampleCache* load_cached_samples(opencl::Context& context,
+                                 const char* const in_path,
+                                 GpuAllocationPool& gpu_alloc,
+                                 size_t budget_bytes) {
+  // read either packed dataset or directory
+  std::unique_ptr<DatasetFile> dataset;
+  std::vector<HostSample> host_samples;
+  size_t count, w, h;
+  if (DatasetFile::is_dataset(in_path)) {
+    dataset.reset(new DatasetFile(in_path));
+    count = dataset->size();
+    w = count ? dataset->width(0) : 0;
+    h = count ? dataset->height(0) : 0;
+  } else {
+    prepare_host_samples(in_path, host_samples);
+    count = host_samples.size();
+    w = count ? host_samples[0].w : 0;
+    h = count ? host_samples[0].h : 0;
+  }
+  utils::require(count > 0, "No training samples found");
+
+  // all samples go to pinned host memory, device slots are filled on demand
+  SampleCache* cache = new SampleCache(&context, count, w, h, budget_bytes);
+  size_t px_count = w * h;
+  for (size_t i = 0; i < count; i++) {
+    float *input = cache->host_input(i), *expected = cache->host_expected(i);
+    const float *src_input, *src_expected;
+    if (dataset) {
+      utils::require(dataset->width(i) == w && dataset->height(i) == h,
+                     "Cached samples should all have the same size");
+      src_input = dataset->input_luma(i, input);
+      src_expected = dataset->expected_luma(i, expected);
     } else {
-      train_set.push_back(&samples[i]);
+      utils::require(host_samples[i].w == w && host_samples[i].h == h,
+                     "Cached samples should all have the same size");
+      src_input = &host_samples[i].input_luma[0];
+      src_expected = &host_samples[i].expected_luma[0];
     }
+    if (src_input != input)
+      memcpy(input, src_input, sizeof(float) * px_count);
+    if (src_expected != expected)
+      memcpy(expected, src_expected, sizeof(float) * px_count);
+
+    SampleAllocationPool sample;
+    sample.input_w = w;
+    sample.input_h = h;
+    sample.id = i;
+    gpu_alloc.samples.push_back(sample);
   }
+  return cache;
+}
+
+void pack_samples(const char* const samples_dir, const char* const out_path,
+                  const char* const storage_name) {
+  std::string storage_str(storage_name ? storage_name : "float32");
+  DatasetStorage storage = parse_storage(storage_str);
+
+  std::vector<HostSample> samples;
+  prepare_host_samples(samples_dir, samples);
+
+  std::cout << "Packing " << samples.size() << " samples (" << storage_str
+            << ") to: '" << out_path << "'" << std::endl;
+  DatasetFile::write(out_path, samples, storage);
 }
 
 ///
 ///
 /// Impl
 ///
+size_t parse_duration(const char* const value) {
+  const std::string units = "smhdw";
+  const size_t seconds_per_unit[] = {1, 60, 3600, 86400, 604800};
+  std::string str(value);
+  auto unit = str.empty() ? std::string::npos : units.find(str.back());
+  size_t count = (size_t)atoi(str.c_str());
+  if (unit == std::string::npos || count == 0) {
+    throw std::runtime_error(
+        "Invalid duration, expected X[s|m|h|d|w] f.e. '30m' or '2h'");
+  }
+  return count * seconds_per_unit[unit];
+}
+
 void get_training_samples(std::string dir_path,
                           std::vector<TrainSampleFiles>& target) {
   //
@@ -298,12 +919,17 @@ void get_training_samples(std::string dir_path,
       target.push_back(pair);
     }
   }
+
+  // unordered_map has no stable order, sort so that sample ids are
+  // the same between runs
+  std::sort(target.begin(), target.end());
 }
 
 cl_event prepare_image(DataPipeline* const pipeline,
                        const char* const file_path, ImageData& img_data,
                        opencl::MemoryHandle& gpu_data_handle,
-                       opencl::MemoryHandle& gpu_luma_handle, bool print) {
+                       opencl::MemoryHandle& gpu_luma_handle, bool print,
+                       size_t scale) {
   bool normalize_luma = true;
   if (print) std::cout << "loading image '" << file_path << "'";
   opencl::utils::load_image(file_path, img_data);  // TODO should throw
@@ -314,5 +940,5 @@ cl_event prepare_image(DataPipeline* const pipeline,
 
   // extract luma channel
   return pipeline->extract_luma(img_data, gpu_data_handle, gpu_luma_handle,
-                                normalize_luma);
+                                normalize_luma, nullptr, scale);
 }
@@ -0,0 +1,69 @@
+#include "MemoryPlanner.hpp"
+
+#include <algorithm>  // std::sort, std::max
+
+#include "pch.hpp"
+
+namespace cnn_sr {
+
+size_t MemoryPlanner::add(size_t size, size_t first_step, size_t last_step) {
+  utils::require(size > 0, "Planned buffer cannot be empty");
+  utils::require(first_step <= last_step,
+                 "Buffer lifetime should end after it starts");
+  _buffers.push_back({size, first_step, last_step, 0, false});
+  return _buffers.size() - 1;
+}
+
+bool MemoryPlanner::lifetimes_overlap(const Buffer& a, const Buffer& b) {
+  return a.first_step <= b.last_step && b.first_step <= a.last_step;
+}
+
+size_t MemoryPlanner::plan(size_t alignment) {
+  if (alignment == 0) alignment = 1;
+  std::vector<size_t> order(_buffers.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+    if (_buffers[a].size != _buffers[b].size)
+      return _buffers[a].size > _buffers[b].size;
+    return a < b;  // deterministic layout
+  });
+
+  for (auto& buffer : _buffers) buffer.placed = false;
+  size_t arena_size = 0;
+  std::vector<const Buffer*> live;
+  for (size_t id : order) {
+    Buffer& buffer = _buffers[id];
+    live.clear();
+    for (auto& other : _buffers)
+      if (other.placed && lifetimes_overlap(buffer, other))
+        live.push_back(&other);
+    std::sort(live.begin(), live.end(), [](const Buffer* a, const Buffer* b) {
+      return a->offset < b->offset;
+    });
+
+    // first gap between live buffers that is big enough
+    size_t offset = 0;
+    for (auto other : live) {
+      if (offset + buffer.size <= other->offset) break;
+      size_t end = other->offset + other->size;
+      offset = std::max(offset, (end + alignment - 1) / alignment * alignment);
+    }
+    buffer.offset = offset;
+    buffer.placed = true;
+    arena_size = std::max(arena_size, offset + buffer.size);
+  }
+  return arena_size;
+}
+
+size_t MemoryPlanner::offset(size_t id) const {
+  utils::require(id < _buffers.size() && _buffers[id].placed,
+                 "Buffer was not planned");
+  return _buffers[id].offset;
+}
+
+size_t MemoryPlanner::unplanned_size() const {
+  size_t result = 0;
+  for (auto& buffer : _buffers) result += buffer.size;
+  return result;
+}
+}
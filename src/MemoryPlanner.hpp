@@ -0,0 +1,48 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include <cstddef>  // size_t
+#include <vector>
+
+namespace cnn_sr {
+
+/**
+ * Places buffers in single arena so that buffers that are never used at the
+ * same time share memory. Each buffer is described by its size and by its
+ * lifetime: first and last step (inclusive) of the schedule that touches it.
+ * Steps have to follow the order in which kernels are enqueued - queue is
+ * in-order, so a buffer is dead as soon as its last kernel was enqueued.
+ *
+ * Placement is greedy: biggest buffers first, each at the lowest offset
+ * that does not collide with already placed buffers of overlapping lifetime.
+ */
+class MemoryPlanner {
+ public:
+  /** @return id used to query the offset after plan() */
+  size_t add(size_t size, size_t first_step, size_t last_step);
+
+  /**
+   * Assign offsets, each one is multiple of alignment.
+   * @return arena size in bytes
+   */
+  size_t plan(size_t alignment);
+
+  size_t offset(size_t id) const;
+  inline size_t size(size_t id) const { return _buffers[id].size; }
+  inline size_t buffer_count() const { return _buffers.size(); }
+  /** Memory that separate allocations would need */
+  size_t unplanned_size() const;
+
+ private:
+  struct Buffer {
+    size_t size, first_step, last_step, offset;
+    bool placed;
+  };
+
+  static bool lifetimes_overlap(const Buffer&, const Buffer&);
+
+  std::vector<Buffer> _buffers;
+};
+}
+
+#endif /* MEMORY_PLANNER_H */
@@ -0,0 +1,325 @@
+#include "ParametersFile.hpp"
+
+#include <fstream>
+#include <cstring>    // memcpy, memcmp
+#include <ios>        // std::ios_base::failure
+#include <stdexcept>  // std::runtime_error
+
+namespace cnn_sr {
+
+const unsigned int ParametersFile::VERSION = 1;
+
+const char* const parameters_magic = "CNNSRPAR";
+const size_t magic_size = 8;
+const size_t header_size = magic_size + 4 + 4 + 8 + 4;
+const size_t chunk_header_size = 4 + 8;
+const char* const layer_chunk_tag = "LAYR";
+const char* const momentum_chunk_tag = "MOMT";
+const char* const adam_chunk_tag = "ADAM";
+const char* const quantization_chunk_tag = "QNT8";
+const char* const training_state_chunk_tag = "TRST";
+const char* const optimizer_step_chunk_tag = "STEP";
+const char* const loss_scaling_chunk_tag = "LSCL";
+const char* const shard_order_chunk_tag = "SHRD";
+
+///
+/// Helpers. NOTE: we assume the host is little endian
+///
+unsigned int fnv1a(const char* data, size_t len) {
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+template <typename T>
+void put(std::vector<char>& buf, T value) {
+  const char* ptr = (const char*)&value;
+  buf.insert(buf.end(), ptr, ptr + sizeof(T));
+}
+
+void put_tag(std::vector<char>& buf, const char* const tag) {
+  buf.insert(buf.end(), tag, tag + 4);
+}
+
+void put_blob(std::vector<char>& buf, const std::vector<float>& data,
+              ParametersStorage storage) {
+  if (storage == ParametersStorage::Float16) {
+    for (float v : data) put<unsigned short>(buf, utils::float_to_half(v));
+  } else if (!data.empty()) {
+    const char* ptr = (const char*)&data[0];
+    buf.insert(buf.end(), ptr, ptr + sizeof(float) * data.size());
+  }
+}
+
+/** Bounds checked reads from memory mapped file */
+struct Reader {
+  Reader(const char* data, size_t size) : data(data), size(size) {}
+
+  template <typename T>
+  T get() {
+    T value;
+    memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  const char* take(size_t len) {
+    if (pos + len > size) throw IOException("Unexpected end of parameters file");
+    const char* ptr = data + pos;
+    pos += len;
+    return ptr;
+  }
+
+  void read_blob(std::vector<float>& target, size_t count,
+                 ParametersStorage storage) {
+    target.resize(count);
+    if (storage == ParametersStorage::Float16) {
+      const char* src = take(sizeof(unsigned short) * count);
+      for (size_t i = 0; i < count; i++) {
+        unsigned short h;
+        memcpy(&h, src + i * sizeof(unsigned short), sizeof(h));
+        target[i] = utils::half_to_float(h);
+      }
+    } else if (count > 0) {
+      memcpy(&target[0], take(sizeof(float) * count), sizeof(float) * count);
+    }
+  }
+
+  const char* const data;
+  const size_t size;
+  size_t pos = 0;
+};
+
+///
+/// ParametersFile
+///
+bool ParametersFile::is_binary(const char* const path) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[magic_size];
+  if (!file.read(magic, magic_size)) return false;
+  return memcmp(magic, parameters_magic, magic_size) == 0;
+}
+
+bool ParametersFile::is_json_path(const char* const file_path) {
+  std::string path(file_path);
+  const std::string ext = ".json";
+  return path.size() >= ext.size() &&
+         path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+void ParametersFile::write(const char* const path, const ParametersFile& params,
+                           ParametersStorage storage) {
+  // body
+  std::vector<char> body;
+  unsigned int chunk_count = 0;
+  for (size_t layer_idx = 0; layer_idx < params.layers.size(); layer_idx++) {
+    auto& layer = params.layers[layer_idx];
+    size_t el_size = storage == ParametersStorage::Float16 ? 2 : 4;
+    unsigned long long payload_size =
+        4 * sizeof(unsigned int) +
+        el_size * (layer.weights.size() + layer.bias.size());
+    put_tag(body, layer_chunk_tag);
+    put<unsigned long long>(body, payload_size);
+    put<unsigned int>(body, layer.n_prev_filter_cnt);
+    put<unsigned int>(body, layer.current_filter_count);
+    put<unsigned int>(body, layer.f_spatial_size);
+    put<unsigned int>(body, (unsigned int)storage);
+    put_blob(body, layer.weights, storage);
+    put_blob(body, layer.bias, storage);
+    ++chunk_count;
+
+    // momentum is always float32, so that we can resume bit-exactly
+    if (!layer.previous_delta_w.empty()) {
+      payload_size = sizeof(unsigned int) +
+                     sizeof(float) * (layer.previous_delta_w.size() +
+                                      layer.previous_delta_b.size());
+      put_tag(body, momentum_chunk_tag);
+      put<unsigned long long>(body, payload_size);
+      put<unsigned int>(body, layer_idx);
+      put_blob(body, layer.previous_delta_w, ParametersStorage::Float32);
+      put_blob(body, layer.previous_delta_b, ParametersStorage::Float32);
+      ++chunk_count;
+    }
+
+    // same for Adam moments
+    if (!layer.first_moment_w.empty()) {
+      payload_size = sizeof(unsigned int) +
+                     2 * sizeof(float) * (layer.first_moment_w.size() +
+                                          layer.first_moment_b.size());
+      put_tag(body, adam_chunk_tag);
+      put<unsigned long long>(body, payload_size);
+      put<unsigned int>(body, layer_idx);
+      put_blob(body, layer.first_moment_w, ParametersStorage::Float32);
+      put_blob(body, layer.first_moment_b, ParametersStorage::Float32);
+      put_blob(body, layer.second_moment_w, ParametersStorage::Float32);
+      put_blob(body, layer.second_moment_b, ParametersStorage::Float32);
+      ++chunk_count;
+    }
+  }
+
+  for (size_t layer_idx = 0; layer_idx < params.layers.size(); layer_idx++) {
+    auto& layer = params.layers[layer_idx];
+    if (layer.input_scale <= 0.0f) continue;
+    unsigned long long payload_size =
+        sizeof(unsigned int) +
+        sizeof(float) * (1 + layer.weight_scales.size());
+    put_tag(body, quantization_chunk_tag);
+    put<unsigned long long>(body, payload_size);
+    put<unsigned int>(body, layer_idx);
+    put<float>(body, layer.input_scale);
+    put_blob(body, layer.weight_scales, ParametersStorage::Float32);
+    ++chunk_count;
+  }
+
+  if (params.has_training_state) {
+    auto& state = params.training_state;
+    unsigned long long payload_size =
+        2 * sizeof(unsigned int) + state.rng_state.size() +
+        sizeof(unsigned int) * state.sample_order.size();
+    put_tag(body, training_state_chunk_tag);
+    put<unsigned long long>(body, payload_size);
+    put<unsigned int>(body, state.rng_state.size());
+    body.insert(body.end(), state.rng_state.begin(), state.rng_state.end());
+    put<unsigned int>(body, state.sample_order.size());
+    for (auto id : state.sample_order) put<unsigned int>(body, id);
+    ++chunk_count;
+
+    put_tag(body, optimizer_step_chunk_tag);
+    put<unsigned long long>(body, sizeof(unsigned long long));
+    put<unsigned long long>(body, state.optimizer_step);
+    ++chunk_count;
+
+    if (!state.loss_scaling.empty()) {
+      payload_size =
+          sizeof(unsigned int) + sizeof(float) * state.loss_scaling.size();
+      put_tag(body, loss_scaling_chunk_tag);
+      put<unsigned long long>(body, payload_size);
+      put<unsigned int>(body, state.loss_scaling.size());
+      put_blob(body, state.loss_scaling, ParametersStorage::Float32);
+      ++chunk_count;
+    }
+
+    if (!state.shard_order.empty()) {
+      payload_size = sizeof(unsigned int) * (1 + state.shard_order.size());
+      put_tag(body, shard_order_chunk_tag);
+      put<unsigned long long>(body, payload_size);
+      put<unsigned int>(body, state.shard_order.size());
+      for (auto idx : state.shard_order) put<unsigned int>(body, idx);
+      ++chunk_count;
+    }
+  }
+
+  // header
+  std::vector<char> header;
+  header.insert(header.end(), parameters_magic, parameters_magic + magic_size);
+  put<unsigned int>(header, VERSION);
+  put<unsigned int>(header, chunk_count);
+  put<unsigned long long>(header, params.epochs);
+  put<unsigned int>(header, fnv1a(body.data(), body.size()));
+
+  header.insert(header.end(), body.begin(), body.end());
+  utils::write_file_atomic(path, header.data(), header.size());
+}
+
+void ParametersFile::read(const char* const path, ParametersFile& params) {
+  utils::MappedFile file(path);
+  Reader r(file.data(), file.size());
+
+  // header
+  if (memcmp(r.take(magic_size), parameters_magic, magic_size) != 0)
+    throw IOException("Not a binary parameters file");
+  auto version = r.get<unsigned int>();
+  if (version > VERSION)
+    throw IOException("Parameters file was written by newer version");
+  auto chunk_count = r.get<unsigned int>();
+  params.epochs = (size_t)r.get<unsigned long long>();
+  auto checksum = r.get<unsigned int>();
+  if (fnv1a(file.data() + header_size, file.size() - header_size) != checksum)
+    throw IOException("Parameters file is corrupted (checksum mismatch)");
+
+  // chunks
+  params.layers.clear();
+  params.has_training_state = false;
+  for (size_t i = 0; i < chunk_count; i++) {
+    const char* tag = r.take(4);
+    auto payload_size = (size_t)r.get<unsigned long long>();
+    size_t payload_end = r.pos + payload_size;
+
+    if (memcmp(tag, layer_chunk_tag, 4) == 0) {
+      params.layers.push_back(LayerParameters());
+      LayerParameters& layer = params.layers.back();
+      layer.n_prev_filter_cnt = r.get<unsigned int>();
+      layer.current_filter_count = r.get<unsigned int>();
+      layer.f_spatial_size = r.get<unsigned int>();
+      auto storage = (ParametersStorage)r.get<unsigned int>();
+      size_t weight_count = layer.f_spatial_size * layer.f_spatial_size *
+                            layer.n_prev_filter_cnt *
+                            layer.current_filter_count;
+      r.read_blob(layer.weights, weight_count, storage);
+      r.read_blob(layer.bias, layer.current_filter_count, storage);
+
+    } else if (memcmp(tag, momentum_chunk_tag, 4) == 0) {
+      auto layer_idx = r.get<unsigned int>();
+      if (layer_idx >= params.layers.size())
+        throw IOException("Momentum chunk for unknown layer");
+      LayerParameters& layer = params.layers[layer_idx];
+      r.read_blob(layer.previous_delta_w, layer.weights.size(),
+                  ParametersStorage::Float32);
+      r.read_blob(layer.previous_delta_b, layer.bias.size(),
+                  ParametersStorage::Float32);
+
+    } else if (memcmp(tag, adam_chunk_tag, 4) == 0) {
+      auto layer_idx = r.get<unsigned int>();
+      if (layer_idx >= params.layers.size())
+        throw IOException("Adam moments chunk for unknown layer");
+      LayerParameters& layer = params.layers[layer_idx];
+      auto f32 = ParametersStorage::Float32;
+      r.read_blob(layer.first_moment_w, layer.weights.size(), f32);
+      r.read_blob(layer.first_moment_b, layer.bias.size(), f32);
+      r.read_blob(layer.second_moment_w, layer.weights.size(), f32);
+      r.read_blob(layer.second_moment_b, layer.bias.size(), f32);
+
+    } else if (memcmp(tag, quantization_chunk_tag, 4) == 0) {
+      auto layer_idx = r.get<unsigned int>();
+      if (layer_idx >= params.layers.size())
+        throw IOException("Int8 calibration chunk for unknown layer");
+      LayerParameters& layer = params.layers[layer_idx];
+      layer.input_scale = r.get<float>();
+      r.read_blob(layer.weight_scales, layer.current_filter_count,
+                  ParametersStorage::Float32);
+
+    } else if (memcmp(tag, training_state_chunk_tag, 4) == 0) {
+      auto& state = params.training_state;
+      auto rng_state_len = r.get<unsigned int>();
+      const char* rng_state = r.take(rng_state_len);
+      state.rng_state.assign(rng_state, rng_state + rng_state_len);
+      auto sample_count = r.get<unsigned int>();
+      state.sample_order.resize(sample_count);
+      for (size_t j = 0; j < sample_count; j++)
+        state.sample_order[j] = r.get<unsigned int>();
+      params.has_training_state = true;
+
+    } else if (memcmp(tag, optimizer_step_chunk_tag, 4) == 0) {
+      params.training_state.optimizer_step =
+          (size_t)r.get<unsigned long long>();
+
+    } else if (memcmp(tag, loss_scaling_chunk_tag, 4) == 0) {
+      auto state_size = r.get<unsigned int>();
+      r.read_blob(params.training_state.loss_scaling, state_size,
+                  ParametersStorage::Float32);
+
+    } else if (memcmp(tag, shard_order_chunk_tag, 4) == 0) {
+      auto& shard_order = params.training_state.shard_order;
+      auto shard_count = r.get<unsigned int>();
+      shard_order.resize(shard_count);
+      for (size_t j = 0; j < shard_count; j++)
+        shard_order[j] = r.get<unsigned int>();
+    }
+
+    if (r.pos > payload_end) throw IOException("Invalid chunk size");
+    r.pos = payload_end;  // skip what we did not read
+  }
+}
+}
@@ -0,0 +1,105 @@
+#ifndef PARAMETERS_FILE_H
+#define PARAMETERS_FILE_H
+
+#include "pch.hpp"
+
+namespace cnn_sr {
+
+/* clang-format off */
+/**
+ * Binary parameters file. Much faster to write and read then JSON, see
+ * README for the description of JSON version. All values are little endian.
+ *
+ *  file    := header, chunk*
+ *  header  := magic:char[8]="CNNSRPAR", version:u32, chunk_count:u32,
+ *             epochs:u64, checksum:u32 (FNV-1a of all bytes after the header)
+ *  chunk   := tag:char[4], payload_size:u64, payload
+ *
+ * Known chunks (unknown ones are skipped):
+ *  "LAYR"  := n_prev_filter_cnt:u32, current_filter_count:u32, f_spatial_size:u32,
+ *             storage:u32 (see ParametersStorage),
+ *             weights:blob[weight_size], bias:blob[bias_size]
+ *             Layers are written in order (layer 1 first).
+ *  "MOMT"  := layer_idx:u32, previous_delta_w:f32[weight_size],
+ *             previous_delta_b:f32[bias_size]
+ *             Momentum of the layer, always after "LAYR" chunk of same layer.
+ *  "ADAM"  := layer_idx:u32, first_moment_w:f32[weight_size],
+ *             first_moment_b:f32[bias_size], second_moment_w:f32[weight_size],
+ *             second_moment_b:f32[bias_size]
+ *             Adam moments of the layer, always after "LAYR" chunk of same layer.
+ *  "QNT8"  := layer_idx:u32, input_scale:f32, weight_scales:f32[current_filter_count]
+ *             Int8 calibration of the layer, always after "LAYR" chunk of same layer.
+ *  "TRST"  := rng_state_len:u32, rng_state:char[rng_state_len],
+ *             sample_count:u32, sample_order:u32[sample_count]
+ *  "STEP"  := optimizer_step:u64
+ *             Adam updates done so far, only with "TRST" chunk.
+ *  "LSCL"  := state_size:u32, state:f32[state_size]
+ *             Dynamic loss scaling state, only with "TRST" chunk.
+ *  "SHRD"  := shard_count:u32, shard_order:u32[shard_count]
+ *             Order of streamed shards, only with "TRST" chunk.
+ */
+/* clang-format on */
+enum class ParametersStorage : unsigned int { Float32 = 0, Float16 = 1 };
+
+/** Parameters of single layer as stored in file */
+struct LayerParameters {
+  size_t n_prev_filter_cnt = 0, current_filter_count = 0, f_spatial_size = 0;
+  std::vector<float> weights;
+  std::vector<float> bias;
+  /** optional, empty if momentum was not stored */
+  std::vector<float> previous_delta_w;
+  std::vector<float> previous_delta_b;
+  /** optional, empty if Adam moments were not stored */
+  std::vector<float> first_moment_w;
+  std::vector<float> first_moment_b;
+  std::vector<float> second_moment_w;
+  std::vector<float> second_moment_b;
+  /** optional int8 calibration, input_scale is 0 if it was not stored */
+  float input_scale = 0.0f;
+  std::vector<float> weight_scales;
+};
+
+/** Everything besides parameters that is needed to resume the training */
+struct TrainingState {
+  /** serialized random engine used to shuffle samples */
+  std::string rng_state;
+  /** sample ids (indices in sorted list of sample files) after last shuffle */
+  std::vector<size_t> sample_order;
+  /** Adam bias correction depends on number of updates done */
+  size_t optimizer_step = 0;
+  /** mixed precision only, see loss_scaling.cl. Empty if not used */
+  std::vector<float> loss_scaling;
+  /** streaming only, shard order of last epoch. Empty if not used */
+  std::vector<size_t> shard_order;
+};
+
+struct ParametersFile {
+  static const unsigned int VERSION;
+
+  /**
+   * Check if file starts with binary parameters file magic. If not we should
+   * treat it as JSON.
+   */
+  static bool is_binary(const char* const);
+
+  /** Output paths with '.json' extension are written as JSON */
+  static bool is_json_path(const char* const);
+
+  /** @throws IOException on any read error or checksum mismatch */
+  static void read(const char* const, ParametersFile&);
+
+  /**
+   * Write is atomic: file is first written under temporary name, flushed to
+   * disk and then renamed, so crash will never leave partial file.
+   */
+  static void write(const char* const, const ParametersFile&,
+                    ParametersStorage storage = ParametersStorage::Float32);
+
+  size_t epochs = 0;
+  std::vector<LayerParameters> layers;
+  bool has_training_state = false;
+  TrainingState training_state;
+};
+}
+
+#endif /* PARAMETERS_FILE_H   */
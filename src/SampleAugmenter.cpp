@@ -0,0 +1,145 @@
+#include "SampleAugmenter.hpp"
+
+#include <algorithm>  // for std::sort
+#include <cmath>      // for std::round
+#include <iostream>
+#include <chrono>
+
+#include "DatasetFile.hpp"
+#include "opencl\Context.hpp"
+
+namespace cnn_sr {
+
+SampleAugmenter::SampleAugmenter(DataPipeline* pipeline,
+                                 const char* const source_dir,
+                                 size_t crop_size, float degrade_factor,
+                                 size_t upscale_factor)
+    : _pipeline(pipeline),
+      _context(pipeline->context()),
+      _crop_size(crop_size),
+      _upscale_factor(upscale_factor),
+      _small_size(upscale_factor > 1
+                      ? crop_size / upscale_factor
+                      : (size_t)(crop_size / degrade_factor)) {
+  utils::require(_small_size > 0 && _small_size <= _crop_size,
+                 "Degrade factor should be >= 1 and smaller then crop size");
+  utils::require(_crop_size % _upscale_factor == 0,
+                 "Crop size should be multiple of upscale factor");
+
+  // sorted, so that sample ids are the same between runs
+  std::vector<std::string> files;
+  utils::list_files(source_dir, files);
+  files.erase(std::remove_if(files.begin(), files.end(),
+                             [](const std::string& f) {
+                               return f == "." || f == "..";
+                             }),
+              files.end());
+  std::sort(files.begin(), files.end());
+
+  // decoding dominates, spread it over all cores
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::vector<float>> lumas(files.size());
+  std::vector<size_t> ws(files.size(), 0), hs(files.size(), 0);
+  utils::parallel_for(files.size(), [&](size_t i) {
+    try {
+      std::string path = std::string(source_dir) + "\\" + files[i];
+      load_luma(path.c_str(), ws[i], hs[i], lumas[i]);
+    } catch (IOException&) {
+      ws[i] = hs[i] = 0;  // reported below
+    }
+  });
+
+  // all sources in single uint8 buffer
+  std::vector<unsigned char> source_luma;
+  for (size_t i = 0; i < files.size(); i++) {
+    if (ws[i] < _crop_size || hs[i] < _crop_size) {
+      std::cout << "'" << files[i] << "' could not be read or is smaller "
+                   "then crop size. Skipping" << std::endl;
+      continue;
+    }
+    _sources.push_back({source_luma.size(), ws[i], hs[i]});
+    for (float v : lumas[i]) {
+      float raw = std::round(v * 255.0f);
+      source_luma.push_back(
+          (unsigned char)(raw < 0.0f ? 0.0f : raw > 255.0f ? 255.0f : raw));
+    }
+    std::vector<float>().swap(lumas[i]);
+  }
+  utils::require(!_sources.empty(), "No source images found");
+  auto dt = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+  std::cout << "Loaded " << _sources.size() << " source images ("
+            << source_luma.size() / 1024 / 1024 << "MB) in " << dt << "ms"
+            << std::endl;
+
+  size_t count = _sources.size();
+  _source_luma = _context->allocate(CL_MEM_READ_ONLY, source_luma.size());
+  _context->write_buffer(_source_luma, (void*)&source_luma[0], true);
+  _crops.resize(4 * count);
+  _crops_gpu_buf =
+      _context->allocate(CL_MEM_READ_ONLY, sizeof(cl_uint) * _crops.size());
+  // with upscale_factor > 1 crops are downscaled straight into the arena
+  if (_upscale_factor == 1)
+    _small_gpu_buf = _context->allocate(
+        CL_MEM_READ_WRITE,
+        sizeof(cl_float) * _small_size * _small_size * count);
+}
+
+void SampleAugmenter::init_samples(GpuAllocationPool& gpu_alloc) {
+  auto& arena = gpu_alloc.sample_arena;
+  size_t input_size = _upscale_factor > 1 ? _small_size : _crop_size;
+  arena.allocate(_context, input_size, input_size, _sources.size(),
+                 DatasetStorage::Float32, _upscale_factor);
+  for (size_t i = 0; i < _sources.size(); i++) {
+    SampleAllocationPool sample;
+    sample.input_w = input_size;
+    sample.input_h = input_size;
+    sample.id = i;
+    sample.arena = &arena;
+    sample.arena_slot = i;
+    gpu_alloc.samples.push_back(sample);
+  }
+}
+
+void SampleAugmenter::generate(GpuAllocationPool& gpu_alloc,
+                               std::mt19937& generator) {
+  auto& arena = gpu_alloc.sample_arena;
+  size_t count = _sources.size();
+  size_t input_size = _upscale_factor > 1 ? _small_size : _crop_size;
+  utils::require(arena.capacity == count && arena.w == input_size &&
+                     arena.expected_scale == _upscale_factor,
+                 "Call init_samples before generating samples");
+
+  // crops are kept alive in member, queue is in-order and blocked every
+  // epoch, so there is no need to block here
+  for (size_t i = 0; i < count; i++) {
+    auto& src = _sources[i];
+    std::uniform_int_distribution<size_t> x_dist(0, src.w - _crop_size),
+        y_dist(0, src.h - _crop_size);
+    _crops[4 * i + 0] = src.offset;
+    _crops[4 * i + 1] = src.w;
+    _crops[4 * i + 2] = x_dist(generator);
+    _crops[4 * i + 3] = y_dist(generator);
+  }
+  _context->write_buffer(_crops_gpu_buf, (void*)&_crops[0], false);
+
+  // ground truth -> downscaled -> upscaled input (mean subtracted)
+  _pipeline->crop_samples(_source_luma, _crops_gpu_buf, count, _crop_size,
+                          arena.expected_luma);
+  if (_upscale_factor > 1) {
+    // net upscales on its own, input is the downscaled crop
+    _pipeline->downscale(arena.expected_luma, count, _crop_size, _small_size,
+                         arena.input_luma);
+    _pipeline->subtract_sample_means(arena.input_luma, count,
+                                     _small_size * _small_size,
+                                     arena.input_means);
+    return;
+  }
+  _pipeline->downscale(arena.expected_luma, count, _crop_size, _small_size,
+                       _small_gpu_buf);
+  _pipeline->upscale_bicubic(_small_gpu_buf, count, _small_size, _crop_size,
+                             arena.input_luma);
+  _pipeline->subtract_sample_means(arena.input_luma, count,
+                                   _crop_size * _crop_size, arena.input_means);
+}
+}
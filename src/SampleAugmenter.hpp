@@ -0,0 +1,63 @@
+#ifndef SAMPLE_AUGMENTER_H
+#define SAMPLE_AUGMENTER_H
+
+#include <random>  // for std::mt19937
+
+#include "ConfigBasedDataPipeline.hpp"
+
+namespace cnn_sr {
+
+/**
+ * Creates training samples on device, replacing pre-baked sample files. Luma
+ * of all source images stays resident (uint8). Every call to generate draws
+ * new random crop from each source image. Crop is the ground truth, input is
+ * the crop downscaled by degrade factor and bicubically upscaled back. If
+ * the net upscales on its own (upscale_factor > 1), input is the downscaled
+ * crop.
+ *
+ * There is one sample per source image, all live in single SampleArena.
+ */
+class SampleAugmenter {
+ public:
+  /**
+   * @param source_dir     images, each has to be at least crop_size big
+   * @param crop_size      size of (square) training samples
+   * @param degrade_factor crop is downscaled by this factor, then upscaled
+   * @param upscale_factor net upscale factor, if > 1 it replaces the
+   *                       degrade_factor and input is not upscaled back
+   */
+  SampleAugmenter(DataPipeline*, const char* const source_dir,
+                  size_t crop_size, float degrade_factor,
+                  size_t upscale_factor = 1);
+
+  inline size_t sample_count() const { return _sources.size(); }
+
+  /** Allocate arena and add one sample per source image to the pool */
+  void init_samples(GpuAllocationPool&);
+
+  /** Draw new crops for all samples and degrade them. Non blocking */
+  void generate(GpuAllocationPool&, std::mt19937&);
+
+ private:
+  SampleAugmenter(const SampleAugmenter&) = delete;
+  SampleAugmenter& operator=(const SampleAugmenter&) = delete;
+
+  struct Source {
+    size_t offset, w, h;
+  };
+
+  DataPipeline* const _pipeline;
+  opencl::Context* const _context;
+  const size_t _crop_size, _upscale_factor, _small_size;
+  std::vector<Source> _sources;
+  opencl::MemoryHandle _source_luma = gpu_nullptr;
+
+  /** 4 values per sample, see DataPipeline::crop_samples */
+  std::vector<unsigned int> _crops;
+  opencl::MemoryHandle _crops_gpu_buf = gpu_nullptr;
+  /** downscaled crops */
+  opencl::MemoryHandle _small_gpu_buf = gpu_nullptr;
+};
+}
+
+#endif /* SAMPLE_AUGMENTER_H   */
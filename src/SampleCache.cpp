@@ -0,0 +1,130 @@
+#include "SampleCache.hpp"
+
+#include <algorithm>  // std::min
+#include <iostream>
+#include <stdexcept>  // std::runtime_error
+
+#include "opencl\Context.hpp"
+
+namespace cnn_sr {
+
+const size_t SampleCache::NO_SLOT = (size_t)-1;
+
+SampleCache::SampleCache(opencl::Context* context, size_t sample_count,
+                         size_t w, size_t h, size_t device_budget_bytes)
+    : _context(context), _px_count(w * h) {
+  size_t per_sample = 2 * sizeof(cl_float) * _px_count,
+         slot_count = std::min(sample_count, device_budget_bytes / per_sample);
+  utils::require(slot_count > 0, "Sample cache budget is too small");
+
+  // single buffer could be bigger then the device allows
+  _samples_per_chunk =
+      std::min(sample_count, _context->max_allocation_size() / per_sample);
+  utils::require(_samples_per_chunk > 0, "Sample is too big to allocate");
+  for (size_t i = 0; i < sample_count; i += _samples_per_chunk) {
+    size_t count = std::min(_samples_per_chunk, sample_count - i);
+    HostChunk chunk;
+    chunk.buffer = _context->allocate(
+        CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, per_sample * count);
+    chunk.ptr = (float*)_context->map_buffer(chunk.buffer);
+    _host_chunks.push_back(chunk);
+  }
+
+  _arena.allocate(_context, w, h, slot_count);
+  _slots.resize(slot_count);
+  for (size_t i = 0; i < slot_count; i++) {
+    _lru_position.push_back(_lru.insert(_lru.end(), i));
+  }
+  _slot_of_sample.resize(sample_count, NO_SLOT);
+
+  std::cout << "Sample cache: " << slot_count << "/" << sample_count
+            << " samples on gpu" << std::endl;
+}
+
+SampleCache::~SampleCache() {
+  for (auto& chunk : _host_chunks) {
+    if (chunk.ptr) _context->unmap_buffer(chunk.buffer, chunk.ptr);
+  }
+}
+
+float* SampleCache::host_input(size_t sample_id) {
+  auto& chunk = _host_chunks[sample_id / _samples_per_chunk];
+  return chunk.ptr + 2 * _px_count * (sample_id % _samples_per_chunk);
+}
+
+float* SampleCache::host_expected(size_t sample_id) {
+  return host_input(sample_id) + _px_count;
+}
+
+void SampleCache::make_resident(SampleAllocationPool* const* samples,
+                                size_t count) {
+  if (count > capacity())
+    throw std::runtime_error(
+        "Sample cache cannot hold all samples of a mini-batch");
+  ++_request_id;
+
+  // hits first, so that they are protected from eviction
+  for (size_t i = 0; i < count; i++) {
+    size_t slot_idx = _slot_of_sample[samples[i]->id];
+    if (slot_idx == NO_SLOT) continue;
+    _slots[slot_idx].request_id = _request_id;
+    _lru.splice(_lru.begin(), _lru, _lru_position[slot_idx]);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    auto& sample = *samples[i];
+    size_t slot_idx = _slot_of_sample[sample.id];
+    if (slot_idx != NO_SLOT) {
+      ++_hits;
+    } else {
+      ++_misses;
+      slot_idx = upload(sample.id);
+      if (slot_idx == NO_SLOT) throw std::runtime_error("Sample cache is full");
+    }
+
+    sample.arena = &_arena;
+    sample.arena_slot = slot_idx;
+  }
+}
+
+void SampleCache::prefetch(SampleAllocationPool* const* samples,
+                           size_t count) {
+  // same request id, so that samples of last make_resident stay
+  for (size_t i = 0; i < count; i++) {
+    size_t slot_idx = _slot_of_sample[samples[i]->id];
+    if (slot_idx != NO_SLOT) {
+      _slots[slot_idx].request_id = _request_id;
+      _lru.splice(_lru.begin(), _lru, _lru_position[slot_idx]);
+    } else if (upload(samples[i]->id) != NO_SLOT) {
+      ++_prefetched;
+    } else {
+      break;
+    }
+  }
+}
+
+size_t SampleCache::upload(size_t sample_id) {
+  // least recently used slot is at the back. It can not be used by this
+  // request, since all its samples are at the front
+  size_t slot_idx = _lru.back();
+  Slot& slot = _slots[slot_idx];
+  if (slot.request_id == _request_id) return NO_SLOT;
+  if (slot.sample_id != NO_SLOT) _slot_of_sample[slot.sample_id] = NO_SLOT;
+  slot.sample_id = sample_id;
+  slot.request_id = _request_id;
+  _slot_of_sample[sample_id] = slot_idx;
+  _lru.splice(_lru.begin(), _lru, _lru_position[slot_idx]);
+
+  // refill from pinned memory, non blocking
+  _arena.write(_context, slot_idx, host_input(sample_id),
+               host_expected(sample_id));
+  return slot_idx;
+}
+
+void SampleCache::print_stats() {
+  size_t total = _hits + _misses;
+  std::cout << "Sample cache hits: " << _hits << "/" << total << " ("
+            << (total ? _hits * 100.0f / total : 0.0f) << "%), prefetched: "
+            << _prefetched << std::endl;
+}
+}
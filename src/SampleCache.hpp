@@ -0,0 +1,97 @@
+#ifndef SAMPLE_CACHE_H
+#define SAMPLE_CACHE_H
+
+#include <list>
+
+#include "ConfigBasedDataPipeline.hpp"
+
+namespace cnn_sr {
+
+/**
+ * Keeps only the most recently used samples on device. All samples live in
+ * pinned host memory (CL_MEM_ALLOC_HOST_PTR buffers, each below the device's
+ * max allocation size), device holds a fixed number of slots (single
+ * SampleArena) that fit into provided memory budget. Samples are
+ * immutable, so eviction does not need to copy anything back - the host copy
+ * is always valid.
+ *
+ * Misses are uploaded with non blocking writes. Queue is in-order, so they
+ * finish before the mini-batch that requested them copies the data. Samples
+ * of the next mini-batch can be uploaded ahead with prefetch.
+ *
+ * NOTE: SampleAllocationPool::arena_slot of a sample is only valid after
+ * make_resident was called for the sample (and till next call).
+ */
+class SampleCache {
+ public:
+  SampleCache(opencl::Context*, size_t sample_count, size_t w, size_t h,
+              size_t device_budget_bytes);
+  ~SampleCache();
+
+  /** Number of samples that fit on device */
+  inline size_t capacity() const { return _slots.size(); }
+
+  /** Device slots, samples point here after make_resident */
+  inline SampleArena* arena() { return &_arena; }
+
+  /** Host storage for the sample's luma, fill it before training */
+  float* host_input(size_t sample_id);
+  float* host_expected(size_t sample_id);
+
+  /**
+   * Make sure all provided samples are on device and set their arena slots.
+   * Least recently used samples that are not in the list are evicted.
+   */
+  void make_resident(SampleAllocationPool* const* samples, size_t count);
+
+  /**
+   * Start uploading samples that will be requested by next make_resident.
+   * Samples of last make_resident are not evicted, samples that do not fit
+   * are skipped.
+   */
+  void prefetch(SampleAllocationPool* const* samples, size_t count);
+
+  void print_stats();
+
+ private:
+  SampleCache(const SampleCache&) = delete;
+  SampleCache& operator=(const SampleCache&) = delete;
+
+  static const size_t NO_SLOT;
+
+  /** Evict least recently used slot and upload sample there. NO_SLOT if all
+   * slots are used by current request */
+  size_t upload(size_t sample_id);
+
+  struct Slot {
+    size_t sample_id = NO_SLOT;
+    /** used to protect samples of current request from eviction */
+    size_t request_id = 0;
+  };
+
+  opencl::Context* const _context;
+  const size_t _px_count;
+
+  struct HostChunk {
+    opencl::MemoryHandle buffer = gpu_nullptr;
+    float* ptr = nullptr;
+  };
+
+  /** pinned host storage, _samples_per_chunk samples each */
+  std::vector<HostChunk> _host_chunks;
+  size_t _samples_per_chunk = 0;
+
+  SampleArena _arena;
+  std::vector<Slot> _slots;
+  /** slot index for each sample, NO_SLOT if sample is not resident */
+  std::vector<size_t> _slot_of_sample;
+  /** slot indices, most recently used at front */
+  std::list<size_t> _lru;
+  std::vector<std::list<size_t>::iterator> _lru_position;
+
+  size_t _request_id = 0;
+  size_t _hits = 0, _misses = 0, _prefetched = 0;
+};
+}
+
+#endif /* SAMPLE_CACHE_H   */
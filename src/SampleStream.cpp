@@ -0,0 +1,169 @@
+#include "SampleStream.hpp"
+
+#include <algorithm>  // for std::shuffle
+#include <cstring>    // memcpy
+#include <iostream>
+#include <stdexcept>  // std::runtime_error
+
+#include "opencl\Context.hpp"
+
+namespace cnn_sr {
+
+SampleStream::SampleStream(opencl::Context* context,
+                           const char* const dataset_path, size_t shard_size,
+                           size_t first_sample)
+    : _context(context),
+      _dataset(dataset_path),
+      _shard_size(shard_size),
+      _first_sample(first_sample),
+      _sample_count(_dataset.size() > first_sample
+                        ? _dataset.size() - first_sample
+                        : 0) {
+  utils::require(_shard_size > 0, "Shard size should be > 0");
+  utils::require(_sample_count > 0, "No samples to stream");
+
+  // mini-batches are built from samples of same size
+  size_t w = _dataset.width(_first_sample), h = _dataset.height(_first_sample);
+  for (size_t i = _first_sample; i < _dataset.size(); i++) {
+    utils::require(_dataset.width(i) == w && _dataset.height(i) == h,
+                   "Streamed samples should all have the same size");
+  }
+  _px_count = w * h;
+
+  // device buffers are allocated once and reused by every shard
+  for (auto& slot : _slots) {
+    slot.samples.resize(std::min(_shard_size, _sample_count));
+    slot.decoded_ids.resize(slot.samples.size());
+    slot.host_luma.resize(2 * _px_count * slot.samples.size());
+    slot.arena.allocate(_context, w, h, slot.samples.size());
+    for (size_t i = 0; i < slot.samples.size(); i++) {
+      auto& sample = slot.samples[i];
+      sample.input_w = w;
+      sample.input_h = h;
+      sample.arena = &slot.arena;
+      sample.arena_slot = i;
+    }
+  }
+
+  size_t shard_count = (_sample_count + _shard_size - 1) / _shard_size;
+  for (size_t i = 0; i < shard_count; i++) _shard_order.push_back(i);
+  std::cout << "Streaming " << _sample_count << " samples in " << shard_count
+            << " shards" << std::endl;
+}
+
+SampleStream::~SampleStream() {
+  wait_for_decode();
+  for (auto& slot : _slots) wait_for_upload(slot);
+}
+
+bool SampleStream::restore_shard_order(const std::vector<size_t>& order) {
+  std::vector<size_t> sorted(order);
+  std::sort(sorted.begin(), sorted.end());
+  for (size_t i = 0; i < sorted.size(); i++) {
+    if (sorted[i] != i) return false;
+  }
+  if (sorted.size() != _shard_order.size()) return false;
+  _shard_order = order;
+  return true;
+}
+
+void SampleStream::begin_epoch(std::mt19937& generator) {
+  wait_for_decode();
+  for (auto& slot : _slots) wait_for_upload(slot);
+  std::shuffle(_shard_order.begin(), _shard_order.end(), generator);
+  _next_shard_pos = 0;
+  start_decode(0);
+}
+
+bool SampleStream::next_shard(std::vector<SampleAllocationPool*>& target,
+                              std::mt19937& generator) {
+  target.clear();
+  size_t pos = _next_shard_pos, shard_count = _shard_order.size();
+  if (pos >= shard_count) return false;
+  Slot& slot = slot_for(pos);
+
+  // first shard of the epoch could not be uploaded ahead
+  if (pos == 0) {
+    wait_for_decode();
+    upload(slot);
+    if (shard_count > 1) start_decode(1);
+  }
+  wait_for_upload(slot);
+
+  // slot of next shard held previous shard, which is fully processed. Upload
+  // runs while this shard is trained on
+  if (pos + 1 < shard_count) {
+    wait_for_decode();
+    upload(slot_for(pos + 1));
+  }
+  ++_next_shard_pos;
+  for (auto& sample : slot.samples) {
+    if (sample.id != (size_t)-1) target.push_back(&sample);
+  }
+  std::shuffle(target.begin(), target.end(), generator);
+
+  // host luma of this slot is free after its upload finished. Samples of
+  // the slot keep their ids till the upload of shard pos + 2
+  if (pos + 2 < shard_count) start_decode(pos + 2);
+  return true;
+}
+
+void SampleStream::start_decode(size_t shard_pos) {
+  _decode_thread =
+      std::thread(&SampleStream::decode_shard, this, _shard_order[shard_pos],
+                  std::ref(slot_for(shard_pos)));
+}
+
+void SampleStream::wait_for_decode() {
+  if (_decode_thread.joinable()) _decode_thread.join();
+}
+
+void SampleStream::decode_shard(size_t shard_idx, Slot& slot) {
+  // NOTE: this also pages in the mapped file, so disk reads happen here
+  size_t first = _first_sample + shard_idx * _shard_size,
+         expected_offset = _px_count * slot.samples.size();
+  for (size_t i = 0; i < slot.samples.size(); i++) {
+    size_t sample_idx = first + i;
+    if (sample_idx >= _dataset.size()) {
+      slot.decoded_ids[i] = (size_t)-1;  // last shard may be smaller
+      continue;
+    }
+    slot.decoded_ids[i] = sample_idx;
+    float* input = &slot.host_luma[i * _px_count];
+    float* expected = &slot.host_luma[expected_offset + i * _px_count];
+    const float* src = _dataset.input_luma(sample_idx, input);
+    if (src != input) memcpy(input, src, sizeof(float) * _px_count);
+    src = _dataset.expected_luma(sample_idx, expected);
+    if (src != expected) memcpy(expected, src, sizeof(float) * _px_count);
+  }
+}
+
+void SampleStream::upload(Slot& slot) {
+  // host_luma is not touched till the upload finishes, see next_shard.
+  // Unused slots of the last shard are at the end, skip them
+  size_t count = 0;
+  for (size_t i = 0; i < slot.samples.size(); i++) {
+    slot.samples[i].id = slot.decoded_ids[i];
+    if (slot.decoded_ids[i] != (size_t)-1) ++count;
+  }
+  size_t size = sizeof(cl_float) * _px_count * count,
+         expected_offset = _px_count * slot.samples.size();
+  slot.uploads[0] = _context->write_buffer_async(
+      slot.arena.input_luma, 0, size, (void*)&slot.host_luma[0]);
+  slot.uploads[1] =
+      _context->write_buffer_async(slot.arena.expected_luma, 0, size,
+                                   (void*)&slot.host_luma[expected_offset]);
+}
+
+void SampleStream::wait_for_upload(Slot& slot) {
+  if (!slot.uploads[0]) return;
+  // main queue uses the arena only after this, transfer queue is not ordered
+  // with it
+  cl_int ciErr1 = clWaitForEvents(2, slot.uploads);
+  for (auto& ev : slot.uploads) {
+    clReleaseEvent(ev);
+    ev = nullptr;
+  }
+  _context->check_error(ciErr1, "Shard upload failed");
+}
+}
@@ -0,0 +1,94 @@
+#ifndef SAMPLE_STREAM_H
+#define SAMPLE_STREAM_H
+
+#include <random>  // for std::mt19937
+#include <thread>
+
+#include "ConfigBasedDataPipeline.hpp"
+#include "DatasetFile.hpp"
+
+namespace cnn_sr {
+
+/**
+ * Streams training samples from packed dataset in shards, so that the dataset
+ * can be much bigger then device memory. Only 2 shards are resident: the one
+ * we are training on and the next one. While shard k is processed, shard k+1
+ * is uploaded on the transfer queue and shard k+2 is read from disk and
+ * decoded on background thread.
+ *
+ * Shard k holds samples [first_sample + k*shard_size, ...). Order of shards is
+ * shuffled every epoch and samples are shuffled inside of each shard.
+ */
+class SampleStream {
+ public:
+  SampleStream(opencl::Context*, const char* const dataset_path,
+               size_t shard_size, size_t first_sample = 0);
+  ~SampleStream();
+
+  inline size_t sample_count() const { return _sample_count; }
+  inline size_t shard_count() const { return _shard_order.size(); }
+
+  /** Every epoch shuffles the order of previous one, store it in checkpoint */
+  inline const std::vector<size_t>& shard_order() const {
+    return _shard_order;
+  }
+
+  /** @return false if order is not a permutation of our shards */
+  bool restore_shard_order(const std::vector<size_t>&);
+
+  /** Shuffle shards and start reading first of them */
+  void begin_epoch(std::mt19937&);
+
+  /**
+   * Wait for next shard and start uploading the one after it. Samples from
+   * previous shard must not be used after this call, all its mini-batches
+   * have to be finished.
+   * @return false if all shards from this epoch were already returned
+   */
+  bool next_shard(std::vector<SampleAllocationPool*>&, std::mt19937&);
+
+ private:
+  SampleStream(const SampleStream&) = delete;
+  SampleStream& operator=(const SampleStream&) = delete;
+
+  struct Slot {
+    SampleArena arena;
+    std::vector<SampleAllocationPool> samples;
+    /** ids written by decode, -1 past the end of last shard. Samples get
+     * them in upload, after the previous shard of the slot was trained */
+    std::vector<size_t> decoded_ids;
+    /** decoded input luma of all samples, then expected luma of all samples.
+     * Same layout as the arena, so each is uploaded with single write */
+    std::vector<float> host_luma;
+    /** writes of input and expected luma, nullptr if none is in flight */
+    cl_event uploads[2] = {nullptr, nullptr};
+  };
+
+  /** Shard on position shard_pos goes to slot shard_pos % 2 */
+  inline Slot& slot_for(size_t shard_pos) { return _slots[shard_pos % 2]; }
+
+  void start_decode(size_t shard_pos);
+  void wait_for_decode();
+  /**
+   * runs on background thread, does not touch the Context. Only writes host
+   * luma and decoded ids, samples may still be trained on
+   */
+  void decode_shard(size_t shard_idx, Slot&);
+  /** Apply decoded ids to the samples and start the upload */
+  void upload(Slot&);
+  void wait_for_upload(Slot&);
+
+ private:
+  opencl::Context* const _context;
+  DatasetFile _dataset;
+  const size_t _shard_size, _first_sample, _sample_count;
+  size_t _px_count;
+
+  Slot _slots[2];
+  std::vector<size_t> _shard_order;
+  size_t _next_shard_pos = 0;
+  std::thread _decode_thread;
+};
+}
+
+#endif /* SAMPLE_STREAM_H   */
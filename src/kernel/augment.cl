@@ -0,0 +1,118 @@
+/**
+ * Training sample augmentation. Random crops of resident source images are
+ * degraded on device - downscaled and bicubically upscaled back to the crop
+ * size. All images are square, samples are stored one after another.
+ */
+
+/**
+ * Cut crops out of source luma (uint8) and normalize them to 0..1.
+ * @param crops 4 values per sample: source offset, source width, x, y
+ */
+__kernel void crop(__global const uchar* source,  //
+                   __global const uint* crops,    //
+                   __global float* target,        //
+                   __const uint size,             //
+                   __const uint sample_count) {
+  const int idx = get_global_id(0);
+  const uint px_count = size * size;
+  if (idx >= px_count * sample_count) return;
+
+  const uint sample_id = idx / px_count, px = idx - sample_id * px_count;
+  __global const uint* c = crops + 4 * sample_id;
+  const uint x = c[2] + px % size, y = c[3] + px / size;
+  target[idx] = source[c[0] + y * c[1] + x] / 255.0f;
+}
+
+/** Box filter, each small pixel is the mean of area it covers */
+__kernel void downscale(__global const float* src,  //
+                        __global float* target,     //
+                        __const uint size,          //
+                        __const uint small_size,    //
+                        __const uint sample_count) {
+  const int idx = get_global_id(0);
+  const uint small_px_count = small_size * small_size;
+  if (idx >= small_px_count * sample_count) return;
+
+  const uint sample_id = idx / small_px_count,
+             px = idx - sample_id * small_px_count;
+  const uint sx = px % small_size, sy = px / small_size;
+  const float scale = (float)size / small_size;
+  const uint x0 = (uint)(sx * scale), y0 = (uint)(sy * scale),
+             x1 = max(x0 + 1, min(size, (uint)((sx + 1) * scale))),
+             y1 = max(y0 + 1, min(size, (uint)((sy + 1) * scale)));
+
+  __global const float* img = src + sample_id * size * size;
+  float sum = 0.0f;
+  for (uint y = y0; y < y1; y++) {
+    for (uint x = x0; x < x1; x++) {
+      sum += img[y * size + x];
+    }
+  }
+  target[idx] = sum / ((x1 - x0) * (y1 - y0));
+}
+
+/** Keys cubic convolution kernel with a = -0.5 */
+inline float cubic_weight(float x) {
+  x = fabs(x);
+  if (x <= 1.0f) return (1.5f * x - 2.5f) * x * x + 1.0f;
+  if (x < 2.0f) return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+  return 0.0f;
+}
+
+/** Bicubic upscale, pixels outside of the image are clamped to the edge */
+__kernel void upscale_bicubic(__global const float* src,  //
+                              __global float* target,     //
+                              __const uint small_size,    //
+                              __const uint size,          //
+                              __const uint sample_count) {
+  const int idx = get_global_id(0);
+  const uint px_count = size * size;
+  if (idx >= px_count * sample_count) return;
+
+  const uint sample_id = idx / px_count, px = idx - sample_id * px_count;
+  const float scale = (float)small_size / size;
+  // pixel centers are at +0.5
+  const float fx = (px % size + 0.5f) * scale - 0.5f,
+              fy = (px / size + 0.5f) * scale - 0.5f;
+  const int ix = (int)floor(fx), iy = (int)floor(fy),
+            max_idx = (int)small_size - 1;
+
+  __global const float* img = src + sample_id * small_size * small_size;
+  float result = 0.0f;
+  for (int j = -1; j <= 2; j++) {
+    const int y = clamp(iy + j, 0, max_idx);
+    const float wy = cubic_weight(fy - (iy + j));
+    for (int i = -1; i <= 2; i++) {
+      const int x = clamp(ix + i, 0, max_idx);
+      result += wy * cubic_weight(fx - (ix + i)) * img[y * small_size + x];
+    }
+  }
+  target[idx] = clamp(result, 0.0f, 1.0f);
+}
+
+/**
+ * Subtract mean of each sample from all its values. One work group per
+ * sample, local size has to be power of 2.
+ */
+__kernel void subtract_sample_mean(__global float* data,    //
+                                   __global float* means,   //
+                                   __local float* scratch,  //
+                                   __const uint px_count) {
+  const uint sample_id = get_group_id(0), local_index = get_local_id(0),
+             local_size = get_local_size(0);
+  __global float* sample = data + sample_id * px_count;
+
+  float sum = 0.0f;
+  for (uint i = local_index; i < px_count; i += local_size) sum += sample[i];
+  scratch[local_index] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (uint offset = local_size / 2; offset > 0; offset /= 2) {
+    if (local_index < offset)
+      scratch[local_index] += scratch[local_index + offset];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  const float mean = scratch[0] / px_count;
+  for (uint i = local_index; i < px_count; i += local_size) sample[i] -= mean;
+  if (local_index == 0) means[sample_id] = mean;
+}
@@ -28,6 +28,43 @@ inline void atomic_add_global(volatile __global float* source, const float opera
                           newVal.intVal) != prevVal.intVal);
 }
 
+/**
+ * Half precision activations and deltas. Math is done in float, only storage
+ * differs, unless HALF_MATH is defined and device supports cl_khr_fp16 - then
+ * products and sums of each row are half, only sum of rows is float. With
+ * cl_khr_fp16 half values are converted directly, otherwise through
+ * vload_half/vstore_half.
+ */
+#if defined(cl_khr_fp16) && \
+    (defined(DELTAS_HALF) || defined(INPUT_HALF) || defined(HALF_MATH))
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+#define LOAD_HALF(arena, idx) ((float)(arena)[idx])
+#else
+#define LOAD_HALF(arena, idx) vload_half(idx, arena)
+#endif
+
+#if defined(HALF_MATH) && defined(cl_khr_fp16)
+#define MATH_T half
+#else
+#define MATH_T float
+#endif
+
+#ifdef DELTAS_HALF
+#define DELTAS_T half
+#define LOAD_DELTA(arena, idx) LOAD_HALF(arena, idx)
+#else
+#define DELTAS_T float
+#define LOAD_DELTA(arena, idx) (arena)[idx]
+#endif
+
+#ifdef INPUT_HALF
+#define INPUT_T half
+#define LOAD_INPUT(arena, idx) LOAD_HALF(arena, idx)
+#else
+#define INPUT_T float
+#define LOAD_INPUT(arena, idx) (arena)[idx]
+#endif
+
 /* clang-format off */
 /**
  *
@@ -50,16 +87,20 @@ inline void atomic_add_global(volatile __global float* source, const float opera
  *     for b = 0..spatial_size(l):       # (it's kernel size, what You expect ?)
  *       for k = 0..filter_count(l-1):   # for all inputs
  *         dJ/dw[abnk] += deltas[i,j,n]  # (1) error for this point
- *           * layer_input[i+b,j+a,k]    # (2) input at this point
+ *           * layer_input[i+b,j+a,k]    # (2) input at this point *
+ * macros:
+ *   DELTAS_HALF                    deltas are stored as half
+ *   INPUT_HALF                     layer_input is stored as half
+ *   HALF_MATH                      compute in half precision
  */
 /* clang-format on */
-__kernel void backpropagate(__read_only __global float* deltas,       //
-                            __read_only __global float* layer_input,  //
-                            __global float* target_grad_w,            //
-                            __global float* target_grad_b,            //
-                            uint n_current_filter_cnt,                //
-                            uint n_prev_filter_cnt,                   //
-                            uint f_spatial_size,                      //
+__kernel void backpropagate(__read_only __global DELTAS_T* deltas,      //
+                            __read_only __global INPUT_T* layer_input,  //
+                            __global float* target_grad_w,              //
+                            __global float* target_grad_b,              //
+                            uint n_current_filter_cnt,                  //
+                            uint n_prev_filter_cnt,                     //
+                            uint f_spatial_size,                        //
                             uint layer_out_w, uint layer_out_h) {
   const int id = get_global_id(0);
   const uint sample_id = get_global_id(1);
@@ -87,11 +128,12 @@ __kernel void backpropagate(__read_only __global float* deltas,       //
   if (id < weights_size) {
     float grad_w = 0.0f, grad_b = 0.0f;
     for (size_t row = 0; row < layer_out_h; row++) {
+      MATH_T row_grad_w = 0.0f, row_grad_b = 0.0f;
       for (size_t col = 0; col < layer_out_w; col++) {
         // (1) delta[i,j,n](l)
         int idx = ((row * layer_out_w) + col) * n_current_filter_cnt;
-        float delta = deltas[IMAGE_OFFSET_CURR + idx + n];
-        grad_b += delta;
+        MATH_T delta = LOAD_DELTA(deltas, IMAGE_OFFSET_CURR + idx + n);
+        row_grad_b += delta;
 
         // (2) layer_input[i+b,j+a,k]
         // NOTE: we normally should be subtracting [dx,dy], but it does
@@ -100,9 +142,12 @@ __kernel void backpropagate(__read_only __global float* deltas,       //
         int prev_layer_idx = ((prev_layer_pos.y * input_w) + prev_layer_pos.x) *
                              n_prev_filter_cnt;
 
-        float input = layer_input[IMAGE_OFFSET_PREV + prev_layer_idx + k];
-        grad_w += input * delta;
+        MATH_T input =
+            LOAD_INPUT(layer_input, IMAGE_OFFSET_PREV + prev_layer_idx + k);
+        row_grad_w += input * delta;
       }
+      grad_w += row_grad_w;
+      grad_b += row_grad_b;
     }
 
     // write
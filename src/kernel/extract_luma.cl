@@ -4,20 +4,54 @@ __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |  //
 
 __constant float4 rgb2y = {0.299f, 0.587f, 0.114f, 0.0f};
 
+/** Keys cubic convolution kernel with a = -0.5, same as in augment.cl */
+inline float cubic_weight(float x) {
+  x = fabs(x);
+  if (x <= 1.0f) return (1.5f * x - 2.5f) * x * x + 1.0f;
+  if (x < 2.0f) return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+  return 0.0f;
+}
+
+/**
+ * Luma of original image at position in image scale times bigger. Bicubic
+ * interpolation, pixel centers are at +0.5, pixels outside of the image are
+ * clamped to the edge (sampler)
+ */
+float read_luma_scaled(__read_only image2d_t image, int2 pos, uint scale) {
+  if (scale == 1)
+    return dot(convert_float4(read_imageui(image, sampler, pos)), rgb2y);
+  const float2 f = (convert_float2(pos) + 0.5f) / scale - 0.5f;
+  const int2 p = convert_int2(floor(f));
+  float result = 0.0f;
+  for (int j = -1; j <= 2; j++) {
+    const float wy = cubic_weight(f.y - (p.y + j));
+    for (int i = -1; i <= 2; i++) {
+      const float4 col = convert_float4(
+          read_imageui(image, sampler, p + (int2)(i, j)));
+      result += wy * cubic_weight(f.x - (p.x + i)) * dot(col, rgb2y);
+    }
+  }
+  return clamp(result, 0.0f, 255.0f);
+}
+
+/**
+ * @param w      width of target luma (scale * image width)
+ * @param h      height of target luma (scale * image height)
+ * @param scale  target is scale times bigger then the image
+ */
 __kernel void extract_luma(__read_only image2d_t image,  //
                            __global float* target,       //
-                           int w, int h) {
+                           int w, int h, uint scale) {
   const int2 pos = {get_global_id(0), get_global_id(1)};
 
   if (pos.x >= 0 && pos.x < w &&  //
       pos.y >= 0 && pos.y < h) {
     int idx = pos.y * w + pos.x;
-    uint4 pixel_col = read_imageui(image, sampler, pos);
-    float4 pixel_col_f = convert_float4(pixel_col);
+    float luma = read_luma_scaled(image, pos, scale);
 #ifdef NORMALIZE
-    target[idx] = dot(pixel_col_f, rgb2y) / 255.0f;
+    target[idx] = luma / 255.0f;
 #else
-    target[idx] = dot(pixel_col_f, rgb2y);
+    target[idx] = luma;
 #endif  // NORMALIZE
   }
 }
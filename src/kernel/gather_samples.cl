@@ -0,0 +1,47 @@
+/**
+ * Gather whole mini-batch from sample arenas in single launch. Sample with
+ * arena slot s occupies elements [s*px_count, (s+1)*px_count) of input arena
+ * and [s*expected_px_count, (s+1)*expected_px_count) of expected arena.
+ * Element type of arenas:
+ *   default       - float
+ *   STORAGE_UINT8 - uchar, value / 255 - input_means[s] (expected: value / 255)
+ *   STORAGE_HALF  - half
+ */
+#if defined(STORAGE_UINT8)
+#define ARENA_T uchar
+#define LOAD(arena, idx) (arena[idx] / 255.0f)
+#elif defined(STORAGE_HALF)
+#define ARENA_T half
+#define LOAD(arena, idx) vload_half(idx, arena)
+#else
+#define ARENA_T float
+#define LOAD(arena, idx) arena[idx]
+#endif
+
+__kernel void gather_samples(__global const ARENA_T* input_arena,     //
+                             __global const ARENA_T* expected_arena,  //
+                             __global const float* input_means,       //
+                             __global const uint* slots,              //
+                             __global float* input_target,            //
+                             __global float* expected_target,         //
+                             __const uint px_count,                   //
+                             __const uint expected_px_count,          //
+                             __const uint sample_count) {
+  const int idx = get_global_id(0);
+  if (idx < expected_px_count * sample_count) {
+    const uint sample_idx = idx / expected_px_count;
+    const uint slot = slots[sample_idx];
+    const uint px = idx - sample_idx * expected_px_count;
+    expected_target[idx] = LOAD(expected_arena, slot * expected_px_count + px);
+
+    // input is smaller if network upscales on its own
+    if (px >= px_count) return;
+    const uint src_idx = slot * px_count + px,
+               target_idx = sample_idx * px_count + px;
+#ifdef STORAGE_UINT8
+    input_target[target_idx] = LOAD(input_arena, src_idx) - input_means[slot];
+#else
+    input_target[target_idx] = LOAD(input_arena, src_idx);
+#endif
+  }
+}
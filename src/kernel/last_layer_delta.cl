@@ -1,3 +1,16 @@
+/**
+ * With LOSS_SCALING defined deltas are multiplied by current loss scale
+ * (see loss_scaling.cl), so that all following deltas and gradients are
+ * scaled too.
+ */
+#ifdef LOSS_SCALING
+#define LOSS_SCALING_ARG , __global const float* loss_scaling
+#define LOSS_SCALE loss_scaling[0]
+#else
+#define LOSS_SCALING_ARG
+#define LOSS_SCALE 1.0f
+#endif
+
 /* clang-format off */
 /**
  * [main description]
@@ -17,7 +30,8 @@ __kernel void last_layer_delta(__read_only __global float* ground_truth_image,
                                __const uint ground_truth_w,  //
                                __const uint ground_truth_h,  //
                                __const uint algo_result_w,   //
-                               __const uint algo_result_h) {
+                               __const uint algo_result_h
+                                   LOSS_SCALING_ARG) {
   const int2 pos = {get_global_id(0), get_global_id(1)};  // x=col=i, y=row=j
   const uint sample_id = get_global_id(2);
   const int2 out_size = {algo_result_w, algo_result_h};
@@ -45,6 +59,6 @@ __kernel void last_layer_delta(__read_only __global float* ground_truth_image,
     float relu_deriv = y > 0.0f ? 1.0f : 0.0f;
 
     // write result
-    target[IMAGE_OFFSET_ALGO + idx] = d * relu_deriv;
+    target[IMAGE_OFFSET_ALGO + idx] = d * relu_deriv * LOSS_SCALE;
   }
 }
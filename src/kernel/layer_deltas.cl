@@ -1,3 +1,44 @@
+/**
+ * Half precision activations and deltas. Math is done in float, only storage
+ * differs, unless HALF_MATH is defined and device supports cl_khr_fp16. With
+ * cl_khr_fp16 half values are converted directly, otherwise through
+ * vload_half/vstore_half.
+ */
+#if defined(cl_khr_fp16) && \
+    (defined(ACTIVATIONS_HALF) || defined(NEXT_DELTAS_HALF) || \
+     defined(HALF_MATH))
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+#define LOAD_HALF(arena, idx) ((float)(arena)[idx])
+#define STORE_HALF(arena, idx, v) ((arena)[idx] = (half)(v))
+#else
+#define LOAD_HALF(arena, idx) vload_half(idx, arena)
+#define STORE_HALF(arena, idx, v) vstore_half(v, idx, arena)
+#endif
+
+#ifdef ACTIVATIONS_HALF
+#define ACTIVATIONS_T half
+#define LOAD_ACTIVATION(arena, idx) LOAD_HALF(arena, idx)
+#define STORE_ACTIVATION(arena, idx, v) STORE_HALF(arena, idx, v)
+#else
+#define ACTIVATIONS_T float
+#define LOAD_ACTIVATION(arena, idx) (arena)[idx]
+#define STORE_ACTIVATION(arena, idx, v) ((arena)[idx] = (v))
+#endif
+
+#if defined(HALF_MATH) && defined(cl_khr_fp16)
+#define MATH_T half
+#else
+#define MATH_T float
+#endif
+
+#ifdef NEXT_DELTAS_HALF
+#define NEXT_DELTAS_T half
+#define LOAD_NEXT_DELTA(arena, idx) LOAD_HALF(arena, idx)
+#else
+#define NEXT_DELTAS_T float
+#define LOAD_NEXT_DELTA(arena, idx) (arena)[idx]
+#endif
+
 
 /* clang-format off */
 /**
@@ -24,10 +65,16 @@
  *
  * macros:
  * 	CURRENT_FILTER_COUNT                   filter_count(l-1)
+ * 	ACTIVATIONS_HALF                       layer_output and target are stored as half
+ * 	NEXT_DELTAS_HALF                       deltas_next_layer are stored as half
+ * 	HALF_MATH                              compute deltas in half precision
+ * 	SKIP_RELU                              layer (l-1) is linear, derivative is 1
  *
  * @param  float*      deltas_next_layer   size: output_w(l) * output_w(l) * filter_count(l)
  * @param  float*      layer_output        size: output_w(l-1) * output_w(l-1) * filter_count(l-1)
  * @param  float*      target              size: output_w(l-1) * output_w(l-1) * filter_count(l-1)
+ *                                         May be the same buffer as layer_output, each work item
+ *                                         reads its activations before it writes the deltas
  * @param  float*      W                   weights between (l-1) and (l).
  *                                         WARN: w3 is between (l2) and (l3), w2 -> (l1) and (l2), w1 -> (input) and (l1)
  *                                         size: f_spatial_size*f_spatial_size*filter_count(l-1)*filter_count(l)
@@ -39,13 +86,13 @@
  * @return {[type]}                        [description]
  */
 /* clang-format on */
-__kernel void deltas(__read_only __global float* deltas_next_layer,  //
-                     __read_only __global float* layer_output,       //
-                     __global float* target,                         //
-                     __read_only __global float* W,                  //
-                     uint f_spatial_size,                            //
-                     uint f_next_spatial_size,                       //
-                     uint n_next_filter_cnt,                         //
+__kernel void deltas(__read_only __global NEXT_DELTAS_T* deltas_next_layer,  //
+                     __read_only __global ACTIVATIONS_T* layer_output,       //
+                     __global ACTIVATIONS_T* target,                         //
+                     __read_only __global float* W,                          //
+                     uint f_spatial_size,                                    //
+                     uint f_next_spatial_size,                               //
+                     uint n_next_filter_cnt,                                 //
                      uint layer_out_w, uint layer_out_h) {
   // x=col=i; range: 0..layer_out_w
   // y=row=j; range: 0..layer_out_h
@@ -62,8 +109,8 @@ __kernel void deltas(__read_only __global float* deltas_next_layer,  //
   sample_id* n_next_filter_cnt* next_layer_out.x* next_layer_out.y
 
   // zeroed result cache and read read output values for output[i,j,n]
-  float delta_for_filter[CURRENT_FILTER_COUNT];
-  float activation_func_derivatives[CURRENT_FILTER_COUNT];
+  MATH_T delta_for_filter[CURRENT_FILTER_COUNT];
+  MATH_T activation_func_derivatives[CURRENT_FILTER_COUNT];
 
   // range check for i,j
   if (pos.x >= 0 && pos.x < out_dim.x &&  //
@@ -72,8 +119,12 @@ __kernel void deltas(__read_only __global float* deltas_next_layer,  //
     for (size_t n = 0; n < CURRENT_FILTER_COUNT; n++) {
       delta_for_filter[n] = 0.0f;
       // (3) f`( x[i,j,n](l-1) )
-      float y_ijn = layer_output[IMAGE_OFFSET_CURR + idx + n];
+#ifdef SKIP_RELU
+      activation_func_derivatives[n] = 1.0f;
+#else
+      float y_ijn = LOAD_ACTIVATION(layer_output, IMAGE_OFFSET_CURR + idx + n);
       activation_func_derivatives[n] = y_ijn > 0.0f ? 1.0f : 0.0f;
+#endif  // SKIP_RELU
     }
 
     for (size_t dy = 0; dy < f_next_spatial_size; dy++) {
@@ -94,19 +145,19 @@ __kernel void deltas(__read_only __global float* deltas_next_layer,  //
           bool in_range =
               next_layer_pos.x >= 0 && next_layer_pos.x < next_layer_out.x &&
               next_layer_pos.y >= 0 && next_layer_pos.y < next_layer_out.y;
-          float delta =
-              in_range
-                  ? deltas_next_layer[IMAGE_OFFSET_NEXT + next_layer_idx + k]
-                  : 0.0f;
+          MATH_T delta = in_range ? LOAD_NEXT_DELTA(deltas_next_layer,
+                                                    IMAGE_OFFSET_NEXT +
+                                                        next_layer_idx + k)
+                                  : 0.0f;
 
           for (size_t n = 0; n < CURRENT_FILTER_COUNT; n++) {
             // (1) w[abnk](l-1)
             // NOTE: n iterates over lower layer's filters
             size_t w_idx = w_idx_2D + n * n_next_filter_cnt + k;
-            float w = W[w_idx];
+            MATH_T w = W[w_idx];
 
             // (3) f`( x[i,j,n](l-1) )
-            float activation_func_derivative = activation_func_derivatives[n];
+            MATH_T activation_func_derivative = activation_func_derivatives[n];
 
             // result
             delta_for_filter[n] += delta * w * activation_func_derivative;
@@ -119,7 +170,8 @@ __kernel void deltas(__read_only __global float* deltas_next_layer,  //
 
     // write results
     for (size_t n = 0; n < CURRENT_FILTER_COUNT; n++) {
-      target[IMAGE_OFFSET_CURR + idx + n] = delta_for_filter[n];
+      STORE_ACTIVATION(target, IMAGE_OFFSET_CURR + idx + n,
+                       delta_for_filter[n]);
     }
 
     // end
@@ -0,0 +1,106 @@
+/**
+ * Int8 inference. Same convolution as layer_uber_kernel.cl, but inputs and
+ * weights are int8 and dot products are accumulated in int. Result is scaled
+ * back to float, bias and relu are applied and the value is requantized for
+ * the next layer.
+ *
+ * Real values:
+ *   input   = input_scale * input[i]               (one scale per layer)
+ *   weight  = weight_scale[n] * W[n, dy, dx, k]    (one scale per filter)
+ *
+ * macros:
+ *   CURRENT_FILTER_COUNT      filter count for curent layer
+ *   PREVIOUS_FILTER_COUNT     filter count for previous layer
+ *   F_SPATIAL_SIZE            spatial size
+ *   SKIP_RELU                 write raw result
+ *   OUTPUT_FLOAT              write float result instead of int8 (last layer)
+ */
+
+#ifdef OUTPUT_FLOAT
+#define OUTPUT_T float
+#else
+#define OUTPUT_T char
+#endif
+
+// dp4a: native on devices with 4x8bit integer dot product
+#ifdef __opencl_c_integer_dot_product_input_4x8bit
+#define DOT4(a, b) dot(a, b)
+#else
+inline int dot4(char4 a, char4 b) {
+  int4 p = convert_int4(a) * convert_int4(b);
+  return p.x + p.y + p.z + p.w;
+}
+#define DOT4(a, b) dot4(a, b)
+#endif
+
+/** Symmetric, saturated to [-127, 127] */
+inline char quantize_value(float value, float inv_scale) {
+  return convert_char_rte(clamp(value * inv_scale, -127.0f, 127.0f));
+}
+
+/**
+ * @param input                int8 output of previous layer, same layout as
+ *                             in layer_uber_kernel.cl
+ * @param target               output, size: out_w * out_h * CURRENT_FILTER_COUNT
+ * @param W                    int8 weights, each filter is contiguous:
+ *                               index = ((n * F_SPATIAL_SIZE + dy) *
+ *                                 F_SPATIAL_SIZE + dx) * PREVIOUS_FILTER_COUNT + k
+ * @param scales               per filter: input_scale * weight_scale[n]
+ * @param B                    float biases
+ * @param output_inv_scale     1 / input_scale of next layer
+ * @param input_w              source width
+ * @param input_h              source height
+ */
+__kernel void forward_int8(__global const char* input,    //
+                           __global OUTPUT_T* target,     //
+                           __global const char* W,        //
+                           __global const float* scales,  //
+                           __global const float* B,       //
+                           __const float output_inv_scale,
+                           __const uint input_w, __const uint input_h) {
+  const int2 pos = {get_global_id(0), get_global_id(1)};
+  const uint sample_id = get_global_id(2);
+  const int2 out_size = {input_w - F_SPATIAL_SIZE + 1,
+                         input_h - F_SPATIAL_SIZE + 1};
+  if (pos.x >= out_size.x || pos.y >= out_size.y) return;
+
+  const uint filter_size =
+      F_SPATIAL_SIZE * F_SPATIAL_SIZE * PREVIOUS_FILTER_COUNT;
+  const uint out_idx =
+      (sample_id * out_size.x * out_size.y + pos.y * out_size.x + pos.x) *
+      CURRENT_FILTER_COUNT;
+  __global const char* in =
+      input + sample_id * PREVIOUS_FILTER_COUNT * input_w * input_h;
+
+  for (uint n = 0; n < CURRENT_FILTER_COUNT; n++) {
+    __global const char* w = W + n * filter_size;
+    int acc = 0;
+    for (uint dy = 0; dy < F_SPATIAL_SIZE; dy++) {
+      for (uint dx = 0; dx < F_SPATIAL_SIZE; dx++) {
+        __global const char* in_px =
+            in + ((pos.y + dy) * input_w + pos.x + dx) * PREVIOUS_FILTER_COUNT;
+        __global const char* w_px =
+            w + (dy * F_SPATIAL_SIZE + dx) * PREVIOUS_FILTER_COUNT;
+#if PREVIOUS_FILTER_COUNT % 4 == 0
+        for (uint k = 0; k < PREVIOUS_FILTER_COUNT / 4; k++) {
+          acc += DOT4(vload4(k, in_px), vload4(k, w_px));
+        }
+#else
+        for (uint k = 0; k < PREVIOUS_FILTER_COUNT; k++) {
+          acc += in_px[k] * w_px[k];
+        }
+#endif
+      }
+    }
+
+    float result = acc * scales[n] + B[n];
+#ifndef SKIP_RELU
+    result = max(result, 0.0f);
+#endif  // SKIP_RELU
+#ifdef OUTPUT_FLOAT
+    target[out_idx + n] = result;
+#else
+    target[out_idx + n] = quantize_value(result, output_inv_scale);
+#endif  // OUTPUT_FLOAT
+  }
+}
@@ -1,3 +1,33 @@
+/**
+ * Half precision activations. Math is always done in float, only storage
+ * differs. With cl_khr_fp16 half values are converted directly, otherwise
+ * through vload_half/vstore_half.
+ */
+#if defined(cl_khr_fp16) && (defined(INPUT_HALF) || defined(OUTPUT_HALF))
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+#define LOAD_HALF(arena, idx) ((float)(arena)[idx])
+#define STORE_HALF(arena, idx, v) ((arena)[idx] = (half)(v))
+#else
+#define LOAD_HALF(arena, idx) vload_half(idx, arena)
+#define STORE_HALF(arena, idx, v) vstore_half(v, idx, arena)
+#endif
+
+#ifdef INPUT_HALF
+#define INPUT_T half
+#define LOAD_INPUT(arena, idx) LOAD_HALF(arena, idx)
+#else
+#define INPUT_T float
+#define LOAD_INPUT(arena, idx) (arena)[idx]
+#endif
+
+#ifdef OUTPUT_HALF
+#define OUTPUT_T half
+#define STORE_OUTPUT(arena, idx, v) STORE_HALF(arena, idx, v)
+#else
+#define OUTPUT_T float
+#define STORE_OUTPUT(arena, idx, v) ((arena)[idx] = (v))
+#endif
+
 /**
  *
  * Weights are 4D, indexing formula:
@@ -13,6 +43,8 @@
  *
  * macros:
  *   CURRENT_FILTER_COUNT      filter count for curent layer
+ *   INPUT_HALF                input is stored as half
+ *   OUTPUT_HALF               target is stored as half
  *
  * @param input                output of previous layer, size:
  *                               * 1st layer: img_w * img_h
@@ -34,8 +66,8 @@
  * @param input_h              source height
  */
 __kernel
-void forward(__read_only __global float* input,
-          __global float* target,
+void forward(__read_only __global INPUT_T* input,
+          __global OUTPUT_T* target,
           __read_only __global float* W,
           __read_only __global float* B,
           uint input_w, uint input_h){
@@ -74,7 +106,7 @@ void forward(__read_only __global float* input,
       size_t w_idx_2D = ((dy * F_SPATIAL_SIZE) + dx) * CURRENT_FILTER_COUNT * PREVIOUS_FILTER_COUNT;
 
       for (size_t k = 0; k < PREVIOUS_FILTER_COUNT; k++) {
-        float point_value = input[IMAGE_OFFSET_IN + base_input_idx + k];
+        float point_value = LOAD_INPUT(input, IMAGE_OFFSET_IN + base_input_idx + k);
         size_t w_idx_3D = w_idx_2D + k * CURRENT_FILTER_COUNT;
 
         for (size_t n = 0; n < CURRENT_FILTER_COUNT; n++) {
@@ -87,10 +119,9 @@ void forward(__read_only __global float* input,
   // add bias and write cached results to target buffer
   for (size_t filter_id = 0; filter_id < CURRENT_FILTER_COUNT; filter_id++) {
     float result = vals_by_filter[filter_id] + B[filter_id];
-#ifdef SKIP_RELU
-    target[IMAGE_OFFSET_OUT + out_idx + filter_id] = result;
-#else
-    target[IMAGE_OFFSET_OUT + out_idx + filter_id] = max(result, 0.0f);
+#ifndef SKIP_RELU
+    result = max(result, 0.0f);
 #endif // SKIP_RELU
+    STORE_OUTPUT(target, IMAGE_OFFSET_OUT + out_idx + filter_id, result);
   }
 }
@@ -0,0 +1,93 @@
+/**
+ * Sampling of training samples in proportion to their last loss. Losses are
+ * kept per arena slot, so that slot ids can be drawn on device.
+ */
+
+/** Store loss of each sample of the mini-batch under its arena slot */
+__kernel void scatter_losses(__global const float* batch_losses,  //
+                             __global const uint* slots,          //
+                             __global float* sample_losses,       //
+                             __const uint sample_count) {
+  const int idx = get_global_id(0);
+  if (idx >= sample_count) return;
+  sample_losses[slots[idx]] = batch_losses[idx];
+}
+
+/** Losses of the given slots, so that only some slots can be drawn from */
+__kernel void gather_losses(__global const float* sample_losses,  //
+                            __global const uint* slots,           //
+                            __global float* target,               //
+                            __const uint count) {
+  const int idx = get_global_id(0);
+  if (idx >= count) return;
+  target[idx] = sample_losses[slots[idx]];
+}
+
+/**
+ * Inclusive prefix sum of losses. Run as single work group: each work item
+ * scans consecutive chunk, then chunk totals are scanned in local memory.
+ */
+__kernel void loss_prefix_sum(__global const float* losses,  //
+                              __global float* cdf,           //
+                              __local float* scratch,        //
+                              __const uint count) {
+  const uint local_index = get_local_id(0), local_size = get_local_size(0);
+  const uint chunk = (count + local_size - 1) / local_size,
+             begin = min(count, local_index * chunk),
+             end = min(count, begin + chunk);
+
+  float sum = 0.0f;
+  for (uint i = begin; i < end; i++) {
+    sum += losses[i];
+    cdf[i] = sum;
+  }
+  scratch[local_index] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Hillis-Steele scan of chunk totals
+  for (uint offset = 1; offset < local_size; offset *= 2) {
+    float other = local_index >= offset ? scratch[local_index - offset] : 0.0f;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    scratch[local_index] += other;
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  const float chunk_offset = local_index > 0 ? scratch[local_index - 1] : 0.0f;
+  for (uint i = begin; i < end; i++) cdf[i] += chunk_offset;
+}
+
+/**
+ * Draw arena slots, one uniform random number u in [0, 1) per draw. Draws
+ * with u < loss_fraction pick slot in proportion to its loss (binary search
+ * in cdf), rest pick slot uniformly. If all losses are 0 every draw is
+ * uniform.
+ */
+__kernel void draw_by_loss(__global const float* cdf,       //
+                           __global const float* uniforms,  //
+                           __global uint* target,           //
+                           __const uint count,              //
+                           __const uint draw_count,         //
+                           __const float loss_fraction) {
+  const int idx = get_global_id(0);
+  if (idx >= draw_count) return;
+
+  const float u = uniforms[idx], total = cdf[count - 1];
+  uint slot;
+  if (u < loss_fraction && total > 0.0f) {
+    const float x = u / loss_fraction * total;
+    uint lo = 0, hi = count - 1;
+    while (lo < hi) {
+      uint mid = (lo + hi) / 2;
+      if (cdf[mid] > x)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    slot = lo;
+  } else if (u < loss_fraction) {
+    slot = (uint)(u / loss_fraction * count);
+  } else {
+    slot = (uint)((u - loss_fraction) / (1.0f - loss_fraction) * count);
+  }
+  target[idx] = min(slot, count - 1);
+}
@@ -0,0 +1,45 @@
+/**
+ * Dynamic loss scaling for mixed precision training. Deltas of last layer
+ * are multiplied by the loss scale, so that small gradients do not underflow
+ * in half precision. Optimizer kernels divide the gradients by the same
+ * scale. Whole state lives on gpu, so that the host never waits for it:
+ *
+ *   state[0]  current loss scale
+ *   state[1]  updates since last overflow
+ *   state[2]  overflow flag (!= 0 if gradients are not finite)
+ *   state[3]  skipped updates so far
+ *   state[4]  applied updates so far (Adam step), exact up to 2^24
+ */
+
+/** Raise overflow flag if any of the gradients is inf or nan */
+__kernel void check_overflow(__global const float* gradients,  //
+                             __global float* state,            //
+                             __const uint size) {
+  const uint idx = get_global_id(0);
+  if (idx >= size) return;
+  // all writers store the same value, race is harmless
+  if (!isfinite(gradients[idx])) state[2] = 1.0f;
+}
+
+/**
+ * Single work item, runs after the optimizer. Halves the scale on overflow
+ * (update was skipped), doubles it after growth_interval clean updates.
+ * Only applied updates are counted as Adam steps.
+ */
+__kernel void update_loss_scale(__global float* state,  //
+                                __const uint growth_interval) {
+  if (get_global_id(0) != 0) return;
+  if (state[2] != 0.0f) {
+    state[0] = max(state[0] * 0.5f, 1.0f);
+    state[1] = 0.0f;
+    state[3] += 1.0f;
+  } else if (state[1] + 1.0f >= growth_interval) {
+    state[0] = min(state[0] * 2.0f, 65536.0f * 65536.0f);
+    state[1] = 0.0f;
+    state[4] += 1.0f;
+  } else {
+    state[1] += 1.0f;
+    state[4] += 1.0f;
+  }
+  state[2] = 0.0f;
+}
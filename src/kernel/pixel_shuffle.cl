@@ -0,0 +1,42 @@
+/**
+ * Sub-pixel convolution (ESPCN). Layer output of size w*h with r*r channels
+ * (channels are innermost, same as in layer_uber_kernel.cl) is rearranged
+ * into single channel image of size (w*r)*(h*r):
+ *
+ *   target[y*r + dy, x*r + dx] = src[y, x, dy*r + dx]
+ *
+ * One work item per pixel of the big image, samples are stored one after
+ * another.
+ */
+__kernel void pixel_shuffle(__global const float* src,  //
+                            __global float* target,     //
+                            __const uint w,             //
+                            __const uint h,             //
+                            __const uint r,             //
+                            __const uint sample_count) {
+  const uint idx = get_global_id(0);
+  const uint big_w = w * r, px_count = big_w * h * r;
+  if (idx >= px_count * sample_count) return;
+
+  const uint sample_id = idx / px_count, px = idx - sample_id * px_count;
+  const uint bx = px % big_w, by = px / big_w;
+  const uint x = bx / r, y = by / r, channel = (by % r) * r + bx % r;
+  target[idx] = src[(sample_id * w * h + y * w + x) * r * r + channel];
+}
+
+/** Inverse of pixel_shuffle, used to bring deltas back to layer layout */
+__kernel void pixel_unshuffle(__global const float* src,  //
+                              __global float* target,     //
+                              __const uint w,             //
+                              __const uint h,             //
+                              __const uint r,             //
+                              __const uint sample_count) {
+  const uint idx = get_global_id(0);
+  const uint big_w = w * r, px_count = big_w * h * r;
+  if (idx >= px_count * sample_count) return;
+
+  const uint sample_id = idx / px_count, px = idx - sample_id * px_count;
+  const uint bx = px % big_w, by = px / big_w;
+  const uint x = bx / r, y = by / r, channel = (by % r) * r + bx % r;
+  target[(sample_id * w * h + y * w + x) * r * r + channel] = src[idx];
+}
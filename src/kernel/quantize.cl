@@ -0,0 +1,12 @@
+/**
+ * Symmetric int8 quantization of float buffer, used for input of first int8
+ * layer (see layer_int8.cl). Values are saturated to [-127, 127].
+ */
+__kernel void quantize(__global const float* src,  //
+                       __global char* target,      //
+                       __const float inv_scale,    //
+                       __const uint count) {
+  const int idx = get_global_id(0);
+  if (idx < count)
+    target[idx] = convert_char_rte(clamp(src[idx] * inv_scale, -127.0f, 127.0f));
+}
@@ -31,7 +31,7 @@ inline void atomic_add_global(volatile __global float* source, const float opera
 /**
  * Part of mean square error calculations. Here we take 2 same sized,
  * single color channel buffers with image data and get the difference
- * between respective pixels.
+ * between respective pixels. Error of each sample goes to target[sample_id].
  */
 __kernel void squared_err(__read_only __global float* ground_truth_image,
                           __read_only __global float* algo_result,
@@ -85,8 +85,17 @@ __kernel void squared_err(__read_only __global float* ground_truth_image,
     barrier(CLK_LOCAL_MEM_FENCE);
   }
 
-  // add local result to global result
+  // add local result to result of the sample
   if (local_index == 0) {
-    atomic_add_global(target, scratch[0]);
+    atomic_add_global(target + sample_id, scratch[0]);
   }
 }
+
+/**
+ * squared_err adds to target[sample_id], so it has to start from 0.
+ */
+__kernel void clear_squared_err(__global float* target,  //
+                                __const uint sample_count) {
+  const uint idx = get_global_id(0);
+  if (idx < sample_count) target[idx] = 0.0f;
+}
@@ -15,23 +15,62 @@ __constant float4 YCbCr2g = { 1.0f,  -0.343f, -0.711f,  0.0f};
 __constant float4 YCbCr2b = { 1.0f,   1.765f,    0.0f,  0.0f};
 /* clang-format on */
 
+/** Keys cubic convolution kernel with a = -0.5, same as in augment.cl */
+inline float cubic_weight(float x) {
+  x = fabs(x);
+  if (x <= 1.0f) return (1.5f * x - 2.5f) * x * x + 1.0f;
+  if (x < 2.0f) return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+  return 0.0f;
+}
+
+/**
+ * Pixel of original image at position in image scale times bigger. Bicubic
+ * interpolation, same as extract_luma.cl uses for luma, pixel centers are
+ * at +0.5
+ */
+uint4 read_scaled(__read_only image2d_t image, int2 pos, uint scale) {
+  if (scale == 1) return read_imageui(image, sampler, pos);
+  const float2 f = (convert_float2(pos) + 0.5f) / scale - 0.5f;
+  const int2 p = convert_int2(floor(f));
+  float4 result = 0.0f;
+  for (int j = -1; j <= 2; j++) {
+    const float wy = cubic_weight(f.y - (p.y + j));
+    for (int i = -1; i <= 2; i++) {
+      const float4 col = convert_float4(
+          read_imageui(image, sampler, p + (int2)(i, j)));
+      result += wy * cubic_weight(f.x - (p.x + i)) * col;
+    }
+  }
+  return convert_uint4_rte(clamp(result, 0.0f, 255.0f));
+}
+
+/**
+ * @param ground_truth_w  width of original image
+ * @param ground_truth_h  height of original image
+ * @param luma_w          width of new luma, at most ground_truth_w * scale
+ * @param luma_h          height of new luma, at most ground_truth_h * scale
+ * @param scale           target is scale times bigger then original image
+ */
 __kernel void swap_luma(__read_only image2d_t original_image,  //
                         __read_only __global float* new_luma,  //
                         __global uchar* target,                //
                         const uint ground_truth_w,
                         const uint ground_truth_h,  //
-                        const uint luma_w, const uint luma_h) {
-  const size_t padding = (ground_truth_w - luma_w) / 2;
+                        const uint luma_w, const uint luma_h,
+                        const uint scale) {
+  const uint target_w = ground_truth_w * scale,
+             target_h = ground_truth_h * scale;
+  const size_t padding = (target_w - luma_w) / 2;
   const int2 pos = {get_global_id(0), get_global_id(1)},
              pos_luma = {pos.x - padding, pos.y - padding};
-  const size_t idx = pos.y * ground_truth_w + pos.x,
+  const size_t idx = pos.y * target_w + pos.x,
                idx_luma = pos_luma.y * luma_w + pos_luma.x;
 
-  if (pos.x < 0 || pos.x >= ground_truth_w ||  //
-      pos.y < 0 || pos.y >= ground_truth_h)
+  if (pos.x < 0 || pos.x >= target_w ||  //
+      pos.y < 0 || pos.y >= target_h)
     return;
 
-  const uint4 pixel_col = read_imageui(original_image, sampler, pos);
+  const uint4 pixel_col = read_scaled(original_image, pos, scale);
   const float4 pixel_col_f = convert_float4(pixel_col);
   uint3 new_color;
   if (pos_luma.x < 0 || pos_luma.x >= luma_w ||  //
@@ -31,3 +31,119 @@ __kernel void update_params(
     previous_delta_bias[idx] = delta_b;
   }
 }
+
+/**
+ * With LOSS_SCALING defined gradients are multiplied by the loss scale (see
+ * loss_scaling.cl). They are divided back before use and whole update is
+ * skipped if any of them overflowed. Gradients are zeroed in both cases.
+ */
+#ifdef LOSS_SCALING
+#define LOSS_SCALING_ARG , __global const float* loss_scaling
+#define GRADIENT_SCALE (1.0f / loss_scaling[0])
+#define SKIP_UPDATE (loss_scaling[2] != 0.0f)
+#define BIAS_CORRECTION(beta, host_value) \
+  (1.0f - pown(beta, (int)loss_scaling[4] + 1))
+#else
+#define LOSS_SCALING_ARG
+#define GRADIENT_SCALE 1.0f
+#define SKIP_UPDATE false
+#define BIAS_CORRECTION(beta, host_value) host_value
+#endif
+
+/**
+ * Same update for parameters of all layers packed into one buffer. Each
+ * segment (weights or bias of a layer) has its own learning rate and weight
+ * decay, values between segments are only alignment padding. Gradients are
+ * zeroed, so that next mini-batch can start accumulating right away.
+ *
+ * @param segment_ranges  2 values per segment: [begin, end)
+ * @param segment_rates   2 values per segment: learning rate, weight decay
+ */
+__kernel void update_params_packed(__global float* parameters,           //
+                                   __global float* gradients,            //
+                                   __global float* previous_deltas,      //
+                                   __global const uint* segment_ranges,  //
+                                   __global const float* segment_rates,  //
+                                   __const uint segment_count,           //
+                                   __const float momentum,               //
+                                   __const uint batch_size,              //
+                                   __const uint size LOSS_SCALING_ARG) {
+  const uint idx = get_global_id(0);
+  if (idx >= size) return;
+  if (SKIP_UPDATE) {
+    gradients[idx] = 0.0f;
+    return;
+  }
+
+  const float grad_scale = GRADIENT_SCALE;
+  for (uint s = 0; s < segment_count; s++) {
+    if (idx < segment_ranges[2 * s] || idx >= segment_ranges[2 * s + 1])
+      continue;
+    float value = parameters[idx];
+    float delta = momentum * previous_deltas[idx] +
+                  segment_rates[2 * s] * gradients[idx] * grad_scale +
+                  segment_rates[2 * s + 1] * value;
+    parameters[idx] = value - delta / batch_size;
+    previous_deltas[idx] = delta;
+  }
+  gradients[idx] = 0.0f;
+}
+
+/**
+ * Adam over parameters packed same as in update_params_packed. Weight decay
+ * is added to the gradient (L2), with ADAMW defined it is decoupled from the
+ * gradient and applied directly to the parameter.
+ *
+ * @param bias_correction_1  1 - beta1^step
+ * @param bias_correction_2  1 - beta2^step
+ * With LOSS_SCALING defined skipped updates are not counted as steps, so the
+ * step is taken from the loss scaling state and both values are ignored.
+ */
+__kernel void adam_packed(__global float* parameters,           //
+                          __global float* gradients,            //
+                          __global float* first_moments,        //
+                          __global float* second_moments,       //
+                          __global const uint* segment_ranges,  //
+                          __global const float* segment_rates,  //
+                          __const uint segment_count,           //
+                          __const float beta1,                  //
+                          __const float beta2,                  //
+                          __const float epsilon,                //
+                          __const float bias_correction_1,      //
+                          __const float bias_correction_2,      //
+                          __const uint batch_size,              //
+                          __const uint size LOSS_SCALING_ARG) {
+  const uint idx = get_global_id(0);
+  if (idx >= size) return;
+  if (SKIP_UPDATE) {
+    gradients[idx] = 0.0f;
+    return;
+  }
+
+  const float grad_scale = GRADIENT_SCALE,
+              correction_1 = BIAS_CORRECTION(beta1, bias_correction_1),
+              correction_2 = BIAS_CORRECTION(beta2, bias_correction_2);
+  for (uint s = 0; s < segment_count; s++) {
+    if (idx < segment_ranges[2 * s] || idx >= segment_ranges[2 * s + 1])
+      continue;
+    const float learning_rate = segment_rates[2 * s],
+                weight_decay = segment_rates[2 * s + 1];
+    float value = parameters[idx];
+    float grad = gradients[idx] * grad_scale / batch_size;
+#ifndef ADAMW
+    grad += weight_decay * value;
+#endif
+    float m = beta1 * first_moments[idx] + (1.0f - beta1) * grad;
+    float v = beta2 * second_moments[idx] + (1.0f - beta2) * grad * grad;
+    first_moments[idx] = m;
+    second_moments[idx] = v;
+
+    float update = learning_rate * (m / correction_1) /
+                   (sqrt(v / correction_2) + epsilon);
+#ifdef ADAMW
+    update += learning_rate * weight_decay * value;
+#endif
+    parameters[idx] = value - update;
+  }
+  gradients[idx] = 0.0f;
+}
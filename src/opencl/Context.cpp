@@ -74,6 +74,7 @@ void Context::init(bool profile) {
 
   _kernels.reserve(max_resources_per_type);
   _allocations.reserve(max_resources_per_type);
+  _events.reserve(max_resources_per_type);
 
   initialized = true;
 }
@@ -103,7 +104,14 @@ void Context::_cleanup() {
     alloc->release();
   }
 
+  // events (block() above already released them, but let's be sure)
+  release_events();
+
   // other
+  if (_cltransfer_queue) {
+    clFinish(_cltransfer_queue);
+    clReleaseCommandQueue(_cltransfer_queue);
+  }
   if (_clcommand_queue) clReleaseCommandQueue(_clcommand_queue);
   if (_clcontext) clReleaseContext(_clcontext);
 }
@@ -132,7 +140,7 @@ RawMemoryHandle* Context::raw_memory(MemoryHandle handle) {
 void Context::print_app_memory_usage() {
   size_t image_memory = 0, buffer_memory = 0;
   for (const RawMemoryHandle& mem : _allocations) {
-    if (!mem.is_usable()) continue;
+    if (!mem.is_usable() || mem.is_sub_buffer) continue;
     if (mem.is_image()) {
       image_memory += mem.size;
     } else {
@@ -145,7 +153,7 @@ void Context::print_app_memory_usage() {
             << (image_memory + buffer_memory) * 100.0 / _device.global_mem_size
             << "%), " << buffer_memory / unit  //
             << "MB of raw buffers and " << image_memory / unit
-            << "MB for images" << std::endl;
+            << "MB for images, live events: " << _events.size() << std::endl;
 }
 
 // core: execution related
@@ -159,6 +167,21 @@ void Context::block() {
               "Error during command queue flush during Context::block()");
   ciErr1 = clFinish(_clcommand_queue);
   check_error(ciErr1, "Error during clFinish during Context::block()");
+
+  // all commands are finished - no one should wait for the events now
+  release_events();
+}
+
+cl_event Context::register_event(cl_event ev) {
+  if (ev) _events.push_back(ev);
+  return ev;
+}
+
+void Context::release_events() {
+  for (auto ev : _events) {
+    clReleaseEvent(ev);
+  }
+  _events.clear();
 }
 
 MemoryHandle Context::allocate(cl_mem_flags flags, size_t size) {
@@ -175,6 +198,34 @@ MemoryHandle Context::allocate(cl_mem_flags flags, size_t size) {
   return idx;
 }
 
+MemoryHandle Context::create_sub_buffer(MemoryHandle parent_handle,
+                                        cl_mem_flags flags, size_t offset,
+                                        size_t size) {
+  check_error(initialized, "Context was not initialized");
+  auto parent = raw_memory(parent_handle);
+  check_error(!parent->is_image() && !parent->is_sub_buffer,
+              "Sub-buffer can only be created from normal buffer");
+  check_error(offset + size <= parent->size,
+              "Sub-buffer does not fit into parent buffer");
+  check_error(offset % sub_buffer_alignment() == 0,
+              "Sub-buffer offset is not aligned to device base address");
+
+  cl_int ciErr1;
+  cl_buffer_region region = {offset, size};
+  cl_mem handle = clCreateSubBuffer(parent->handle, flags,
+                                    CL_BUFFER_CREATE_TYPE_REGION, &region,
+                                    &ciErr1);
+  check_error(ciErr1, "Error in clCreateSubBuffer");
+  // NOTE: push_back may invalidate parent pointer
+  _allocations.push_back(RawMemoryHandle());
+  MemoryHandle idx = _allocations.size() - 1;
+  auto mem_handle = &_allocations[idx];
+  mem_handle->handle = handle;
+  mem_handle->size = size;
+  mem_handle->is_sub_buffer = true;
+  return idx;
+}
+
 Kernel* Context::create_kernel(char const* file_path, char const* cmp_opt,
                                char const* main_f) {
   check_error(initialized, "Context was not initialized");
@@ -251,7 +302,7 @@ cl_event Context::read_buffer(MemoryHandle gpu_buffer_handle, size_t offset,
       events_to_wait_for_count, events_to_wait_for,  // sync events
       &finish_token);
   check_error(ciErr1, "Error in read buffer");
-  return finish_token;
+  return register_event(finish_token);
 }
 
 cl_event Context::read_buffer(MemoryHandle gpu_buffer_handle, void* dst,
@@ -262,6 +313,29 @@ cl_event Context::read_buffer(MemoryHandle gpu_buffer_handle, void* dst,
                            events_to_wait_for, events_to_wait_for_count);
 }
 
+void* Context::map_buffer(MemoryHandle gpu_buffer_handle) {
+  check_error(initialized, "Context was not initialized");
+  auto gpu_buffer = raw_memory(gpu_buffer_handle);
+  cl_int ciErr1;
+  void* ptr = clEnqueueMapBuffer(_clcommand_queue, gpu_buffer->handle, CL_TRUE,
+                                 CL_MAP_READ | CL_MAP_WRITE, 0,
+                                 gpu_buffer->size, 0, nullptr, nullptr, &ciErr1);
+  check_error(ciErr1, "Error in map buffer");
+  return ptr;
+}
+
+void Context::unmap_buffer(MemoryHandle gpu_buffer_handle, void* ptr) {
+  check_error(initialized, "Context was not initialized");
+  auto gpu_buffer = raw_memory(gpu_buffer_handle);
+  cl_event finish_token;
+  cl_int ciErr1 = clEnqueueUnmapMemObject(_clcommand_queue, gpu_buffer->handle,
+                                          ptr, 0, nullptr, &finish_token);
+  check_error(ciErr1, "Error in unmap buffer");
+  ciErr1 = clWaitForEvents(1, &finish_token);
+  clReleaseEvent(finish_token);
+  check_error(ciErr1, "Error in unmap buffer");
+}
+
 cl_event Context::write_buffer(MemoryHandle gpu_buffer_handle, size_t offset,
                                size_t size, void* src, bool block,
                                cl_event* events_to_wait_for,
@@ -282,6 +356,28 @@ cl_event Context::write_buffer(MemoryHandle gpu_buffer_handle, size_t offset,
       events_to_wait_for_count, events_to_wait_for,  // sync events
       &finish_token);
   check_error(ciErr1, "Error in write buffer");
+  return register_event(finish_token);
+}
+
+cl_event Context::write_buffer_async(MemoryHandle gpu_buffer_handle,
+                                     size_t offset, size_t size, void* src) {
+  check_error(initialized, "Context was not initialized");
+  auto gpu_buffer = raw_memory(gpu_buffer_handle);
+  check_error(size <= gpu_buffer->size,
+              "Tried to write more then is allocated");
+  cl_int ciErr1;
+  if (!_cltransfer_queue) {
+    _cltransfer_queue =
+        clCreateCommandQueue(_clcontext, _device.device_id, 0, &ciErr1);
+    check_error(ciErr1, "Error in clCreateCommandQueue (transfer queue)");
+  }
+  cl_event finish_token;
+  ciErr1 = clEnqueueWriteBuffer(_cltransfer_queue, gpu_buffer->handle,
+                                CL_FALSE, offset, size, src, 0, nullptr,
+                                &finish_token);
+  check_error(ciErr1, "Error in async write buffer");
+  // start the transfer right away
+  clFlush(_cltransfer_queue);
   return finish_token;
 }
 
@@ -337,7 +433,7 @@ cl_event Context::copy_buffer(MemoryHandle src_buffer, MemoryHandle dst_buffer,
                                       events_to_wait_for_count,
                                       events_to_wait_for, &finish_token);
   check_error(ciErr1, "Error in copy buffer");
-  return finish_token;
+  return register_event(finish_token);
 }
 
 ///
@@ -465,7 +561,7 @@ cl_event Context::write_image(MemoryHandle gpu_buffer_handle,
       events_to_wait_for_count, events_to_wait_for,  // sync events
       &finish_token);
   check_error(ciErr1, "Error in write_image");
-  return finish_token;
+  return register_event(finish_token);
 }
 
 ///
@@ -562,6 +658,8 @@ void Context::device_info(cl_device_id device_id, DeviceInfo& info) {
   /* clang-format off */
   ciErr1 =  clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE,
                             1024, &info.global_mem_size, nullptr);
+  ciErr1 |= clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+                            1024, &info.max_mem_alloc_size, nullptr);
   ciErr1 |= clGetDeviceInfo(device_id, CL_DEVICE_IMAGE_SUPPORT,
                             1024, &info.image_support, nullptr);
   ciErr1 |= clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE,
@@ -578,6 +676,8 @@ void Context::device_info(cl_device_id device_id, DeviceInfo& info) {
                             1024, &info.local_mem_type, nullptr);
   ciErr1 |= clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS,
                             1024, &info.compute_units, nullptr);
+  ciErr1 |= clGetDeviceInfo(device_id, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                            1024, &info.mem_base_addr_align, nullptr);
   ciErr1 |= clGetDeviceInfo(device_id, CL_DEVICE_NAME,
                             sizeof(info.name), &info.name, &value_size);
   info.name[value_size] = '\0';
@@ -34,12 +34,16 @@ struct DeviceInfo {
   char name[MAX_INFO_STRING_LEN];
   cl_uint compute_units;
   cl_ulong global_mem_size;
+  /** single allocation can not be bigger */
+  cl_ulong max_mem_alloc_size;
   cl_ulong local_mem_size;
   cl_device_local_mem_type local_mem_type;
   cl_uint address_bits;
   size_t max_work_group_size;
   size_t work_items_for_dims[3];
   cl_bool image_support;
+  /** in bits, sub-buffer origin has to be aligned to this */
+  cl_uint mem_base_addr_align;
 };
 
 /**
@@ -60,6 +64,8 @@ struct RawMemoryHandle {
   size_t size = 0;
   /* must be nonzero if represents image */
   size_t bpp = 0;
+  /* view into other allocation, does not own any memory */
+  bool is_sub_buffer = false;
 
  private:
   bool released;
@@ -82,8 +88,26 @@ class Context {
   // execution
   //
 
+  /**
+   * Wait for all enqueued commands to finish. This also releases all events
+   * that were created since last call, so any cl_event returned by Context or
+   * Kernel should not be used after this call.
+   */
   void block();
 
+  /**
+   * Take ownership of event returned by opencl. The event will be released
+   * during next Context::block(), so that long running applications do not
+   * leak event objects.
+   *
+   * @param  ev  event created f.e. by clEnqueueNDRangeKernel
+   * @return     same event
+   */
+  cl_event register_event(cl_event);
+
+  /** number of events that are tracked and were not released yet */
+  size_t live_event_count() const { return _events.size(); }
+
   /**
    * Allocate memory on opencl device
    * https://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateBuffer.html
@@ -94,6 +118,29 @@ class Context {
    */
   MemoryHandle allocate(cl_mem_flags, size_t);
 
+  /**
+   * Create view into part of existing buffer, no data is copied
+   * https://www.khronos.org/registry/cl/sdk/1.2/docs/man/xhtml/clCreateSubBuffer.html
+   *
+   * @param  parent   buffer to create view into
+   * @param  flags    opencl flags, should not be less restrictive then parent's
+   * @param  offset   bytes, has to be multiple of sub_buffer_alignment()
+   * @param  size     bytes
+   * @return          handler used by context
+   */
+  MemoryHandle create_sub_buffer(MemoryHandle parent, cl_mem_flags,
+                                 size_t offset, size_t size);
+
+  /** Required alignment (in bytes) of sub-buffer offset */
+  inline size_t sub_buffer_alignment() const {
+    return _device.mem_base_addr_align / 8;
+  }
+
+  /** Biggest single allocation (in bytes) */
+  inline size_t max_allocation_size() const {
+    return (size_t)_device.max_mem_alloc_size;
+  }
+
   /**
    * Create kernel from file
    *
@@ -151,6 +198,16 @@ class Context {
                         int event_count = 0);
   /* clang-format on */
 
+  /**
+   * Non blocking write on separate transfer queue (created on first use), so
+   * that it can overlap with kernels from the main queue. There is no
+   * ordering between the queues and block() does not wait for the transfer
+   * queue. Returned event is not registered - caller has to wait for it and
+   * release it.
+   */
+  cl_event write_buffer_async(MemoryHandle, size_t offset, size_t size,
+                              void* src);
+
   /**
    * Copy data from host memory to opencl device
    *
@@ -164,6 +221,19 @@ class Context {
   cl_event write_buffer(MemoryHandle, void* src, bool block,
                         cl_event* es = nullptr, int event_count = 0);
 
+  /**
+   * Map whole buffer to host address space (blocking). Buffers allocated with
+   * CL_MEM_ALLOC_HOST_PTR are usually backed by pinned host memory, which
+   * makes transfers from the mapped pointer much faster.
+   *
+   * @param  gpu_buffer               buffer to map
+   * @return                          host pointer, valid till unmap_buffer
+   */
+  void* map_buffer(MemoryHandle);
+
+  /** Unmap pointer returned by map_buffer (blocking) */
+  void unmap_buffer(MemoryHandle, void*);
+
   /**
    * Fill with zero values
    *
@@ -279,6 +349,7 @@ class Context {
 
  private:
   void _cleanup();
+  void release_events();
   size_t channels_count(cl_channel_order, cl_channel_type);
   size_t per_pixel_bytes(cl_channel_order, cl_channel_type);
   void platform_info(cl_platform_id platform_id, PlatformInfo& platform_info,
@@ -289,6 +360,7 @@ class Context {
   bool initialized;
   cl_context _clcontext;
   cl_command_queue _clcommand_queue;
+  cl_command_queue _cltransfer_queue = nullptr;
   bool _profiling;
 
   DeviceInfo _device;
@@ -296,6 +368,7 @@ class Context {
 
   std::vector<Kernel> _kernels;
   std::vector<RawMemoryHandle> _allocations;
+  std::vector<cl_event> _events;
 };
 }
 
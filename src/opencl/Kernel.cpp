@@ -104,6 +104,7 @@ cl_event Kernel::execute(cl_uint work_dim,                //
       events_to_wait_for_count, events_to_wait_for,  // sync events
       &finish_token);
   context->check_error(ciErr1, "Error in clEnqueueNDRangeKernel");
+  context->register_event(finish_token);
 
   if (context->is_running_profile_mode()) {
     clWaitForEvents(1, &finish_token);
@@ -52,7 +52,8 @@ class Kernel {
    * @param  local_work_size          :size_t*, work group size
    * @param  events_to_wait_for       [OPT] wait for other operations to finish
    * @param  events_to_wait_for_count [OPT]
-   * @return                          opencl event object
+   * @return                          opencl event object, owned by the context
+   *                                  and valid till next Context::block()
    */
   cl_event execute(cl_uint work_dim,                //
                    const size_t *global_work_size,  //
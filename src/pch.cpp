@@ -8,6 +8,18 @@
 #include <dirent.h>   // list files in directory
 #include <cstdlib>    // for string -> number conversion
 #include <cstring>    // for strcmp/strlen when reading json
+#include <atomic>
+#include <exception>  // std::exception_ptr
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>  // CreateFileMapping
+#else
+#include <sys/mman.h>  // mmap
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #
 #include "json/gason.h"
 
@@ -64,6 +76,86 @@ size_t closest_power_of_2(int x) {
   return static_cast<size_t>(x + 1);
 }
 
+void parallel_for(size_t count, const std::function<void(size_t)>& fn) {
+  size_t thread_count = std::thread::hardware_concurrency();
+  if (thread_count == 0) thread_count = 1;
+  if (thread_count > count) thread_count = count;
+
+  std::atomic<size_t> next_idx(0);
+  std::exception_ptr error = nullptr;
+  std::mutex error_mutex;
+  auto worker = [&]() {
+    for (size_t i = next_idx++; i < count; i = next_idx++) {
+      try {
+        fn(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+        next_idx = count;  // stop other workers
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; i++)
+    threads.push_back(std::thread(worker));
+  worker();  // calling thread works too
+  for (auto& t : threads) t.join();
+  if (error) std::rethrow_exception(error);
+}
+
+unsigned short float_to_half(float value) {
+  unsigned int f;
+  memcpy(&f, &value, sizeof(f));
+  unsigned int sign = (f >> 16) & 0x8000, exponent = (f >> 23) & 0xff,
+               mantissa = f & 0x7fffff;
+
+  if (exponent == 0xff) {  // inf, nan
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  int e = (int)exponent - 127 + 15;
+  if (e >= 0x1f) return sign | 0x7c00;  // overflow -> inf
+  if (e <= 0) {                         // subnormal or zero
+    if (e < -10) return sign;
+    mantissa |= 0x800000;
+    unsigned int shift = 14 - e;
+    unsigned int half_m = mantissa >> shift,
+                 rest = mantissa & ((1u << shift) - 1),
+                 halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half_m & 1))) ++half_m;
+    return sign | half_m;
+  }
+  unsigned int half = sign | (e << 10) | (mantissa >> 13),
+               rest = mantissa & 0x1fff;
+  // mantissa overflow correctly carries into exponent
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+  return half;
+}
+
+float half_to_float(unsigned short h) {
+  unsigned int sign = (h & 0x8000) << 16, exponent = (h >> 10) & 0x1f,
+               mantissa = h & 0x3ff, f;
+  if (exponent == 0x1f) {  // inf, nan
+    f = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent == 0) {
+    if (mantissa == 0) {
+      f = sign;
+    } else {  // subnormal - normalize it
+      int e = -1;
+      do {
+        ++e;
+        mantissa <<= 1;
+      } while ((mantissa & 0x400) == 0);
+      f = sign | ((127 - 15 - e) << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  } else {
+    f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+  float result;
+  memcpy(&result, &f, sizeof(f));
+  return result;
+}
+
 ///
 /// File system
 ///
@@ -98,6 +190,75 @@ void list_files(const char* const path, std::vector<std::string>& target) {
   }
 }
 
+MappedFile::MappedFile(const char* const path) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) throw IOException("File not found");
+  LARGE_INTEGER file_size;
+  GetFileSizeEx(file, &file_size);
+  _size = (size_t)file_size.QuadPart;
+  if (_size > 0) {
+    HANDLE mapping =
+        CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping) {
+      _data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);  // view holds the reference
+    }
+  }
+  CloseHandle(file);
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) throw IOException("File not found");
+  struct stat st;
+  fstat(fd, &st);
+  _size = (size_t)st.st_size;
+  if (_size > 0) {
+    void* ptr = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+    _data = ptr == MAP_FAILED ? nullptr : (const char*)ptr;
+  }
+  close(fd);  // mapping holds the reference
+#endif
+  if (_size > 0 && !_data) throw IOException("Could not memory map the file");
+}
+
+MappedFile::~MappedFile() {
+  if (!_data) return;
+#ifdef _WIN32
+  UnmapViewOfFile(_data);
+#else
+  munmap((void*)_data, _size);
+#endif
+}
+
+void write_file_atomic(const char* const path, const char* data, size_t size) {
+  std::string tmp_path = std::string(path) + ".tmp";
+#ifdef _WIN32
+  HANDLE file = CreateFileA(tmp_path.c_str(), GENERIC_WRITE, 0, nullptr,
+                            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) throw IOException("Could not open file");
+  DWORD written = 0;
+  bool ok = WriteFile(file, data, (DWORD)size, &written, nullptr) &&
+            written == size && FlushFileBuffers(file);
+  CloseHandle(file);
+  ok = ok && MoveFileExA(tmp_path.c_str(), path, MOVEFILE_REPLACE_EXISTING |
+                                                     MOVEFILE_WRITE_THROUGH);
+#else
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw IOException("Could not open file");
+  bool ok = true;
+  for (size_t done = 0; ok && done < size;) {
+    ssize_t n = write(fd, data + done, size - done);
+    ok = n > 0;
+    done += ok ? (size_t)n : 0;
+  }
+  ok = fsync(fd) == 0 && ok;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp_path.c_str(), path) == 0;
+#endif
+  if (!ok) throw IOException("Could not write file");
+}
+
 ///
 /// Json utils
 ///
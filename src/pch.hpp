@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <functional>
 // #include <cstddef>  // for size_t
 
 // TODO use during compilation
@@ -18,6 +19,7 @@ namespace cnn_sr {
   class DataPipeline;
   class ConfigBasedDataPipeline;
   struct LayerData;
+  struct QuantizedLayer;
   struct CnnLayerGpuAllocationPool;
 }
 
@@ -65,6 +67,17 @@ inline bool is_even(T x) {
 
 size_t closest_power_of_2(int);
 
+/**
+ * Call fn(i) for every i in 0..count-1 using all hardware threads. Work is
+ * distributed dynamically, so items may take different time. First exception
+ * thrown by fn is rethrown on calling thread after all workers finish.
+ */
+void parallel_for(size_t count, const std::function<void(size_t)>& fn);
+
+/** IEEE 754 half precision conversions (round to nearest even) */
+unsigned short float_to_half(float);
+float half_to_float(unsigned short);
+
 ///
 /// Utils - macros
 ///
@@ -83,6 +96,32 @@ void get_file_content(const char* const, std::stringstream&);
 
 void list_files(const char* const, std::vector<std::string>&);
 
+/**
+ * Read only view of the whole file. Content is paged in by OS on access,
+ * so opening even very big files is cheap.
+ */
+class MappedFile {
+ public:
+  MappedFile(const char* const);
+  ~MappedFile();
+
+  inline const char* data() const { return _data; }
+  inline size_t size() const { return _size; }
+
+ private:
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* _data = nullptr;
+  size_t _size = 0;
+};
+
+/**
+ * Write data to temporary file, flush it to disk and rename it to target path.
+ * Readers will see either old or new version of the file, never partial one.
+ */
+void write_file_atomic(const char* const, const char* data, size_t size);
+
 ///
 /// Json utils
 ///
@@ -45,6 +45,17 @@ int main(int, char **) {
   ADD_TEST(LastLayerDeltaTest);
   ADD_TEST(UpdateParametersTest);
   ADD_TEST(ConfigTest);
+  ADD_TEST(ParametersFileTest);
+  ADD_TEST(DatasetFileTest);
+  ADD_TEST(GatherSamplesTest);
+  ADD_TEST(AugmentTest);
+  ADD_TEST(LossSamplingTest);
+  ADD_TEST(Int8LayerTest);
+  ADD_TEST(PixelShuffleTest);
+  ADD_TEST(MemoryPlannerTest);
+  ADD_TEST(RecomputeActivationsTest);
+  ADD_TEST(SampleStreamTest);
+  ADD_TEST(SampleCacheTest);
 
   //
   //
@@ -0,0 +1,152 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <algorithm>  // std::min, std::max
+#include <cmath>      // std::floor, std::fabs
+
+#include "../../src/DataPipeline.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// PIMPL
+///
+struct AugmentTestImpl {
+  /** Same as in augment.cl */
+  float cubic_weight(float x) {
+    x = std::fabs(x);
+    if (x <= 1.0f) return (1.5f * x - 2.5f) * x * x + 1.0f;
+    if (x < 2.0f) return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+    return 0.0f;
+  }
+
+  void downscale(const float *src, size_t size, size_t small_size,
+                 float *target) {
+    float scale = (float)size / small_size;
+    for (size_t sy = 0; sy < small_size; sy++) {
+      for (size_t sx = 0; sx < small_size; sx++) {
+        size_t x0 = (size_t)(sx * scale), y0 = (size_t)(sy * scale);
+        size_t x1 = std::min(size, (size_t)((sx + 1) * scale)),
+               y1 = std::min(size, (size_t)((sy + 1) * scale));
+        x1 = std::max(x0 + 1, x1);
+        y1 = std::max(y0 + 1, y1);
+        float sum = 0.0f;
+        for (size_t y = y0; y < y1; y++)
+          for (size_t x = x0; x < x1; x++) sum += src[y * size + x];
+        target[sy * small_size + sx] = sum / ((x1 - x0) * (y1 - y0));
+      }
+    }
+  }
+
+  void upscale(const float *src, size_t small_size, size_t size,
+               float *target) {
+    float scale = (float)small_size / size;
+    int max_idx = (int)small_size - 1;
+    for (size_t py = 0; py < size; py++) {
+      for (size_t px = 0; px < size; px++) {
+        float fx = (px + 0.5f) * scale - 0.5f, fy = (py + 0.5f) * scale - 0.5f;
+        int ix = (int)std::floor(fx), iy = (int)std::floor(fy);
+        float result = 0.0f;
+        for (int j = -1; j <= 2; j++) {
+          int y = std::min(std::max(iy + j, 0), max_idx);
+          float wy = cubic_weight(fy - (iy + j));
+          for (int i = -1; i <= 2; i++) {
+            int x = std::min(std::max(ix + i, 0), max_idx);
+            float wx = cubic_weight(fx - (ix + i));
+            result += wy * wx * src[y * small_size + x];
+          }
+        }
+        target[py * size + px] = std::min(std::max(result, 0.0f), 1.0f);
+      }
+    }
+  }
+};
+
+///
+/// AugmentTest
+///
+
+TEST_SPEC_PIMPL(AugmentTest)
+
+void AugmentTest::init() {}
+
+std::string AugmentTest::name(size_t) {
+  return "Augmentation test (crop, downscale, bicubic upscale, mean)";
+}
+
+size_t AugmentTest::data_set_count() { return 1; }
+
+bool AugmentTest::operator()(size_t, cnn_sr::DataPipeline *const pipeline) {
+  assert_not_null(pipeline);
+  auto _context = pipeline->context();
+
+  // 2 source images of different sizes, one after another
+  const size_t size = 12, small_size = 5, sample_count = 2;
+  const size_t src_w[2] = {20, 14}, src_h[2] = {17, 12};
+  const cl_uint crops[8] = {0, 20, 3, 4,  //
+                            20 * 17, 14, 2, 0};
+  std::vector<unsigned char> source;
+  for (size_t i = 0; i < src_w[0] * src_h[0] + src_w[1] * src_h[1]; i++)
+    source.push_back((unsigned char)((i * 37 + i / 7) % 256));
+
+  // expected values
+  const size_t px_count = size * size, small_px_count = small_size * small_size;
+  std::vector<float> exp_crops(sample_count * px_count),
+      exp_small(sample_count * small_px_count),
+      exp_upscaled(sample_count * px_count), exp_means(sample_count);
+  for (size_t s = 0; s < sample_count; s++) {
+    const cl_uint *c = crops + 4 * s;
+    for (size_t p = 0; p < px_count; p++) {
+      size_t x = c[2] + p % size, y = c[3] + p / size;
+      exp_crops[s * px_count + p] = source[c[0] + y * c[1] + x] / 255.0f;
+    }
+    _impl->downscale(&exp_crops[s * px_count], size, small_size,
+                     &exp_small[s * small_px_count]);
+    _impl->upscale(&exp_small[s * small_px_count], small_size, size,
+                   &exp_upscaled[s * px_count]);
+    float sum = 0.0f;
+    for (size_t p = 0; p < px_count; p++) sum += exp_upscaled[s * px_count + p];
+    exp_means[s] = sum / px_count;
+  }
+  std::vector<float> exp_input(exp_upscaled);
+  for (size_t i = 0; i < exp_input.size(); i++)
+    exp_input[i] -= exp_means[i / px_count];
+
+  // gpu allocate
+  auto gpu_buf_source = _context->allocate(CL_MEM_READ_ONLY, source.size());
+  _context->write_buffer(gpu_buf_source, (void *)&source[0], true);
+  auto gpu_buf_crops = _context->allocate(CL_MEM_READ_ONLY, sizeof(crops));
+  _context->write_buffer(gpu_buf_crops, (void *)crops, true);
+  auto gpu_buf_crop_res = _context->allocate(
+      CL_MEM_READ_WRITE, sizeof(cl_float) * sample_count * px_count);
+  auto gpu_buf_small = _context->allocate(
+      CL_MEM_READ_WRITE, sizeof(cl_float) * sample_count * small_px_count);
+  auto gpu_buf_upscaled = _context->allocate(
+      CL_MEM_READ_WRITE, sizeof(cl_float) * sample_count * px_count);
+  auto gpu_buf_means =
+      _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * sample_count);
+
+  pipeline->crop_samples(gpu_buf_source, gpu_buf_crops, sample_count, size,
+                         gpu_buf_crop_res);
+  assert_equals(pipeline, exp_crops, gpu_buf_crop_res);
+
+  pipeline->downscale(gpu_buf_crop_res, sample_count, size, small_size,
+                      gpu_buf_small);
+  assert_equals(pipeline, exp_small, gpu_buf_small);
+
+  pipeline->upscale_bicubic(gpu_buf_small, sample_count, small_size, size,
+                            gpu_buf_upscaled);
+  assert_equals(pipeline, exp_upscaled, gpu_buf_upscaled);
+
+  pipeline->subtract_sample_means(gpu_buf_upscaled, sample_count, px_count,
+                                  gpu_buf_means);
+  assert_equals(pipeline, exp_input, gpu_buf_upscaled);
+  assert_equals(pipeline, exp_means, gpu_buf_means);
+
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
@@ -24,8 +24,9 @@ struct ConfigDataSet : DataSet {
 ///
 struct ConfigTestImpl {
   /* clang-format off */
-  ConfigDataSet data_sets[4] = {
+  ConfigDataSet data_sets[5] = {
       ConfigDataSet("ok", "test/data/config.json", false,false),
+      ConfigDataSet("layers", "test/data/config_layers.json", false,false),
       ConfigDataSet("invalid value", "test/data/config_invalid_val.json", false,true),
       ConfigDataSet("invalid file", "test/data/config_non_parseable.json", true,false),
       ConfigDataSet("file nonexistent", "test/data/NOPE.json", true,false)};
@@ -52,7 +53,7 @@ TEST_SPEC_PIMPL(ConfigTest)
 
 void ConfigTest::init() {}
 
-size_t ConfigTest::data_set_count() { return 4; }
+size_t ConfigTest::data_set_count() { return 5; }
 
 std::string ConfigTest::name(size_t data_set_id) {
   assert_data_set_ok(data_set_id);
@@ -78,27 +79,28 @@ bool ConfigTest::operator()(size_t data_set_id,
 
   try {
     Config c1 = reader.read(data.cfg_file);
-    assert_true(c1.n1 == c2.n1 && c1.n2 == c2.n2,
-                "filter count does not match");
-    assert_true(c1.f1 == c2.f1 && c1.f2 == c2.f2 && c1.f3 == c2.f3,
-                "filter spatial size does not match");
+    assert_true(c1.layers.size() == c2.layers.size(),
+                "layer count does not match");
+    for (size_t i = 0; i < c1.layers.size(); i++) {
+      auto& l1 = c1.layers[i];
+      auto& l2 = c2.layers[i];
+      assert_true(l1.filter_count == l2.filter_count,
+                  "filter count does not match");
+      assert_true(l1.f_spatial_size == l2.f_spatial_size,
+                  "filter spatial size does not match");
+      assert_true(l1.relu == l2.relu, "activation does not match");
+      assert_true(l1.learning_rate == l2.learning_rate,
+                  "learning rate does not match");
+      assert_true(params_cmp(l1.params_distr, l2.params_distr),
+                  "parameters distribution does not match");
+    }
     assert_true(c1.momentum == c2.momentum, "momentum does not match");
     assert_true(c1.weight_decay_parameter == c2.weight_decay_parameter,
                 "weight decay parameter does not match");
-    assert_true(c1.learning_rate[0] == c2.learning_rate[0]         //
-                    && c1.learning_rate[1] == c2.learning_rate[1]  //
-                    && c1.learning_rate[2] == c2.learning_rate[2],
-                "learning rate does not match");
     // std::cout << c1.parameters_file << "'" << std::endl;
     // std::cout << c2.parameters_file << "'" << std::endl;
     assert_true(c1.parameters_file.compare(c2.parameters_file) == 0,
                 "parameters_file does not match");
-    assert_true(params_cmp(c1.params_distr_1, c2.params_distr_1),
-                "parameters distribution 1 does not match");
-    assert_true(params_cmp(c1.params_distr_2, c2.params_distr_2),
-                "parameters distribution 2 does not match");
-    assert_true(params_cmp(c1.params_distr_3, c2.params_distr_3),
-                "parameters distribution 3 does not match");
   } catch (TestException& e) {
     std::cout << e.what() << std::endl;
     invalid_val = true;
@@ -0,0 +1,118 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <random>  // for std::mt19937
+#include <chrono>  // for random seed
+#include <cstdio>  // std::remove
+
+#include "../../src/DatasetFile.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// Data set
+///
+struct DatasetFileDataSet : DataSet {
+  DatasetFileDataSet(std::string name, cnn_sr::DatasetStorage storage)
+      : DataSet(name), storage(storage) {}
+
+  cnn_sr::DatasetStorage storage;
+};
+
+///
+/// PIMPL
+///
+struct DatasetFileTestImpl {
+  /* clang-format off */
+  DatasetFileDataSet data_sets[3] = {
+      DatasetFileDataSet("float32", cnn_sr::DatasetStorage::Float32),
+      DatasetFileDataSet("float16", cnn_sr::DatasetStorage::Float16),
+      DatasetFileDataSet("uint8", cnn_sr::DatasetStorage::UInt8)};
+  /* clang-format on */
+
+  const char *const file_path = "test/data/tmp_dataset.bin";
+  const size_t sample_count = 7;
+
+  /** random rgba pixels go through the same path as images from disk */
+  void create_sample(std::mt19937 &generator, cnn_sr::HostSample &sample) {
+    sample.w = 5 + generator() % 10;
+    sample.h = 5 + generator() % 10;
+    size_t px_count = sample.w * sample.h;
+    std::vector<unsigned char> rgba(px_count * 4);
+    for (auto &v : rgba) v = (unsigned char)(generator() % 256);
+
+    sample.input_luma.resize(px_count);
+    sample.expected_luma.resize(px_count);
+    cnn_sr::extract_luma(&rgba[0], px_count, &sample.input_luma[0]);
+    for (auto &v : rgba) v = (unsigned char)(generator() % 256);
+    cnn_sr::extract_luma(&rgba[0], px_count, &sample.expected_luma[0]);
+
+    float sum = 0.0f;
+    for (float v : sample.input_luma) sum += v;
+    sample.input_mean = sum / px_count;
+    for (float &v : sample.input_luma) v -= sample.input_mean;
+  }
+};
+
+///
+/// DatasetFileTest
+///
+
+TEST_SPEC_PIMPL(DatasetFileTest)
+
+void DatasetFileTest::init() {}
+
+size_t DatasetFileTest::data_set_count() { return 3; }
+
+std::string DatasetFileTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  return "Packed dataset file test - " + _impl->data_sets[data_set_id].name;
+}
+
+bool DatasetFileTest::operator()(size_t data_set_id,
+                                 cnn_sr::DataPipeline *const pipeline) {
+  using namespace cnn_sr;
+  assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
+  auto &data = _impl->data_sets[data_set_id];
+
+  // host luma uses same coefficients as the kernel
+  unsigned char px[4] = {255, 255, 255, 255};
+  float luma;
+  extract_luma(px, 1, &luma);
+  assert_equals(1.0f, luma);
+
+  unsigned seed1 = std::chrono::system_clock::now().time_since_epoch().count();
+  std::mt19937 generator(seed1);
+  std::vector<HostSample> expected(_impl->sample_count);
+  for (auto &sample : expected) _impl->create_sample(generator, sample);
+
+  DatasetFile::write(_impl->file_path, expected, data.storage);
+  assert_true(DatasetFile::is_dataset(_impl->file_path),
+              "Written file should be recognised as dataset");
+
+  {
+    DatasetFile dataset(_impl->file_path);
+    assert_equals((int)expected.size(), (int)dataset.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+      auto &e = expected[i];
+      assert_equals((int)e.w, (int)dataset.width(i));
+      assert_equals((int)e.h, (int)dataset.height(i));
+      // NOTE: uint8 and float16 precision is within assert_equals margin
+      std::vector<float> buf(e.w * e.h);
+      const float *ptr = dataset.input_luma(i, &buf[0]);
+      assert_equals(e.input_luma, std::vector<float>(ptr, ptr + buf.size()));
+      ptr = dataset.expected_luma(i, &buf[0]);
+      assert_equals(e.expected_luma,
+                    std::vector<float>(ptr, ptr + buf.size()));
+    }
+  }
+  std::remove(_impl->file_path);
+
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
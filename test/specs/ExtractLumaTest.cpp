@@ -1,5 +1,8 @@
 #include "TestSpecsDeclarations.hpp"
 
+#include <algorithm>  // std::min, std::max
+#include <cmath>      // std::floor, std::fabs
+
 #include "../../src/opencl/UtilsOpenCL.hpp"
 #include "../../src/DataPipeline.hpp"
 
@@ -12,14 +15,26 @@ namespace specs {
 /// Data set
 ///
 struct ExtractLumaDataSet : DataSet {
-  ExtractLumaDataSet(bool n, std::string name) : DataSet(name), normalize(n) {}
+  ExtractLumaDataSet(bool n, std::string name, size_t scale = 1)
+      : DataSet(name), normalize(n), scale(scale) {}
   bool normalize;
+  /** luma is bicubically upscaled by this factor */
+  size_t scale;
 };
 
+
 ///
 /// PIMPL
 ///
 struct ExtractLumaTestImpl {
+  /** Same as in extract_luma.cl */
+  float cubic_weight(float x) {
+    x = std::fabs(x);
+    if (x <= 1.0f) return (1.5f * x - 2.5f) * x * x + 1.0f;
+    if (x < 2.0f) return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+    return 0.0f;
+  }
+
   const size_t data_size[2] = {5, 5};
   const std::vector<float> output = {0.000f, 1.000f, 0.812f, 0.853f, 0.437f,  //
                                      0.170f, 0.701f, 0.413f, 0.886f, 0.787f,  //
@@ -27,9 +42,10 @@ struct ExtractLumaTestImpl {
                                      0.670f, 0.745f, 0.853f, 0.745f, 0.299f,
                                      0.810f, 0.588f, 0.859f, 0.593f, 0.702f};
 
-  ExtractLumaDataSet data_sets[2] = {
+  ExtractLumaDataSet data_sets[3] = {
       ExtractLumaDataSet(true, "normalized"),
-      ExtractLumaDataSet(false, "not normalized")};
+      ExtractLumaDataSet(false, "not normalized"),
+      ExtractLumaDataSet(true, "bicubic x2", 2)};
 };
 
 ///
@@ -40,7 +56,7 @@ TEST_SPEC_PIMPL(ExtractLumaTest)
 
 void ExtractLumaTest::init() {}
 
-size_t ExtractLumaTest::data_set_count() { return 2; }
+size_t ExtractLumaTest::data_set_count() { return 3; }
 
 std::string ExtractLumaTest::name(size_t data_set_id) {
   assert_data_set_ok(data_set_id);
@@ -52,6 +68,7 @@ bool ExtractLumaTest::operator()(size_t data_set_id,
   assert_not_null(pipeline);
   assert_data_set_ok(data_set_id);
   bool normalize = _impl->data_sets[data_set_id].normalize;
+  size_t scale = _impl->data_sets[data_set_id].scale;
 
   opencl::utils::ImageData data;
   load_image(test_image, data);
@@ -62,12 +79,33 @@ bool ExtractLumaTest::operator()(size_t data_set_id,
 
   opencl::MemoryHandle gpu_buf_raw_img = gpu_nullptr,
                        gpu_buf_luma = gpu_nullptr;
-  pipeline->extract_luma(data, gpu_buf_raw_img, gpu_buf_luma, normalize);
+  pipeline->extract_luma(data, gpu_buf_raw_img, gpu_buf_luma, normalize,
+                         nullptr, scale);
 
   std::vector<float> expected = _impl->output;
   for (int i = 0; (!normalize) && (i < data.w * data.h); i++) {
     expected[i] *= 255;
   }
+  if (scale > 1) {
+    // bicubic upscale of expected luma, edge pixels are clamped
+    int w = data.w, h = data.h, big_w = w * scale, big_h = h * scale;
+    std::vector<float> upscaled(big_w * big_h);
+    for (int y = 0; y < big_h; y++)
+      for (int x = 0; x < big_w; x++) {
+        float fx = (x + 0.5f) / scale - 0.5f, fy = (y + 0.5f) / scale - 0.5f;
+        int ix = (int)std::floor(fx), iy = (int)std::floor(fy);
+        float v = 0.0f;
+        for (int j = -1; j <= 2; j++)
+          for (int i = -1; i <= 2; i++) {
+            int sx = std::min(std::max(ix + i, 0), w - 1),
+                sy = std::min(std::max(iy + j, 0), h - 1);
+            v += _impl->cubic_weight(fx - (ix + i)) *
+                 _impl->cubic_weight(fy - (iy + j)) * expected[sy * w + sx];
+          }
+        upscaled[y * big_w + x] = std::min(std::max(v, 0.0f), 1.0f);
+      }
+    expected.swap(upscaled);
+  }
   assert_equals(pipeline, expected, gpu_buf_luma);
 
   return true;
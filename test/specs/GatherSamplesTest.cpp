@@ -0,0 +1,100 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include "../../src/ConfigBasedDataPipeline.hpp"
+#include "../../src/DatasetFile.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// PIMPL
+///
+struct GatherSamplesTestImpl {
+  const cnn_sr::DatasetStorage storages[3] = {cnn_sr::DatasetStorage::Float32,
+                                              cnn_sr::DatasetStorage::UInt8,
+                                              cnn_sr::DatasetStorage::Float16};
+  const char *const names[3] = {"float32", "uint8", "float16"};
+};
+
+///
+/// GatherSamplesTest
+///
+
+TEST_SPEC_PIMPL(GatherSamplesTest)
+
+void GatherSamplesTest::init() {}
+
+std::string GatherSamplesTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  return std::string("Gather samples from arena test - ") +
+         _impl->names[data_set_id];
+}
+
+size_t GatherSamplesTest::data_set_count() { return 3; }
+
+bool GatherSamplesTest::operator()(size_t data_set_id,
+                                   cnn_sr::DataPipeline *const pipeline) {
+  using namespace cnn_sr;
+  assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
+  auto _context = pipeline->context();
+  auto storage = _impl->storages[data_set_id];
+
+  const size_t w = 15, h = 12, px_count = w * h, arena_size = 4;
+  const cl_uint slots[3] = {2, 0, 3};
+  const size_t batch_size = 3;
+
+  // arena: every sample has different mean
+  SampleArena arena;
+  arena.allocate(_context, w, h, arena_size, storage);
+  std::vector<float> means(arena_size);
+  std::vector<std::vector<float>> input(arena_size), expected(arena_size);
+  std::vector<std::vector<char>> encoded(arena_size);
+  for (size_t i = 0; i < arena_size; i++) {
+    means[i] = 0.1f * (i + 1);
+    for (size_t j = 0; j < px_count; j++) {
+      expected[i].push_back(((j * 7 + i * 31) % 256) / 255.0f);
+      input[i].push_back(((j * 3 + i * 17) % 256) / 255.0f - means[i]);
+    }
+    const void *input_src = &input[i][0], *expected_src = &expected[i][0];
+    if (storage != DatasetStorage::Float32) {
+      size_t size = storage_element_size(storage) * px_count;
+      encode_luma(encoded[i], &input[i][0], px_count, means[i], storage);
+      encode_luma(encoded[i], &expected[i][0], px_count, 0.0f, storage);
+      input_src = &encoded[i][0];
+      expected_src = &encoded[i][size];
+    }
+    arena.write(_context, i, input_src, expected_src);
+  }
+  arena.write_means(_context, &means[0], arena_size);
+  _context->block();
+
+  // expected mini-batch
+  std::vector<float> expected_input, expected_gt;
+  for (size_t i = 0; i < batch_size; i++) {
+    auto &in = input[slots[i]], &gt = expected[slots[i]];
+    expected_input.insert(expected_input.end(), in.begin(), in.end());
+    expected_gt.insert(expected_gt.end(), gt.begin(), gt.end());
+  }
+
+  // gpu allocate
+  auto gpu_buf_slots =
+      _context->allocate(CL_MEM_READ_ONLY, sizeof(cl_uint) * batch_size);
+  _context->write_buffer(gpu_buf_slots, (void *)slots, true);
+  size_t target_size = sizeof(cl_float) * px_count * batch_size;
+  auto gpu_buf_input = _context->allocate(CL_MEM_READ_WRITE, target_size);
+  auto gpu_buf_gt = _context->allocate(CL_MEM_READ_WRITE, target_size);
+
+  pipeline->gather_samples(arena.input_luma, arena.expected_luma,
+                           arena.input_means, storage, gpu_buf_slots,
+                           batch_size, px_count, gpu_buf_input, gpu_buf_gt);
+  assert_equals(pipeline, expected_input, gpu_buf_input);
+  assert_equals(pipeline, expected_gt, gpu_buf_gt);
+
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
@@ -0,0 +1,117 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <algorithm>  // std::min, std::max
+#include <cmath>      // std::round
+#include <random>     // for std::mt19937
+
+#include "../../src/DataPipeline.hpp"
+#include "../../src/LayerData.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// Data set
+///
+struct Int8LayerDataSet : DataSet {
+  Int8LayerDataSet(std::string name, size_t n_prev_filter_cnt)
+      : DataSet(name), n_prev_filter_cnt(n_prev_filter_cnt) {}
+  /** 4 and more uses 4x8bit dot products */
+  size_t n_prev_filter_cnt;
+};
+
+///
+/// PIMPL
+///
+struct Int8LayerTestImpl {
+  Int8LayerDataSet data_sets[2] = {Int8LayerDataSet("scalar", 1),
+                                   Int8LayerDataSet("dot4", 8)};
+
+  const size_t current_filter_count = 3, f_spatial_size = 3,  //
+      input_w = 7, input_h = 6;
+};
+
+///
+/// Int8LayerTest
+///
+
+TEST_SPEC_PIMPL(Int8LayerTest)
+
+void Int8LayerTest::init() {}
+
+std::string Int8LayerTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  return "Int8 layer test - " + _impl->data_sets[data_set_id].name;
+}
+
+size_t Int8LayerTest::data_set_count() { return 2; }
+
+bool Int8LayerTest::operator()(size_t data_set_id,
+                               cnn_sr::DataPipeline *const pipeline) {
+  assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
+  auto context = pipeline->context();
+  auto &impl = *_impl;
+  size_t k_cnt = impl.data_sets[data_set_id].n_prev_filter_cnt,
+         n_cnt = impl.current_filter_count, f = impl.f_spatial_size,
+         w = impl.input_w, h = impl.input_h;
+
+  std::mt19937 generator(7);
+  std::uniform_real_distribution<float> distr(-1.0f, 1.0f);
+  cnn_sr::LayerData layer_data(k_cnt, n_cnt, f);
+  for (size_t i = 0; i < layer_data.weight_size(); i++)
+    layer_data.weights.push_back(distr(generator));
+  for (size_t i = 0; i < layer_data.bias_size(); i++)
+    layer_data.bias.push_back(distr(generator));
+  std::vector<float> input(w * h * k_cnt);
+  for (auto &v : input) v = distr(generator);
+
+  cnn_sr::QuantizedLayer quantized;
+  quantized.input_scale = 1.0f / 127;
+  quantized.compute_weight_scales(layer_data);
+  quantized.quantize_weights(layer_data);
+
+  // gpu
+  opencl::MemoryHandle gpu_input = gpu_nullptr, gpu_input_int8 = gpu_nullptr,
+                       gpu_output = gpu_nullptr;
+  cnn_sr::LayerAllocationPool gpu_alloc;
+  gpu_input =
+      context->allocate(CL_MEM_READ_ONLY, sizeof(cl_float) * input.size());
+  context->write_buffer(gpu_input, (void *)&input[0], true);
+  auto kernel = pipeline->create_int8_layer_kernel(layer_data, true);
+  auto ev = pipeline->quantize(gpu_input, input.size(), quantized.input_scale,
+                               gpu_input_int8);
+  pipeline->execute_layer_int8(*kernel, layer_data, quantized, gpu_alloc,
+                               gpu_input_int8, w, h, 1, 0.0f, gpu_output,
+                               &ev);
+  context->block();
+
+  // expected: float convolution of dequantized values, int accumulation on
+  // gpu is exact
+  size_t out_w = w - f + 1, out_h = h - f + 1;
+  std::vector<float> expected(out_w * out_h * n_cnt);
+  for (size_t y = 0; y < out_h; y++)
+    for (size_t x = 0; x < out_w; x++)
+      for (size_t n = 0; n < n_cnt; n++) {
+        float sum = 0.0f;
+        for (size_t dy = 0; dy < f; dy++)
+          for (size_t dx = 0; dx < f; dx++)
+            for (size_t k = 0; k < k_cnt; k++) {
+              float v = input[((y + dy) * w + x + dx) * k_cnt + k];
+              float q = std::round(v / quantized.input_scale);
+              q = std::min(127.0f, std::max(-127.0f, q));
+              auto q_w = quantized.weights[((n * f + dy) * f + dx) * k_cnt + k];
+              sum += q * quantized.input_scale * q_w *
+                     quantized.weight_scales[n];
+            }
+        expected[(y * out_w + x) * n_cnt + n] = sum + layer_data.bias[n];
+      }
+
+  assert_equals(pipeline, expected, gpu_output);
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
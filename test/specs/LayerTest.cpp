@@ -123,9 +123,30 @@ bool LayerTest::operator()(size_t data_set_id,
   // create kernel & run
   auto kernel = pipeline->create_layer_kernel(layer_data, false);
   pipeline->execute_layer(*kernel, layer_data, gpu_alloc, gpu_buf_in,
-                          data->input_w, data->input_h, gpu_output);
+                          data->input_w, data->input_h, 1, gpu_output);
   assert_equals(pipeline, data->output, gpu_output);
 
+  // same with input and output stored as half
+  std::vector<unsigned short> half_input(data->input.size());
+  for (size_t i = 0; i < half_input.size(); i++)
+    half_input[i] = cnn_sr::utils::float_to_half(data->input[i]);
+  auto gpu_buf_in_half = _context->allocate(
+      CL_MEM_READ_WRITE, sizeof(cl_half) * half_input.size());
+  _context->write_buffer(gpu_buf_in_half, (void*)&half_input[0], true);
+
+  opencl::MemoryHandle gpu_output_half = gpu_nullptr;
+  auto kernel_half =
+      pipeline->create_layer_kernel(layer_data, false, true, true);
+  pipeline->execute_layer(*kernel_half, layer_data, gpu_alloc,
+                          gpu_buf_in_half, data->input_w, data->input_h, 1,
+                          gpu_output_half, nullptr, sizeof(cl_half));
+  std::vector<unsigned short> half_output(data->output.size());
+  _context->read_buffer(gpu_output_half, (void*)&half_output[0], true);
+  std::vector<float> output(half_output.size());
+  for (size_t i = 0; i < output.size(); i++)
+    output[i] = cnn_sr::utils::half_to_float(half_output[i]);
+  assert_equals(data->output, output);
+
   return true;
 }
 
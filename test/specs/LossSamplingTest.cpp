@@ -0,0 +1,125 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <random>  // for std::mt19937
+
+#include "../../src/DataPipeline.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// PIMPL
+///
+struct LossSamplingTestImpl {
+  /** more then 64 (local size), so that prefix sum needs chunks */
+  const size_t slot_count = 150, batch_size = 3, draw_count = 500;
+};
+
+///
+/// LossSamplingTest
+///
+
+TEST_SPEC_PIMPL(LossSamplingTest)
+
+void LossSamplingTest::init() {}
+
+std::string LossSamplingTest::name(size_t) {
+  return "Loss sampling test (scatter, gather, prefix sum, draw)";
+}
+
+size_t LossSamplingTest::data_set_count() { return 1; }
+
+bool LossSamplingTest::operator()(size_t,
+                                  cnn_sr::DataPipeline *const pipeline) {
+  assert_not_null(pipeline);
+  auto _context = pipeline->context();
+  const size_t slot_count = _impl->slot_count,
+               batch_size = _impl->batch_size,
+               draw_count = _impl->draw_count;
+
+  // only slots 7, 42 and 130 have loss
+  const float batch_losses[3] = {2.0f, 0.5f, 1.5f};
+  const cl_uint slots[3] = {42, 7, 130};
+  std::vector<float> exp_losses(slot_count, 0.0f), exp_cdf(slot_count);
+  for (size_t i = 0; i < batch_size; i++)
+    exp_losses[slots[i]] = batch_losses[i];
+  float sum = 0.0f;
+  for (size_t i = 0; i < slot_count; i++) {
+    sum += exp_losses[i];
+    exp_cdf[i] = sum;
+  }
+
+  std::mt19937 generator;
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::vector<float> uniforms(draw_count);
+  for (auto &u : uniforms) u = uniform(generator);
+
+  // gpu allocate
+  /* clang-format off */
+  auto gpu_buf_batch_losses = _context->allocate(CL_MEM_READ_ONLY, sizeof(batch_losses));
+  _context->write_buffer(gpu_buf_batch_losses, (void *)batch_losses, true);
+  auto gpu_buf_slots = _context->allocate(CL_MEM_READ_ONLY, sizeof(slots));
+  _context->write_buffer(gpu_buf_slots, (void *)slots, true);
+  auto gpu_buf_losses = _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * slot_count);
+  _context->zeros_float(gpu_buf_losses, true);
+  auto gpu_buf_cdf = _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * slot_count);
+  auto gpu_buf_uniforms = _context->allocate(CL_MEM_READ_ONLY, sizeof(cl_float) * draw_count);
+  _context->write_buffer(gpu_buf_uniforms, (void *)&uniforms[0], true);
+  auto gpu_buf_drawn = _context->allocate(CL_MEM_WRITE_ONLY, sizeof(cl_uint) * draw_count);
+  /* clang-format on */
+
+  pipeline->scatter_losses(gpu_buf_batch_losses, gpu_buf_slots, batch_size,
+                           gpu_buf_losses);
+  assert_equals(pipeline, exp_losses, gpu_buf_losses);
+
+  // losses of only some slots, as for training samples
+  const cl_uint train_slots[3] = {130, 8, 7};
+  const std::vector<float> exp_train_losses = {1.5f, 0.0f, 0.5f};
+  auto gpu_buf_train_slots =
+      _context->allocate(CL_MEM_READ_ONLY, sizeof(train_slots));
+  _context->write_buffer(gpu_buf_train_slots, (void *)train_slots, true);
+  auto gpu_buf_train_losses =
+      _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * 3);
+  pipeline->gather_losses(gpu_buf_losses, gpu_buf_train_slots, 3,
+                          gpu_buf_train_losses);
+  assert_equals(pipeline, exp_train_losses, gpu_buf_train_losses);
+
+  pipeline->loss_prefix_sum(gpu_buf_losses, slot_count, gpu_buf_cdf);
+  assert_equals(pipeline, exp_cdf, gpu_buf_cdf);
+
+  // all draws by loss - only slots with loss are ever drawn
+  std::vector<unsigned int> drawn(draw_count);
+  size_t hits[3] = {0, 0, 0};
+  pipeline->draw_by_loss(gpu_buf_cdf, slot_count, gpu_buf_uniforms,
+                         draw_count, 1.0f, gpu_buf_drawn);
+  _context->read_buffer(gpu_buf_drawn, (void *)&drawn[0], true);
+  for (auto slot : drawn) {
+    bool known = false;
+    for (size_t i = 0; i < batch_size; i++) {
+      if (slot != slots[i]) continue;
+      known = true;
+      ++hits[i];
+    }
+    assert_true(known, "Drawn slot without loss");
+  }
+  // roughly in proportion to loss: 2.0 : 0.5 : 1.5
+  assert_true(hits[0] > hits[2] && hits[2] > hits[1],
+              "Draws are not proportional to loss");
+
+  // uniform draws cover the rest of the slots too
+  pipeline->draw_by_loss(gpu_buf_cdf, slot_count, gpu_buf_uniforms,
+                         draw_count, 0.0f, gpu_buf_drawn);
+  _context->read_buffer(gpu_buf_drawn, (void *)&drawn[0], true);
+  for (size_t i = 0; i < draw_count; i++) {
+    assert_true(drawn[i] < slot_count, "Drawn slot out of range");
+    assert_true(drawn[i] == (cl_uint)(uniforms[i] * slot_count),
+                "Uniform draw does not match");
+  }
+
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
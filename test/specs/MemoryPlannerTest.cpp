@@ -0,0 +1,81 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <algorithm>  // std::min, std::max
+#include <random>     // for std::mt19937
+
+#include "../../src/MemoryPlanner.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// PIMPL
+///
+struct MemoryPlannerTestImpl {
+  const size_t alignment = 128, buffer_count = 40, step_count = 20;
+};
+
+///
+/// MemoryPlannerTest
+///
+
+TEST_SPEC_PIMPL(MemoryPlannerTest)
+
+void MemoryPlannerTest::init() {}
+
+std::string MemoryPlannerTest::name(size_t) {
+  return "Memory planner test (buffer lifetimes)";
+}
+
+size_t MemoryPlannerTest::data_set_count() { return 1; }
+
+bool MemoryPlannerTest::operator()(size_t, cnn_sr::DataPipeline *const) {
+  auto &impl = *_impl;
+  const size_t alignment = impl.alignment;
+
+  // chain of layers during inference: each output is dead after next layer
+  cnn_sr::MemoryPlanner chain;
+  size_t sizes[4] = {1000, 4000, 3000, 500};
+  for (size_t i = 0; i < 4; i++) chain.add(sizes[i], i, i + 1);
+  size_t chain_size = chain.plan(alignment);
+  // biggest consecutive pair: 4000 and 3000 (+ alignment of the second)
+  assert_true(chain_size <= 4096 + 3000, "Chain should reuse memory");
+  assert_true(chain_size < chain.unplanned_size(),
+              "Chain should use less memory than separate buffers");
+
+  // random lifetimes: buffers that live at the same time cannot overlap
+  std::mt19937 generator(11);
+  std::uniform_int_distribution<size_t> size_distr(1, 5000),
+      step_distr(0, impl.step_count);
+  cnn_sr::MemoryPlanner planner;
+  std::vector<size_t> first(impl.buffer_count), last(impl.buffer_count);
+  for (size_t i = 0; i < impl.buffer_count; i++) {
+    size_t a = step_distr(generator), b = step_distr(generator);
+    first[i] = std::min(a, b);
+    last[i] = std::max(a, b);
+    planner.add(size_distr(generator), first[i], last[i]);
+  }
+  size_t arena_size = planner.plan(alignment);
+  assert_true(arena_size <= planner.unplanned_size() +
+                                impl.buffer_count * alignment,
+              "Arena is bigger than separate buffers");
+
+  for (size_t i = 0; i < impl.buffer_count; i++) {
+    size_t begin_i = planner.offset(i), end_i = begin_i + planner.size(i);
+    assert_true(begin_i % alignment == 0, "Buffer offset is not aligned");
+    assert_true(end_i <= arena_size, "Buffer does not fit in the arena");
+    for (size_t j = i + 1; j < impl.buffer_count; j++) {
+      bool live_together = first[i] <= last[j] && first[j] <= last[i];
+      if (!live_together) continue;
+      size_t begin_j = planner.offset(j), end_j = begin_j + planner.size(j);
+      assert_true(end_i <= begin_j || end_j <= begin_i,
+                  "Buffers that are live at the same time overlap");
+    }
+  }
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
@@ -0,0 +1,188 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <random>   // for std::mt19937
+#include <chrono>   // for random seed
+#include <cstdio>   // std::remove
+#include <fstream>  // to corrupt the file
+#include <sstream>  // to serialize random engine
+#
+#include "../../src/ParametersFile.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// Data set
+///
+struct ParametersFileDataSet : DataSet {
+  ParametersFileDataSet(std::string name, cnn_sr::ParametersStorage storage,
+                        bool corrupt)
+      : DataSet(name), storage(storage), corrupt(corrupt) {}
+
+  cnn_sr::ParametersStorage storage;
+  bool corrupt;
+};
+
+///
+/// PIMPL
+///
+struct ParametersFileTestImpl {
+  /* clang-format off */
+  ParametersFileDataSet data_sets[3] = {
+      ParametersFileDataSet("float32", cnn_sr::ParametersStorage::Float32, false),
+      ParametersFileDataSet("float16", cnn_sr::ParametersStorage::Float16, false),
+      ParametersFileDataSet("corrupted", cnn_sr::ParametersStorage::Float32, true)};
+  /* clang-format on */
+
+  const char *const file_path = "test/data/tmp_parameters.bin";
+  const size_t layer_dims[3][3] = {{1, 32, 9}, {32, 16, 1}, {16, 1, 5}};
+
+  void create_data(std::mt19937 &generator, cnn_sr::ParametersFile &params) {
+    params.epochs = generator() % 10000;
+    for (size_t i = 0; i < 3; i++) {
+      params.layers.push_back(cnn_sr::LayerParameters());
+      auto &layer = params.layers.back();
+      layer.n_prev_filter_cnt = layer_dims[i][0];
+      layer.current_filter_count = layer_dims[i][1];
+      layer.f_spatial_size = layer_dims[i][2];
+      size_t ws = layer.f_spatial_size * layer.f_spatial_size *
+                  layer.n_prev_filter_cnt * layer.current_filter_count;
+      for (size_t j = 0; j < ws; j++)
+        layer.weights.push_back(((int)(generator() % 2000) - 1000) / 1000.0f);
+      for (size_t j = 0; j < layer.current_filter_count; j++)
+        layer.bias.push_back(((int)(generator() % 2000) - 1000) / 1000.0f);
+      // int8 calibration, momentum and Adam moments only for some layers,
+      // all optional
+      if (i != 2) {
+        layer.input_scale = (generator() % 1000 + 1) / 1000.0f;
+        for (size_t j = 0; j < layer.current_filter_count; j++)
+          layer.weight_scales.push_back(random_float(generator));
+      }
+      if (i == 1) continue;
+      for (size_t j = 0; j < ws; j++)
+        layer.previous_delta_w.push_back(random_float(generator));
+      for (size_t j = 0; j < layer.current_filter_count; j++)
+        layer.previous_delta_b.push_back(random_float(generator));
+      if (i == 0) continue;
+      for (size_t j = 0; j < ws; j++) {
+        layer.first_moment_w.push_back(random_float(generator));
+        layer.second_moment_w.push_back(random_float(generator));
+      }
+      for (size_t j = 0; j < layer.current_filter_count; j++) {
+        layer.first_moment_b.push_back(random_float(generator));
+        layer.second_moment_b.push_back(random_float(generator));
+      }
+    }
+
+    // training state
+    params.has_training_state = true;
+    std::ostringstream os;
+    os << generator;
+    params.training_state.rng_state = os.str();
+    for (size_t i = 0; i < 50; i++)
+      params.training_state.sample_order.push_back(generator() % 1000);
+    params.training_state.optimizer_step = generator() % 100000;
+    for (size_t i = 0; i < 5; i++)
+      params.training_state.loss_scaling.push_back(random_float(generator));
+    for (size_t i = 0; i < 8; i++)
+      params.training_state.shard_order.push_back(generator() % 8);
+  }
+
+  float random_float(std::mt19937 &generator) {
+    return ((int)(generator() % 2000) - 1000) / 1000.0f;
+  }
+};
+
+///
+/// ParametersFileTest
+///
+
+TEST_SPEC_PIMPL(ParametersFileTest)
+
+void ParametersFileTest::init() {}
+
+size_t ParametersFileTest::data_set_count() { return 3; }
+
+std::string ParametersFileTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  return "Binary parameters file test - " + _impl->data_sets[data_set_id].name;
+}
+
+bool ParametersFileTest::operator()(size_t data_set_id,
+                                    cnn_sr::DataPipeline *const pipeline) {
+  using namespace cnn_sr;
+  assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
+  auto &data = _impl->data_sets[data_set_id];
+
+  unsigned seed1 = std::chrono::system_clock::now().time_since_epoch().count();
+  std::mt19937 generator(seed1);
+  ParametersFile expected;
+  _impl->create_data(generator, expected);
+
+  ParametersFile::write(_impl->file_path, expected, data.storage);
+  assert_true(ParametersFile::is_binary(_impl->file_path),
+              "Written file should be recognised as binary");
+
+  if (data.corrupt) {
+    std::fstream file(_impl->file_path,
+                      std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(100);
+    file.put('\x7f');
+    file.close();
+  }
+
+  bool io_err = false;
+  ParametersFile result;
+  try {
+    ParametersFile::read(_impl->file_path, result);
+  } catch (IOException &e) {
+    io_err = true;
+  }
+  std::remove(_impl->file_path);
+
+  assert_true(io_err == data.corrupt, "Expected checksum error");
+  if (data.corrupt) return true;
+
+  assert_equals((int)expected.epochs, (int)result.epochs);
+  assert_equals(3, (int)result.layers.size());
+  for (size_t i = 0; i < 3; i++) {
+    auto &e = expected.layers[i];
+    auto &r = result.layers[i];
+    assert_equals((int)e.n_prev_filter_cnt, (int)r.n_prev_filter_cnt);
+    assert_equals((int)e.current_filter_count, (int)r.current_filter_count);
+    assert_equals((int)e.f_spatial_size, (int)r.f_spatial_size);
+    // NOTE: float16 precision is still within assert_equals margin
+    assert_equals(e.weights, r.weights);
+    assert_equals(e.bias, r.bias);
+    // momentum is always float32 - must be bit-exact
+    assert_equals((int)e.previous_delta_w.size(), (int)r.previous_delta_w.size());
+    assert_equals((int)e.previous_delta_b.size(), (int)r.previous_delta_b.size());
+    assert_true(e.previous_delta_w == r.previous_delta_w &&
+                    e.previous_delta_b == r.previous_delta_b,
+                "Momentum should be restored bit-exactly");
+    assert_true(e.first_moment_w == r.first_moment_w &&
+                    e.first_moment_b == r.first_moment_b &&
+                    e.second_moment_w == r.second_moment_w &&
+                    e.second_moment_b == r.second_moment_b,
+                "Adam moments should be restored bit-exactly");
+    assert_true(e.input_scale == r.input_scale &&
+                    e.weight_scales == r.weight_scales,
+                "Int8 calibration should be restored bit-exactly");
+  }
+
+  auto &es = expected.training_state, &rs = result.training_state;
+  assert_true(result.has_training_state, "Expected training state");
+  assert_true(es.rng_state == rs.rng_state, "Random engine state differs");
+  assert_true(es.sample_order == rs.sample_order, "Sample order differs");
+  assert_equals((int)es.optimizer_step, (int)rs.optimizer_step);
+  assert_true(es.loss_scaling == rs.loss_scaling, "Loss scaling state differs");
+  assert_true(es.shard_order == rs.shard_order, "Shard order differs");
+
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
@@ -0,0 +1,85 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include "../../src/DataPipeline.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// Data set
+///
+struct PixelShuffleDataSet : DataSet {
+  PixelShuffleDataSet(std::string name, size_t r) : DataSet(name), r(r) {}
+  size_t r;
+};
+
+///
+/// PIMPL
+///
+struct PixelShuffleTestImpl {
+  PixelShuffleDataSet data_sets[2] = {PixelShuffleDataSet("r=2", 2),
+                                      PixelShuffleDataSet("r=3", 3)};
+
+  const size_t w = 5, h = 4, sample_count = 2;
+};
+
+///
+/// PixelShuffleTest
+///
+
+TEST_SPEC_PIMPL(PixelShuffleTest)
+
+void PixelShuffleTest::init() {}
+
+std::string PixelShuffleTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  return "Pixel shuffle test - " + _impl->data_sets[data_set_id].name;
+}
+
+size_t PixelShuffleTest::data_set_count() { return 2; }
+
+bool PixelShuffleTest::operator()(size_t data_set_id,
+                                  cnn_sr::DataPipeline *const pipeline) {
+  assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
+  auto context = pipeline->context();
+  auto &impl = *_impl;
+  size_t r = impl.data_sets[data_set_id].r, w = impl.w, h = impl.h,
+         sample_count = impl.sample_count, big_w = w * r, big_h = h * r;
+
+  // layer output, channels are innermost
+  std::vector<float> layer_output(sample_count * w * h * r * r);
+  for (size_t i = 0; i < layer_output.size(); i++)
+    layer_output[i] = (float)i;
+
+  // expected: target[y*r + dy, x*r + dx] = src[y, x, dy*r + dx]
+  std::vector<float> expected(layer_output.size());
+  for (size_t s = 0; s < sample_count; s++)
+    for (size_t by = 0; by < big_h; by++)
+      for (size_t bx = 0; bx < big_w; bx++) {
+        size_t channel = (by % r) * r + bx % r,
+               src_idx = (s * w * h + (by / r) * w + bx / r) * r * r + channel;
+        expected[(s * big_h + by) * big_w + bx] = layer_output[src_idx];
+      }
+
+  // gpu
+  size_t size = sizeof(cl_float) * layer_output.size();
+  auto gpu_src = context->allocate(CL_MEM_READ_WRITE, size);
+  auto gpu_shuffled = context->allocate(CL_MEM_READ_WRITE, size);
+  auto gpu_unshuffled = context->allocate(CL_MEM_READ_WRITE, size);
+  context->write_buffer(gpu_src, (void *)&layer_output[0], true);
+  auto ev = pipeline->pixel_shuffle(gpu_src, w, h, sample_count, r,
+                                    gpu_shuffled);
+  pipeline->pixel_unshuffle(gpu_shuffled, w, h, sample_count, r,
+                            gpu_unshuffled, &ev);
+  context->block();
+
+  assert_equals(pipeline, expected, gpu_shuffled);
+  assert_equals(pipeline, layer_output, gpu_unshuffled);
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
@@ -0,0 +1,107 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <random>  // for std::mt19937
+
+#include "../../src/Config.hpp"
+#include "../../src/ConfigBasedDataPipeline.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// PIMPL
+///
+struct RecomputeActivationsTestImpl {
+  const size_t input_w = 12, input_h = 10, sample_count = 2;
+  /** not consecutive, so mini-batch is gathered instead of arena views */
+  const size_t slots[2] = {1, 0};
+  cnn_sr::ParametersDistribution pd = {0.0f, 0.3f, 0.0f, 0.1f};
+};
+
+///
+/// RecomputeActivationsTest
+///
+
+TEST_SPEC_PIMPL(RecomputeActivationsTest)
+
+void RecomputeActivationsTest::init() {}
+
+std::string RecomputeActivationsTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  return "Recompute activations test - first_layer vs none";
+}
+
+size_t RecomputeActivationsTest::data_set_count() { return 1; }
+
+bool RecomputeActivationsTest::operator()(
+    size_t data_set_id, cnn_sr::DataPipeline *const pipeline) {
+  using namespace cnn_sr;
+  assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
+  auto context = pipeline->context();
+  auto &impl = *_impl;
+  size_t w = impl.input_w, h = impl.input_h, px_count = w * h;
+
+  // relu on first layer, so its deltas depend on the recomputed output
+  std::vector<LayerConfig> layers = {LayerConfig(4, 3, 0.001f, impl.pd),
+                                     LayerConfig(3, 1, 0.001f, impl.pd),
+                                     LayerConfig(1, 3, 0.001f, impl.pd, false)};
+  Config cfg(layers, 0.9f, 0.0f);
+  ConfigBasedDataPipeline net(cfg, context);
+  net.init(DataPipeline::LOAD_KERNEL_ALL);
+
+  // samples
+  GpuAllocationPool gpu_alloc;
+  gpu_alloc.layers.resize(net.layer_count());
+  auto &arena = gpu_alloc.sample_arena;
+  arena.allocate(context, w, h, impl.sample_count);
+  std::mt19937 generator(11);
+  std::uniform_real_distribution<float> distr(0.0f, 1.0f);
+  std::vector<std::vector<float>> input(impl.sample_count),
+      expected(impl.sample_count);
+  for (size_t i = 0; i < impl.sample_count; i++) {
+    for (size_t j = 0; j < px_count; j++) {
+      input[i].push_back(distr(generator) - 0.5f);
+      expected[i].push_back(distr(generator));
+    }
+    arena.write(context, i, &input[i][0], &expected[i][0]);
+  }
+  context->block();
+  for (size_t i = 0; i < impl.sample_count; i++) {
+    SampleAllocationPool sample;
+    sample.input_w = w;
+    sample.input_h = h;
+    sample.id = impl.slots[i];
+    sample.arena = &arena;
+    sample.arena_slot = impl.slots[i];
+    gpu_alloc.samples.push_back(sample);
+  }
+  std::vector<SampleAllocationPool *> batch;
+  for (auto &sample : gpu_alloc.samples) batch.push_back(&sample);
+
+  // same weights for both runs, parameters are never updated (update only
+  // in finish_epoch). Changing the config makes execute_batch re-plan
+  net.set_mini_batch_size(impl.sample_count);
+  net.pack_parameters(gpu_alloc);
+  auto &parameters = gpu_alloc.parameter_arena;
+  std::vector<float> gradients[2];
+  for (size_t run = 0; run < 2; run++) {
+    cfg.recompute_first_layer = run == 1;
+    context->zeros_float(parameters.gradients, true);
+    net.execute_batch(true, gpu_alloc, batch);
+    gradients[run].resize(parameters.size);
+    context->read_buffer(parameters.gradients, (void *)&gradients[run][0],
+                         true);
+  }
+
+  bool any_nonzero = false;
+  for (float g : gradients[0]) any_nonzero |= g != 0.0f;
+  assert_true(any_nonzero, "Expected non zero gradients");
+  assert_equals(gradients[0], gradients[1]);
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
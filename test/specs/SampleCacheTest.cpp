@@ -0,0 +1,127 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <stdexcept>  // std::runtime_error
+
+#include "../../src/SampleCache.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// PIMPL
+///
+struct SampleCacheTestImpl {
+  const size_t sample_count = 6, capacity = 3, w = 4, h = 3;
+
+  /** every value identifies the sample it belongs to */
+  float value(size_t id, size_t px, bool expected) {
+    return (expected ? 0.5f : 0.0f) + id * 0.05f + (px % 5) * 0.01f;
+  }
+};
+
+///
+/// SampleCacheTest
+///
+
+TEST_SPEC_PIMPL(SampleCacheTest)
+
+void SampleCacheTest::init() {}
+
+std::string SampleCacheTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  return "Sample cache test - LRU eviction";
+}
+
+size_t SampleCacheTest::data_set_count() { return 1; }
+
+bool SampleCacheTest::operator()(size_t data_set_id,
+                                 cnn_sr::DataPipeline *const pipeline) {
+  using namespace cnn_sr;
+  assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
+  auto context = pipeline->context();
+  auto &impl = *_impl;
+  size_t px_count = impl.w * impl.h,
+         per_sample = 2 * sizeof(cl_float) * px_count;
+
+  // budget is not multiple of sample size, rest is unused
+  SampleCache cache(context, impl.sample_count, impl.w, impl.h,
+                    impl.capacity * per_sample + per_sample / 2);
+  assert_equals((int)impl.capacity, (int)cache.capacity());
+  std::vector<SampleAllocationPool> samples(impl.sample_count);
+  for (size_t i = 0; i < impl.sample_count; i++) {
+    samples[i].id = i;
+    samples[i].input_w = impl.w;
+    samples[i].input_h = impl.h;
+    float *input = cache.host_input(i), *expected = cache.host_expected(i);
+    for (size_t j = 0; j < px_count; j++) {
+      input[j] = impl.value(i, j, false);
+      expected[j] = impl.value(i, j, true);
+    }
+  }
+
+  // device slot has to hold luma of the sample
+  auto check_resident = [&](size_t id) {
+    auto &sample = samples[id];
+    assert_true(sample.arena == cache.arena(), "Sample should be in arena");
+    std::vector<float> input(px_count), expected(px_count), host(px_count);
+    size_t offset = sizeof(cl_float) * px_count * sample.arena_slot;
+    context->read_buffer(sample.arena->input_luma, offset,
+                         sizeof(cl_float) * px_count, &input[0], true);
+    context->read_buffer(sample.arena->expected_luma, offset,
+                         sizeof(cl_float) * px_count, &expected[0], true);
+    for (size_t j = 0; j < px_count; j++) host[j] = impl.value(id, j, false);
+    assert_equals(host, input);
+    for (size_t j = 0; j < px_count; j++) host[j] = impl.value(id, j, true);
+    assert_equals(host, expected);
+  };
+  auto request = [&](std::vector<size_t> ids) {
+    std::vector<SampleAllocationPool *> batch;
+    for (size_t id : ids) batch.push_back(&samples[id]);
+    cache.make_resident(&batch[0], batch.size());
+    for (size_t id : ids) check_resident(id);
+  };
+
+  // fill all slots, recency order: 2, 1, 0
+  request({0, 1, 2});
+  size_t slots[3] = {samples[0].arena_slot, samples[1].arena_slot,
+                     samples[2].arena_slot};
+  assert_true(slots[0] != slots[1] && slots[1] != slots[2] &&
+                  slots[0] != slots[2],
+              "Samples should be in different slots");
+
+  // least recently used sample 0 is evicted
+  request({3});
+  assert_equals((int)slots[0], (int)samples[3].arena_slot);
+  // hit keeps the slot and refreshes sample 1, so sample 2 goes next
+  request({1});
+  assert_equals((int)slots[1], (int)samples[1].arena_slot);
+  request({4});
+  assert_equals((int)slots[2], (int)samples[4].arena_slot);
+
+  // samples of current request are protected: only one slot is free for
+  // prefetch, sample 0 does not fit and is skipped
+  request({1, 3});
+  std::vector<SampleAllocationPool *> next = {&samples[5], &samples[0]};
+  cache.prefetch(&next[0], next.size());
+  check_resident(1);
+  check_resident(3);
+  request({5});
+  assert_equals((int)slots[2], (int)samples[5].arena_slot);
+
+  // mini-batch bigger then the cache
+  bool thrown = false;
+  try {
+    request({0, 1, 2, 4});
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  assert_true(thrown, "Request bigger then capacity should throw");
+
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
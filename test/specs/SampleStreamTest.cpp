@@ -0,0 +1,98 @@
+#include "TestSpecsDeclarations.hpp"
+
+#include <cstdio>  // std::remove
+#include <random>  // for std::mt19937
+
+#include "../../src/SampleStream.hpp"
+
+namespace test {
+namespace specs {
+
+///
+/// PIMPL
+///
+struct SampleStreamTestImpl {
+  const char *const file_path = "test/data/tmp_stream_dataset.bin";
+  /** 3 shards, last one has single sample */
+  const size_t sample_count = 7, shard_size = 3, epochs = 3;
+  const size_t w = 6, h = 5;
+
+  /** every value identifies the sample it belongs to */
+  float value(size_t id, size_t px, bool expected) {
+    return (expected ? 0.5f : 0.0f) + id * 0.05f + (px % 5) * 0.01f;
+  }
+};
+
+///
+/// SampleStreamTest
+///
+
+TEST_SPEC_PIMPL(SampleStreamTest)
+
+void SampleStreamTest::init() {}
+
+std::string SampleStreamTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  return "Sample stream test - partial last shard";
+}
+
+size_t SampleStreamTest::data_set_count() { return 1; }
+
+bool SampleStreamTest::operator()(size_t data_set_id,
+                                  cnn_sr::DataPipeline *const pipeline) {
+  using namespace cnn_sr;
+  assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
+  auto context = pipeline->context();
+  auto &impl = *_impl;
+  size_t px_count = impl.w * impl.h;
+
+  std::vector<HostSample> samples(impl.sample_count);
+  for (size_t i = 0; i < samples.size(); i++) {
+    auto &sample = samples[i];
+    sample.w = impl.w;
+    sample.h = impl.h;
+    for (size_t j = 0; j < px_count; j++) {
+      sample.input_luma.push_back(impl.value(i, j, false));
+      sample.expected_luma.push_back(impl.value(i, j, true));
+    }
+  }
+  DatasetFile::write(impl.file_path, samples, DatasetStorage::Float32);
+
+  {
+    SampleStream stream(context, impl.file_path, impl.shard_size);
+    assert_equals(3, (int)stream.shard_count());
+    std::mt19937 generator(5);
+    std::vector<SampleAllocationPool *> shard;
+    for (size_t epoch = 0; epoch < impl.epochs; epoch++) {
+      std::vector<int> returned(impl.sample_count, 0);
+      stream.begin_epoch(generator);
+      while (stream.next_shard(shard, generator)) {
+        // luma in the arena has to belong to the sample with that id
+        std::vector<float> input(px_count), expected(px_count);
+        for (auto sample : shard) {
+          assert_true(sample->id < impl.sample_count, "Invalid sample id");
+          ++returned[sample->id];
+          size_t offset = sizeof(cl_float) * px_count * sample->arena_slot;
+          context->read_buffer(sample->arena->input_luma, offset,
+                               sizeof(cl_float) * px_count, &input[0], true);
+          context->read_buffer(sample->arena->expected_luma, offset,
+                               sizeof(cl_float) * px_count, &expected[0],
+                               true);
+          assert_equals(samples[sample->id].input_luma, input);
+          assert_equals(samples[sample->id].expected_luma, expected);
+        }
+      }
+      for (int count : returned)
+        assert_equals(1, count);
+    }
+  }
+  std::remove(impl.file_path);
+
+  return true;
+}
+
+//
+//
+}  // namespace specs
+}  // namespace test
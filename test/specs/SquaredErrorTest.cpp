@@ -69,11 +69,11 @@ bool SquaredErrorTest::operator()(size_t,
   /* clang-format on */
 
   // exec
-  opencl::MemoryHandle tmp_buffer = gpu_nullptr;
+  auto tmp_buffer = _context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float));
   float target = 0.0f;
   pipeline->squared_error(gpu_buf_ground_truth,            //
                           ground_truth_w, ground_truth_h,  //
-                          gpu_buf_algo_res,                //
+                          1, gpu_buf_algo_res,             //
                           tmp_buffer, target, total_padding);
   _context->block();
   assert_equals(sum, target);
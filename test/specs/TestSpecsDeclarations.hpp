@@ -37,6 +37,17 @@ DECLARE_TEST_SPEC(LayerTest)
 DECLARE_TEST_SPEC(LastLayerDeltaTest)
 DECLARE_TEST_SPEC(UpdateParametersTest)
 DECLARE_TEST_SPEC(ConfigTest)
+DECLARE_TEST_SPEC(ParametersFileTest)
+DECLARE_TEST_SPEC(DatasetFileTest)
+DECLARE_TEST_SPEC(GatherSamplesTest)
+DECLARE_TEST_SPEC(AugmentTest)
+DECLARE_TEST_SPEC(LossSamplingTest)
+DECLARE_TEST_SPEC(Int8LayerTest)
+DECLARE_TEST_SPEC(PixelShuffleTest)
+DECLARE_TEST_SPEC(MemoryPlannerTest)
+DECLARE_TEST_SPEC(RecomputeActivationsTest)
+DECLARE_TEST_SPEC(SampleStreamTest)
+DECLARE_TEST_SPEC(SampleCacheTest)
 
 }
 }
@@ -2,6 +2,8 @@
 
 #include <random>  // for std::mt19937
 #include <chrono>  // for random seed
+#include <cmath>   // for std::sqrt, std::pow
+#include <limits>  // for std::numeric_limits<float>::infinity
 #
 #include "../../src/DataPipeline.hpp"
 #include "../../src/LayerData.hpp"
@@ -56,17 +58,204 @@ TEST_SPEC_PIMPL(UpdateParametersTest)
 
 void UpdateParametersTest::init() {}
 
-size_t UpdateParametersTest::data_set_count() { return 1; }
+size_t UpdateParametersTest::data_set_count() { return 5; }
 
-std::string UpdateParametersTest::name(size_t) {
-  return "Update parameters test";
+std::string UpdateParametersTest::name(size_t data_set_id) {
+  assert_data_set_ok(data_set_id);
+  const char *const names[5] = {
+      "Update parameters test", "Update packed parameters test",
+      "Update packed parameters test - adam",
+      "Update packed parameters test - adamw",
+      "Update packed parameters test - loss scaling"};
+  return names[data_set_id];
 }
 
-bool UpdateParametersTest::operator()(size_t,
+bool UpdateParametersTest::operator()(size_t data_set_id,
                                       cnn_sr::DataPipeline *const pipeline) {
   using namespace cnn_sr;
   assert_not_null(pipeline);
+  assert_data_set_ok(data_set_id);
   auto context = pipeline->context();
+  if (data_set_id == 4) {
+    // 2 updates with scaled gradients: first one is applied and the loss
+    // scale grows, second one overflows - it is skipped and scale shrinks
+    const float momentum = _impl->momentum, loss_scale = 1024.0f;
+    const size_t batch_size = _impl->batch_size, size = 16;
+    const cl_uint ranges[4] = {0, 7, 10, 15};
+    const float rates[4] = {0.001f, 0.01f, 0.01f, 0.0f};
+    std::mt19937 generator;
+    std::vector<float> params(size), grads(size), deltas(size);
+    for (size_t i = 0; i < size; i++) {
+      params[i] = (generator() % 2560) / 10.0f;
+      grads[i] = (generator() % 2560) / 100.0f;
+      deltas[i] = (generator() % 2560) / 10.0f;
+    }
+    std::vector<float> exp_params(params), exp_deltas(deltas),
+        exp_grads(size, 0.0f), scaled_grads(size), overflown_grads(size);
+    for (size_t i = 0; i < size; i++) {
+      scaled_grads[i] = grads[i] * loss_scale;
+      overflown_grads[i] = scaled_grads[i];
+    }
+    overflown_grads[3] = std::numeric_limits<float>::infinity();
+    for (size_t s = 0; s < 2; s++) {
+      for (size_t i = ranges[2 * s]; i < ranges[2 * s + 1]; i++) {
+        float delta = momentum * deltas[i] + rates[2 * s] * grads[i] +
+                      rates[2 * s + 1] * params[i];
+        exp_params[i] = params[i] - delta / batch_size;
+        exp_deltas[i] = delta;
+      }
+    }
+    // scale, updates since overflow, overflow flag, skipped updates, applied
+    // updates
+    const float state[5] = {loss_scale, 0.0f, 0.0f, 0.0f, 0.0f};
+    std::vector<float> exp_state = {loss_scale, 0.0f, 0.0f, 1.0f, 1.0f};
+
+    /* clang-format off */
+    auto gpu_params = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_grads  = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_deltas = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_ranges = context->allocate(CL_MEM_READ_ONLY, sizeof(ranges));
+    auto gpu_rates  = context->allocate(CL_MEM_READ_ONLY, sizeof(rates));
+    auto gpu_state  = context->allocate(CL_MEM_READ_WRITE, sizeof(state));
+    context->write_buffer(gpu_params, (void *)&params[0], true);
+    context->write_buffer(gpu_deltas, (void *)&deltas[0], true);
+    context->write_buffer(gpu_ranges, (void *)ranges,     true);
+    context->write_buffer(gpu_rates,  (void *)rates,      true);
+    context->write_buffer(gpu_state,  (void *)state,      true);
+    /* clang-format on */
+
+    std::vector<float> *step_grads[2] = {&scaled_grads, &overflown_grads};
+    for (size_t t = 0; t < 2; t++) {
+      context->write_buffer(gpu_grads, (void *)&(*step_grads[t])[0], true);
+      pipeline->check_overflow(gpu_grads, size, gpu_state);
+      pipeline->update_packed_parameters(gpu_params, gpu_grads, gpu_deltas,
+                                         gpu_ranges, gpu_rates, 2, size,
+                                         batch_size, momentum, nullptr,
+                                         gpu_state);
+      pipeline->update_loss_scale(gpu_state, 1);
+      context->block();
+    }
+
+    assert_equals(pipeline, exp_params, gpu_params);
+    assert_equals(pipeline, exp_deltas, gpu_deltas);
+    assert_equals(pipeline, exp_grads, gpu_grads);
+    assert_equals(pipeline, exp_state, gpu_state);
+    return true;
+  }
+
+  if (data_set_id >= 2) {
+    // 2 steps of adam, so that both moments and bias correction are used
+    const bool adamw = data_set_id == 3;
+    const float beta1 = 0.9f, beta2 = 0.999f, epsilon = 1e-8f;
+    const size_t batch_size = _impl->batch_size, size = 16, steps = 2;
+    const cl_uint ranges[4] = {0, 7, 10, 15};
+    const float rates[4] = {0.001f, 0.01f, 0.01f, 0.0f};
+    std::mt19937 generator;
+    std::vector<float> params(size), grads[steps] = {std::vector<float>(size),
+                                                     std::vector<float>(size)};
+    for (size_t i = 0; i < size; i++) {
+      params[i] = (generator() % 2560) / 100.0f;
+      for (size_t t = 0; t < steps; t++)
+        grads[t][i] = ((int)(generator() % 2560) - 1280) / 100.0f;
+    }
+    std::vector<float> exp_params(params), exp_m(size, 0.0f),
+        exp_v(size, 0.0f), exp_grads(size, 0.0f);
+    for (size_t t = 0; t < steps; t++) {
+      float c1 = (float)(1.0 - std::pow((double)beta1, t + 1)),
+            c2 = (float)(1.0 - std::pow((double)beta2, t + 1));
+      for (size_t s = 0; s < 2; s++) {
+        float lr = rates[2 * s], decay = rates[2 * s + 1];
+        for (size_t i = ranges[2 * s]; i < ranges[2 * s + 1]; i++) {
+          float value = exp_params[i], g = grads[t][i] / batch_size;
+          if (!adamw) g += decay * value;
+          exp_m[i] = beta1 * exp_m[i] + (1.0f - beta1) * g;
+          exp_v[i] = beta2 * exp_v[i] + (1.0f - beta2) * g * g;
+          float update =
+              lr * (exp_m[i] / c1) / (std::sqrt(exp_v[i] / c2) + epsilon);
+          if (adamw) update += lr * decay * value;
+          exp_params[i] = value - update;
+        }
+      }
+    }
+
+    /* clang-format off */
+    auto gpu_params = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_grads  = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_m      = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_v      = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_ranges = context->allocate(CL_MEM_READ_ONLY, sizeof(ranges));
+    auto gpu_rates  = context->allocate(CL_MEM_READ_ONLY, sizeof(rates));
+    context->write_buffer(gpu_params, (void *)&params[0], true);
+    context->zeros_float(gpu_m, true);
+    context->zeros_float(gpu_v, true);
+    context->write_buffer(gpu_ranges, (void *)ranges,     true);
+    context->write_buffer(gpu_rates,  (void *)rates,      true);
+    /* clang-format on */
+
+    for (size_t t = 0; t < steps; t++) {
+      context->write_buffer(gpu_grads, (void *)&grads[t][0], true);
+      pipeline->update_packed_parameters_adam(
+          gpu_params, gpu_grads, gpu_m, gpu_v, gpu_ranges, gpu_rates, 2, size,
+          batch_size, beta1, beta2, epsilon, t + 1, adamw);
+    }
+
+    // padding between segments keeps its initial values
+    assert_equals(pipeline, exp_params, gpu_params);
+    assert_equals(pipeline, exp_m, gpu_m);
+    assert_equals(pipeline, exp_v, gpu_v);
+    assert_equals(pipeline, exp_grads, gpu_grads);
+    return true;
+  }
+
+  if (data_set_id == 1) {
+    // parameters of all layers in one buffer
+    const float momentum = _impl->momentum, w_decay = 0.01f;
+    const size_t batch_size = _impl->batch_size;
+
+    // 2 segments with padding between them: [0, 7), [10, 15)
+    const size_t size = 16;
+    const cl_uint ranges[4] = {0, 7, 10, 15};
+    const float rates[4] = {0.001f, w_decay, 0.01f, 0.0f};
+    std::mt19937 generator;
+    std::vector<float> params(size), grads(size), deltas(size);
+    for (size_t i = 0; i < size; i++) {
+      params[i] = (generator() % 2560) / 10.0f;
+      grads[i] = (generator() % 2560) / 100.0f;
+      deltas[i] = (generator() % 2560) / 10.0f;
+    }
+    std::vector<float> exp_params(params), exp_deltas(deltas),
+        exp_grads(size, 0.0f);
+    for (size_t s = 0; s < 2; s++) {
+      for (size_t i = ranges[2 * s]; i < ranges[2 * s + 1]; i++) {
+        float delta = momentum * deltas[i] + rates[2 * s] * grads[i] +
+                      rates[2 * s + 1] * params[i];
+        exp_params[i] = params[i] - delta / batch_size;
+        exp_deltas[i] = delta;
+      }
+    }
+
+    /* clang-format off */
+    auto gpu_params = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_grads  = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_deltas = context->allocate(CL_MEM_READ_WRITE, sizeof(cl_float) * size);
+    auto gpu_ranges = context->allocate(CL_MEM_READ_ONLY, sizeof(ranges));
+    auto gpu_rates  = context->allocate(CL_MEM_READ_ONLY, sizeof(rates));
+    context->write_buffer(gpu_params, (void *)&params[0], true);
+    context->write_buffer(gpu_grads,  (void *)&grads[0],  true);
+    context->write_buffer(gpu_deltas, (void *)&deltas[0], true);
+    context->write_buffer(gpu_ranges, (void *)ranges,     true);
+    context->write_buffer(gpu_rates,  (void *)rates,      true);
+    /* clang-format on */
+
+    pipeline->update_packed_parameters(gpu_params, gpu_grads, gpu_deltas,
+                                       gpu_ranges, gpu_rates, 2, size,
+                                       batch_size, momentum);
+
+    assert_equals(pipeline, exp_params, gpu_params);
+    assert_equals(pipeline, exp_deltas, gpu_deltas);
+    assert_equals(pipeline, exp_grads, gpu_grads);
+    return true;
+  }
 
   // create test data
   LayerData layer_data(_impl->n_prev_filter_cnt, _impl->current_filter_count,